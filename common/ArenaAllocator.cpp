@@ -0,0 +1,147 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief ArenaAllocator implementation @file
+
+#include "ArenaAllocator.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace mozilla {
+namespace telemetry {
+
+static const size_t kAlignment = 8;
+
+static inline size_t Align(size_t aSize)
+{
+  return (aSize + kAlignment - 1) & ~(kAlignment - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+ArenaAllocator::ArenaAllocator(size_t aChunkSize, size_t aMaxRetained) :
+  mHead(nullptr),
+  mCurrent(nullptr),
+  mChunkSize(Align(aChunkSize)),
+  mMaxRetained(aMaxRetained),
+  mCapacity(0) { }
+
+////////////////////////////////////////////////////////////////////////////////
+ArenaAllocator::~ArenaAllocator()
+{
+  while (mHead) {
+    Chunk* next = mHead->mNext;
+    free(mHead);
+    mHead = next;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void* ArenaAllocator::Malloc(size_t aSize)
+{
+  aSize = Align(aSize);
+  while (mCurrent && mCurrent->mSize + aSize > mCurrent->mCapacity) {
+    mCurrent = mCurrent->mNext; // try the chunks retained by the last Reset
+  }
+  if (!mCurrent) {
+    // grow geometrically so large documents need only a few chunks
+    size_t size = mCapacity > mChunkSize ? mCapacity : mChunkSize;
+    AddChunk(aSize > size ? aSize : size);
+  }
+  void* p = Top(mCurrent);
+  mCurrent->mSize += aSize;
+  return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void* ArenaAllocator::Realloc(void* aPtr, size_t aOriginalSize,
+                              size_t aNewSize)
+{
+  if (!aPtr) return Malloc(aNewSize);
+  if (aNewSize <= aOriginalSize) return aPtr;
+
+  // grow in place when this was the last allocation in the chunk
+  size_t original = Align(aOriginalSize);
+  size_t required = Align(aNewSize);
+  if (mCurrent && static_cast<char*>(aPtr) + original == Top(mCurrent)
+      && mCurrent->mSize - original + required <= mCurrent->mCapacity) {
+    mCurrent->mSize += required - original;
+    return aPtr;
+  }
+  void* p = Malloc(aNewSize);
+  memcpy(p, aPtr, aOriginalSize);
+  return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ArenaAllocator::Reset()
+{
+  if (!mHead) return;
+
+  size_t retained = mHead->mCapacity;
+  mHead->mSize = 0;
+  Chunk* last = mHead;
+  while (last->mNext && retained + last->mNext->mCapacity <= mMaxRetained) {
+    last = last->mNext;
+    last->mSize = 0;
+    retained += last->mCapacity;
+  }
+
+  Chunk* c = last->mNext;
+  last->mNext = nullptr;
+  while (c) {
+    Chunk* next = c->mNext;
+    free(c);
+    c = next;
+  }
+  mCapacity = retained;
+  mCurrent = mHead;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+size_t ArenaAllocator::Size() const
+{
+  size_t size = 0;
+  for (Chunk* c = mHead; c; c = c->mNext) {
+    size += c->mSize;
+  }
+  return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Private Member Functions
+////////////////////////////////////////////////////////////////////////////////
+char* ArenaAllocator::Top(Chunk* aChunk) const
+{
+  return reinterpret_cast<char*>(aChunk) + Align(sizeof(Chunk))
+    + aChunk->mSize;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ArenaAllocator::AddChunk(size_t aSize)
+{
+  Chunk* c = static_cast<Chunk*>(malloc(Align(sizeof(Chunk)) + aSize));
+  if (!c) throw std::bad_alloc();
+  c->mNext = nullptr;
+  c->mCapacity = aSize;
+  c->mSize = 0;
+  mCapacity += aSize;
+
+  if (!mHead) {
+    mHead = c;
+  } else {
+    Chunk* last = mHead;
+    while (last->mNext) {
+      last = last->mNext;
+    }
+    last->mNext = c;
+  }
+  mCurrent = c;
+}
+
+}
+}
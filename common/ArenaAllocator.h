@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Chunked arena allocator satisfying the rapidjson Allocator concept. Memory is
+never freed piecemeal; the whole arena is rewound with Reset() so the chunks
+can be reused by the next document.
+ */
+
+#ifndef mozilla_telemetry_Arena_Allocator_h
+#define mozilla_telemetry_Arena_Allocator_h
+
+#include <boost/utility.hpp>
+#include <cstddef>
+
+namespace mozilla {
+namespace telemetry {
+
+class ArenaAllocator : boost::noncopyable
+{
+public:
+  static const bool kNeedFree = false;
+
+  /**
+   * Constructor
+   *
+   * @param aChunkSize Minimum size of each chunk requested from the heap.
+   * @param aMaxRetained High water mark; Reset() releases chunks beyond this
+   *                     capacity back to the heap (the first chunk is always
+   *                     retained).
+   */
+  ArenaAllocator(size_t aChunkSize = kDefaultChunkSize,
+                 size_t aMaxRetained = kDefaultMaxRetained);
+  ~ArenaAllocator();
+
+  void* Malloc(size_t aSize);
+  void* Realloc(void* aPtr, size_t aOriginalSize, size_t aNewSize);
+  static void Free(void*) { }
+
+  /**
+   * Invalidates every allocation and rewinds the arena for reuse.
+   */
+  void Reset();
+
+  /**
+   * Returns the number of bytes held from the heap.
+   *
+   * @return size_t Capacity in bytes.
+   */
+  size_t Capacity() const;
+
+  /**
+   * Returns the number of bytes handed out since the last Reset.
+   *
+   * @return size_t Size in bytes.
+   */
+  size_t Size() const;
+
+private:
+  static const size_t kDefaultChunkSize = 4 * 1024;
+  static const size_t kDefaultMaxRetained = 1024 * 1024;
+
+  struct Chunk
+  {
+    Chunk*  mNext;
+    size_t  mCapacity;
+    size_t  mSize;
+  };
+
+  char* Top(Chunk* aChunk) const;
+  void AddChunk(size_t aSize);
+
+  Chunk*  mHead;
+  Chunk*  mCurrent;
+  size_t  mChunkSize;
+  size_t  mMaxRetained;
+  size_t  mCapacity;
+};
+
+inline size_t ArenaAllocator::Capacity() const
+{
+  return mCapacity;
+}
+
+}
+}
+
+#endif // mozilla_telemetry_Arena_Allocator_h
@@ -0,0 +1,131 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief AsyncReadBuffer implementation @file
+
+#include "AsyncReadBuffer.h"
+
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <sstream>
+#include <unistd.h>
+
+using namespace std;
+
+namespace mozilla {
+namespace telemetry {
+
+////////////////////////////////////////////////////////////////////////////////
+AsyncReadBuffer::AsyncReadBuffer(const boost::filesystem::path& aName,
+                                 size_t aChunkSize) :
+  mFd(-1),
+  mCurrent(-1),
+  mEof(false),
+  mStop(false)
+{
+  mFd = open(aName.c_str(), O_RDONLY);
+  if (mFd < 0) {
+    stringstream ss;
+    ss << "file open failed: " << aName.string();
+    throw runtime_error(ss.str());
+  }
+  posix_fadvise(mFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  mChunks[0].mData.resize(aChunkSize);
+  mChunks[1].mData.resize(aChunkSize);
+  setg(nullptr, nullptr, nullptr);
+  mThread = thread(&AsyncReadBuffer::ReadAhead, this);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+AsyncReadBuffer::~AsyncReadBuffer()
+{
+  {
+    lock_guard<mutex> lock(mMutex);
+    mStop = true;
+  }
+  mCond.notify_all();
+  mThread.join();
+  close(mFd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const std::string& AsyncReadBuffer::GetError() const
+{
+  return mError;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+AsyncReadBuffer::int_type AsyncReadBuffer::underflow()
+{
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+  unique_lock<mutex> lock(mMutex);
+  if (mCurrent >= 0) {
+    // hand the consumed chunk back to the I/O thread and drop it from the
+    // page cache so the input does not evict more useful data
+    Chunk& done = mChunks[mCurrent];
+    posix_fadvise(mFd, done.mOffset, done.mSize, POSIX_FADV_DONTNEED);
+    done.mFull = false;
+    mCond.notify_all();
+  }
+  mCurrent = mCurrent == 0 ? 1 : 0;
+  Chunk& next = mChunks[mCurrent];
+  mCond.wait(lock, [this, &next] { return next.mFull || mEof; });
+  if (!next.mFull || next.mSize == 0) {
+    setg(nullptr, nullptr, nullptr);
+    return traits_type::eof();
+  }
+  char* p = next.mData.data();
+  setg(p, p, p + next.mSize);
+  return traits_type::to_int_type(*p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Private Member Functions
+////////////////////////////////////////////////////////////////////////////////
+void AsyncReadBuffer::ReadAhead()
+{
+  uint64_t offset = 0;
+  for (int i = 0; ; i = i == 0 ? 1 : 0) {
+    Chunk& c = mChunks[i];
+    {
+      unique_lock<mutex> lock(mMutex);
+      mCond.wait(lock, [this, &c] { return !c.mFull || mStop; });
+      if (mStop) return;
+    }
+
+    // the chunk is owned by this thread until it is marked full
+    size_t size = 0;
+    while (size < c.mData.size()) {
+      ssize_t n = pread(mFd, c.mData.data() + size, c.mData.size() - size,
+                        offset + size);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        if (n < 0) {
+          lock_guard<mutex> lock(mMutex);
+          mError = strerror(errno);
+        }
+        break;
+      }
+      size += n;
+    }
+
+    lock_guard<mutex> lock(mMutex);
+    c.mOffset = offset;
+    c.mSize = size;
+    c.mFull = size > 0;
+    offset += size;
+    if (size < c.mData.size()) mEof = true;
+    mCond.notify_all();
+    if (mEof) return;
+  }
+}
+
+}
+}
@@ -0,0 +1,80 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Double buffered file input; a background thread reads the next chunk while
+the current one is consumed through a std::istream.
+ */
+
+#ifndef mozilla_telemetry_Async_Read_Buffer_h
+#define mozilla_telemetry_Async_Read_Buffer_h
+
+#include <boost/filesystem.hpp>
+#include <boost/utility.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mozilla {
+namespace telemetry {
+
+class AsyncReadBuffer : public std::streambuf, boost::noncopyable
+{
+public:
+  /**
+   * Opens the file and starts reading ahead.
+   *
+   * @param aName Fully qualified name of the file to read.
+   * @param aChunkSize Size of each of the two read ahead buffers.
+   */
+  AsyncReadBuffer(const boost::filesystem::path& aName,
+                  size_t aChunkSize = kDefaultChunkSize);
+  ~AsyncReadBuffer();
+
+  /**
+   * Returns the read error encountered by the I/O thread.
+   *
+   * @return const std::string& Empty if no error occurred.
+   */
+  const std::string& GetError() const;
+
+protected:
+  int_type underflow();
+
+private:
+  static const size_t kDefaultChunkSize = 4 * 1024 * 1024;
+
+  struct Chunk
+  {
+    Chunk() : mOffset(0), mSize(0), mFull(false) { }
+
+    std::vector<char> mData;
+    uint64_t          mOffset; ///< file position of mData[0]
+    size_t            mSize;
+    bool              mFull;
+  };
+
+  void ReadAhead();
+
+  int                     mFd;
+  Chunk                   mChunks[2];
+  int                     mCurrent; ///< chunk being consumed, -1 before start
+  bool                    mEof;
+  bool                    mStop;
+  std::string             mError;
+  std::mutex              mMutex;
+  std::condition_variable mCond;
+  std::thread             mThread;
+};
+
+}
+}
+
+#endif // mozilla_telemetry_Async_Read_Buffer_h
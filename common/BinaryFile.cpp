@@ -0,0 +1,88 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief BinaryFile implementation @file
+
+#include "BinaryFile.h"
+
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+namespace mozilla {
+namespace telemetry {
+
+static const uint32_t kByteOrderMark = 0x01020304;
+
+////////////////////////////////////////////////////////////////////////////////
+BinaryHeader MakeBinaryHeader(const char* aMagic, uint32_t aVersion,
+                              uint32_t aChecksum)
+{
+  BinaryHeader h;
+  memcpy(h.mMagic, aMagic, sizeof(h.mMagic));
+  h.mByteOrder = kByteOrderMark;
+  h.mVersion = aVersion;
+  h.mChecksum = aChecksum;
+  return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void CheckBinaryHeader(const BinaryHeader& aHeader, const char* aMagic,
+                       uint32_t aVersion, const std::string& aWhat)
+{
+  if (memcmp(aHeader.mMagic, aMagic, sizeof(aHeader.mMagic)) != 0) {
+    stringstream ss;
+    ss << "invalid " << aWhat;
+    throw runtime_error(ss.str());
+  }
+  if (aHeader.mByteOrder != kByteOrderMark) {
+    stringstream ss;
+    ss << "foreign byte order, " << aWhat;
+    throw runtime_error(ss.str());
+  }
+  if (aHeader.mVersion != aVersion) {
+    stringstream ss;
+    ss << "unsupported version " << aHeader.mVersion << ", " << aWhat;
+    throw runtime_error(ss.str());
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void WriteBinaryFile(const boost::filesystem::path& aName,
+                     const std::function<void (std::ostream&)>& aWrite)
+{
+  // unique so concurrent writers sharing a directory never mix their output
+  fs::path tmp = aName;
+  tmp += fs::unique_path(".%%%%-%%%%");
+  try {
+    ofstream ofs(tmp.c_str(), ios_base::binary | ios_base::trunc);
+    if (!ofs) {
+      stringstream ss;
+      ss << "file open failed: " << tmp.string();
+      throw runtime_error(ss.str());
+    }
+    aWrite(ofs);
+    ofs.close();
+    if (!ofs) {
+      stringstream ss;
+      ss << "file write failed: " << tmp.string();
+      throw runtime_error(ss.str());
+    }
+    fs::rename(tmp, aName);
+  }
+  catch (...) {
+    boost::system::error_code ec;
+    fs::remove(tmp, ec);
+    throw;
+  }
+}
+
+}
+}
@@ -0,0 +1,75 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Header and write path shared by the binary files the converter keeps for
+itself (specification snapshots, the duplicate filter state and record
+indexes). The files are written in native byte order; the byte order marker
+reads back differently on a host with the other byte order, so such a file is
+rejected instead of misread. A CRC32C covers the body that follows the
+format's header.
+ */
+
+#ifndef mozilla_telemetry_Binary_File_h
+#define mozilla_telemetry_Binary_File_h
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+
+namespace mozilla {
+namespace telemetry {
+
+struct BinaryHeader
+{
+  char      mMagic[4];
+  uint32_t  mByteOrder;
+  uint32_t  mVersion;
+  uint32_t  mChecksum;  ///< CRC32C of the body
+};
+
+/**
+ * Fills a header in native byte order.
+ *
+ * @param aMagic Four character format tag.
+ * @param aVersion Format version.
+ * @param aChecksum CRC32C of the body (see Crc32c).
+ *
+ * @return BinaryHeader
+ */
+BinaryHeader MakeBinaryHeader(const char* aMagic, uint32_t aVersion,
+                              uint32_t aChecksum);
+
+/**
+ * Validates the magic number, byte order and version of a header; the
+ * checksum is left to the caller as the body may not be read yet.
+ *
+ * @param aHeader Header read from the file.
+ * @param aMagic Expected four character format tag.
+ * @param aVersion Supported format version.
+ * @param aWhat Description of the file for the error messages (i.e.
+ *              "record index: a.log.idx").
+ */
+void CheckBinaryHeader(const BinaryHeader& aHeader, const char* aMagic,
+                       uint32_t aVersion, const std::string& aWhat);
+
+/**
+ * Writes a file under a unique temporary name and renames it over aName, so
+ * a reader (or a crash) never sees a partial file. The temporary file is
+ * removed when the write fails.
+ *
+ * @param aName File name.
+ * @param aWrite Writes the file content.
+ */
+void WriteBinaryFile(const boost::filesystem::path& aName,
+                     const std::function<void (std::ostream&)>& aWrite);
+
+}
+}
+
+#endif // mozilla_telemetry_Binary_File_h
@@ -0,0 +1,479 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief ColumnarBlock implementation @file
+
+#include "ColumnarBlock.h"
+#include "HistogramConverter.h"
+#include "TelemetryConstants.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <sstream>
+
+using namespace std;
+
+namespace mozilla {
+namespace telemetry {
+
+static const char kMagic[] = "TCOL";
+static const uint32_t kVersion = 1;
+/// magic, version, row count, spec count, the three fixed column lengths and
+/// the info and histogram column counts
+static const size_t kHeaderSize = 4 + 4 + 4 + 4 + 3 * 4 + 4 + 4;
+/// name length, dictionary size and byte length
+static const size_t kInfoColumnHeaderSize = 3 * 4;
+/// spec index, definition id, name length, bucket count, row count and byte
+/// length
+static const size_t kHistogramColumnHeaderSize = 6 * 4;
+/// largest integral summary value stored as a varint
+static const double kMaxIntegral = 9007199254740992.0; // 2^53
+
+////////////////////////////////////////////////////////////////////////////////
+static size_t PutVarint(string& aBuf, uint64_t aValue)
+{
+  size_t n = 1;
+  while (aValue >= 0x80) {
+    aBuf.push_back(static_cast<char>(aValue | 0x80));
+    aValue >>= 7;
+    ++n;
+  }
+  aBuf.push_back(static_cast<char>(aValue));
+  return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static size_t GetVarintSize(uint64_t aValue)
+{
+  size_t n = 1;
+  for (; aValue >= 0x80; aValue >>= 7) ++n;
+  return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static size_t PutSigned(string& aBuf, int64_t aValue)
+{
+  return PutVarint(aBuf, (static_cast<uint64_t>(aValue) << 1)
+                   ^ static_cast<uint64_t>(aValue >> 63));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static size_t PutValue(string& aBuf, double aValue)
+{
+  if (aValue == floor(aValue) && fabs(aValue) < kMaxIntegral) {
+    int64_t v = static_cast<int64_t>(aValue);
+    return PutVarint(aBuf, ((static_cast<uint64_t>(v) << 1)
+                            ^ static_cast<uint64_t>(v >> 63)) << 1);
+  }
+  uint64_t bits;
+  memcpy(&bits, &aValue, sizeof(bits));
+  aBuf.push_back(1);
+  for (int i = 0; i < 8; ++i) {
+    aBuf.push_back(static_cast<char>(bits >> (i * 8)));
+  }
+  return 9;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void WriteFixed(ostream& aOutput, uint64_t aValue, int aBytes)
+{
+  char buf[8];
+  for (int i = 0; i < aBytes; ++i) {
+    buf[i] = static_cast<char>(aValue >> (i * 8));
+  }
+  aOutput.write(buf, aBytes);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void WriteString(ostream& aOutput, const string& aValue)
+{
+  WriteFixed(aOutput, aValue.size(), 4);
+  aOutput.write(aValue.data(), aValue.size());
+}
+
+/**
+ * Bounds checked decoding of an encoded block.
+ */
+class BlockReader
+{
+public:
+  BlockReader(const char* aData, size_t aLength) :
+    mPos(reinterpret_cast<const unsigned char*>(aData)),
+    mEnd(mPos + aLength) { }
+
+  uint64_t GetFixed(int aBytes)
+  {
+    Require(aBytes);
+    uint64_t v = 0;
+    for (int i = 0; i < aBytes; ++i) {
+      v |= static_cast<uint64_t>(mPos[i]) << (i * 8);
+    }
+    mPos += aBytes;
+    return v;
+  }
+
+  uint64_t GetVarint()
+  {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      Require(1);
+      uint64_t b = *mPos++;
+      v |= (b & 0x7f) << shift;
+      if (b < 0x80) return v;
+    }
+    throw runtime_error("columnar block: invalid varint");
+  }
+
+  int64_t GetSigned()
+  {
+    uint64_t v = GetVarint();
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+  }
+
+  double GetValue()
+  {
+    uint64_t v = GetVarint();
+    if (v & 1) {
+      uint64_t bits = GetFixed(8);
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      return d;
+    }
+    v >>= 1;
+    return static_cast<double>(static_cast<int64_t>(v >> 1)
+                               ^ -static_cast<int64_t>(v & 1));
+  }
+
+  string GetString(size_t aLength)
+  {
+    Require(aLength);
+    string s(reinterpret_cast<const char*>(mPos), aLength);
+    mPos += aLength;
+    return s;
+  }
+
+  /// Returns a reader over the next aLength bytes and skips them
+  BlockReader GetColumn(size_t aLength)
+  {
+    Require(aLength);
+    BlockReader r(reinterpret_cast<const char*>(mPos), aLength);
+    mPos += aLength;
+    return r;
+  }
+
+  bool AtEnd() const
+  {
+    return mPos == mEnd;
+  }
+
+private:
+  void Require(size_t aLength)
+  {
+    if (static_cast<size_t>(mEnd - mPos) < aLength) {
+      throw runtime_error("columnar block: truncated");
+    }
+  }
+
+  const unsigned char* mPos;
+  const unsigned char* mEnd;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+ColumnarBlock::ColumnarBlock()
+{
+  Clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+size_t ColumnarBlock::Append(const char* aUuid, size_t aUuidLength,
+                             uint64_t aTimestamp,
+                             const RapidjsonValue& aDocument,
+                             const HistogramSpecification& aSpec)
+{
+  size_t size = mSize;
+  uint32_t spec = 0;
+  while (spec < mSpecs.size() && mSpecs[spec] != aSpec.GetHash()) ++spec;
+  if (spec == mSpecs.size()) {
+    mSpecs.push_back(aSpec.GetHash());
+    mSize += 8;
+  }
+
+  mSize += PutVarint(mUuids, aUuidLength);
+  mUuids.append(aUuid, aUuidLength);
+  mSize += aUuidLength;
+  mSize += PutSigned(mTimestamps,
+                     static_cast<int64_t>(aTimestamp - mLastTimestamp));
+  mLastTimestamp = aTimestamp;
+  mSize += PutVarint(mSpecIndices, spec);
+
+  const RapidjsonValue& info = aDocument["info"];
+  AppendInfo(info);
+  const RapidjsonValue& histograms = aDocument["histograms"];
+  if (histograms.IsObject()) {
+    AppendHistograms(histograms, spec, aSpec);
+  }
+  ++mRowCount;
+  return mSize - size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ColumnarBlock::Write(ostream& aOutput) const
+{
+  aOutput.write(kMagic, 4);
+  WriteFixed(aOutput, kVersion, 4);
+  WriteFixed(aOutput, mRowCount, 4);
+  WriteFixed(aOutput, mSpecs.size(), 4);
+  for (auto it = mSpecs.begin(); it != mSpecs.end(); ++it) {
+    WriteFixed(aOutput, *it, 8);
+  }
+  WriteString(aOutput, mUuids);
+  WriteString(aOutput, mTimestamps);
+  WriteString(aOutput, mSpecIndices);
+
+  WriteFixed(aOutput, mInfoColumns.size(), 4);
+  string buf;
+  for (auto it = mInfoColumns.begin(); it != mInfoColumns.end(); ++it) {
+    WriteString(aOutput, it->mName);
+    WriteFixed(aOutput, it->mEntries.size(), 4);
+    for (auto eit = it->mEntries.begin(); eit != it->mEntries.end(); ++eit) {
+      buf.clear();
+      PutVarint(buf, eit->size());
+      aOutput.write(buf.data(), buf.size());
+      aOutput.write(eit->data(), eit->size());
+    }
+    WriteString(aOutput, it->mRows);
+  }
+
+  WriteFixed(aOutput, mHistogramColumns.size(), 4);
+  for (auto it = mHistogramColumns.begin(); it != mHistogramColumns.end();
+       ++it) {
+    WriteFixed(aOutput, it->mSpec, 4);
+    WriteFixed(aOutput, it->mDefinition, 4);
+    WriteString(aOutput, it->mName);
+    WriteFixed(aOutput, it->mBucketCount, 4);
+    WriteFixed(aOutput, it->mRowCount, 4);
+    WriteString(aOutput, it->mRows);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ColumnarBlock::Clear()
+{
+  mRowCount = 0;
+  mSize = kHeaderSize;
+  mSummary.resize(kExtraBucketsSize);
+  mLastTimestamp = 0;
+  mSpecs.clear();
+  mUuids.clear();
+  mTimestamps.clear();
+  mSpecIndices.clear();
+  mInfoColumns.clear();
+  mInfoIndex.clear();
+  mHistogramColumns.clear();
+  mHistogramIndex.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ColumnarBlock::Read(const char* aData, size_t aLength, vector<Row>& aRows)
+{
+  BlockReader r(aData, aLength);
+  if (r.GetString(4) != kMagic) {
+    throw runtime_error("columnar block: invalid magic");
+  }
+  uint64_t version = r.GetFixed(4);
+  if (version != kVersion) {
+    stringstream ss;
+    ss << "columnar block: unsupported version " << version;
+    throw runtime_error(ss.str());
+  }
+  size_t rows = r.GetFixed(4);
+  vector<uint64_t> specs(r.GetFixed(4));
+  for (auto it = specs.begin(); it != specs.end(); ++it) {
+    *it = r.GetFixed(8);
+  }
+
+  aRows.clear();
+  aRows.resize(rows);
+  BlockReader uuids = r.GetColumn(r.GetFixed(4));
+  BlockReader timestamps = r.GetColumn(r.GetFixed(4));
+  BlockReader indices = r.GetColumn(r.GetFixed(4));
+  uint64_t timestamp = 0;
+  for (size_t i = 0; i < rows; ++i) {
+    aRows[i].mUuid = uuids.GetString(uuids.GetVarint());
+    timestamp += static_cast<uint64_t>(timestamps.GetSigned());
+    aRows[i].mTimestamp = timestamp;
+    uint64_t spec = indices.GetVarint();
+    if (spec >= specs.size()) {
+      throw runtime_error("columnar block: invalid spec index");
+    }
+    aRows[i].mSpecHash = specs[spec];
+  }
+
+  size_t columns = r.GetFixed(4);
+  for (size_t c = 0; c < columns; ++c) {
+    string name = r.GetString(r.GetFixed(4));
+    vector<string> entries(r.GetFixed(4));
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      *it = r.GetString(r.GetVarint());
+    }
+    BlockReader values = r.GetColumn(r.GetFixed(4));
+    for (size_t i = 0; i < rows; ++i) {
+      uint64_t v = values.GetVarint();
+      if (v > entries.size()) {
+        throw runtime_error("columnar block: invalid dictionary index");
+      }
+      if (v) aRows[i].mInfo.push_back(make_pair(name, entries[v - 1]));
+    }
+  }
+
+  columns = r.GetFixed(4);
+  for (size_t c = 0; c < columns; ++c) {
+    Histogram h;
+    r.GetFixed(4); // spec index, implied by the row
+    h.mDefinition = r.GetFixed(4);
+    h.mName = r.GetString(r.GetFixed(4));
+    size_t bucketCount = r.GetFixed(4);
+    size_t count = r.GetFixed(4);
+    BlockReader values = r.GetColumn(r.GetFixed(4));
+    h.mCounts.resize(bucketCount);
+    h.mSummary.resize(kExtraBucketsSize);
+    size_t row = 0;
+    for (size_t n = 0; n < count; ++n) {
+      row += values.GetVarint();
+      if (row >= rows) {
+        throw runtime_error("columnar block: invalid row");
+      }
+      for (size_t i = 0; i < bucketCount;) {
+        uint64_t run = values.GetVarint();
+        if (run > bucketCount - i) {
+          throw runtime_error("columnar block: invalid zero run");
+        }
+        fill_n(h.mCounts.begin() + i, run, 0);
+        i += run;
+        if (i < bucketCount) {
+          h.mCounts[i++] = static_cast<int32_t>(values.GetSigned());
+        }
+      }
+      for (size_t i = 0; i < kExtraBucketsSize; ++i) {
+        h.mSummary[i] = values.GetValue();
+      }
+      aRows[row++].mHistograms.push_back(h);
+    }
+  }
+  if (!r.AtEnd()) {
+    throw runtime_error("columnar block: trailing data");
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Private Member Functions
+////////////////////////////////////////////////////////////////////////////////
+void ColumnarBlock::AppendInfo(const RapidjsonValue& aInfo)
+{
+  if (aInfo.IsObject()) {
+    rapidjson::StringBuffer sb;
+    for (RapidjsonValue::ConstMemberIterator it = aInfo.MemberBegin();
+         it != aInfo.MemberEnd(); ++it) {
+      string name(it->name.GetString(), it->name.GetStringLength());
+      auto cit = mInfoIndex.find(name);
+      if (cit == mInfoIndex.end()) {
+        cit = mInfoIndex.insert(make_pair(name, mInfoColumns.size())).first;
+        mInfoColumns.push_back(InfoColumn());
+        InfoColumn& c = mInfoColumns.back();
+        c.mName = name;
+        c.mLastRow = static_cast<size_t>(-1);
+        c.mRows.assign(mRowCount, 0); // missing from the previous rows
+        mSize += kInfoColumnHeaderSize + name.size() + mRowCount;
+      }
+      InfoColumn& c = mInfoColumns[cit->second];
+      if (c.mLastRow == mRowCount) continue; // duplicate member
+
+      // the writer only accepts an object or array at the root
+      sb.Clear();
+      rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+      writer.StartArray();
+      it->value.Accept(writer);
+      writer.EndArray();
+      string value(sb.GetString() + 1, sb.Size() - 2);
+      auto dit = c.mDictionary.find(value);
+      if (dit == c.mDictionary.end()) {
+        uint32_t index = static_cast<uint32_t>(c.mEntries.size());
+        dit = c.mDictionary.insert(make_pair(value, index)).first;
+        c.mEntries.push_back(value);
+        mSize += GetVarintSize(value.size()) + value.size();
+      }
+      mSize += PutVarint(c.mRows, dit->second + 1);
+      c.mLastRow = mRowCount;
+    }
+  }
+  for (auto it = mInfoColumns.begin(); it != mInfoColumns.end(); ++it) {
+    if (it->mLastRow != mRowCount) {
+      it->mRows.push_back(0);
+      ++mSize;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ColumnarBlock::AppendHistograms(const RapidjsonValue& aHistograms,
+                                     uint32_t aSpecIndex,
+                                     const HistogramSpecification& aSpec)
+{
+  for (RapidjsonValue::ConstMemberIterator it = aHistograms.MemberBegin();
+       it != aHistograms.MemberEnd(); ++it) {
+    if (!it->value.IsArray()) continue; // not converted
+    uint32_t id;
+    const HistogramDefinition* hd = aSpec.GetDefinition(it->name.GetString(),
+                                                        id);
+    if (!hd) continue;
+    mCounts.resize(hd->GetBucketCount());
+    if (!ReadHistogramArray(it->value, hd->GetBucketCount(), mCounts.data(),
+                            mSummary.data())) {
+      continue;
+    }
+
+    uint64_t key = static_cast<uint64_t>(aSpecIndex) << 32 | id;
+    auto cit = mHistogramIndex.find(key);
+    if (cit == mHistogramIndex.end()) {
+      cit = mHistogramIndex.insert(make_pair(key, mHistogramColumns.size()))
+        .first;
+      mHistogramColumns.push_back(HistogramColumn());
+      HistogramColumn& c = mHistogramColumns.back();
+      c.mSpec = aSpecIndex;
+      c.mDefinition = id;
+      c.mName.assign(it->name.GetString(), it->name.GetStringLength());
+      c.mBucketCount = hd->GetBucketCount();
+      c.mRowCount = 0;
+      c.mNextRow = 0;
+      mSize += kHistogramColumnHeaderSize + c.mName.size();
+    }
+    HistogramColumn& c = mHistogramColumns[cit->second];
+    if (c.mNextRow > mRowCount) continue; // duplicate member
+
+    mSize += PutVarint(c.mRows, mRowCount - c.mNextRow);
+    for (int i = 0; i < c.mBucketCount;) {
+      int run = i;
+      while (run < c.mBucketCount && mCounts[run] == 0) ++run;
+      mSize += PutVarint(c.mRows, run - i);
+      i = run;
+      if (i < c.mBucketCount) {
+        mSize += PutSigned(c.mRows, mCounts[i++]);
+      }
+    }
+    for (auto vit = mSummary.begin(); vit != mSummary.end(); ++vit) {
+      mSize += PutValue(c.mRows, *vit);
+    }
+    ++c.mRowCount;
+    c.mNextRow = mRowCount + 1;
+  }
+}
+
+}
+}
@@ -0,0 +1,192 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Columnar binary encoding of a block of converted telemetry records.
+
+A block stores its rows column by column. Integers are little endian, "varint"
+is the unsigned LEB128 encoding and signed values are zigzag encoded first;
+the structure uses fixed width fields so the encoded size is known exactly as
+rows are appended.
+
+    "TCOL", u32 version (1)
+    u32 row count
+    u32 spec count, u64 spec hash per spec
+    uuid column       u32 byte length, per row: varint length, bytes
+    timestamp column  u32 byte length, per row: signed varint delta from the
+                      previous row (the first from 0)
+    spec column       u32 byte length, per row: varint spec index
+    u32 info column count, per info column:
+      u32 name length, name
+      u32 dictionary size, per entry: varint length, JSON value text
+      u32 byte length, per row: varint dictionary index + 1 (0 missing)
+    u32 histogram column count, per histogram column:
+      u32 spec index, u32 definition id, u32 name length, name
+      u32 bucket count, u32 row count
+      u32 byte length, per row containing the histogram:
+        varint rows skipped since the previous entry
+        counts: varint zero run, signed varint count; repeated until the
+        bucket count is covered (a run reaching the end has no count)
+        summary values: varint (zigzag << 1) for integral values, otherwise
+        varint 1 followed by the IEEE 754 double
+
+Only the info object and the converted histograms are stored, other payload
+members and histograms missing from the specification are dropped.
+ */
+
+#ifndef mozilla_telemetry_Columnar_Block_h
+#define mozilla_telemetry_Columnar_Block_h
+
+#include "HistogramSpecification.h"
+
+#include <boost/utility.hpp>
+#include <cstdint>
+#include <ostream>
+#include <rapidjson/document.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace mozilla {
+namespace telemetry {
+
+/**
+ * Accumulates converted records as columns, the encoded size is known at all
+ * times so the block can be flushed at a size limit.
+ *
+ */
+class ColumnarBlock : boost::noncopyable
+{
+public:
+  /// A decoded histogram
+  struct Histogram
+  {
+    std::string mName;
+    uint32_t mDefinition;
+    std::vector<int32_t> mCounts;
+    std::vector<double> mSummary;
+  };
+
+  /// A decoded row
+  struct Row
+  {
+    std::string mUuid;
+    uint64_t mTimestamp;
+    uint64_t mSpecHash;
+    /// info member name and JSON value text
+    std::vector<std::pair<std::string, std::string>> mInfo;
+    std::vector<Histogram> mHistograms;
+  };
+
+  ColumnarBlock();
+
+  /**
+   * Appends a converted record.
+   *
+   * @param aUuid Record uuid.
+   * @param aUuidLength Length of the uuid.
+   * @param aTimestamp Record timestamp.
+   * @param aDocument Converted (ver 2 or 3) payload.
+   * @param aSpec Specification the histograms were converted with.
+   *
+   * @return size_t Number of bytes the record added to the encoded block.
+   */
+  size_t Append(const char* aUuid, size_t aUuidLength, uint64_t aTimestamp,
+                const RapidjsonValue& aDocument,
+                const HistogramSpecification& aSpec);
+
+  /**
+   * Writes the encoded block.
+   *
+   * @param aOutput Output stream.
+   */
+  void Write(std::ostream& aOutput) const;
+
+  /**
+   * Removes all rows and columns.
+   */
+  void Clear();
+
+  /**
+   * Returns the encoded size of the block.
+   *
+   * @return size_t Number of bytes Write produces.
+   */
+  size_t GetSize() const;
+
+  /**
+   * Returns the number of rows in the block.
+   *
+   * @return size_t Number of rows.
+   */
+  size_t GetRowCount() const;
+
+  /**
+   * Decodes an encoded block.
+   *
+   * @param aData Encoded block.
+   * @param aLength Length of the encoded block.
+   * @param aRows Receives the rows.
+   */
+  static void Read(const char* aData, size_t aLength, std::vector<Row>& aRows);
+
+private:
+  struct InfoColumn
+  {
+    std::string mName;
+    std::unordered_map<std::string, uint32_t> mDictionary;
+    std::vector<std::string> mEntries; ///< dictionary in index order
+    std::string mRows;
+    size_t mLastRow;
+  };
+
+  struct HistogramColumn
+  {
+    uint32_t mSpec;
+    uint32_t mDefinition;
+    std::string mName;
+    int mBucketCount;
+    size_t mRowCount;
+    size_t mNextRow;  ///< row following the last one stored
+    std::string mRows;
+  };
+
+  void AppendInfo(const RapidjsonValue& aInfo);
+  void AppendHistograms(const RapidjsonValue& aHistograms,
+                        uint32_t aSpecIndex,
+                        const HistogramSpecification& aSpec);
+
+  size_t mRowCount;
+  size_t mSize;
+  uint64_t mLastTimestamp;
+  std::vector<uint64_t> mSpecs;
+  std::string mUuids;
+  std::string mTimestamps;
+  std::string mSpecIndices;
+  std::vector<InfoColumn> mInfoColumns;
+  std::unordered_map<std::string, size_t> mInfoIndex;
+  std::vector<HistogramColumn> mHistogramColumns;
+  /// histogram column keyed by spec index << 32 | definition id
+  std::unordered_map<uint64_t, size_t> mHistogramIndex;
+  std::vector<int> mCounts;     ///< scratch, counts of the histogram read
+  std::vector<double> mSummary; ///< scratch, summary of the histogram read
+};
+
+inline size_t ColumnarBlock::GetSize() const
+{
+  return mSize;
+}
+
+inline size_t ColumnarBlock::GetRowCount() const
+{
+  return mRowCount;
+}
+
+}
+}
+
+#endif // mozilla_telemetry_ColumnarBlock_h
@@ -7,9 +7,11 @@
 #ifndef mozilla_common_h
 #define mozilla_common_h
 
+#include "ArenaAllocator.h"
+
 #include <rapidjson/document.h>
 
-typedef rapidjson::GenericDocument<rapidjson::UTF8<>, rapidjson::CrtAllocator> RapidjsonDocument;
-typedef rapidjson::GenericValue<rapidjson::UTF8<>, rapidjson::CrtAllocator>  RapidjsonValue;
+typedef rapidjson::GenericDocument<rapidjson::UTF8<>, mozilla::telemetry::ArenaAllocator> RapidjsonDocument;
+typedef rapidjson::GenericValue<rapidjson::UTF8<>, mozilla::telemetry::ArenaAllocator>  RapidjsonValue;
 
 #endif
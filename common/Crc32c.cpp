@@ -0,0 +1,101 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief Crc32c implementation @file
+
+#include "Crc32c.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define TELEMETRY_CRC32C_SSE42 1
+#endif
+
+namespace mozilla {
+namespace telemetry {
+
+static const uint32_t kPolynomial = 0x82f63b78; // reversed Castagnoli
+
+typedef uint32_t (*Crc32cFunction)(uint32_t, const unsigned char*, size_t);
+
+////////////////////////////////////////////////////////////////////////////////
+struct Crc32cTable
+{
+  Crc32cTable()
+  {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ (kPolynomial & (0 - (crc & 1)));
+      }
+      mTable[i] = crc;
+    }
+  }
+
+  uint32_t mTable[256];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+static uint32_t Crc32cSoftware(uint32_t aCrc, const unsigned char* aData,
+                               size_t aLength)
+{
+  static const Crc32cTable table;
+  for (size_t i = 0; i < aLength; ++i) {
+    aCrc = table.mTable[(aCrc ^ aData[i]) & 0xff] ^ (aCrc >> 8);
+  }
+  return aCrc;
+}
+
+#ifdef TELEMETRY_CRC32C_SSE42
+////////////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cHardware(uint32_t aCrc, const unsigned char* aData,
+                               size_t aLength)
+{
+  for (; aLength && (reinterpret_cast<uintptr_t>(aData) & 7); --aLength) {
+    aCrc = __builtin_ia32_crc32qi(aCrc, *aData++);
+  }
+#ifdef __x86_64__
+  for (; aLength >= 8; aLength -= 8, aData += 8) {
+    uint64_t v;
+    memcpy(&v, aData, sizeof(v));
+    aCrc = static_cast<uint32_t>(__builtin_ia32_crc32di(aCrc, v));
+  }
+#endif
+  for (; aLength >= 4; aLength -= 4, aData += 4) {
+    uint32_t v;
+    memcpy(&v, aData, sizeof(v));
+    aCrc = __builtin_ia32_crc32si(aCrc, v);
+  }
+  for (; aLength; --aLength) {
+    aCrc = __builtin_ia32_crc32qi(aCrc, *aData++);
+  }
+  return aCrc;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+static Crc32cFunction SelectCrc32c()
+{
+#ifdef TELEMETRY_CRC32C_SSE42
+  unsigned eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+    return Crc32cHardware;
+  }
+#endif
+  return Crc32cSoftware;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t Crc32c(uint32_t aCrc, const void* aData, size_t aLength)
+{
+  static const Crc32cFunction crc32c = SelectCrc32c();
+  return ~crc32c(~aCrc, static_cast<const unsigned char*>(aData), aLength);
+}
+
+}
+}
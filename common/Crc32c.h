@@ -0,0 +1,35 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+CRC32C (Castagnoli) checksum. The SSE4.2 crc32 instruction is used when the
+CPU supports it, otherwise a table driven implementation.
+ */
+
+#ifndef mozilla_telemetry_Crc32c_h
+#define mozilla_telemetry_Crc32c_h
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mozilla {
+namespace telemetry {
+
+/**
+ * Extends a CRC32C checksum with aLength bytes.
+ *
+ * @param aCrc Checksum of the preceding data (0 to start a new checksum).
+ * @param aData Data to add to the checksum.
+ * @param aLength Number of bytes in aData.
+ *
+ * @return uint32_t Updated checksum.
+ */
+uint32_t Crc32c(uint32_t aCrc, const void* aData, size_t aLength);
+
+}
+}
+
+#endif // mozilla_telemetry_Crc32c_h
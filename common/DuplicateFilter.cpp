@@ -0,0 +1,246 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief DuplicateFilter implementation @file
+
+#include "DuplicateFilter.h"
+#include "BinaryFile.h"
+#include "Crc32c.h"
+
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+namespace mozilla {
+namespace telemetry {
+
+static const char kStateMagic[4] = { 'T', 'D', 'U', 'P' };
+static const uint32_t kStateVersion = 3;
+/// A block is one cache line
+static const size_t kBlockWords = 8;
+static const size_t kBlockBits = kBlockWords * 64;
+static const size_t kProbes = 8;
+/// ~0.1% false positives per generation when full (blocked, 8 probes)
+static const size_t kBitsPerKey = 16;
+
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t Hash(const char* aKey, size_t aLength)
+{
+  // FNV-1a followed by the murmur3 finalizer to spread the bits
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < aLength; ++i) {
+    h ^= static_cast<unsigned char>(aKey[i]);
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static bool Contains(const uint64_t* aBlock, const uint64_t* aMask)
+{
+  for (size_t i = 0; i < kBlockWords; ++i) {
+    if ((aBlock[i] & aMask[i]) != aMask[i]) return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+DuplicateFilter::DuplicateFilter(size_t aMemoryBudget,
+                                 uint64_t aRotationWindow) :
+  mCurrent(0),
+  mBlocks(aMemoryBudget / 2 / (kBlockWords * sizeof(uint64_t))),
+  mCapacity(0),
+  mRotationWindow(aRotationWindow)
+{
+  if (mBlocks == 0) mBlocks = 1;
+  mCapacity = mBlocks * kBlockBits / kBitsPerKey;
+  for (size_t i = 0; i < 2; ++i) {
+    mGenerations[i].mBits.resize(mBlocks * kBlockWords);
+    mGenerations[i].mStart = 0;
+    mGenerations[i].mCount = 0;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Passes the saved fields of the state in file order to aField
+template<typename Generation, typename F>
+static void VisitState(const uint64_t& aBlocks, const uint64_t& aCurrent,
+                       const Generation* aGenerations, F aField)
+{
+  aField(&aBlocks, sizeof(aBlocks));
+  aField(&aCurrent, sizeof(aCurrent));
+  for (size_t i = 0; i < 2; ++i) {
+    const Generation& g = aGenerations[i];
+    aField(&g.mStart, sizeof(g.mStart));
+    aField(&g.mCount, sizeof(g.mCount));
+    aField(g.mBits.data(), g.mBits.size() * sizeof(uint64_t));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Sets the probe bits of a key in aMask, returns the offset of its block
+static size_t Probe(const char* aKey, size_t aLength, size_t aBlocks,
+                    uint64_t* aMask)
+{
+  uint64_t h = Hash(aKey, aLength);
+  uint32_t bit = static_cast<uint32_t>(h);
+  uint32_t step = (bit >> 9) | 1; // odd, so the probes are distinct
+  for (size_t i = 0; i < kProbes; ++i, bit += step) {
+    size_t b = bit % kBlockBits;
+    aMask[b / 64] |= 1ULL << (b % 64);
+  }
+  return static_cast<size_t>(((h >> 32) * aBlocks) >> 32) * kBlockWords;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool DuplicateFilter::WasSeen(const char* aKey, size_t aLength) const
+{
+  uint64_t mask[kBlockWords] = { 0 };
+  size_t block = Probe(aKey, aLength, mBlocks, mask);
+
+  lock_guard<mutex> lock(mMutex);
+  return Contains(mGenerations[0].mBits.data() + block, mask)
+    || Contains(mGenerations[1].mBits.data() + block, mask);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool DuplicateFilter::IsDuplicate(const char* aKey, size_t aLength,
+                                  uint64_t aTimestamp)
+{
+  uint64_t mask[kBlockWords] = { 0 };
+  size_t block = Probe(aKey, aLength, mBlocks, mask);
+
+  lock_guard<mutex> lock(mMutex);
+  Generation* current = &mGenerations[mCurrent];
+  if (current->mCount >= mCapacity
+      || (mRotationWindow && current->mCount
+          && aTimestamp >= current->mStart
+          && aTimestamp - current->mStart >= mRotationWindow)) {
+    Rotate();
+    current = &mGenerations[mCurrent];
+  }
+  uint64_t* bits = current->mBits.data() + block;
+  if (Contains(bits, mask)) return true;
+
+  bool seen = Contains(mGenerations[mCurrent ^ 1].mBits.data() + block, mask);
+  // a key seen in the previous generation is carried over so it stays known
+  // as long as it keeps being resubmitted
+  for (size_t i = 0; i < kBlockWords; ++i) {
+    bits[i] |= mask[i];
+  }
+  if (current->mCount++ == 0) current->mStart = aTimestamp;
+  return seen;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void DuplicateFilter::Load(const boost::filesystem::path& aName)
+{
+  ifstream ifs(aName.c_str(), ios_base::binary);
+  if (!ifs) {
+    stringstream ss;
+    ss << "file open failed: " << aName.string();
+    throw runtime_error(ss.str());
+  }
+
+  BinaryHeader h;
+  uint64_t blocks, current;
+  if (!ifs.read(reinterpret_cast<char*>(&h), sizeof(h))
+      || !ifs.read(reinterpret_cast<char*>(&blocks), sizeof(blocks))
+      || !ifs.read(reinterpret_cast<char*>(&current), sizeof(current))) {
+    stringstream ss;
+    ss << "invalid duplicate filter state: " << aName.string();
+    throw runtime_error(ss.str());
+  }
+  CheckBinaryHeader(h, kStateMagic, kStateVersion,
+                    "duplicate filter state: " + aName.string());
+  if (blocks != mBlocks || current > 1) {
+    stringstream ss;
+    ss << "duplicate filter state does not match the memory budget: "
+      << aName.string();
+    throw runtime_error(ss.str());
+  }
+
+  Generation g[2];
+  for (size_t i = 0; i < 2; ++i) {
+    g[i].mBits.resize(mBlocks * kBlockWords);
+    if (!ifs.read(reinterpret_cast<char*>(&g[i].mStart), sizeof(g[i].mStart))
+        || !ifs.read(reinterpret_cast<char*>(&g[i].mCount),
+                     sizeof(g[i].mCount))
+        || !ifs.read(reinterpret_cast<char*>(g[i].mBits.data()),
+                     g[i].mBits.size() * sizeof(uint64_t))) {
+      stringstream ss;
+      ss << "truncated duplicate filter state: " << aName.string();
+      throw runtime_error(ss.str());
+    }
+  }
+  uint32_t checksum = 0;
+  VisitState(blocks, current, g, [&](const void* aData, size_t aLength) {
+    checksum = Crc32c(checksum, aData, aLength);
+  });
+  if (checksum != h.mChecksum) {
+    stringstream ss;
+    ss << "corrupt duplicate filter state: " << aName.string();
+    throw runtime_error(ss.str());
+  }
+
+  lock_guard<mutex> lock(mMutex);
+  for (size_t i = 0; i < 2; ++i) {
+    mGenerations[i].mBits.swap(g[i].mBits);
+    mGenerations[i].mStart = g[i].mStart;
+    mGenerations[i].mCount = g[i].mCount;
+  }
+  mCurrent = current;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void DuplicateFilter::Save(const boost::filesystem::path& aName)
+{
+  lock_guard<mutex> lock(mMutex);
+  uint64_t blocks = mBlocks;
+  uint64_t current = mCurrent;
+  uint32_t checksum = 0;
+  VisitState(blocks, current, mGenerations,
+             [&](const void* aData, size_t aLength) {
+               checksum = Crc32c(checksum, aData, aLength);
+             });
+  BinaryHeader h = MakeBinaryHeader(kStateMagic, kStateVersion, checksum);
+  WriteBinaryFile(aName, [&](ostream& aOutput) {
+    aOutput.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    VisitState(blocks, current, mGenerations,
+               [&](const void* aData, size_t aLength) {
+                 aOutput.write(static_cast<const char*>(aData), aLength);
+               });
+  });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+size_t DuplicateFilter::GetCapacity() const
+{
+  return mCapacity;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Private Members
+////////////////////////////////////////////////////////////////////////////////
+void DuplicateFilter::Rotate()
+{
+  mCurrent ^= 1;
+  Generation& g = mGenerations[mCurrent];
+  memset(g.mBits.data(), 0, g.mBits.size() * sizeof(uint64_t));
+  g.mStart = 0;
+  g.mCount = 0;
+}
+
+}
+}
@@ -0,0 +1,106 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Approximate set of the submission ids seen recently, used to drop resubmitted
+records before their payload is inflated. The set is a pair of blocked bloom
+filters (one cache line per key); the current generation receives the new keys
+and the previous one is only queried. The generations rotate when the current
+one is full or spans the rotation window, so a key is remembered for at least
+one window. False positives drop a unique record, false negatives never occur
+within the window.
+ */
+
+#ifndef mozilla_telemetry_Duplicate_Filter_h
+#define mozilla_telemetry_Duplicate_Filter_h
+
+#include <boost/filesystem.hpp>
+#include <boost/utility.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace mozilla {
+namespace telemetry {
+
+class DuplicateFilter : boost::noncopyable
+{
+public:
+  /**
+   * Creates an empty filter.
+   *
+   * @param aMemoryBudget Bytes shared by the two generations (at least one
+   *                      64 byte block each).
+   * @param aRotationWindow Span of header timestamps covered by a generation,
+   *                        0 only rotates full generations.
+   */
+  DuplicateFilter(size_t aMemoryBudget, uint64_t aRotationWindow);
+
+  /**
+   * Tests whether a key was seen in the last one or two generations and
+   * records it. Safe to call from multiple threads.
+   *
+   * @param aKey Key bytes (i.e. the submission id).
+   * @param aLength Number of bytes in aKey.
+   * @param aTimestamp Header timestamp of the record, drives the rotation.
+   *
+   * @return bool True if the key is (probably) a duplicate.
+   */
+  bool IsDuplicate(const char* aKey, size_t aLength, uint64_t aTimestamp);
+
+  /**
+   * Tests whether a key was seen in the last one or two generations without
+   * recording it. Safe to call from multiple threads.
+   *
+   * @param aKey Key bytes (i.e. the submission id).
+   * @param aLength Number of bytes in aKey.
+   *
+   * @return bool True if the key is (probably) a duplicate.
+   */
+  bool WasSeen(const char* aKey, size_t aLength) const;
+
+  /**
+   * Restores the state written by Save; the memory budget must match.
+   *
+   * @param aName State file name.
+   */
+  void Load(const boost::filesystem::path& aName);
+
+  /**
+   * Writes the state to a file (through a temporary file renamed over it).
+   *
+   * @param aName State file name.
+   */
+  void Save(const boost::filesystem::path& aName);
+
+  /**
+   * Returns the number of keys a generation holds before it is rotated.
+   */
+  size_t GetCapacity() const;
+
+private:
+  struct Generation
+  {
+    std::vector<uint64_t> mBits;
+    uint64_t              mStart; ///< timestamp of the first key
+    uint64_t              mCount;
+  };
+
+  void Rotate();
+
+  mutable std::mutex  mMutex;
+  Generation          mGenerations[2];
+  size_t              mCurrent;
+  size_t              mBlocks;
+  size_t              mCapacity;
+  uint64_t            mRotationWindow;
+};
+
+}
+}
+
+#endif // mozilla_telemetry_Duplicate_Filter_h
@@ -0,0 +1,117 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief HistogramAggregator implementation @file
+
+#include "HistogramAggregator.h"
+#include "HistogramConverter.h"
+#include "HistogramKernels.h"
+#include "TelemetryConstants.h"
+
+#include <cstdio>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+namespace mozilla {
+namespace telemetry {
+
+////////////////////////////////////////////////////////////////////////////////
+void HistogramAggregator::Add(const fs::path& aPath,
+                              const RapidjsonValue& aDocument,
+                              const HistogramSpecification& aSpec)
+{
+  Partition& p = mPartitions[aPath];
+  auto ait = p.begin();
+  while (ait != p.end() && ait->mSpec != aSpec.GetHash()) ++ait;
+  if (ait == p.end()) {
+    p.push_back(Aggregate());
+    ait = p.end() - 1;
+    ait->mSpec = aSpec.GetHash();
+    ait->mRecords = 0;
+  }
+  Aggregate& a = *ait;
+  ++a.mRecords;
+
+  const RapidjsonValue& histograms = aDocument["histograms"];
+  if (!histograms.IsObject()) return;
+  mSummary.resize(kExtraBucketsSize);
+  for (RapidjsonValue::ConstMemberIterator it = histograms.MemberBegin();
+       it != histograms.MemberEnd(); ++it) {
+    uint32_t id;
+    const HistogramDefinition* hd = aSpec.GetDefinition(it->name.GetString(),
+                                                        id);
+    if (!hd) continue;
+    int bucketCount = hd->GetBucketCount();
+    mCounts.resize(bucketCount);
+    if (!ReadHistogramArray(it->value, bucketCount, mCounts.data(),
+                            mSummary.data())) {
+      continue;
+    }
+
+    auto iit = a.mIndex.find(id);
+    if (iit == a.mIndex.end()) {
+      iit = a.mIndex.insert(make_pair(id, a.mHistograms.size())).first;
+      a.mHistograms.push_back(Accumulator());
+      Accumulator& acc = a.mHistograms.back();
+      acc.mName.assign(it->name.GetString(), it->name.GetStringLength());
+      acc.mCounts.resize(bucketCount);
+      acc.mSummary.assign(kExtraBucketsSize, -1);
+    }
+    Accumulator& acc = a.mHistograms[iit->second];
+    AddCounts(acc.mCounts.data(), mCounts.data(), bucketCount);
+    for (size_t i = 0; i < kExtraBucketsSize; ++i) {
+      if (mSummary[i] == -1) continue; // not recorded
+      if (acc.mSummary[i] == -1) {
+        acc.mSummary[i] = mSummary[i];
+      } else {
+        acc.mSummary[i] += mSummary[i];
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void HistogramAggregator::Write(ostream& aOutput) const
+{
+  // formatted by hand, the summed doubles need more digits than the rapidjson
+  // writer emits; histogram names are identifiers and need no escaping
+  char buf[32];
+  for (auto pit = mPartitions.begin(); pit != mPartitions.end(); ++pit) {
+    for (auto ait = pit->second.begin(); ait != pit->second.end(); ++ait) {
+      snprintf(buf, sizeof(buf), "%016llx",
+               static_cast<unsigned long long>(ait->mSpec));
+      aOutput << pit->first.string() << "\t{\"spec\":\"" << buf
+        << "\",\"records\":" << ait->mRecords << ",\"histograms\":{";
+      for (auto hit = ait->mHistograms.begin(); hit != ait->mHistograms.end();
+           ++hit) {
+        if (hit != ait->mHistograms.begin()) aOutput << ',';
+        aOutput << '"' << hit->mName << "\":[";
+        for (auto cit = hit->mCounts.begin(); cit != hit->mCounts.end();
+             ++cit) {
+          aOutput << *cit << ',';
+        }
+        for (auto sit = hit->mSummary.begin(); sit != hit->mSummary.end();
+             ++sit) {
+          if (sit != hit->mSummary.begin()) aOutput << ',';
+          snprintf(buf, sizeof(buf), "%.17g", *sit);
+          aOutput << buf;
+        }
+        aOutput << ']';
+      }
+      aOutput << "}}\n";
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void HistogramAggregator::Clear()
+{
+  mPartitions.clear();
+}
+
+}
+}
@@ -0,0 +1,121 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Sums converted histograms per dimension path and histogram specification.
+ */
+
+#ifndef mozilla_telemetry_Histogram_Aggregator_h
+#define mozilla_telemetry_Histogram_Aggregator_h
+
+#include "HistogramSpecification.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/utility.hpp>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <rapidjson/document.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mozilla {
+namespace telemetry {
+
+/**
+ * Accumulates the bucket counts and summary values of converted records, keyed
+ * by (dimension path, specification hash, histogram definition).
+ *
+ * The aggregate is written as one line per (path, specification):
+ *
+ *     path<tab>{"spec":"<hex hash>","records":n,"histograms":{"NAME":[...]}}
+ *
+ * each histogram array holding the summed counts followed by the summed
+ * summary values (-1 when no record carried the value).
+ */
+class HistogramAggregator : boost::noncopyable
+{
+public:
+  /**
+   * Adds the histograms of a converted record.
+   *
+   * @param aPath Dimension path of the record.
+   * @param aDocument Converted (ver 2 or 3) payload.
+   * @param aSpec Specification the histograms were converted with.
+   */
+  void Add(const boost::filesystem::path& aPath,
+           const RapidjsonValue& aDocument,
+           const HistogramSpecification& aSpec);
+
+  /**
+   * Writes the aggregate, one line per (path, specification).
+   *
+   * @param aOutput Output stream.
+   */
+  void Write(std::ostream& aOutput) const;
+
+  /**
+   * Drops all aggregates.
+   */
+  void Clear();
+
+  /**
+   * Tests whether anything was aggregated for a dimension path.
+   *
+   * @param aPath Dimension path.
+   *
+   * @return bool True if the path has an aggregate.
+   */
+  bool HasPartition(const boost::filesystem::path& aPath) const;
+
+  /**
+   * Returns the number of dimension paths aggregated.
+   *
+   * @return size_t Number of paths.
+   */
+  size_t GetPartitionCount() const;
+
+private:
+  struct Accumulator
+  {
+    std::string mName;
+    std::vector<int64_t> mCounts;
+    std::vector<double> mSummary;
+  };
+
+  struct Aggregate
+  {
+    uint64_t mSpec;
+    uint64_t mRecords;
+    std::vector<Accumulator> mHistograms;
+    /// accumulator index keyed by definition id
+    std::unordered_map<uint32_t, size_t> mIndex;
+  };
+
+  /// aggregates of a path, one per specification
+  typedef std::vector<Aggregate> Partition;
+
+  std::map<boost::filesystem::path, Partition> mPartitions;
+  std::vector<int> mCounts;     ///< scratch, counts of the histogram read
+  std::vector<double> mSummary; ///< scratch, summary of the histogram read
+};
+
+inline bool
+HistogramAggregator::HasPartition(const boost::filesystem::path& aPath) const
+{
+  return mPartitions.find(aPath) != mPartitions.end();
+}
+
+inline size_t HistogramAggregator::GetPartitionCount() const
+{
+  return mPartitions.size();
+}
+
+}
+}
+
+#endif // mozilla_telemetry_HistogramAggregator_h
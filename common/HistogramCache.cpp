@@ -7,10 +7,11 @@
 /// @brief Histogram cache implementation @file
 
 #include "HistogramCache.h"
+#include "BinaryFile.h"
+#include "MemoryMappedFile.h"
 
 #include <boost/asio.hpp>
 
-#include <openssl/md5.h>
 #include <iostream>
 #include <fstream>
 
@@ -20,6 +21,17 @@ namespace fs = boost::filesystem;
 namespace mozilla {
 namespace telemetry {
 
+/// Releases a held lock for the lifetime of the object
+class Unlocked : boost::noncopyable
+{
+public:
+  Unlocked(unique_lock<mutex>& aLock) : mLock(aLock) { mLock.unlock(); }
+  ~Unlocked() { mLock.lock(); }
+
+private:
+  unique_lock<mutex>& mLock;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 HistogramCache::HistogramCache(const std::string& aHistogramServer)
 {
@@ -37,24 +49,32 @@ std::shared_ptr<HistogramSpecification>
 HistogramCache::FindHistogram(const std::string& aRevisionKey)
 {
   shared_ptr<HistogramSpecification> h;
+  unique_lock<mutex> lock(mMutex);
 
   if (aRevisionKey.compare(0, 4, "http") != 0) {
     ++mMetrics.mInvalidRevisions.mValue;
     return h;
   }
   auto it = mRevisions.find(aRevisionKey);
+  while (it == mRevisions.end() && mLoading.count(aRevisionKey)) {
+    mLoaded.wait(lock); // another thread is loading it
+    it = mRevisions.find(aRevisionKey);
+  }
   if (it != mRevisions.end()) {
     ++mMetrics.mCacheHits.mValue;
     h = it->second;
   } else {
     ++mMetrics.mCacheMisses.mValue;
+    mLoading.insert(aRevisionKey);
     try {
-      h = LoadHistogram(aRevisionKey);
+      h = LoadHistogram(aRevisionKey, lock);
     }
     catch (const exception& e) {
       ++mMetrics.mConnectionErrors.mValue;
       cerr << "LoadHistogram - " << e.what() << endl;
     }
+    mLoading.erase(aRevisionKey);
+    mLoaded.notify_all();
   }
   return h;
 }
@@ -63,6 +83,7 @@ HistogramCache::FindHistogram(const std::string& aRevisionKey)
 void
 HistogramCache::GetMetrics(message::Message& aMsg)
 {
+  lock_guard<mutex> lock(mMutex);
   aMsg.clear_fields();
   ConstructField(aMsg, mMetrics.mConnectionErrors);
   ConstructField(aMsg, mMetrics.mHTTPErrors);
@@ -83,87 +104,35 @@ HistogramCache::GetMetrics(message::Message& aMsg)
 /// Private Member Functions
 ////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<HistogramSpecification>
-HistogramCache::LoadHistogram(const std::string& aRevisionKey)
+HistogramCache::LoadHistogram(const std::string& aRevisionKey,
+                              std::unique_lock<std::mutex>& aLock)
 {
   string json;
   string tmpName = aRevisionKey;
   std::replace(tmpName.begin(), tmpName.end(), '/', '-');
   fs::path tmp_cache = fs::temp_directory_path() / (tmpName + ".json");
+  fs::path snapshot = fs::temp_directory_path() / (tmpName + ".spec");
+  shared_ptr<HistogramSpecification> h = LoadSnapshot(snapshot);
+  if (h) {
+    return AddHistogram(aRevisionKey, h->GetHash(), h);
+  }
+
   ifstream ifs(tmp_cache.c_str());
   if (!ifs) {
-    using boost::asio::ip::tcp;
-    boost::asio::io_service io_service;
-
-    // Get a list of endpoints corresponding to the server name.
-    tcp::resolver resolver(io_service);
-    tcp::resolver::query query(mHistogramServer, mHistogramServerPort);
-    tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
-
-    // Try each endpoint until we successfully establish a connection.
-    tcp::socket socket(io_service);
-    boost::asio::connect(socket, endpoint_iterator);
-
-    // Form the request. We specify the "Connection: close" header so that the
-    // server will close the socket after transmitting the response. This will
-    // allow us to treat all data up until the EOF as the content.
-    boost::asio::streambuf request;
-    std::ostream request_stream(&request);
-    request_stream << "GET " << "/histogram_buckets?revision=" << aRevisionKey
-                   << " HTTP/1.0\r\n";
-    request_stream << "Host: " << mHistogramServer << ":" << mHistogramServerPort
-                   << "\r\n";
-    request_stream << "Accept: */*\r\n";
-    request_stream << "Connection: close\r\n\r\n";
-
-    // Send the request.
-    boost::asio::write(socket, request);
-
-    // Read the response status line. The response streambuf will automatically
-    // grow to accommodate the entire line. The growth may be limited by passing
-    // a maximum size to the streambuf constructor.
-    boost::asio::streambuf response;
-    boost::asio::read_until(socket, response, "\r\n");
-
-    // Check that response is OK.
-    std::istream response_stream(&response);
-    std::string http_version;
-    response_stream >> http_version;
-    unsigned int status_code;
-    response_stream >> status_code;
-    std::string status_message;
-    std::getline(response_stream, status_message);
-    if (!response_stream || http_version.substr(0, 5) != "HTTP/") {
-      ++mMetrics.mHTTPErrors.mValue;
-      return shared_ptr<HistogramSpecification>();
+    unsigned status;
+    {
+      // the download can take seconds, the other revisions stay available
+      Unlocked unlocked(aLock);
+      status = FetchHistogram(aRevisionKey, json);
     }
-
-    // Read the response headers, which are terminated by a blank line.
-    boost::asio::read_until(socket, response, "\r\n\r\n");
-
-    // Process the response headers.
-    std::string header;
-    while (std::getline(response_stream, header) && header != "\r");
-    if (status_code != 200) {
+    if (status != 200) {
       ++mMetrics.mHTTPErrors.mValue;
-      shared_ptr<HistogramSpecification> h;
-      mRevisions.insert(make_pair(aRevisionKey, h)); // prevent retries
+      if (status != 0) {
+        mRevisions.insert(make_pair(aRevisionKey, h)); // prevent retries
+      }
       return h;
     }
-
-    ostringstream oss;
-    // Write whatever content we already have to output.
-    if (response.size() > 0) oss << &response;
-    // Read until EOF, writing data to output as we go.
-    boost::system::error_code error;
-    while (boost::asio::read(socket, response,
-                             boost::asio::transfer_at_least(1), error)) {
-      oss << &response;
-    }
-    if (error != boost::asio::error::eof) {
-      throw boost::system::system_error(error);
-    }
     try {
-      json = oss.str();
       ofstream ofs(tmp_cache.c_str());
       ofs << json;
       ofs.close();
@@ -177,23 +146,147 @@ HistogramCache::LoadHistogram(const std::string& aRevisionKey)
   } else {
     json = string(istream_iterator<char>(ifs), istream_iterator<char>());
   }
-  // histogram specs do not change often between revisions. dedup based on contents of the json
-  unsigned char digest[MD5_DIGEST_LENGTH];
-  MD5((unsigned char*)json.c_str(), json.size(), digest);
-
-  string key(reinterpret_cast<char*>(digest), MD5_DIGEST_LENGTH);
-
+  // histogram specs do not change often between revisions. dedup based on
+  // contents of the json
+  uint64_t key = HistogramSpecification::HashJSON(json);
   auto it = mCache.find(key);
   if (it != mCache.end()) {
-    mRevisions.insert(make_pair(aRevisionKey, it->second));
-    return it->second;
+    h = it->second;
+  } else {
+    h.reset(new HistogramSpecification(json, &mDefinitions));
+  }
+  WriteSnapshot(snapshot, *h);
+  return AddHistogram(aRevisionKey, key, h);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+unsigned
+HistogramCache::FetchHistogram(const std::string& aRevisionKey,
+                               std::string& aJson) const
+{
+  using boost::asio::ip::tcp;
+  boost::asio::io_service io_service;
+
+  // Get a list of endpoints corresponding to the server name.
+  tcp::resolver resolver(io_service);
+  tcp::resolver::query query(mHistogramServer, mHistogramServerPort);
+  tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
+
+  // Try each endpoint until we successfully establish a connection.
+  tcp::socket socket(io_service);
+  boost::asio::connect(socket, endpoint_iterator);
+
+  // Form the request. We specify the "Connection: close" header so that the
+  // server will close the socket after transmitting the response. This will
+  // allow us to treat all data up until the EOF as the content.
+  boost::asio::streambuf request;
+  std::ostream request_stream(&request);
+  request_stream << "GET " << "/histogram_buckets?revision=" << aRevisionKey
+                 << " HTTP/1.0\r\n";
+  request_stream << "Host: " << mHistogramServer << ":" << mHistogramServerPort
+                 << "\r\n";
+  request_stream << "Accept: */*\r\n";
+  request_stream << "Connection: close\r\n\r\n";
+
+  // Send the request.
+  boost::asio::write(socket, request);
+
+  // Read the response status line. The response streambuf will automatically
+  // grow to accommodate the entire line. The growth may be limited by passing
+  // a maximum size to the streambuf constructor.
+  boost::asio::streambuf response;
+  boost::asio::read_until(socket, response, "\r\n");
+
+  // Check that response is OK.
+  std::istream response_stream(&response);
+  std::string http_version;
+  response_stream >> http_version;
+  unsigned int status_code;
+  response_stream >> status_code;
+  std::string status_message;
+  std::getline(response_stream, status_message);
+  if (!response_stream || http_version.substr(0, 5) != "HTTP/") {
+    return 0;
   }
 
-  shared_ptr<HistogramSpecification> h(new HistogramSpecification(json));
-  mCache.insert(make_pair(key, h));
-  mRevisions.insert(make_pair(aRevisionKey, h));
+  // Read the response headers, which are terminated by a blank line.
+  boost::asio::read_until(socket, response, "\r\n\r\n");
+
+  // Process the response headers.
+  std::string header;
+  while (std::getline(response_stream, header) && header != "\r");
+  if (status_code != 200) {
+    return status_code;
+  }
+
+  ostringstream oss;
+  // Write whatever content we already have to output.
+  if (response.size() > 0) oss << &response;
+  // Read until EOF, writing data to output as we go.
+  boost::system::error_code error;
+  while (boost::asio::read(socket, response,
+                           boost::asio::transfer_at_least(1), error)) {
+    oss << &response;
+  }
+  if (error != boost::asio::error::eof) {
+    throw boost::system::system_error(error);
+  }
+  aJson = oss.str();
+  return status_code;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<HistogramSpecification>
+HistogramCache::AddHistogram(const std::string& aRevisionKey, uint64_t aKey,
+                             std::shared_ptr<HistogramSpecification> aSpec)
+{
+  auto it = mCache.insert(make_pair(aKey, aSpec)).first;
+  mRevisions.insert(make_pair(aRevisionKey, it->second));
+  return it->second;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<HistogramSpecification>
+HistogramCache::LoadSnapshot(const boost::filesystem::path& aSnapshot)
+{
+  shared_ptr<HistogramSpecification> h;
+  boost::system::error_code ec;
+  if (!fs::exists(aSnapshot, ec)) {
+    return h;
+  }
+  try {
+    MemoryMappedFile mmf(aSnapshot);
+    auto it = mCache.find(HistogramSpecification::GetSnapshotHash(
+      mmf.GetData(), mmf.GetSize()));
+    if (it != mCache.end()) {
+      return it->second;
+    }
+    h.reset(new HistogramSpecification(mmf.GetData(), mmf.GetSize(),
+                                       &mDefinitions));
+  }
+  catch (const exception& e) {
+    // stale or damaged, it is rewritten once the JSON has been loaded
+    cerr << "LoadSnapshot - " << aSnapshot.string() << " " << e.what() << endl;
+  }
   return h;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void
+HistogramCache::WriteSnapshot(const boost::filesystem::path& aSnapshot,
+                              const HistogramSpecification& aSpec)
+{
+  // concurrent converters share the temp directory, they never map a
+  // partial snapshot
+  try {
+    WriteBinaryFile(aSnapshot, [&](ostream& aOutput) {
+      aSpec.WriteSnapshot(aOutput);
+    });
+  }
+  catch (const exception& e) {
+    cerr << "WriteSnapshot - " << aSnapshot.string() << " " << e.what() << endl;
+  }
+}
+
 }
 }
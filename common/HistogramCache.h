@@ -6,7 +6,9 @@
 
 /** @file 
 Retrieves the requested histogram revision from cache.  If not cached checks for
-and loads the histogram file from disk and adds it to the cache. 
+and loads the histogram file from disk and adds it to the cache. A binary
+snapshot of the compiled specification is kept next to each cached file and
+loaded in preference to it.
 */
 
 #ifndef mozilla_telemetry_Histogram_Cache_h
@@ -16,8 +18,11 @@ and loads the histogram file from disk and adds it to the cache.
 #include "Metric.h"
 
 #include <boost/filesystem.hpp>
+#include <condition_variable>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <unordered_map>
 #include <vector>
 #include <string>
@@ -33,7 +38,9 @@ public:
   /**
    * Retrieves the requested histogram revision from cache.  If not cached it 
    * will attempt to load the file from the histogram server and add it to the 
-   * cache. 
+   * cache. Safe to call from multiple threads; a revision is loaded once
+   * while other threads asking for it wait, lookups of other revisions are
+   * not blocked by the download.
    * 
    * @param aRevision RevisionKey of the histogram file to load.
    * 
@@ -74,23 +81,82 @@ private:
    * Retrieves the requested histogram revision from the histogram server.
    * 
    * @param aRevisionKey Revision of the histogram file to load.
+   * @param aLock Holds mMutex, released while the file is downloaded.
    * 
    * @return const Histogram* nullptr if load fails
    */
   std::shared_ptr<HistogramSpecification>
-  LoadHistogram(const std::string& aRevisionKey);
+  LoadHistogram(const std::string& aRevisionKey,
+                std::unique_lock<std::mutex>& aLock);
+
+  /**
+   * Downloads a histogram file, called without holding mMutex.
+   *
+   * @param aRevisionKey Revision of the histogram file to load.
+   * @param aJson Receives the response body when the status is 200.
+   *
+   * @return unsigned HTTP status code, 0 if the response is malformed.
+   */
+  unsigned FetchHistogram(const std::string& aRevisionKey,
+                          std::string& aJson) const;
+
+  /**
+   * Registers a specification under its content key and revision, an
+   * identical specification already cached is returned instead of aSpec.
+   *
+   * @param aRevisionKey Revision of the histogram file.
+   * @param aKey Specification hash.
+   * @param aSpec Loaded specification.
+   *
+   * @return std::shared_ptr<HistogramSpecification> Cached specification.
+   */
+  std::shared_ptr<HistogramSpecification>
+  AddHistogram(const std::string& aRevisionKey, uint64_t aKey,
+               std::shared_ptr<HistogramSpecification> aSpec);
+
+  /**
+   * Maps a snapshot written by WriteSnapshot, a specification with the same
+   * hash already in the cache is returned without loading the snapshot.
+   *
+   * @param aSnapshot Snapshot file next to the JSON cache file.
+   *
+   * @return std::shared_ptr<HistogramSpecification> nullptr if the snapshot
+   *         is missing, stale or damaged
+   */
+  std::shared_ptr<HistogramSpecification>
+  LoadSnapshot(const boost::filesystem::path& aSnapshot);
+
+  /**
+   * Writes the compiled specification next to the JSON cache file so the
+   * next start skips the JSON parse; failures are only logged.
+   *
+   * @param aSnapshot Snapshot file name.
+   * @param aSpec Specification to write.
+   */
+  void WriteSnapshot(const boost::filesystem::path& aSnapshot,
+                     const HistogramSpecification& aSpec);
 
   std::string mHistogramServer;
   std::string mHistogramServerPort;
 
-  /// Cache of histogram schema keyed by MD5
-  std::unordered_map<std::string, std::shared_ptr<HistogramSpecification> >
+  /// Cache of histogram schema keyed by specification hash
+  std::unordered_map<uint64_t, std::shared_ptr<HistogramSpecification> >
     mCache;
 
   /// Cache of histogram schema keyed by revision
   std::map<std::string, std::shared_ptr<HistogramSpecification> > mRevisions;
 
+  /// Definitions shared by the revisions
+  HistogramDefinitionPool mDefinitions;
+
   Metrics mMetrics;
+
+  /// Guards the caches and metrics so worker threads can share the cache
+  std::mutex mMutex;
+
+  /// Revisions being loaded, signalled through mLoaded when done
+  std::set<std::string> mLoading;
+  std::condition_variable mLoaded;
 };
 
 }
@@ -7,10 +7,18 @@
 /// @brief Histogram converter implementation @file
 
 #include "HistogramConverter.h"
+#include "HistogramKernels.h"
+#include "JsonScanner.h"
+#include "SplicingWriter.h"
 #include "TelemetryConstants.h"
 
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <rapidjson/reader.h>
 #include <vector>
 
 using namespace std;
@@ -18,15 +26,447 @@ using namespace std;
 namespace mozilla {
 namespace telemetry {
 
-bool RewriteValues(shared_ptr<HistogramDefinition> aDef,
+bool RewriteValues(const HistogramDefinition* aDef,
                    const RapidjsonValue& aData,
-                   vector<int>& aRewrite);
+                   int* aRewrite);
+
+bool RewriteHistogram(shared_ptr<HistogramSpecification>& aHist,
+                      RapidjsonValue& aValue,
+                      RapidjsonDocument::AllocatorType& aAlloc,
+                      HistogramEncoding aEncoding);
+
+typedef SplicingWriter<rapidjson::StringBuffer> OutputWriter;
+
+////////////////////////////////////////////////////////////////////////////////
+/// Returns aBucketCount zeroed counters in a per thread buffer sized for the
+/// largest histogram of the specification, so converting a histogram never
+/// allocates
+static int* GetBucketScratch(const HistogramSpecification& aHist,
+                             int aBucketCount)
+{
+  static thread_local vector<int> scratch;
+  size_t size = max(aHist.GetMaxBucketCount(), aBucketCount);
+  if (scratch.size() < size) {
+    scratch.resize(size);
+  }
+  fill_n(scratch.begin(), aBucketCount, 0);
+  return scratch.data();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Returns the ver of a payload converted with an encoding
+static int GetVersion(HistogramEncoding aEncoding)
+{
+  return aEncoding == kSparseHistograms ? 3 : 2;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Number of characters of an integer written as JSON
+static size_t IntLength(int aValue)
+{
+  size_t n = aValue < 0 ? 2 : 1;
+  unsigned v = aValue < 0 ? 0u - static_cast<unsigned>(aValue) : aValue;
+  for (; v >= 10; v /= 10) ++n;
+  return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Tests whether the sparse form "[i,c,...]," of the non zero counts is
+/// shorter than the dense "c,c,...," form
+static bool IsSparseShorter(const int* aCounts, int aBucketCount)
+{
+  // each pair costs at least two characters more than its dense count and
+  // each zero saves two, so the sparse form needs fewer than half the buckets
+  // set
+  size_t nonZero = CountNonZero(aCounts, aBucketCount);
+  if (2 * nonZero + 1 >= static_cast<size_t>(aBucketCount)) return false;
+
+  size_t dense = 0, sparse = 3, pairs = 0;
+  for (int i = 0; i < aBucketCount; ++i) {
+    size_t length = IntLength(aCounts[i]);
+    dense += length + 1;
+    if (aCounts[i] != 0) {
+      sparse += IntLength(i) + length + 2;
+      ++pairs;
+    }
+  }
+  if (pairs) --sparse; // no separator after the last pair
+  return sparse < dense;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Writes the bucket counts of a histogram array
+static void WriteCounts(const int* aCounts, int aBucketCount,
+                        HistogramEncoding aEncoding, OutputWriter& aWriter)
+{
+  if (aEncoding == kSparseHistograms
+      && IsSparseShorter(aCounts, aBucketCount)) {
+    aWriter.StartArray();
+    for (int i = 0; i < aBucketCount; ++i) {
+      if (aCounts[i] != 0) {
+        aWriter.Int(i);
+        aWriter.Int(aCounts[i]);
+      }
+    }
+    aWriter.EndArray();
+  } else {
+    for (int i = 0; i < aBucketCount; ++i) {
+      aWriter.Int(aCounts[i]);
+    }
+  }
+}
+
+/**
+ * SAX handler collecting the bucket counts and summary values of one
+ * histogram object; mirrors RewriteValues and the summary extraction of
+ * RewriteHistogram.
+ */
+class HistogramHandler : boost::noncopyable
+{
+public:
+  HistogramHandler(const HistogramDefinition* aDef, int* aRewrite,
+                   vector<double>& aSummary) :
+    mDef(aDef),
+    mRewrite(aRewrite),
+    mSummary(aSummary),
+    mDepth(0),
+    mMember(kOther),
+    mLowerBound(0),
+    mExpectName(false),
+    mInValues(false),
+    mHasValues(false),
+    mValid(true) { }
+
+  bool IsValid() const
+  {
+    if (!mHasValues) {
+      cerr << "RewriteValues - value object not found\n";
+      return false;
+    }
+    return mValid;
+  }
+
+  void Null() { Scalar(false, 0, false, 0); }
+  void Bool(bool) { Scalar(false, 0, false, 0); }
+  void Int(int i) { Scalar(true, i, true, i); }
+  void Uint(unsigned u)
+  {
+    Scalar(u <= INT_MAX, static_cast<int>(u), true, u);
+  }
+  void Int64(int64_t i) { Scalar(false, 0, true, static_cast<double>(i)); }
+  void Uint64(uint64_t u) { Scalar(false, 0, true, static_cast<double>(u)); }
+  void Double(double d) { Scalar(false, 0, true, d); }
+
+  void String(const char* aStr, rapidjson::SizeType aLength, bool)
+  {
+    if (mExpectName && mDepth == 1) {
+      mMember = kOther;
+      if (aLength == 6 && memcmp(aStr, "values", 6) == 0) {
+        mMember = kValues;
+      } else {
+        for (int x = 0; kExtraBuckets[x] != nullptr; ++x) {
+          if (strcmp(aStr, kExtraBuckets[x]) == 0) {
+            mMember = x;
+            break;
+          }
+        }
+      }
+      mExpectName = false;
+    } else if (mExpectName && mDepth == 2 && mInValues) {
+      mLowerBound = ParseLong(aStr, aLength);
+      mExpectName = false;
+    } else {
+      Scalar(false, 0, false, 0);
+    }
+  }
+
+  void StartObject()
+  {
+    if (mDepth == 0) {
+      mExpectName = true;
+    } else if (mDepth == 1 && mMember == kValues) {
+      mInValues = mHasValues = mExpectName = true;
+    } else if (mDepth == 2 && mInValues) {
+      Invalid();
+    }
+    ++mDepth;
+  }
+
+  void EndObject(rapidjson::SizeType)
+  {
+    if (--mDepth == 1) {
+      mInValues = false;
+      mExpectName = true;
+    }
+  }
+
+  void StartArray()
+  {
+    if ((mDepth == 1 && mMember == kValues) || (mDepth == 2 && mInValues)) {
+      Invalid();
+    }
+    ++mDepth;
+  }
+
+  void EndArray(rapidjson::SizeType)
+  {
+    if (--mDepth == 1) mExpectName = true;
+  }
+
+private:
+  static const int kOther = -1;
+  static const int kValues = -2;
+
+  void Scalar(bool aIsInt, int aInt, bool aIsNumber, double aNumber)
+  {
+    if (mDepth == 1) {
+      if (mMember == kValues) {
+        Invalid();
+      } else if (mMember >= 0 && aIsNumber) {
+        mSummary[mMember] = aNumber;
+      }
+      mExpectName = true;
+    } else if (mDepth == 2 && mInValues) {
+      int index = aIsInt ? mDef->GetBucketIndex(mLowerBound) : -1;
+      if (!aIsInt) {
+        cerr << "RewriteValues - invalid value object\n";
+        mValid = false;
+      } else if (index == -1) {
+        cerr << "RewriteValues - invalid bucket lower bound\n";
+        mValid = false;
+      } else {
+        mRewrite[index] = aInt;
+      }
+      mExpectName = true;
+    }
+  }
+
+  void Invalid()
+  {
+    if (mValid) cerr << "RewriteValues - invalid value object\n";
+    mValid = false;
+  }
+
+  const HistogramDefinition* mDef;
+  int*            mRewrite;
+  vector<double>& mSummary;
+  int   mDepth;
+  int   mMember;      ///< kExtraBuckets index, kValues or kOther
+  long  mLowerBound;
+  bool  mExpectName;  ///< the next string at depth 1 (or 2 in values) is a name
+  bool  mInValues;
+  bool  mHasValues;
+  bool  mValid;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// Writes the rewritten "histograms" object starting at aValue; returns one
+/// past its end or nullptr if it is malformed or could not be converted
+static char* WriteHistograms(const HistogramSpecification& aHist,
+                             char* aValue, OutputWriter& aWriter,
+                             HistogramEncoding aEncoding)
+{
+  rapidjson::Reader reader;
+  vector<double> summary;
+  aWriter.StartObject();
+  char* p = SkipWhitespace(aValue + 1);
+  while (*p != '}') {
+    if (*p != '"') return nullptr;
+    char* name = p;
+    p = SkipString(p);
+    if (!p) return nullptr;
+    size_t nameLength = p - name;
+
+    p = SkipWhitespace(p);
+    if (*p != ':') return nullptr;
+    char* value = SkipWhitespace(p + 1);
+    p = SkipValue(value);
+    if (!p || p == value) return nullptr;
 
-bool RewriteHistogram(shared_ptr<HistogramSpecification>& aHist, RapidjsonValue& aValue);
+    const HistogramDefinition* hd = nullptr;
+    const char* key = name + 1;
+    if (*value == '{') {
+      name[nameLength - 1] = 0;
+      hd = aHist.ResolveDefinition(key);
+      name[nameLength - 1] = '"';
+    } else {
+      cerr << "RewriteHistogram - not a histogram object\n";
+    }
+
+    if (hd) {
+      int bucketCount = hd->GetBucketCount();
+      int* rewrite = GetBucketScratch(aHist, bucketCount);
+      summary.assign(kExtraBucketsSize, -1);
+      HistogramHandler handler(hd, rewrite, summary);
+      char ch = *p;
+      *p = 0;
+      rapidjson::InsituStringStream is(value);
+      reader.Parse<rapidjson::kParseInsituFlag>(is, handler);
+      *p = ch;
+      if (reader.HasParseError() || !handler.IsValid()) return nullptr;
+
+      if (key == name + 1) {
+        aWriter.Raw(name, nameLength, rapidjson::kStringType);
+      } else {
+        aWriter.String(key, nameLength - 1 - (key - name));
+      }
+      aWriter.StartArray();
+      WriteCounts(rewrite, bucketCount, aEncoding, aWriter);
+      for (auto it = summary.begin(); it != summary.end(); ++it) {
+        aWriter.Double(*it);
+      }
+      aWriter.EndArray();
+    } else {
+      if (!IsValidValue(value, p)) return nullptr;
+      aWriter.Raw(name, nameLength, rapidjson::kStringType);
+      aWriter.Raw(value, p - value, GetJsonType(*value));
+    }
 
+    p = SkipWhitespace(p);
+    if (*p == ',') {
+      p = SkipWhitespace(p + 1);
+      if (*p == '}') return nullptr;
+    } else if (*p != '}') {
+      return nullptr;
+    }
+  }
+  aWriter.EndObject();
+  return p + 1;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
-bool ConvertHistogramData(HistogramCache& aCache, RapidjsonDocument& aDoc)
+static bool IsName(const char* aName, size_t aNameLength, const char* aMember)
+{
+  return strlen(aMember) + 2 == aNameLength
+    && memcmp(aName + 1, aMember, aNameLength - 2) == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Finds the value of a top level member following the value ending at aPos
+static char* FindMember(char* aPos, const char* aMember, char*& aEnd)
+{
+  char* p = SkipWhitespace(aPos);
+  while (*p == ',') {
+    char* name = SkipWhitespace(p + 1);
+    if (*name != '"') return nullptr;
+    p = SkipString(name);
+    if (!p) return nullptr;
+    size_t nameLength = p - name;
+    p = SkipWhitespace(p);
+    if (*p != ':') return nullptr;
+    char* value = SkipWhitespace(p + 1);
+    p = SkipValue(value);
+    if (!p || p == value) return nullptr;
+    if (IsName(name, nameLength, aMember)) {
+      aEnd = p;
+      return value;
+    }
+    p = SkipWhitespace(p);
+  }
+  return nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Parses the info object and looks up the specification of its revision
+static shared_ptr<HistogramSpecification>
+LoadInfo(HistogramCache& aCache, char* aValue, char* aEnd,
+         RapidjsonDocument& aInfo)
+{
+  shared_ptr<HistogramSpecification> hist;
+  if (*aValue != '{') return hist;
+  char ch = *aEnd;
+  *aEnd = 0;
+  aInfo.Parse<0>(aValue); // the raw value is written out, no in situ
+  *aEnd = ch;
+  if (aInfo.HasParseError()) return hist;
+  const RapidjsonValue& revision = aInfo["revision"];
+  if (!revision.IsString()) return hist;
+  hist = aCache.FindHistogram(revision.GetString());
+  if (!hist) {
+    cerr << "ConvertHistogramData - histogram not found: "
+      << revision.GetString() << endl;
+  }
+  return hist;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static bool WritePayload(HistogramCache& aCache, char* aJson,
+                         OutputWriter& aWriter, RapidjsonDocument& aInfo,
+                         HistogramEncoding aEncoding)
+{
+  shared_ptr<HistogramSpecification> hist;
+  // an info object found ahead of a preceding histograms object
+  char* parsedInfo = nullptr;
+  bool hasInfo = false, hasVer = false, hasHistograms = false;
+
+  char* p = SkipWhitespace(aJson);
+  if (*p != '{') return false;
+  aWriter.StartObject();
+  p = SkipWhitespace(p + 1);
+  while (*p != '}') {
+    if (*p != '"') return false;
+    char* name = p;
+    p = SkipString(p);
+    if (!p) return false;
+    size_t nameLength = p - name;
+
+    p = SkipWhitespace(p);
+    if (*p != ':') return false;
+    char* value = SkipWhitespace(p + 1);
+
+    if (IsName(name, nameLength, "histograms")) {
+      if (*value != '{') return false;
+      hasHistograms = true;
+      if (!hist) {
+        // the revision is needed first, the members keep their order
+        char* end = SkipValue(value);
+        if (!end) return false;
+        parsedInfo = FindMember(end, "info", end);
+        if (!parsedInfo) return false;
+        hist = LoadInfo(aCache, parsedInfo, end, aInfo);
+        if (!hist) return false;
+      }
+      aWriter.Raw(name, nameLength, rapidjson::kStringType);
+      p = WriteHistograms(*hist, value, aWriter, aEncoding);
+      if (!p) return false;
+    } else {
+      p = SkipValue(value);
+      if (!p || p == value) return false;
+      aWriter.Raw(name, nameLength, rapidjson::kStringType);
+      if (IsName(name, nameLength, "ver")) {
+        if (p - value != 1 || *value != '1') return false;
+        hasVer = true;
+        aWriter.Int(GetVersion(aEncoding));
+      } else if (IsName(name, nameLength, "info")) {
+        if (value != parsedInfo) {
+          hist = LoadInfo(aCache, value, p, aInfo);
+          if (!hist) return false;
+        }
+        hasInfo = true;
+        aWriter.Raw(value, p - value, rapidjson::kObjectType);
+      } else {
+        if (!IsValidValue(value, p)) return false;
+        aWriter.Raw(value, p - value, GetJsonType(*value));
+      }
+    }
+
+    p = SkipWhitespace(p);
+    if (*p == ',') {
+      p = SkipWhitespace(p + 1);
+      if (*p == '}') return false;
+    } else if (*p != '}') {
+      return false;
+    }
+  }
+  if (*SkipWhitespace(p + 1) != 0) return false;
+  if (!hasInfo || !hasVer || !hasHistograms) return false;
+  aWriter.EndObject();
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ConvertHistogramData(HistogramCache& aCache, RapidjsonDocument& aDoc,
+                          HistogramEncoding aEncoding)
 {
   const RapidjsonValue& info = aDoc["info"];
   if (!info.IsObject()) {
@@ -58,9 +498,10 @@ bool ConvertHistogramData(HistogramCache& aCache, RapidjsonDocument& aDoc)
     {
       shared_ptr<HistogramSpecification> hist = aCache.FindHistogram(revision.GetString());
       if (hist) {
-        result = RewriteHistogram(hist, histograms);
+        result = RewriteHistogram(hist, histograms, aDoc.GetAllocator(),
+                                  aEncoding);
         if (result) {
-          ver.SetInt(2);
+          ver.SetInt(GetVersion(aEncoding));
         } else {
           ver.SetInt(-1);
         }
@@ -71,6 +512,7 @@ bool ConvertHistogramData(HistogramCache& aCache, RapidjsonDocument& aDoc)
     }
     break;
   case 2: // already converted
+  case 3:
     break;
   default:
     cerr << "ConvertHistogramData - invalid version\n";
@@ -84,7 +526,7 @@ bool ConvertHistogramData(HistogramCache& aCache, RapidjsonDocument& aDoc)
 ////////////////////////////////////////////////////////////////////////////////
 bool RewriteValues(const HistogramDefinition* aDef,
                    const RapidjsonValue& aData,
-                   std::vector<int>& aRewrite)
+                   int* aRewrite)
 {
   const RapidjsonValue& values = aData["values"];
   if (!values.IsObject()) {
@@ -97,7 +539,7 @@ bool RewriteValues(const HistogramDefinition* aDef,
       cerr << "RewriteValues - invalid value object\n";
       return false;
     }
-    long lb = strtol(it->name.GetString(), nullptr, 10);
+    long lb = ParseLong(it->name.GetString(), it->name.GetStringLength());
     int i = it->value.GetInt();
     int index = aDef->GetBucketIndex(lb);
     if (index == -1) {
@@ -110,10 +552,11 @@ bool RewriteValues(const HistogramDefinition* aDef,
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-bool RewriteHistogram(shared_ptr<HistogramSpecification>& aHist, RapidjsonValue& aValue)
+bool RewriteHistogram(shared_ptr<HistogramSpecification>& aHist,
+                      RapidjsonValue& aValue,
+                      RapidjsonDocument::AllocatorType& aAlloc,
+                      HistogramEncoding aEncoding)
 {
-  RapidjsonDocument doc;
-  RapidjsonDocument::AllocatorType& alloc = doc.GetAllocator();
   vector<double> summary(kExtraBucketsSize);
   bool result = true;
 
@@ -121,20 +564,13 @@ bool RewriteHistogram(shared_ptr<HistogramSpecification>& aHist, RapidjsonValue&
        it != aValue.MemberEnd(); ++it) {
     if (it->value.IsObject()) {
       const char* name = reinterpret_cast<const char*>(it->name.GetString());
-      const HistogramDefinition* hd = aHist->GetDefinition(name);
-      if (!hd) {
-        if (strncmp(name, "STARTUP_", 8)) {
-          hd = aHist->GetDefinition(name + 8);
-          if (hd) {
-            it->name.SetString(name + 8);
-            // chop off leading "STARTUP_" per
-            // http://mxr.mozilla.org/mozilla-central/source/toolkit/components/telemetry/TelemetryPing.js#532
-          }
-        }
+      const HistogramDefinition* hd = aHist->ResolveDefinition(name);
+      if (hd && name != it->name.GetString()) {
+        it->name.SetString(name);
       }
       if (hd) {
         int bucketCount = hd->GetBucketCount();
-        vector<int> rewrite(bucketCount);
+        int* rewrite = GetBucketScratch(*aHist, bucketCount);
         result = RewriteValues(hd, it->value, rewrite);
         if (result) {
           // save off the summary values before rewriting the histogram data
@@ -148,15 +584,27 @@ bool RewriteHistogram(shared_ptr<HistogramSpecification>& aHist, RapidjsonValue&
           }
           // rewrite the JSON histogram data
           it->value.SetArray();
-          it->value.Reserve(bucketCount + kExtraBucketsSize, alloc);
-          auto end = rewrite.end();
-          for (auto vit = rewrite.begin(); vit != end; ++vit){
-            it->value.PushBack(*vit, alloc);
+          if (aEncoding == kSparseHistograms
+              && IsSparseShorter(rewrite, bucketCount)) {
+            RapidjsonValue pairs(rapidjson::kArrayType);
+            for (int i = 0; i < bucketCount; ++i) {
+              if (rewrite[i] != 0) {
+                pairs.PushBack(i, aAlloc);
+                pairs.PushBack(rewrite[i], aAlloc);
+              }
+            }
+            it->value.Reserve(1 + kExtraBucketsSize, aAlloc);
+            it->value.PushBack(pairs, aAlloc);
+          } else {
+            it->value.Reserve(bucketCount + kExtraBucketsSize, aAlloc);
+            for (int i = 0; i < bucketCount; ++i) {
+              it->value.PushBack(rewrite[i], aAlloc);
+            }
           }
           // add the summary information
           auto send = summary.end();
           for (auto vit = summary.begin(); vit != send; ++vit){
-            it->value.PushBack(*vit, alloc);
+            it->value.PushBack(*vit, aAlloc);
           }
         }
       } else {
@@ -169,5 +617,56 @@ bool RewriteHistogram(shared_ptr<HistogramSpecification>& aHist, RapidjsonValue&
   return result;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+bool ConvertHistogramData(HistogramCache& aCache, char* aJson,
+                          rapidjson::StringBuffer& aOutput,
+                          RapidjsonDocument& aInfo,
+                          HistogramEncoding aEncoding)
+{
+  OutputWriter writer(aOutput);
+  return WritePayload(aCache, aJson, writer, aInfo, aEncoding);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ReadHistogramArray(const RapidjsonValue& aValue, int aBucketCount,
+                        int* aCounts, double* aSummary)
+{
+  if (!aValue.IsArray()) return false;
+  rapidjson::SizeType size = aValue.Size();
+  rapidjson::SizeType summary;
+  if (size > 0 && aValue[0u].IsArray()) { // sparse index, count pairs
+    const RapidjsonValue& pairs = aValue[0u];
+    if (pairs.Size() % 2) return false;
+    thread_local vector<int> scratch;
+    scratch.resize(pairs.Size());
+    for (rapidjson::SizeType i = 0; i < pairs.Size(); ++i) {
+      if (!pairs[i].IsInt()) return false;
+      scratch[i] = pairs[i].GetInt();
+    }
+    if (!ScatterCounts(aCounts, aBucketCount, scratch.data(),
+                       scratch.size() / 2)) {
+      return false;
+    }
+    summary = 1;
+  } else {
+    if (size < static_cast<rapidjson::SizeType>(aBucketCount)) return false;
+    for (int i = 0; i < aBucketCount; ++i) {
+      const RapidjsonValue& v = aValue[static_cast<rapidjson::SizeType>(i)];
+      if (!v.IsInt()) return false;
+      aCounts[i] = v.GetInt();
+    }
+    summary = aBucketCount;
+  }
+  if (size - summary != kExtraBucketsSize) return false;
+
+  for (size_t i = 0; i < kExtraBucketsSize; ++i) {
+    const RapidjsonValue& v = aValue[static_cast<rapidjson::SizeType>(summary
+                                                                      + i)];
+    if (!v.IsNumber()) return false;
+    aSummary[i] = v.GetDouble();
+  }
+  return true;
+}
+
 }
 }
@@ -12,11 +12,71 @@
 #include "HistogramCache.h"
 
 #include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
 
 namespace mozilla {
 namespace telemetry {
 
-bool ConvertHistogramData(HistogramCache& aCache, RapidjsonDocument& aDoc);
+/**
+ * Encodings of the converted histogram arrays.
+ */
+enum HistogramEncoding {
+  /// ver 2: [count_0, ..., count_n-1, summary...]
+  kDenseHistograms,
+  /// ver 3: the ver 2 array or [[index, count, ...], summary...] with only the
+  /// non zero counts, whichever is shorter, chosen per histogram
+  kSparseHistograms
+};
+
+/**
+ * Converts a ver 1 payload DOM in place.
+ *
+ * @param aCache Histogram specification cache.
+ * @param aDoc Payload, the histograms are rewritten as arrays.
+ * @param aEncoding Encoding of the histogram arrays (and the resulting ver).
+ *
+ * @return bool False if the payload is not ver 1 or a histogram could not be
+ *         converted.
+ */
+bool ConvertHistogramData(HistogramCache& aCache, RapidjsonDocument& aDoc,
+                          HistogramEncoding aEncoding = kDenseHistograms);
+
+/**
+ * Converts a ver 1 payload in a single pass without building a DOM.
+ * Only the info object is parsed (into aInfo); each histogram is rewritten
+ * by a SAX handler straight into the output and every other member is copied
+ * verbatim. The members keep their order, the info object is looked up
+ * ahead of a histograms object preceding it.
+ *
+ * @param aCache Histogram specification cache.
+ * @param aJson Null terminated payload, the histogram values are parsed in
+ *              situ (the buffer is modified).
+ * @param aOutput Buffer receiving the converted JSON; it holds a partial
+ *                record to be discarded when the conversion fails.
+ * @param aInfo Receives the info object (i.e. for
+ *              TelemetrySchema::GetInfoDimensionPath).
+ * @param aEncoding Encoding of the histogram arrays (and the resulting ver).
+ *
+ * @return bool False if the payload is malformed, not ver 1 or a histogram
+ *         could not be converted.
+ */
+bool ConvertHistogramData(HistogramCache& aCache, char* aJson,
+                          rapidjson::StringBuffer& aOutput,
+                          RapidjsonDocument& aInfo,
+                          HistogramEncoding aEncoding = kDenseHistograms);
+
+/**
+ * Reads a converted histogram array (either encoding) back into dense counts.
+ *
+ * @param aValue Converted histogram array.
+ * @param aBucketCount Bucket count of the histogram definition.
+ * @param aCounts Receives aBucketCount counts.
+ * @param aSummary Receives the kExtraBucketsSize summary values.
+ *
+ * @return bool False if the array does not match the definition.
+ */
+bool ReadHistogramArray(const RapidjsonValue& aValue, int aBucketCount,
+                        int* aCounts, double* aSummary);
 
 }
 }
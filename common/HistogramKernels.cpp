@@ -0,0 +1,297 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief HistogramKernels implementation @file
+
+#include "HistogramKernels.h"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define TELEMETRY_KERNELS_X86 1
+#endif
+
+using namespace std;
+
+namespace mozilla {
+namespace telemetry {
+
+////////////////////////////////////////////////////////////////////////////////
+static void AddCountsScalar(int64_t* aSum, const int* aCounts, size_t aLength)
+{
+  for (size_t i = 0; i < aLength; ++i) {
+    aSum[i] += aCounts[i];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void SubtractCountsScalar(int64_t* aSum, const int* aCounts,
+                                 size_t aLength)
+{
+  for (size_t i = 0; i < aLength; ++i) {
+    aSum[i] -= aCounts[i];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static bool CountsEqualScalar(const int* aCounts, const int* aOther,
+                              size_t aLength)
+{
+  for (size_t i = 0; i < aLength; ++i) {
+    if (aCounts[i] != aOther[i]) return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static size_t CountNonZeroScalar(const int* aCounts, size_t aLength)
+{
+  size_t n = 0;
+  for (size_t i = 0; i < aLength; ++i) {
+    n += aCounts[i] != 0;
+  }
+  return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Shared by every variant: neither SSE2 nor AVX2 has a scatter store and the
+/// zero fill is already vectorized by the library
+static bool ScatterCountsScalar(int* aCounts, size_t aBucketCount,
+                                const int* aPairs, size_t aPairCount)
+{
+  fill_n(aCounts, aBucketCount, 0);
+  for (size_t i = 0; i < aPairCount; ++i) {
+    int index = aPairs[i * 2];
+    if (index < 0 || static_cast<size_t>(index) >= aBucketCount) return false;
+    aCounts[index] = aPairs[i * 2 + 1];
+  }
+  return true;
+}
+
+static const HistogramKernels kScalarKernels = {
+  "scalar",
+  AddCountsScalar,
+  SubtractCountsScalar,
+  CountsEqualScalar,
+  CountNonZeroScalar,
+  ScatterCountsScalar
+};
+
+#ifdef TELEMETRY_KERNELS_X86
+////////////////////////////////////////////////////////////////////////////////
+/// Sign extends four counts to 64 bit lanes (SSE2 has no pmovsxdq)
+__attribute__((target("sse2")))
+static inline void WidenSse2(__m128i aCounts, __m128i& aLow, __m128i& aHigh)
+{
+  __m128i sign = _mm_srai_epi32(aCounts, 31);
+  aLow = _mm_unpacklo_epi32(aCounts, sign);
+  aHigh = _mm_unpackhi_epi32(aCounts, sign);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse2")))
+static void AddCountsSse2(int64_t* aSum, const int* aCounts, size_t aLength)
+{
+  size_t i = 0;
+  for (; i + 4 <= aLength; i += 4) {
+    __m128i lo, hi;
+    WidenSse2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(aCounts + i)),
+              lo, hi);
+    __m128i* s = reinterpret_cast<__m128i*>(aSum + i);
+    _mm_storeu_si128(s, _mm_add_epi64(_mm_loadu_si128(s), lo));
+    _mm_storeu_si128(s + 1, _mm_add_epi64(_mm_loadu_si128(s + 1), hi));
+  }
+  AddCountsScalar(aSum + i, aCounts + i, aLength - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse2")))
+static void SubtractCountsSse2(int64_t* aSum, const int* aCounts,
+                               size_t aLength)
+{
+  size_t i = 0;
+  for (; i + 4 <= aLength; i += 4) {
+    __m128i lo, hi;
+    WidenSse2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(aCounts + i)),
+              lo, hi);
+    __m128i* s = reinterpret_cast<__m128i*>(aSum + i);
+    _mm_storeu_si128(s, _mm_sub_epi64(_mm_loadu_si128(s), lo));
+    _mm_storeu_si128(s + 1, _mm_sub_epi64(_mm_loadu_si128(s + 1), hi));
+  }
+  SubtractCountsScalar(aSum + i, aCounts + i, aLength - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse2")))
+static bool CountsEqualSse2(const int* aCounts, const int* aOther,
+                            size_t aLength)
+{
+  size_t i = 0;
+  for (; i + 4 <= aLength; i += 4) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aCounts + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aOther + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) != 0xffff) return false;
+  }
+  return CountsEqualScalar(aCounts + i, aOther + i, aLength - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse2")))
+static size_t CountNonZeroSse2(const int* aCounts, size_t aLength)
+{
+  __m128i zeros = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= aLength; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aCounts + i));
+    // each zero lane compares to -1
+    zeros = _mm_sub_epi32(zeros, _mm_cmpeq_epi32(v, _mm_setzero_si128()));
+  }
+  int lanes[4];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), zeros);
+  size_t n = i - (lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+  return n + CountNonZeroScalar(aCounts + i, aLength - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2")))
+static void AddCountsAvx2(int64_t* aSum, const int* aCounts, size_t aLength)
+{
+  size_t i = 0;
+  for (; i + 8 <= aLength; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(aCounts
+                                                                     + i));
+    __m256i lo = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v));
+    __m256i hi = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1));
+    __m256i* s = reinterpret_cast<__m256i*>(aSum + i);
+    _mm256_storeu_si256(s, _mm256_add_epi64(_mm256_loadu_si256(s), lo));
+    _mm256_storeu_si256(s + 1, _mm256_add_epi64(_mm256_loadu_si256(s + 1),
+                                                hi));
+  }
+  AddCountsScalar(aSum + i, aCounts + i, aLength - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2")))
+static void SubtractCountsAvx2(int64_t* aSum, const int* aCounts,
+                               size_t aLength)
+{
+  size_t i = 0;
+  for (; i + 8 <= aLength; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(aCounts
+                                                                     + i));
+    __m256i lo = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v));
+    __m256i hi = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1));
+    __m256i* s = reinterpret_cast<__m256i*>(aSum + i);
+    _mm256_storeu_si256(s, _mm256_sub_epi64(_mm256_loadu_si256(s), lo));
+    _mm256_storeu_si256(s + 1, _mm256_sub_epi64(_mm256_loadu_si256(s + 1),
+                                                hi));
+  }
+  SubtractCountsScalar(aSum + i, aCounts + i, aLength - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2")))
+static bool CountsEqualAvx2(const int* aCounts, const int* aOther,
+                            size_t aLength)
+{
+  size_t i = 0;
+  for (; i + 8 <= aLength; i += 8) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(aCounts
+                                                                     + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(aOther
+                                                                     + i));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, b)) != -1) return false;
+  }
+  return CountsEqualScalar(aCounts + i, aOther + i, aLength - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2")))
+static size_t CountNonZeroAvx2(const int* aCounts, size_t aLength)
+{
+  __m256i zeros = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= aLength; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(aCounts
+                                                                     + i));
+    // each zero lane compares to -1
+    zeros = _mm256_sub_epi32(zeros,
+                             _mm256_cmpeq_epi32(v, _mm256_setzero_si256()));
+  }
+  int lanes[8];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), zeros);
+  size_t n = i;
+  for (int l = 0; l < 8; ++l) n -= lanes[l];
+  return n + CountNonZeroScalar(aCounts + i, aLength - i);
+}
+
+static const HistogramKernels kSse2Kernels = {
+  "sse2",
+  AddCountsSse2,
+  SubtractCountsSse2,
+  CountsEqualSse2,
+  CountNonZeroSse2,
+  ScatterCountsScalar
+};
+
+static const HistogramKernels kAvx2Kernels = {
+  "avx2",
+  AddCountsAvx2,
+  SubtractCountsAvx2,
+  CountsEqualAvx2,
+  CountNonZeroAvx2,
+  ScatterCountsScalar
+};
+
+////////////////////////////////////////////////////////////////////////////////
+static bool HasSse2()
+{
+  unsigned eax, ebx, ecx, edx;
+  return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static bool HasAvx2()
+{
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)
+      || !(ecx & bit_AVX)) {
+    return false;
+  }
+  // the OS must save the YMM registers
+  unsigned xcr0, xcr0High;
+  __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+  if ((xcr0 & 6) != 6 || __get_cpuid_max(0, nullptr) < 7) {
+    return false;
+  }
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & bit_AVX2) != 0;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+vector<const HistogramKernels*> GetSupportedHistogramKernels()
+{
+  vector<const HistogramKernels*> kernels(1, &kScalarKernels);
+#ifdef TELEMETRY_KERNELS_X86
+  if (HasSse2()) kernels.push_back(&kSse2Kernels);
+  if (HasAvx2()) kernels.push_back(&kAvx2Kernels);
+#endif
+  return kernels;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const HistogramKernels& GetHistogramKernels()
+{
+  static const HistogramKernels* kernels =
+    GetSupportedHistogramKernels().back();
+  return *kernels;
+}
+
+}
+}
@@ -0,0 +1,92 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Kernels over histogram bucket count arrays. AVX2 or SSE2 implementations are
+used when the CPU supports them, otherwise scalar loops.
+ */
+
+#ifndef mozilla_telemetry_Histogram_Kernels_h
+#define mozilla_telemetry_Histogram_Kernels_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mozilla {
+namespace telemetry {
+
+/**
+ * One implementation of every kernel.
+ */
+struct HistogramKernels
+{
+  const char* mName;
+
+  /// aSum[i] += aCounts[i]
+  void (*mAddCounts)(int64_t* aSum, const int* aCounts, size_t aLength);
+
+  /// aSum[i] -= aCounts[i]
+  void (*mSubtractCounts)(int64_t* aSum, const int* aCounts, size_t aLength);
+
+  /// Tests whether aCounts[i] == aOther[i] for every i
+  bool (*mCountsEqual)(const int* aCounts, const int* aOther, size_t aLength);
+
+  /// Number of non zero counts
+  size_t (*mCountNonZero)(const int* aCounts, size_t aLength);
+
+  /// Zeroes aBucketCount counts and stores the (index, count) pairs; false if
+  /// an index is out of range
+  bool (*mScatterCounts)(int* aCounts, size_t aBucketCount, const int* aPairs,
+                         size_t aPairCount);
+};
+
+/**
+ * Returns the fastest kernels the CPU supports.
+ *
+ * @return const HistogramKernels& Kernels.
+ */
+const HistogramKernels& GetHistogramKernels();
+
+/**
+ * Returns every implementation the CPU supports, scalar first; used to check
+ * and benchmark the variants against each other.
+ *
+ * @return std::vector<const HistogramKernels*> Kernels.
+ */
+std::vector<const HistogramKernels*> GetSupportedHistogramKernels();
+
+inline void AddCounts(int64_t* aSum, const int* aCounts, size_t aLength)
+{
+  GetHistogramKernels().mAddCounts(aSum, aCounts, aLength);
+}
+
+inline void SubtractCounts(int64_t* aSum, const int* aCounts, size_t aLength)
+{
+  GetHistogramKernels().mSubtractCounts(aSum, aCounts, aLength);
+}
+
+inline bool CountsEqual(const int* aCounts, const int* aOther, size_t aLength)
+{
+  return GetHistogramKernels().mCountsEqual(aCounts, aOther, aLength);
+}
+
+inline size_t CountNonZero(const int* aCounts, size_t aLength)
+{
+  return GetHistogramKernels().mCountNonZero(aCounts, aLength);
+}
+
+inline bool ScatterCounts(int* aCounts, size_t aBucketCount, const int* aPairs,
+                          size_t aPairCount)
+{
+  return GetHistogramKernels().mScatterCounts(aCounts, aBucketCount, aPairs,
+                                              aPairCount);
+}
+
+}
+}
+
+#endif // mozilla_telemetry_HistogramKernels_h
@@ -7,25 +7,187 @@
 /// @brief Histogram specification implementation @file
 
 #include "HistogramSpecification.h"
+#include "BinaryFile.h"
+#include "Crc32c.h"
 
-#include <boost/functional/hash.hpp>
+#include <algorithm>
 #include <boost/lexical_cast.hpp>
+#include <cstring>
 #include <exception>
-#include <fstream>
 #include <rapidjson/document.h>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
 
 using namespace std;
 namespace mozilla {
 namespace telemetry {
 
+// chop off leading "STARTUP_" per
+// http://mxr.mozilla.org/mozilla-central/source/toolkit/components/telemetry/TelemetryPing.js#532
+static const char kStartupPrefix[] = "STARTUP_";
+static const size_t kStartupPrefixLength = sizeof(kStartupPrefix) - 1;
+/// Average number of keys per displacement bucket
+static const size_t kBucketSize = 4;
+/// Displacements tried for a bucket before the hash is reseeded
+static const uint32_t kMaxDisplacement = 1 << 16;
+
+static const char kSnapshotMagic[4] = { 'T', 'H', 'S', 'S' };
+/// Bumped whenever the snapshot layout or the name hash changes
+static const uint32_t kSnapshotVersion = 2;
+/// Pool size below which expired definitions are not swept
+static const size_t kMinSweepSize = 4096;
+
+struct SnapshotHeader
+{
+  BinaryHeader mBinary;         ///< the checksum covers everything after
+  uint64_t  mHash;
+  uint64_t  mSeed;
+  uint32_t  mNameSize;
+  uint32_t  mDisplacementCount;
+  uint32_t  mSlotCount;
+  uint32_t  mDefinitionCount;
+  uint32_t  mBoundCount;
+};
+
+struct SnapshotSlot
+{
+  uint32_t mHash;
+  uint32_t mName;
+  uint32_t mDefinition;
+  uint32_t mAlias;
+};
+
+struct SnapshotDefinition
+{
+  int32_t   mKind;
+  int32_t   mMin;
+  int32_t   mMax;
+  int32_t   mBucketCount;
+  int32_t   mStride;
+  int32_t   mSearchCount;
+  uint32_t  mOffset;
+  uint32_t  mIndexFunction;     ///< position in kIndexFunctions
+};
+
+////////////////////////////////////////////////////////////////////////////////
+static size_t PadName(size_t aSize)
+{
+  return (aSize + 3) & ~static_cast<size_t>(3);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Copies aCount elements from the snapshot and advances the read position
+template<typename T>
+static void ReadArray(const char*& aData, size_t aCount, std::vector<T>& aOut)
+{
+  aOut.resize(aCount);
+  if (aCount) memcpy(aOut.data(), aData, aCount * sizeof(T));
+  aData += aCount * sizeof(T);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename T>
+static void WriteArray(std::string& aOut, const T* aData, size_t aCount)
+{
+  aOut.append(reinterpret_cast<const char*>(aData), aCount * sizeof(T));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Validates the header and the size of a snapshot, not its content
+static void ReadSnapshotHeader(const char* aSnapshot, size_t aLength,
+                               SnapshotHeader& aHeader)
+{
+  if (aLength < sizeof(aHeader)) {
+    throw runtime_error("snapshot is truncated");
+  }
+  memcpy(&aHeader, aSnapshot, sizeof(aHeader));
+  CheckBinaryHeader(aHeader.mBinary, kSnapshotMagic, kSnapshotVersion,
+                    "histogram specification snapshot");
+  uint64_t expected = sizeof(aHeader) + PadName(aHeader.mNameSize)
+    + static_cast<uint64_t>(aHeader.mDisplacementCount) * sizeof(uint32_t)
+    + static_cast<uint64_t>(aHeader.mSlotCount) * sizeof(SnapshotSlot)
+    + static_cast<uint64_t>(aHeader.mDefinitionCount)
+      * sizeof(SnapshotDefinition)
+    + static_cast<uint64_t>(aHeader.mBoundCount) * sizeof(int);
+  if (expected != aLength) {
+    stringstream ss;
+    ss << "snapshot should contain: " << expected << " bytes; " << aLength
+      << " were found";
+    throw runtime_error(ss.str());
+  }
+}
+
+const HistogramDefinition::IndexFunction
+HistogramDefinition::kIndexFunctions[] = {
+  &HistogramDefinition::GetDenseIndex,
+  &HistogramDefinition::GetStridedIndex,
+  &HistogramDefinition::GetSortedIndex,
+  &HistogramDefinition::GetPermutedIndex
+};
+
+const uint32_t HistogramDefinition::kIndexFunctionCount =
+  sizeof(kIndexFunctions) / sizeof(kIndexFunctions[0]);
+
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t HashBytes(uint64_t aHash, const char* aName)
+{
+  for (; *aName; ++aName) { // FNV-1a
+    aHash ^= static_cast<unsigned char>(*aName);
+    aHash *= 1099511628211ULL;
+  }
+  return aHash;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t Mix(uint64_t aHash)
+{
+  // murmur3 finalizer
+  aHash ^= aHash >> 33;
+  aHash *= 0xff51afd7ed558ccdULL;
+  aHash ^= aHash >> 33;
+  aHash *= 0xc4ceb9fe1a85ec53ULL;
+  aHash ^= aHash >> 33;
+  return aHash;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t HashInts(uint64_t aHash, const int* aData, size_t aCount)
+{
+  for (size_t i = 0; i < aCount; ++i) { // FNV-1a over each byte
+    uint32_t v = static_cast<uint32_t>(aData[i]);
+    for (int b = 0; b < 4; ++b, v >>= 8) {
+      aHash ^= v & 0xff;
+      aHash *= 1099511628211ULL;
+    }
+  }
+  return aHash;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Tests whether two names, each optionally prefixed with "STARTUP_", are
+/// spelled the same
+static bool SameKey(const char* aName, bool aAlias, const char* aOther,
+                    bool aOtherAlias)
+{
+  if (aAlias == aOtherAlias) {
+    return strcmp(aName, aOther) == 0;
+  }
+  if (aAlias) {
+    swap(aName, aOther);
+  }
+  return strncmp(aName, kStartupPrefix, kStartupPrefixLength) == 0
+    && strcmp(aName + kStartupPrefixLength, aOther) == 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 HistogramDefinition::HistogramDefinition(const RapidjsonValue& aValue)
 {
-  const RapidjsonValue& k = aValue["kind"]; 
+  const RapidjsonValue& k = aValue["kind"];
   if (!k.IsString()) {
     throw runtime_error("missing kind element");
   }
-  mKind = boost::lexical_cast<int>(k.GetString());
+  mKind = static_cast<Kind>(boost::lexical_cast<int>(k.GetString()));
 
   const RapidjsonValue& mn = aValue["min"];
   if (!mn.IsInt()) {
@@ -49,35 +211,302 @@ HistogramDefinition::HistogramDefinition(const RapidjsonValue& aValue)
   if (!a.IsArray()) {
     throw runtime_error("missing bucket array element");
   }
-  int index = 0;
+  mBounds.reserve(a.Size());
   for (RapidjsonValue::ConstValueIterator it = a.Begin(); it != a.End();
-       ++it, ++index) {
+       ++it) {
     if (!it->IsInt()) {
       throw runtime_error("buckets array must contain integer elements");
     }
-    mBuckets.insert(make_pair(it->GetInt(), index));
+    mBounds.push_back(it->GetInt());
   }
+  int index = static_cast<int>(mBounds.size());
   if (index != mBucketCount) {
     stringstream ss;
     ss << "buckets array should contain: " << mBucketCount << " elements;  "
       << index << " were specified";
     throw runtime_error(ss.str());
   }
+  Compile();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+HistogramDefinition::HistogramDefinition(const SnapshotDefinition& aDefinition,
+                                         const int* aBounds,
+                                         size_t aBoundCount) :
+  mKind(static_cast<Kind>(aDefinition.mKind)),
+  mMin(aDefinition.mMin),
+  mMax(aDefinition.mMax),
+  mBucketCount(aDefinition.mBucketCount),
+  mStride(aDefinition.mStride),
+  mSearchCount(aDefinition.mSearchCount),
+  mOffset(0)
+{
+  // the snapshot is checksummed, the compiled fields are only checked as far
+  // as an index function could read out of bounds with them
+  if (aDefinition.mIndexFunction >= kIndexFunctionCount || mBucketCount < 0
+      || mSearchCount < 0 || mSearchCount > mBucketCount) {
+    throw runtime_error("snapshot definition is invalid");
+  }
+  mGetIndex = kIndexFunctions[aDefinition.mIndexFunction];
+  bool permuted = mGetIndex == &HistogramDefinition::GetPermutedIndex;
+  if ((mGetIndex == &HistogramDefinition::GetStridedIndex
+       && (mStride <= 0 || mBucketCount < 3))
+      || (!permuted && mSearchCount != mBucketCount)) {
+    throw runtime_error("snapshot definition is invalid");
+  }
+
+  // the bucket bounds precede the searched bounds of a permuted definition
+  uint64_t begin = aDefinition.mOffset;
+  uint64_t size = mBucketCount;
+  if (permuted) {
+    mOffset = mBucketCount;
+    size += 2 * static_cast<uint64_t>(mSearchCount);
+  }
+  if (begin < mOffset || begin - mOffset + size > aBoundCount) {
+    throw runtime_error("snapshot definition bounds out of range");
+  }
+  begin -= mOffset;
+  mBounds.assign(aBounds + begin, aBounds + begin + size);
+  if (permuted) {
+    for (auto it = mBounds.end() - mSearchCount; it != mBounds.end(); ++it) {
+      if (*it < 0 || *it >= mBucketCount) {
+        throw runtime_error("snapshot definition index out of range");
+      }
+    }
+  }
+  Link();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Private Member Functions
+////////////////////////////////////////////////////////////////////////////////
+void
+HistogramDefinition::Compile()
+{
+  mStride = 0;
+  mSearchCount = mBucketCount;
+  mOffset = 0;
+  SelectIndexFunction();
+  Link();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+HistogramDefinition::Link()
+{
+  uint64_t h = 14695981039346656037ULL;
+  const int fields[] = { mKind, mMin, mMax, mBucketCount };
+  h = HashInts(h, fields, sizeof(fields) / sizeof(fields[0]));
+  mHash = Mix(HashInts(h, mBounds.data(), mBucketCount));
+
+  mLowerBounds = mBounds.data() + mOffset;
+  mIndices = nullptr;
+  if (mGetIndex == &HistogramDefinition::GetPermutedIndex) {
+    mIndices = mLowerBounds + mSearchCount;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool
+HistogramDefinition::SameContent(const HistogramDefinition& aOther) const
+{
+  return mHash == aOther.mHash && mKind == aOther.mKind
+    && mMin == aOther.mMin && mMax == aOther.mMax
+    && mBucketCount == aOther.mBucketCount
+    && equal(mBounds.begin(), mBounds.begin() + mBucketCount,
+             aOther.mBounds.begin());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+HistogramDefinition::SelectIndexFunction()
+{
+  const int* bounds = mBounds.data();
+  const size_t n = mBucketCount;
+  bool dense = true, sorted = true;
+  for (size_t i = 0; i < n; ++i) {
+    if (bounds[i] != static_cast<int>(i)) dense = false;
+    if (i && bounds[i] <= bounds[i - 1]) sorted = false;
+  }
+
+  switch (mKind) {
+  case kBoolean:
+  case kFlag:
+    if (dense) {
+      mGetIndex = &HistogramDefinition::GetDenseIndex;
+      return;
+    }
+    break;
+  case kLinear:
+    if (dense) {
+      mGetIndex = &HistogramDefinition::GetDenseIndex;
+      return;
+    }
+    if (sorted && n > 2 && bounds[0] == 0) {
+      bool strided = true;
+      int stride = bounds[2] - bounds[1];
+      for (size_t i = 3; i < n && strided; ++i) {
+        strided = bounds[i] - bounds[i - 1] == stride;
+      }
+      if (strided) {
+        mStride = stride;
+        mGetIndex = &HistogramDefinition::GetStridedIndex;
+        return;
+      }
+    }
+    break;
+  default:
+    break;
+  }
+
+  // exponential, linear with rounded bounds and definitions not matching the
+  // shape of their kind
+  if (sorted && n) {
+    mGetIndex = &HistogramDefinition::GetSortedIndex;
+    return;
+  }
+
+  // append a sorted copy of the distinct bounds followed by their bucket
+  // indices (the first bucket wins for a repeated bound)
+  vector<pair<int, int> > pairs;
+  pairs.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    pairs.push_back(make_pair(bounds[i], static_cast<int>(i)));
+  }
+  sort(pairs.begin(), pairs.end());
+  pairs.erase(unique(pairs.begin(), pairs.end(),
+                     [](const pair<int, int>& a, const pair<int, int>& b) {
+                       return a.first == b.first;
+                     }), pairs.end());
+  mOffset = mBounds.size();
+  mSearchCount = static_cast<int>(pairs.size());
+  mBounds.reserve(mOffset + pairs.size() * 2);
+  for (auto& p : pairs) {
+    mBounds.push_back(p.first);
+  }
+  for (auto& p : pairs) {
+    mBounds.push_back(p.second);
+  }
+  mGetIndex = &HistogramDefinition::GetPermutedIndex;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int
+HistogramDefinition::GetDenseIndex(long aLowerBound) const
+{
+  if (static_cast<unsigned long>(aLowerBound)
+      < static_cast<unsigned long>(mBucketCount)) {
+    return static_cast<int>(aLowerBound);
+  }
+  return -1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 int
-HistogramDefinition::GetBucketIndex(long aLowerBound) const
+HistogramDefinition::GetStridedIndex(long aLowerBound) const
 {
-  auto it = mBuckets.find(aLowerBound);
-  if (it == mBuckets.end()) {
+  if (aLowerBound == 0) return 0;
+  // values below the second bound wrap around and fail the range check
+  unsigned long offset = static_cast<unsigned long>(aLowerBound)
+    - static_cast<unsigned long>(mLowerBounds[1]);
+  unsigned long index = offset / mStride;
+  if (offset % mStride != 0
+      || index >= static_cast<unsigned long>(mBucketCount - 1)) {
     return -1;
   }
-  return it->second;
+  return static_cast<int>(index) + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int
+HistogramDefinition::GetSortedIndex(long aLowerBound) const
+{
+  return Search(aLowerBound);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-HistogramSpecification::HistogramSpecification(const std::string& aJSON)
+int
+HistogramDefinition::GetPermutedIndex(long aLowerBound) const
+{
+  int pos = Search(aLowerBound);
+  return pos < 0 ? -1 : mIndices[pos];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int
+HistogramDefinition::Search(long aLowerBound) const
+{
+  if (mSearchCount == 0) return -1;
+  const int* base = mLowerBounds;
+  size_t n = mSearchCount;
+  while (n > 1) {
+    size_t half = n / 2;
+    // compiles to a conditional move, the loop count only depends on n
+    base = base[half] <= aLowerBound ? base + half : base;
+    n -= half;
+  }
+  if (*base != aLowerBound) return -1;
+  return static_cast<int>(base - mLowerBounds);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+HistogramDefinitionPool::HistogramDefinitionPool() :
+  mSweepSize(kMinSweepSize)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<const HistogramDefinition>
+HistogramDefinitionPool::Intern(std::unique_ptr<HistogramDefinition> aDefinition)
+{
+  lock_guard<mutex> lock(mMutex);
+  auto range = mDefinitions.equal_range(aDefinition->mHash);
+  for (auto it = range.first; it != range.second; ++it) {
+    shared_ptr<const HistogramDefinition> hd = it->second.lock();
+    if (hd && hd->SameContent(*aDefinition)) {
+      return hd;
+    }
+  }
+  if (mDefinitions.size() >= mSweepSize) {
+    Sweep();
+  }
+  // not make_shared, the weak references would keep the memory allocated
+  shared_ptr<const HistogramDefinition> hd(aDefinition.release());
+  mDefinitions.insert(make_pair(hd->mHash, hd));
+  return hd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+size_t
+HistogramDefinitionPool::GetSize()
+{
+  lock_guard<mutex> lock(mMutex);
+  Sweep();
+  return mDefinitions.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Private Member Functions
+////////////////////////////////////////////////////////////////////////////////
+void
+HistogramDefinitionPool::Sweep()
+{
+  for (auto it = mDefinitions.begin(); it != mDefinitions.end();) {
+    if (it->second.expired()) {
+      it = mDefinitions.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  mSweepSize = max(kMinSweepSize, mDefinitions.size() * 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+HistogramSpecification::HistogramSpecification(const std::string& aJSON,
+                                               HistogramDefinitionPool* aPool) :
+  mHash(HashJSON(aJSON)),
+  mSeed(0),
+  mMaxBucketCount(0)
 {
   RapidjsonDocument doc;
   if (doc.Parse<0>(aJSON.c_str()).HasParseError()) {
@@ -85,43 +514,155 @@ HistogramSpecification::HistogramSpecification(const std::string& aJSON)
     ss << "json parse failed: " << doc.GetParseError();
     throw runtime_error(ss.str());
   }
-  LoadDefinitions(doc);
+  if (aPool) {
+    LoadDefinitions(doc, *aPool);
+  } else {
+    HistogramDefinitionPool pool;
+    LoadDefinitions(doc, pool);
+  }
+  BuildIndex();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-HistogramSpecification::~HistogramSpecification()
+HistogramSpecification::HistogramSpecification(const char* aSnapshot,
+                                               size_t aLength,
+                                               HistogramDefinitionPool* aPool) :
+  mHash(0),
+  mSeed(0),
+  mMaxBucketCount(0)
 {
-  auto end = mDefinitions.end();
-  for (auto it = mDefinitions.begin(); it != end; ){
-    char* key = it->first;
-    HistogramDefinition* hd = it->second;
-    mDefinitions.erase(it++);
-    delete[] key;
-    delete hd;
+  if (aPool) {
+    LoadSnapshot(aSnapshot, aLength, *aPool);
+  } else {
+    HistogramDefinitionPool pool;
+    LoadSnapshot(aSnapshot, aLength, pool);
   }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void
+HistogramSpecification::WriteSnapshot(std::ostream& aOutput) const
+{
+  string body;
+  WriteArray(body, mNames.data(), mNames.size());
+  body.resize(PadName(body.size()), '\0');
+  WriteArray(body, mDisplacements.data(), mDisplacements.size());
+  for (auto& s : mSlots) {
+    SnapshotSlot ss = { s.mHash, s.mName, s.mDefinition, s.mAlias };
+    WriteArray(body, &ss, 1);
+  }
+  // the bounds of a shared definition are written once
+  vector<int> bounds;
+  unordered_map<const HistogramDefinition*, uint32_t> offsets;
+  for (auto& p : mDefinitions) {
+    const HistogramDefinition& hd = *p;
+    auto it = offsets.find(&hd);
+    if (it == offsets.end()) {
+      it = offsets.insert(make_pair(&hd, bounds.size())).first;
+      bounds.insert(bounds.end(), hd.mBounds.begin(), hd.mBounds.end());
+    }
+    SnapshotDefinition sd = { hd.mKind, hd.mMin, hd.mMax, hd.mBucketCount,
+      hd.mStride, hd.mSearchCount,
+      it->second + static_cast<uint32_t>(hd.mOffset),
+      static_cast<uint32_t>(find(HistogramDefinition::kIndexFunctions,
+                                 HistogramDefinition::kIndexFunctions
+                                 + HistogramDefinition::kIndexFunctionCount,
+                                 hd.mGetIndex)
+                            - HistogramDefinition::kIndexFunctions) };
+    WriteArray(body, &sd, 1);
+  }
+  WriteArray(body, bounds.data(), bounds.size());
+
+  SnapshotHeader h;
+  memset(&h, 0, sizeof(h)); // no uninitialized padding in the file
+  h.mBinary = MakeBinaryHeader(kSnapshotMagic, kSnapshotVersion,
+                               Crc32c(0, body.data(), body.size()));
+  h.mHash = mHash;
+  h.mSeed = mSeed;
+  h.mNameSize = static_cast<uint32_t>(mNames.size());
+  h.mDisplacementCount = static_cast<uint32_t>(mDisplacements.size());
+  h.mSlotCount = static_cast<uint32_t>(mSlots.size());
+  h.mDefinitionCount = static_cast<uint32_t>(mDefinitions.size());
+  h.mBoundCount = static_cast<uint32_t>(bounds.size());
+  aOutput.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  aOutput.write(body.data(), body.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t
+HistogramSpecification::GetSnapshotHash(const char* aSnapshot, size_t aLength)
+{
+  SnapshotHeader h;
+  ReadSnapshotHeader(aSnapshot, aLength, h);
+  return h.mHash;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t
+HistogramSpecification::HashJSON(const std::string& aJSON)
+{
+  return Mix(HashBytes(14695981039346656037ULL, aJSON.c_str()));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 const HistogramDefinition*
 HistogramSpecification::GetDefinition(const char* aName) const
 {
-  auto it = mDefinitions.find(const_cast<char*>(aName));
-  if (it != mDefinitions.end()) {
-    return it->second;
+  const Slot* s = FindSlot(aName);
+  if (!s || s->mAlias) {
+    return nullptr;
+  }
+  return mDefinitions[s->mDefinition].get();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const HistogramDefinition*
+HistogramSpecification::GetDefinition(const char* aName, uint32_t& aId) const
+{
+  const Slot* s = FindSlot(aName);
+  if (!s || s->mAlias) {
+    return nullptr;
+  }
+  aId = s->mDefinition;
+  return mDefinitions[s->mDefinition].get();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const HistogramDefinition*
+HistogramSpecification::ResolveDefinition(const char*& aName) const
+{
+  const Slot* s = FindSlot(aName);
+  if (!s) {
+    return nullptr;
+  }
+  if (s->mAlias) {
+    aName += kStartupPrefixLength;
   }
-  return nullptr;
+  return mDefinitions[s->mDefinition].get();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 /// Private Member Functions
 ////////////////////////////////////////////////////////////////////////////////
 void
-HistogramSpecification::LoadDefinitions(const RapidjsonDocument& aDoc)
+HistogramSpecification::LoadDefinitions(const RapidjsonDocument& aDoc,
+                                        HistogramDefinitionPool& aPool)
 {
   const RapidjsonValue& histograms = aDoc["histograms"];
   if (!histograms.IsObject()) {
     throw runtime_error("histograms element must be an object");
   }
+
+  // size the arrays up front so loading costs one allocation each
+  size_t count = 0, names = 0;
+  for (RapidjsonValue::ConstMemberIterator it = histograms.MemberBegin();
+       it != histograms.MemberEnd(); ++it) {
+    ++count;
+    names += it->name.GetStringLength() + 1;
+  }
+  mNames.reserve(names);
+  mDefinitions.reserve(count);
+
   for (RapidjsonValue::ConstMemberIterator it = histograms.MemberBegin();
        it != histograms.MemberEnd(); ++it) {
     const char* name = it->name.GetString();
@@ -131,10 +672,9 @@ HistogramSpecification::LoadDefinitions(const RapidjsonDocument& aDoc)
       throw runtime_error(ss.str());
     }
     try {
-      HistogramDefinition* hd = new HistogramDefinition(it->value);
-      char* key = new char[strlen(name) + 1];
-      strcpy(key, name);
-      mDefinitions.insert(make_pair(key, hd));
+      unique_ptr<HistogramDefinition> hd(new HistogramDefinition(it->value));
+      mDefinitions.push_back(aPool.Intern(move(hd)));
+      mNames.insert(mNames.end(), name, name + strlen(name) + 1);
     }
     catch (exception& e) {
       stringstream ss;
@@ -142,6 +682,209 @@ HistogramSpecification::LoadDefinitions(const RapidjsonDocument& aDoc)
       throw runtime_error(ss.str());
     }
   }
+
+  for (auto& hd : mDefinitions) {
+    mMaxBucketCount = max(mMaxBucketCount, hd->GetBucketCount());
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+HistogramSpecification::BuildIndex()
+{
+  vector<Slot> keys;
+  keys.reserve(mDefinitions.size() * 2);
+  vector<uint64_t> hashes;
+  vector<uint32_t> order, sizes;
+  vector<bool> used;
+
+  for (mSeed = 0; ; ++mSeed) {
+    keys.clear();
+    hashes.clear();
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < mDefinitions.size(); ++i) {
+      const char* name = &mNames[offset];
+      for (int alias = 0; alias < 2; ++alias) {
+        Slot key = { 0, offset, i, alias != 0 };
+        keys.push_back(key);
+        hashes.push_back(Hash(name, key.mAlias));
+      }
+      offset += static_cast<uint32_t>(strlen(name)) + 1;
+    }
+
+    // drop the repeated keys: a defined name wins over an alias of the same
+    // spelling and the first of two definitions sharing a name wins
+    order.resize(keys.size());
+    for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      if (hashes[a] != hashes[b]) return hashes[a] < hashes[b];
+      if (keys[a].mAlias != keys[b].mAlias) return !keys[a].mAlias;
+      return keys[a].mDefinition < keys[b].mDefinition;
+    });
+    bool collision = false;
+    size_t n = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+      if (n && hashes[order[n - 1]] == hashes[order[i]]) {
+        const Slot& first = keys[order[n - 1]];
+        const Slot& key = keys[order[i]];
+        if (SameKey(&mNames[first.mName], first.mAlias, &mNames[key.mName],
+                    key.mAlias)) {
+          continue;
+        }
+        collision = true; // distinct names sharing a hash
+        break;
+      }
+      order[n++] = order[i];
+    }
+    if (collision) continue;
+    order.resize(n);
+
+    // hash and displace: the buckets are placed from the largest to the
+    // smallest, each one trying displacements until its keys land in free
+    // slots; the table is grown slightly if the seeds keep failing
+    size_t slots = n + n * (mSeed / 8) / 32;
+    mDisplacements.assign(n / kBucketSize + 1, 0);
+    Slot empty = { 0, 0, kEmptySlot, false };
+    mSlots.assign(slots, empty);
+    if (n == 0) return;
+    sizes.assign(mDisplacements.size(), 0);
+    for (auto k : order) ++sizes[GetBucket(hashes[k])];
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      size_t ba = GetBucket(hashes[a]), bb = GetBucket(hashes[b]);
+      if (sizes[ba] != sizes[bb]) return sizes[ba] > sizes[bb];
+      return ba < bb;
+    });
+    used.assign(slots, false);
+    bool placed = true;
+    for (size_t i = 0; i < n && placed; ) {
+      size_t bucket = GetBucket(hashes[order[i]]);
+      size_t end = i + sizes[bucket];
+      placed = false;
+      for (uint32_t d = 0; d < kMaxDisplacement && !placed; ++d) {
+        placed = true;
+        size_t j = i;
+        for (; j < end; ++j) {
+          size_t s = GetSlot(hashes[order[j]], d);
+          if (used[s]) {
+            placed = false;
+            break;
+          }
+          used[s] = true;
+        }
+        if (!placed) {
+          while (j-- > i) used[GetSlot(hashes[order[j]], d)] = false;
+          continue;
+        }
+        mDisplacements[bucket] = d;
+        for (j = i; j < end; ++j) {
+          Slot& s = mSlots[GetSlot(hashes[order[j]], d)];
+          s = keys[order[j]];
+          s.mHash = static_cast<uint32_t>(hashes[order[j]]);
+        }
+      }
+      i = end;
+    }
+    if (placed) return;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+HistogramSpecification::LoadSnapshot(const char* aSnapshot, size_t aLength,
+                                     HistogramDefinitionPool& aPool)
+{
+  SnapshotHeader h;
+  ReadSnapshotHeader(aSnapshot, aLength, h);
+  const char* p = aSnapshot + sizeof(h);
+  if (Crc32c(0, p, aLength - sizeof(h)) != h.mBinary.mChecksum) {
+    throw runtime_error("snapshot checksum mismatch");
+  }
+
+  mHash = h.mHash;
+  mSeed = h.mSeed;
+  ReadArray(p, h.mNameSize, mNames);
+  p = aSnapshot + sizeof(h) + PadName(h.mNameSize);
+  if (!mNames.empty() && mNames.back() != '\0') {
+    throw runtime_error("snapshot names are not terminated");
+  }
+  ReadArray(p, h.mDisplacementCount, mDisplacements);
+  if (h.mSlotCount && mDisplacements.empty()) {
+    throw runtime_error("snapshot index has no displacements");
+  }
+
+  vector<SnapshotSlot> slots;
+  ReadArray(p, h.mSlotCount, slots);
+  mSlots.reserve(slots.size());
+  for (auto& ss : slots) {
+    if (ss.mDefinition != kEmptySlot
+        && (ss.mDefinition >= h.mDefinitionCount || ss.mName >= h.mNameSize)) {
+      throw runtime_error("snapshot slot out of range");
+    }
+    Slot s = { ss.mHash, ss.mName, ss.mDefinition, ss.mAlias != 0 };
+    mSlots.push_back(s);
+  }
+
+  vector<SnapshotDefinition> definitions;
+  ReadArray(p, h.mDefinitionCount, definitions);
+  vector<int> bounds;
+  ReadArray(p, h.mBoundCount, bounds);
+  mDefinitions.reserve(definitions.size());
+  for (auto& sd : definitions) {
+    unique_ptr<HistogramDefinition> hd(
+      new HistogramDefinition(sd, bounds.data(), bounds.size()));
+    mDefinitions.push_back(aPool.Intern(move(hd)));
+    mMaxBucketCount = max(mMaxBucketCount, sd.mBucketCount);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t
+HistogramSpecification::Hash(const char* aName, bool aAlias) const
+{
+  uint64_t h = 14695981039346656037ULL ^ Mix(mSeed);
+  if (aAlias) {
+    h = HashBytes(h, kStartupPrefix);
+  }
+  return Mix(HashBytes(h, aName));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+size_t
+HistogramSpecification::GetBucket(uint64_t aHash) const
+{
+  return static_cast<size_t>(((aHash >> 32) * mDisplacements.size()) >> 32);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+size_t
+HistogramSpecification::GetSlot(uint64_t aHash, uint32_t aDisplacement) const
+{
+  uint64_t h = Mix(aHash + aDisplacement * 0x9e3779b97f4a7c15ULL);
+  return static_cast<size_t>(((h & 0xffffffff) * mSlots.size()) >> 32);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const HistogramSpecification::Slot*
+HistogramSpecification::FindSlot(const char* aName) const
+{
+  if (mSlots.empty()) {
+    return nullptr;
+  }
+  uint64_t h = Hash(aName, false);
+  const Slot& s = mSlots[GetSlot(h, mDisplacements[GetBucket(h)])];
+  if (s.mDefinition == kEmptySlot || s.mHash != static_cast<uint32_t>(h)) {
+    return nullptr;
+  }
+  if (s.mAlias) {
+    if (strncmp(aName, kStartupPrefix, kStartupPrefixLength) != 0) {
+      return nullptr;
+    }
+    aName += kStartupPrefixLength;
+  }
+  if (strcmp(&mNames[s.mName], aName) != 0) {
+    return nullptr;
+  }
+  return &s;
 }
 
 }
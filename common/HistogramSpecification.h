@@ -13,27 +13,39 @@ Accessor and utility functions for the Histogram.json data structure.
 
 #include "Common.h"
 
-#include <boost/functional/hash_fwd.hpp>
 #include <boost/utility.hpp>
-#include <functional>
-#include <map>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <ostream>
 #include <rapidjson/document.h>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
 namespace mozilla {
 namespace telemetry {
 
+struct SnapshotDefinition;
+
 /** 
- * Stores a specific histogram definition within a histogram file
+ * Stores a specific histogram definition within a histogram file. Definitions
+ * are immutable and shared by every specification (and name) defining the
+ * same histogram, see HistogramDefinitionPool.
  * 
  */
 class HistogramDefinition : boost::noncopyable
 {
 public:
-
-  HistogramDefinition(const RapidjsonValue& aValue);
+  /**
+   * Histogram kinds as numbered in Histograms.json.
+   */
+  enum Kind : int {
+    kExponential  = 0,
+    kLinear       = 1,
+    kBoolean      = 2,
+    kFlag         = 3
+  };
 
   /**
    * Returns the index of the associated bucket based on the bucket's lower 
@@ -52,41 +64,153 @@ public:
    */
   int GetBucketCount() const;
 
+  /**
+   * Returns the histogram kind, unknown kinds are passed through as is.
+   *
+   * @return Kind Histogram kind.
+   */
+  Kind GetKind() const;
+
 private:
-  int mKind;
+  friend class HistogramDefinitionPool;
+  friend class HistogramSpecification;
+
+  typedef int (HistogramDefinition::*IndexFunction)(long aLowerBound) const;
+
+  /// Index functions in the order they are numbered in a snapshot
+  static const IndexFunction kIndexFunctions[];
+  static const uint32_t kIndexFunctionCount;
+
+  /**
+   * Parses a definition.
+   *
+   * @param aValue Histogram definition object.
+   */
+  HistogramDefinition(const RapidjsonValue& aValue);
+
+  /**
+   * Restores a definition from its compiled snapshot fields, the index
+   * function is not selected again.
+   *
+   * @param aDefinition Snapshot definition.
+   * @param aBounds Bound array of the snapshot.
+   * @param aBoundCount Number of elements in aBounds.
+   */
+  HistogramDefinition(const SnapshotDefinition& aDefinition,
+                      const int* aBounds, size_t aBoundCount);
+
+  /**
+   * Selects the index function matching the kind and the shape of the bucket
+   * array and computes the content hash.
+   */
+  void Compile();
+
+  /**
+   * Computes the content hash and points the search at mBounds.
+   */
+  void Link();
+
+  /**
+   * Picks mGetIndex, appending the sorted bounds and their bucket indices to
+   * mBounds when the bounds are not sorted.
+   */
+  void SelectIndexFunction();
+
+  /**
+   * Tests whether two definitions were created from the same kind, range and
+   * bucket bounds.
+   */
+  bool SameContent(const HistogramDefinition& aOther) const;
+
+  /// Lower bounds are 0, 1, 2, ... (boolean, flag, enumerated)
+  int GetDenseIndex(long aLowerBound) const;
+  /// Lower bounds are 0, min, min + stride, ... (linear)
+  int GetStridedIndex(long aLowerBound) const;
+  /// Lower bounds are strictly increasing (exponential)
+  int GetSortedIndex(long aLowerBound) const;
+  /// Anything else, searches a sorted copy of the bounds
+  int GetPermutedIndex(long aLowerBound) const;
+
+  int Search(long aLowerBound) const;
+
+  Kind mKind;
   int mMin;
   int mMax;
   int mBucketCount;
-  std::unordered_map<int, int> mBuckets;
+  int mStride;
+  int mSearchCount;         ///< number of bounds searched
+  size_t mOffset;           ///< offset of the searched bounds in mBounds
+  uint64_t mHash;           ///< hash of the content compared by SameContent
+  /// bucket bounds, followed by the sorted distinct bounds and their bucket
+  /// indices when they are not sorted
+  std::vector<int> mBounds;
+  const int* mLowerBounds;
+  const int* mIndices;      ///< bucket index of each searched bound or nullptr
+  IndexFunction mGetIndex;
 };
 
+inline int HistogramDefinition::GetBucketIndex(long aLowerBound) const
+{
+  return (this->*mGetIndex)(aLowerBound);
+}
+
 inline int HistogramDefinition::GetBucketCount() const
 {
   return mBucketCount;
 }
 
-struct Cstring_equal_to : std::binary_function<char*, char*, bool>
+inline HistogramDefinition::Kind HistogramDefinition::GetKind() const
 {
-  bool operator ()(const char* p, const char* q) const
-  {
-    return std::strcmp(p, q) == 0;
-  }
-};
+  return mKind;
+}
 
-struct Cstring_hash : std::unary_function<char*, std::size_t>
+/**
+ * Interns histogram definitions by content so consecutive revisions of a
+ * specification (and the many identical boolean and flag histograms within
+ * one) share a single copy of each definition. The pool only holds weak
+ * references, a definition lives as long as a specification uses it. Safe to
+ * use from multiple threads.
+ */
+class HistogramDefinitionPool : boost::noncopyable
 {
-  std::size_t operator ()(const char* p) const
-  {
-    std::size_t seed = 0;
-    for (const char* i = p; *i != 0; ++i) {
-      boost::hash_combine(seed, *i);
-    }
-    return seed;
-  }
+public:
+  HistogramDefinitionPool();
+
+  /**
+   * Returns the pooled definition with the content of aDefinition, adding
+   * aDefinition if there is none.
+   *
+   * @param aDefinition Compiled definition.
+   *
+   * @return std::shared_ptr<const HistogramDefinition> Shared definition.
+   */
+  std::shared_ptr<const HistogramDefinition>
+  Intern(std::unique_ptr<HistogramDefinition> aDefinition);
+
+  /**
+   * Returns the number of definitions still in use.
+   *
+   * @return size_t Number of definitions.
+   */
+  size_t GetSize();
+
+private:
+  typedef std::unordered_multimap<uint64_t,
+    std::weak_ptr<const HistogramDefinition> > DefinitionMap;
+
+  /// Drops the entries of the definitions no longer in use
+  void Sweep();
+
+  DefinitionMap mDefinitions;
+  size_t        mSweepSize;   ///< entry count triggering the next Sweep
+  std::mutex    mMutex;
 };
 
 /** 
- * Stores the set of histogram definitions within a histogram file.
+ * Stores the set of histogram definitions within a histogram file. The
+ * specification is compiled into a few packed arrays: the names, the
+ * interned definitions and a minimal perfect hash over the names and their
+ * "STARTUP_" prefixed aliases.
  * 
  */
 class HistogramSpecification : boost::noncopyable
@@ -96,13 +220,60 @@ public:
    * Loads the specified Histogram.json into memory.
    * 
    * @param aJSON JSON histogram data.
+   * @param aPool Pool the definitions are interned in, when null they are
+   *              only shared within this specification.
    * 
    * @return
    * 
    */
-  HistogramSpecification(const std::string& aJSON);
-  ~HistogramSpecification();
+  HistogramSpecification(const std::string& aJSON,
+                         HistogramDefinitionPool* aPool = nullptr);
+
+  /**
+   * Loads a snapshot written by WriteSnapshot, no JSON is parsed. The name
+   * index and the bounds are copied out of the snapshot as is; the compiled
+   * definitions are restored, not compiled again.
+   *
+   * @param aSnapshot Snapshot data (typically a memory mapped file).
+   * @param aLength Number of bytes in aSnapshot.
+   * @param aPool Pool the definitions are interned in, when null they are
+   *              only shared within this specification.
+   *
+   * @return
+   *
+   */
+  HistogramSpecification(const char* aSnapshot, size_t aLength,
+                         HistogramDefinitionPool* aPool = nullptr);
+
+  /**
+   * Writes the compiled specification as a versioned binary snapshot: a fixed
+   * header followed by the name, displacement, slot, definition and bound
+   * arrays, each 4 byte aligned and in native byte order.
+   *
+   * @param aOutput Stream receiving the snapshot.
+   */
+  void WriteSnapshot(std::ostream& aOutput) const;
+
+  /**
+   * Returns the hash of the specification a snapshot was written from, only
+   * the header is read.
+   *
+   * @param aSnapshot Snapshot data.
+   * @param aLength Number of bytes in aSnapshot.
+   *
+   * @return uint64_t Specification hash.
+   */
+  static uint64_t GetSnapshotHash(const char* aSnapshot, size_t aLength);
 
+  /**
+   * Computes the hash GetHash returns for a specification loaded from this
+   * JSON without parsing it.
+   *
+   * @param aJSON JSON histogram data.
+   *
+   * @return uint64_t Specification hash.
+   */
+  static uint64_t HashJSON(const std::string& aJSON);
 
   /**
    * Retrieve a specific histogram definition by name.
@@ -114,20 +285,110 @@ public:
    */
   const HistogramDefinition* GetDefinition(const char* aName) const;
 
+  /**
+   * Retrieve a specific histogram definition and its id by name.
+   *
+   * @param aName Histogram name.
+   * @param aId Set to the position of the name within the specification,
+   *            stable for a given specification JSON. Definitions are shared
+   *            so the id, not the definition, identifies the histogram.
+   *
+   * @return HistogramDefinition Histogram definition or nullptr if the
+   * definition is not found.
+   */
+  const HistogramDefinition* GetDefinition(const char* aName,
+                                           uint32_t& aId) const;
+
+  /**
+   * Retrieve a histogram definition by the name used in a payload; a
+   * "STARTUP_" prefixed name resolves to the definition without the prefix
+   * unless the prefixed name is defined itself.
+   *
+   * @param aName Histogram name, advanced past the "STARTUP_" prefix when it
+   *              resolved through the alias.
+   *
+   * @return HistogramDefinition Histogram definition or nullptr if the
+   * definition is not found.
+   */
+  const HistogramDefinition* ResolveDefinition(const char*& aName) const;
+
+  /**
+   * Returns the largest bucket count of the definitions, sizes the scratch
+   * buffers used to convert any histogram of the specification.
+   *
+   * @return int Number of buckets.
+   */
+  int GetMaxBucketCount() const;
+
+  /**
+   * Returns a hash of the specification JSON, identifies the specification
+   * in the columnar output.
+   *
+   * @return uint64_t Specification hash.
+   */
+  uint64_t GetHash() const;
+
 private:
+  struct Slot
+  {
+    uint32_t mHash;       ///< low bits of the name hash
+    uint32_t mName;       ///< offset in mNames
+    uint32_t mDefinition; ///< index in mDefinitions or kEmptySlot
+    bool     mAlias;      ///< the key is mName prefixed with "STARTUP_"
+  };
+
+  static const uint32_t kEmptySlot = 0xffffffff;
 
   /**
    * Loads the histogram definitions/verifies the schema
    * 
    * @param aValue "histograms" object from the JSON document.
+   * @param aPool Pool the definitions are interned in.
    * 
    */
-  void LoadDefinitions(const RapidjsonDocument& aDoc);
+  void LoadDefinitions(const RapidjsonDocument& aDoc,
+                       HistogramDefinitionPool& aPool);
+
+  /**
+   * Builds the perfect hash over the names and aliases, reseeding until
+   * every key lands in its own slot.
+   */
+  void BuildIndex();
+
+  /**
+   * Validates a snapshot and copies its arrays.
+   *
+   * @param aSnapshot Snapshot data.
+   * @param aLength Number of bytes in aSnapshot.
+   * @param aPool Pool the definitions are interned in.
+   */
+  void LoadSnapshot(const char* aSnapshot, size_t aLength,
+                    HistogramDefinitionPool& aPool);
+
+  uint64_t Hash(const char* aName, bool aAlias) const;
+  size_t GetBucket(uint64_t aHash) const;
+  size_t GetSlot(uint64_t aHash, uint32_t aDisplacement) const;
+  const Slot* FindSlot(const char* aName) const;
 
-  std::unordered_map<char*, HistogramDefinition*, Cstring_hash,
-                     Cstring_equal_to> mDefinitions;
+  uint64_t                          mHash;
+  uint64_t                          mSeed;
+  int                               mMaxBucketCount;
+  std::vector<char>                 mNames;
+  std::vector<uint32_t>             mDisplacements;
+  std::vector<Slot>                 mSlots;
+  std::vector<std::shared_ptr<const HistogramDefinition> > mDefinitions;
 };
 
+inline int HistogramSpecification::GetMaxBucketCount() const
+{
+  return mMaxBucketCount;
+}
+
+inline uint64_t HistogramSpecification::GetHash() const
+{
+  return mHash;
+}
+
 }
 }
 
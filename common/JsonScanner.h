@@ -0,0 +1,217 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Structural scanning of null terminated JSON, used to locate member spans
+without parsing (or copying) their values, and parsing of the integer member
+names used as histogram bucket keys.
+ */
+
+#ifndef mozilla_telemetry_Json_Scanner_h
+#define mozilla_telemetry_Json_Scanner_h
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <rapidjson/rapidjson.h>
+#include <rapidjson/reader.h>
+
+namespace mozilla {
+namespace telemetry {
+
+////////////////////////////////////////////////////////////////////////////////
+inline char* SkipWhitespace(char* p)
+{
+  while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t') ++p;
+  return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Returns one past the closing quote or nullptr if the string is unterminated
+inline char* SkipString(char* p)
+{
+  for (++p; (p = strpbrk(p, "\"\\")) != nullptr; ++p) {
+    if (*p == '"') return p + 1;
+    if (*++p == 0) break; // skip the escaped character
+  }
+  return nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Returns one past the end of the JSON value or nullptr if it is malformed.
+/// Only the structure is checked, the content is validated if/when parsed (or
+/// by IsValidValue when the span is copied verbatim).
+inline char* SkipValue(char* p)
+{
+  switch (*p) {
+  case '"':
+    return SkipString(p);
+  case '{':
+  case '[':
+    break;
+  default:
+    while (*p && *p != ',' && *p != '}' && *p != ']' && *p != ' '
+           && *p != '\n' && *p != '\r' && *p != '\t') ++p;
+    return p;
+  }
+
+  int depth = 0;
+  while ((p = strpbrk(p, "\"{}[]")) != nullptr) {
+    switch (*p) {
+    case '"':
+      p = SkipString(p);
+      if (!p) return nullptr;
+      continue;
+    case '{':
+    case '[':
+      ++depth;
+      break;
+    default:
+      if (--depth == 0) return p + 1;
+      break;
+    }
+    ++p;
+  }
+  return nullptr;
+}
+
+/**
+ * rapidjson input stream over a value span, presented wrapped in an array so
+ * a scalar is accepted as the root.
+ */
+class SpanStream
+{
+public:
+  typedef char Ch;
+
+  SpanStream(const char* aBegin, const char* aEnd) :
+    mData(aBegin),
+    mLength(aEnd - aBegin),
+    mPos(0) { }
+
+  Ch Peek() const
+  {
+    if (mPos == 0) return '[';
+    if (mPos <= mLength) return mData[mPos - 1];
+    return mPos == mLength + 1 ? ']' : '\0';
+  }
+
+  Ch Take()
+  {
+    Ch c = Peek();
+    if (mPos <= mLength + 1) ++mPos;
+    return c;
+  }
+
+  size_t Tell() const { return mPos; }
+
+  // required by the stream concept, only used by in situ parsing
+  Ch* PutBegin() { return nullptr; }
+  void Put(Ch) { }
+  size_t PutEnd(Ch*) { return 0; }
+
+private:
+  const char* mData;
+  size_t      mLength;
+  size_t      mPos;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// Validates a span found by SkipValue before it is copied to the output
+/// unparsed; SkipValue only follows the structure.
+inline bool IsValidValue(const char* aBegin, const char* aEnd)
+{
+  SpanStream stream(aBegin, aEnd);
+  rapidjson::BaseReaderHandler<> handler;
+  rapidjson::Reader reader;
+  return reader.Parse<0>(stream, handler);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+inline rapidjson::Type GetJsonType(char aFirst)
+{
+  switch (aFirst) {
+  case '{': return rapidjson::kObjectType;
+  case '[': return rapidjson::kArrayType;
+  case '"': return rapidjson::kStringType;
+  case 't': return rapidjson::kTrueType;
+  case 'f': return rapidjson::kFalseType;
+  case 'n': return rapidjson::kNullType;
+  default: return rapidjson::kNumberType;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Packs up to eight characters into a word, first character in the low byte
+/// and left padded with '0'
+inline uint64_t LoadDigits(const char* aStr, size_t aLength)
+{
+  char buf[8];
+  memset(buf, '0', sizeof(buf));
+  memcpy(buf + sizeof(buf) - aLength, aStr, aLength);
+  uint64_t chunk = 0;
+  for (int i = 7; i >= 0; --i) {
+    chunk = chunk << 8 | static_cast<unsigned char>(buf[i]);
+  }
+  return chunk;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Converts eight packed ASCII digits (SWAR); returns false if any byte is
+/// not a digit
+inline bool ParseEightDigits(uint64_t aChunk, uint32_t& aValue)
+{
+  // a digit has the high nibble 3 before and after adding 6
+  if ((aChunk & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL
+      || ((aChunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL)
+      != 0x3030303030303030ULL) {
+    return false;
+  }
+  // combine adjacent digits, then pairs, then quads
+  aChunk = (aChunk & 0x0F0F0F0F0F0F0F0FULL) * 2561 >> 8;
+  aChunk = (aChunk & 0x00FF00FF00FF00FFULL) * 6553601 >> 16;
+  aValue = static_cast<uint32_t>((aChunk & 0x0000FFFF0000FFFFULL)
+                                 * 42949672960001ULL >> 32);
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Parses a base 10 integer whose length is already known (i.e. a member
+/// name). Digits with an optional minus sign take the SWAR path, anything else
+/// returns what strtol would for the null terminated string.
+inline long ParseLong(const char* aStr, size_t aLength)
+{
+  const char* p = aStr;
+  size_t n = aLength;
+  bool negative = n && *p == '-';
+  if (negative) {
+    ++p;
+    --n;
+  }
+  if (n == 0 || n > 16
+      || n > static_cast<size_t>(std::numeric_limits<long>::digits10)) {
+    return strtol(aStr, nullptr, 10);
+  }
+  uint32_t high = 0, low;
+  if (n > 8) {
+    if (!ParseEightDigits(LoadDigits(p, n - 8), high)) {
+      return strtol(aStr, nullptr, 10);
+    }
+    p += n - 8;
+    n = 8;
+  }
+  if (!ParseEightDigits(LoadDigits(p, n), low)) {
+    return strtol(aStr, nullptr, 10);
+  }
+  long value = static_cast<long>(high) * 100000000L + low;
+  return negative ? -value : value;
+}
+
+}
+}
+
+#endif // mozilla_telemetry_Json_Scanner_h
@@ -0,0 +1,69 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief MemoryMappedFile implementation @file
+
+#include "MemoryMappedFile.h"
+
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace mozilla {
+namespace telemetry {
+
+////////////////////////////////////////////////////////////////////////////////
+MemoryMappedFile::MemoryMappedFile(const boost::filesystem::path& aName) :
+  mFd(-1),
+  mData(nullptr),
+  mSize(0)
+{
+  mFd = open(aName.c_str(), O_RDONLY);
+  if (mFd < 0) {
+    stringstream ss;
+    ss << "file open failed: " << aName.string();
+    throw runtime_error(ss.str());
+  }
+
+  struct stat st;
+  if (fstat(mFd, &st) != 0) {
+    close(mFd);
+    stringstream ss;
+    ss << "file stat failed: " << aName.string();
+    throw runtime_error(ss.str());
+  }
+  mSize = st.st_size;
+  if (mSize == 0) return; // mmap rejects zero length mappings
+
+  void* p = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+  if (p == MAP_FAILED) {
+    close(mFd);
+    stringstream ss;
+    ss << "file mmap failed: " << aName.string() << " " << strerror(errno);
+    throw runtime_error(ss.str());
+  }
+  mData = static_cast<char*>(p);
+  madvise(mData, mSize, MADV_SEQUENTIAL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+MemoryMappedFile::~MemoryMappedFile()
+{
+  if (mData) {
+    munmap(mData, mSize);
+  }
+  close(mFd);
+}
+
+}
+}
@@ -0,0 +1,66 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Read only memory mapping of a telemetry log file.
+ */
+
+#ifndef mozilla_telemetry_Memory_Mapped_File_h
+#define mozilla_telemetry_Memory_Mapped_File_h
+
+#include <boost/filesystem.hpp>
+#include <boost/utility.hpp>
+#include <cstddef>
+
+namespace mozilla {
+namespace telemetry {
+
+class MemoryMappedFile : boost::noncopyable
+{
+public:
+  /**
+   * Maps the entire file into memory (read only).
+   *
+   * @param aName Fully qualified name of the file to map.
+   */
+  MemoryMappedFile(const boost::filesystem::path& aName);
+  ~MemoryMappedFile();
+
+  /**
+   * Returns the start of the mapping.
+   *
+   * @return const char* Pointer to the first byte of the file or nullptr if
+   *         the file is empty.
+   */
+  const char* GetData() const;
+
+  /**
+   * Returns the number of bytes mapped.
+   *
+   * @return size_t File size.
+   */
+  size_t GetSize() const;
+
+private:
+  int     mFd;
+  char*   mData;
+  size_t  mSize;
+};
+
+inline const char* MemoryMappedFile::GetData() const
+{
+  return mData;
+}
+
+inline size_t MemoryMappedFile::GetSize() const
+{
+  return mSize;
+}
+
+}
+}
+
+#endif // mozilla_telemetry_Memory_Mapped_File_h
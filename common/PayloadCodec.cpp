@@ -0,0 +1,490 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief PayloadCodec implementation @file
+
+#include "PayloadCodec.h"
+
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <string>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+using namespace std;
+
+namespace mozilla {
+namespace telemetry {
+
+static const size_t kGzipMinSize = 18; // 10 byte header + 8 byte trailer
+/// Largest expansion trusted when sizing the output from a payload header
+static const uint64_t kMaxPresizeRatio = 1032;
+
+////////////////////////////////////////////////////////////////////////////////
+/// Decodes a little endian field, the byte order of the gzip and LZ4 frame
+/// headers on every architecture
+static uint64_t ReadLittleEndian(const char* aData, size_t aBytes)
+{
+  uint64_t value = 0;
+  for (size_t i = aBytes; i-- > 0;) {
+    value = value << 8 | static_cast<unsigned char>(aData[i]);
+  }
+  return value;
+}
+
+class GzipCodec : public PayloadCodec
+{
+public:
+  GzipCodec()
+  {
+    mZstream.zalloc = Z_NULL;
+    mZstream.zfree = Z_NULL;
+    mZstream.opaque = Z_NULL;
+    mZstream.avail_in = 0;
+    mZstream.next_in = Z_NULL;
+    if (inflateInit2(&mZstream, 16 + MAX_WBITS) != Z_OK) {
+      throw runtime_error("inflateInit2 failed");
+    }
+  }
+
+  ~GzipCodec()
+  {
+    inflateEnd(&mZstream);
+  }
+
+  const char* GetName() const
+  {
+    return "gzip";
+  }
+
+  bool Matches(const char* aData, size_t aLength) const
+  {
+    return aLength > 2 && aData[0] == 0x1f
+      && static_cast<unsigned char>(aData[1]) == 0x8b;
+  }
+
+  uint64_t Begin(const char* aData, size_t aLength)
+  {
+    inflateReset(&mZstream);
+    mZstream.avail_in = aLength;
+    mZstream.next_in =
+      reinterpret_cast<unsigned char*>(const_cast<char*>(aData));
+    if (aLength < kGzipMinSize) return 0;
+
+    // the ISIZE trailer (uncompressed length mod 2^32)
+    return ReadLittleEndian(aData + aLength - 4, 4);
+  }
+
+  Status Next(char* aOut, size_t aSize, size_t& aLength)
+  {
+    mZstream.avail_out = aSize;
+    mZstream.next_out = reinterpret_cast<unsigned char*>(aOut);
+    int ret = inflate(&mZstream, Z_NO_FLUSH);
+    aLength = aSize - mZstream.avail_out;
+    switch (ret) {
+    case Z_STREAM_END:
+      return kEnd;
+    case Z_OK:
+      return kMore;
+    default: // including Z_BUF_ERROR, no progress on a truncated payload
+      return kError;
+    }
+  }
+
+private:
+  /// Long lived inflater, reset per payload
+  z_stream mZstream;
+};
+
+#ifdef HAVE_ZSTD
+class ZstdCodec : public PayloadCodec
+{
+public:
+  ZstdCodec() : mContext(ZSTD_createDCtx())
+  {
+    if (!mContext) {
+      throw runtime_error("ZSTD_createDCtx failed");
+    }
+  }
+
+  ~ZstdCodec()
+  {
+    ZSTD_freeDCtx(mContext);
+  }
+
+  const char* GetName() const
+  {
+    return "zstd";
+  }
+
+  bool Matches(const char* aData, size_t aLength) const
+  {
+    return aLength >= 4 && memcmp(aData, "\x28\xb5\x2f\xfd", 4) == 0;
+  }
+
+  uint64_t Begin(const char* aData, size_t aLength)
+  {
+    ZSTD_DCtx_reset(mContext, ZSTD_reset_session_only);
+    mInput.src = aData;
+    mInput.size = aLength;
+    mInput.pos = 0;
+    unsigned long long size = ZSTD_getFrameContentSize(aData, aLength);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) {
+      return 0;
+    }
+    return size;
+  }
+
+  Status Next(char* aOut, size_t aSize, size_t& aLength)
+  {
+    ZSTD_outBuffer out = { aOut, aSize, 0 };
+    size_t ret = ZSTD_decompressStream(mContext, &out, &mInput);
+    aLength = out.pos;
+    if (ZSTD_isError(ret)) return kError;
+    if (mInput.pos == mInput.size) {
+      if (ret == 0) return kEnd; // the last frame is complete
+      if (out.pos < out.size) return kError; // truncated
+    }
+    return kMore;
+  }
+
+private:
+  ZSTD_DCtx*    mContext;
+  ZSTD_inBuffer mInput;
+};
+#endif
+
+#ifdef HAVE_LZ4
+class Lz4Codec : public PayloadCodec
+{
+public:
+  Lz4Codec()
+  {
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&mContext,
+                                                     LZ4F_VERSION))) {
+      throw runtime_error("LZ4F_createDecompressionContext failed");
+    }
+  }
+
+  ~Lz4Codec()
+  {
+    LZ4F_freeDecompressionContext(mContext);
+  }
+
+  const char* GetName() const
+  {
+    return "lz4";
+  }
+
+  bool Matches(const char* aData, size_t aLength) const
+  {
+    return aLength >= 4 && memcmp(aData, "\x04\x22\x4d\x18", 4) == 0;
+  }
+
+  uint64_t Begin(const char* aData, size_t aLength)
+  {
+    LZ4F_resetDecompressionContext(mContext);
+    mPos = aData;
+    mRemaining = aLength;
+    // magic, FLG, BD then the optional content size when FLG bit 3 is set
+    if (aLength < 14 || !(aData[4] & 0x08)) return 0;
+
+    return ReadLittleEndian(aData + 6, 8);
+  }
+
+  Status Next(char* aOut, size_t aSize, size_t& aLength)
+  {
+    size_t srcSize = mRemaining;
+    aLength = aSize;
+    size_t ret = LZ4F_decompress(mContext, aOut, &aLength, mPos, &srcSize,
+                                 nullptr);
+    if (LZ4F_isError(ret)) return kError;
+    mPos += srcSize;
+    mRemaining -= srcSize;
+    if (mRemaining == 0) {
+      if (ret == 0) return kEnd; // the last frame is complete
+      if (aLength < aSize) return kError; // truncated
+    }
+    return kMore;
+  }
+
+private:
+  LZ4F_dctx*  mContext;
+  const char* mPos;
+  size_t      mRemaining;
+};
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+bool PayloadCodec::Decode(const char* aData, size_t aLength,
+                          DecodeBuffer& aOut)
+{
+  aOut.mLength = 0;
+  // size the output up front when the payload states its decoded size,
+  // anything wrong with it is handled by growing the buffer
+  uint64_t size = Begin(aData, aLength);
+  if (size + 1 > aOut.mSize
+      && size <= static_cast<uint64_t>(aLength) * kMaxPresizeRatio) {
+    aOut.Resize(static_cast<size_t>(size) + 1); // make room for the null
+  }
+  for (;;) {
+    if (aOut.mLength == aOut.mSize && !aOut.Resize(aOut.mSize * 2)) {
+      return false;
+    }
+    size_t length;
+    Status status = Next(aOut.mData + aOut.mLength, aOut.mSize - aOut.mLength,
+                         length);
+    aOut.mLength += length;
+    if (status != kMore) {
+      // the buffer may already be larger than the limit
+      return status == kEnd && aOut.mLength < aOut.mMaxSize;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+DecodeBuffer::DecodeBuffer(size_t aSize) :
+  mData(new char[aSize]),
+  mSize(aSize),
+  mMaxSize(numeric_limits<size_t>::max()),
+  mLength(0),
+  mResizes(0) { }
+
+////////////////////////////////////////////////////////////////////////////////
+DecodeBuffer::~DecodeBuffer()
+{
+  delete[] mData;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool DecodeBuffer::Resize(size_t aSize)
+{
+  if (aSize <= mSize) return true;
+  if (aSize > mMaxSize) aSize = mMaxSize;
+  if (aSize <= mSize) return false;
+
+  char* tmp = new char[aSize];
+  memcpy(tmp, mData, mLength);
+  delete[] mData;
+  mData = tmp;
+  mSize = aSize;
+  ++mResizes;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+PayloadDecoder::Codec::Codec(std::unique_ptr<PayloadCodec> aCodec) :
+  mCodec(std::move(aCodec)),
+  mDecoded(string(mCodec->GetName()) + " Decoded"),
+  mFailures(string(mCodec->GetName()) + " Decode Failures"),
+  mCompressionRatio(string(mCodec->GetName()) + " Compression Ratio", "ratio"),
+  mCompressedBytes(0),
+  mDecodedBytes(0) { }
+
+////////////////////////////////////////////////////////////////////////////////
+PayloadDecoder::PayloadDecoder(size_t aBufferSize) :
+  mBuffer(aBufferSize),
+  mResizes("Inflate Buffer Resizes"),
+  mCompressionRatio("Compression Ratio", "ratio")
+{
+  Register(std::unique_ptr<PayloadCodec>(new GzipCodec));
+#ifdef HAVE_ZSTD
+  Register(std::unique_ptr<PayloadCodec>(new ZstdCodec));
+#endif
+#ifdef HAVE_LZ4
+  Register(std::unique_ptr<PayloadCodec>(new Lz4Codec));
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void PayloadDecoder::Register(std::unique_ptr<PayloadCodec> aCodec)
+{
+  mCodecs.push_back(Codec(std::move(aCodec)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool PayloadDecoder::Matches(const char* aData, size_t aLength) const
+{
+  for (auto it = mCodecs.begin(); it != mCodecs.end(); ++it) {
+    if (it->mCodec->Matches(aData, aLength)) return true;
+  }
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+PayloadDecoder::Result
+PayloadDecoder::Decode(const char* aData, size_t aLength)
+{
+  for (auto it = mCodecs.begin(); it != mCodecs.end(); ++it) {
+    if (!it->mCodec->Matches(aData, aLength)) continue;
+
+    if (!it->mCodec->Decode(aData, aLength, mBuffer) || !Terminate()) {
+      ++it->mFailures.mValue;
+      return kFailed;
+    }
+    ++it->mDecoded.mValue;
+    it->mCompressedBytes += aLength;
+    it->mDecodedBytes += mBuffer.mLength;
+    return kDecoded;
+  }
+  return kNotEncoded;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void PayloadDecoder::Copy(const char* aData, size_t aLength)
+{
+  // unencoded payloads are limited by the record size, not the decode limit
+  size_t maxSize = mBuffer.mMaxSize;
+  mBuffer.mMaxSize = numeric_limits<size_t>::max();
+  mBuffer.mLength = 0;
+  mBuffer.Resize(aLength + 1);
+  mBuffer.mMaxSize = maxSize;
+  memcpy(mBuffer.mData, aData, aLength);
+  mBuffer.mLength = aLength;
+  mBuffer.mData[aLength] = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void PayloadDecoder::SetMaxLength(size_t aLength)
+{
+  // make room for the null
+  mBuffer.mMaxSize = aLength < numeric_limits<size_t>::max() ? aLength + 1
+    : aLength;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void PayloadDecoder::GetMetrics(message::Message& aMsg)
+{
+  uint64_t compressed = 0, decoded = 0;
+  for (auto it = mCodecs.begin(); it != mCodecs.end(); ++it) {
+    compressed += it->mCompressedBytes;
+    decoded += it->mDecodedBytes;
+  }
+  mResizes.mValue += mBuffer.mResizes;
+  ConstructField(aMsg, mResizes);
+  if (compressed > 0) {
+    mCompressionRatio.mValue = static_cast<double>(decoded) / compressed;
+  }
+  ConstructField(aMsg, mCompressionRatio);
+
+  for (auto it = mCodecs.begin(); it != mCodecs.end(); ++it) {
+    if (it->mCompressedBytes > 0) {
+      it->mCompressionRatio.mValue =
+        static_cast<double>(it->mDecodedBytes) / it->mCompressedBytes;
+    }
+    ConstructField(aMsg, it->mDecoded);
+    ConstructField(aMsg, it->mFailures);
+    ConstructField(aMsg, it->mCompressionRatio);
+
+    it->mDecoded.mValue = 0;
+    it->mFailures.mValue = 0;
+    it->mCompressionRatio.mValue = 0;
+    it->mCompressedBytes = 0;
+    it->mDecodedBytes = 0;
+  }
+  mResizes.mValue = 0;
+  mCompressionRatio.mValue = 0;
+  mBuffer.mResizes = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void PayloadDecoder::MergeMetrics(PayloadDecoder& aDecoder)
+{
+  for (size_t i = 0; i < mCodecs.size() && i < aDecoder.mCodecs.size(); ++i) {
+    Codec& c = aDecoder.mCodecs[i];
+    mCodecs[i].mDecoded.mValue += c.mDecoded.mValue;
+    mCodecs[i].mFailures.mValue += c.mFailures.mValue;
+    mCodecs[i].mCompressedBytes += c.mCompressedBytes;
+    mCodecs[i].mDecodedBytes += c.mDecodedBytes;
+
+    c.mDecoded.mValue = 0;
+    c.mFailures.mValue = 0;
+    c.mCompressedBytes = 0;
+    c.mDecodedBytes = 0;
+  }
+  mBuffer.mResizes += aDecoder.mBuffer.mResizes;
+  aDecoder.mBuffer.mResizes = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Private Member Functions
+////////////////////////////////////////////////////////////////////////////////
+bool PayloadDecoder::Terminate()
+{
+  if (mBuffer.mLength == mBuffer.mSize
+      && !mBuffer.Resize(mBuffer.mLength + 1)) {
+    return false;
+  }
+  mBuffer.mData[mBuffer.mLength] = 0;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+PayloadDecoder::Stream::Stream(PayloadDecoder& aDecoder, const char* aData,
+                               size_t aLength) :
+  mDecoder(&aDecoder),
+  mCodec(nullptr),
+  mBegin(aData),
+  mPos(aData),
+  mEnd(aData + aLength),
+  mTell(0),
+  mCompressedLength(0),
+  mDone(true),
+  mError(false)
+{
+  for (auto it = aDecoder.mCodecs.begin(); it != aDecoder.mCodecs.end();
+       ++it) {
+    if (it->mCodec->Matches(aData, aLength)) {
+      mCodec = &*it;
+      mCodec->mCodec->Begin(aData, aLength);
+      mCompressedLength = aLength;
+      mBegin = mPos = mEnd = aDecoder.mBuffer.mData;
+      mDone = false;
+      break;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool PayloadDecoder::Stream::HasError() const
+{
+  return mError;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void PayloadDecoder::Stream::Fill()
+{
+  DecodeBuffer& buf = mDecoder->mBuffer;
+  mTell += mEnd - mBegin;
+  mBegin = mPos = mEnd = buf.mData;
+  while (mPos == mEnd && !mDone) {
+    size_t length;
+    PayloadCodec::Status status = mCodec->mCodec->Next(buf.mData, buf.mSize,
+                                                      length);
+    mEnd = buf.mData + length;
+    if (mTell + length > buf.mMaxSize - 1 || status == PayloadCodec::kError) {
+      ++mCodec->mFailures.mValue;
+      mEnd = mPos;
+      mDone = mError = true;
+    } else if (status == PayloadCodec::kEnd) {
+      ++mCodec->mDecoded.mValue;
+      mCodec->mCompressedBytes += mCompressedLength;
+      mCodec->mDecodedBytes += mTell + length;
+      mDone = true;
+    }
+  }
+}
+
+}
+}
@@ -0,0 +1,291 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Compressed payload codecs. A PayloadDecoder detects the payload format by its
+magic number and decodes it into one reusable scratch buffer, or incrementally
+through a window of that buffer (PayloadDecoder::Stream). gzip is always
+available, zstd and lz4 (frame format) when the libraries were found at build
+time (HAVE_ZSTD, HAVE_LZ4).
+ */
+
+#ifndef mozilla_telemetry_Payload_Codec_h
+#define mozilla_telemetry_Payload_Codec_h
+
+#include "Metric.h"
+
+#include <boost/utility.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace mozilla {
+namespace telemetry {
+
+/// Growable output buffer shared by all codecs
+struct DecodeBuffer : boost::noncopyable
+{
+  DecodeBuffer(size_t aSize);
+  ~DecodeBuffer();
+
+  /**
+   * Grows the buffer preserving the first mLength bytes. The size is clamped
+   * to mMaxSize.
+   *
+   * @param aSize New size in bytes, ignored when not larger than mSize.
+   *
+   * @return bool False if the buffer is already at mMaxSize.
+   */
+  bool Resize(size_t aSize);
+
+  char*   mData;
+  size_t  mSize;
+  size_t  mMaxSize;
+  size_t  mLength;  ///< number of bytes decoded
+  size_t  mResizes;
+};
+
+class PayloadCodec : boost::noncopyable
+{
+public:
+  enum Status {
+    kMore,
+    kEnd,   ///< the payload is fully decoded
+    kError  ///< the payload is corrupt or truncated
+  };
+
+  virtual ~PayloadCodec() { }
+
+  /**
+   * Short name used to label the codec metrics.
+   */
+  virtual const char* GetName() const = 0;
+
+  /**
+   * Tests the magic number of a payload.
+   *
+   * @param aData Payload.
+   * @param aLength Number of bytes in aData.
+   *
+   * @return bool True if the payload is in this codec's format.
+   */
+  virtual bool Matches(const char* aData, size_t aLength) const = 0;
+
+  /**
+   * Starts decoding a payload, the payload must stay valid until the last
+   * call to Next.
+   *
+   * @param aData Payload.
+   * @param aLength Number of bytes in aData.
+   *
+   * @return uint64_t Decoded size stated by the payload, 0 if unknown.
+   */
+  virtual uint64_t Begin(const char* aData, size_t aLength) = 0;
+
+  /**
+   * Decodes the next chunk of the payload.
+   *
+   * @param aOut Output position.
+   * @param aSize Space available at aOut (greater than zero).
+   * @param aLength Number of bytes written to aOut.
+   *
+   * @return Status
+   */
+  virtual Status Next(char* aOut, size_t aSize, size_t& aLength) = 0;
+
+  /**
+   * Decodes a payload replacing the content of aOut.
+   *
+   * @param aData Payload.
+   * @param aLength Number of bytes in aData.
+   * @param aOut Buffer receiving the decoded bytes (grown as necessary).
+   *
+   * @return bool False if the payload is corrupt, truncated or does not fit
+   *         in aOut.mMaxSize.
+   */
+  bool Decode(const char* aData, size_t aLength, DecodeBuffer& aOut);
+};
+
+class PayloadDecoder : boost::noncopyable
+{
+  struct Codec;
+
+public:
+  enum Result {
+    kNotEncoded,  ///< no codec matched, the payload is used as is
+    kDecoded,
+    kFailed
+  };
+
+  /**
+   * Creates a decoder with all the codecs compiled in.
+   *
+   * @param aBufferSize Initial size of the scratch buffer.
+   */
+  PayloadDecoder(size_t aBufferSize);
+
+  /**
+   * rapidjson input stream decoding a payload through a window of the scratch
+   * buffer, the decoded payload is never held in full. Copies share the
+   * decoder state (rapidjson copies streams by value and assigns them back).
+   */
+  class Stream
+  {
+  public:
+    typedef char Ch;
+
+    /**
+     * Opens a payload, unencoded payloads are read in place.
+     *
+     * @param aDecoder Decoder providing the codecs and the window.
+     * @param aData Payload.
+     * @param aLength Number of bytes in aData.
+     */
+    Stream(PayloadDecoder& aDecoder, const char* aData, size_t aLength);
+
+    Ch Peek()
+    {
+      if (mPos == mEnd && !mDone) Fill();
+      return mPos != mEnd ? *mPos : '\0';
+    }
+
+    Ch Take()
+    {
+      Ch c = Peek();
+      if (mPos != mEnd) ++mPos;
+      return c;
+    }
+
+    size_t Tell() const
+    {
+      return mTell + (mPos - mBegin);
+    }
+
+    // required by the stream concept, only used by in situ parsing
+    Ch* PutBegin() { return nullptr; }
+    void Put(Ch) { }
+    size_t PutEnd(Ch*) { return 0; }
+
+    /**
+     * Tests whether decoding failed or exceeded the maximum decoded length.
+     */
+    bool HasError() const;
+
+  private:
+    void Fill();
+
+    PayloadDecoder* mDecoder;
+    Codec*          mCodec; ///< nullptr when the payload is not encoded
+    const char*     mBegin;
+    const char*     mPos;
+    const char*     mEnd;
+    size_t          mTell; ///< decoded bytes before the window
+    size_t          mCompressedLength;
+    bool            mDone;
+    bool            mError;
+  };
+
+  /**
+   * Limits the decoded size of a payload, larger payloads fail to decode.
+   *
+   * @param aLength Maximum number of decoded bytes.
+   */
+  void SetMaxLength(size_t aLength);
+
+  /**
+   * Adds a codec; it is tried after the ones already registered.
+   *
+   * @param aCodec Codec to take ownership of.
+   */
+  void Register(std::unique_ptr<PayloadCodec> aCodec);
+
+  /**
+   * Tests whether a codec recognizes the magic number of a payload.
+   *
+   * @param aData Payload.
+   * @param aLength Number of bytes in aData.
+   *
+   * @return bool False if the payload would be used as is.
+   */
+  bool Matches(const char* aData, size_t aLength) const;
+
+  /**
+   * Decodes a payload into the scratch buffer when a codec recognizes it. On
+   * success the buffer is null terminated.
+   *
+   * @param aData Payload.
+   * @param aLength Number of bytes in aData.
+   *
+   * @return Result
+   */
+  Result Decode(const char* aData, size_t aLength);
+
+  /**
+   * Copies an unencoded payload into the scratch buffer (i.e. for a
+   * destructive parse of read only input) and null terminates it.
+   *
+   * @param aData Payload.
+   * @param aLength Number of bytes in aData.
+   */
+  void Copy(const char* aData, size_t aLength);
+
+  char* GetData() const;
+  size_t GetLength() const;
+
+  /**
+   * Appends the decoder metrics to the fields of the provided message, the
+   * metrics are reset after each call.
+   *
+   * @param aMsg Message receiving the fields.
+   */
+  void GetMetrics(message::Message& aMsg);
+
+  /**
+   * Adds the metrics of another decoder with the same codecs; the metrics of
+   * aDecoder are reset.
+   *
+   * @param aDecoder Decoder to collect the metrics from.
+   */
+  void MergeMetrics(PayloadDecoder& aDecoder);
+
+private:
+  friend class Stream;
+
+  struct Codec
+  {
+    Codec(std::unique_ptr<PayloadCodec> aCodec);
+
+    std::unique_ptr<PayloadCodec> mCodec;
+    Metric    mDecoded;
+    Metric    mFailures;
+    Metric    mCompressionRatio;
+    uint64_t  mCompressedBytes;
+    uint64_t  mDecodedBytes;
+  };
+
+  bool Terminate();
+
+  std::vector<Codec>  mCodecs;
+  DecodeBuffer        mBuffer;
+  Metric              mResizes;
+  Metric              mCompressionRatio;
+};
+
+inline char* PayloadDecoder::GetData() const
+{
+  return mBuffer.mData;
+}
+
+inline size_t PayloadDecoder::GetLength() const
+{
+  return mBuffer.mLength;
+}
+
+}
+}
+
+#endif // mozilla_telemetry_Payload_Codec_h
@@ -0,0 +1,44 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief RecordBatch implementation @file
+
+#include "RecordBatch.h"
+
+namespace mozilla {
+namespace telemetry {
+
+static const size_t kBatchChunkSize = 1024 * 1024;
+static const size_t kBatchMaxRetained = 32 * 1024 * 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+RecordBatch::RecordBatch(size_t aCapacity) :
+  mCapacity(aCapacity),
+  mAllocator(kBatchChunkSize, kBatchMaxRetained)
+{
+  mRecords.reserve(aCapacity);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+RecordBatch::~RecordBatch()
+{
+  Clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void RecordBatch::Clear()
+{
+  // the documents are placement constructed in the arena
+  for (auto it = mRecords.begin(); it != mRecords.end(); ++it) {
+    it->mDocument->~RapidjsonDocument();
+  }
+  mRecords.clear();
+  mRawMembers.clear();
+  mAllocator.Reset();
+}
+
+}
+}
@@ -0,0 +1,120 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Reusable batch of parsed telemetry records filled by
+TelemetryRecord::ReadBatch. The paths, payloads and documents of the whole
+batch live in one arena that is rewound when the batch is refilled.
+ */
+
+#ifndef mozilla_telemetry_Record_Batch_h
+#define mozilla_telemetry_Record_Batch_h
+
+#include "ArenaAllocator.h"
+#include "Common.h"
+#include "SplicingWriter.h"
+
+#include <boost/utility.hpp>
+#include <cstdint>
+#include <vector>
+
+namespace mozilla {
+namespace telemetry {
+
+class TelemetryRecord;
+
+class RecordBatch : boost::noncopyable
+{
+public:
+  struct Record
+  {
+    const char*         mPath;          ///< null terminated
+    uint16_t            mPathLength;
+    uint64_t            mTimestamp;
+    size_t              mPayloadLength; ///< size of the (inflated) JSON
+    RapidjsonDocument*  mDocument;
+    size_t              mRawBegin;      ///< raw members of a selective parse
+    size_t              mRawEnd;
+    const char*         mStreamed;      ///< input of a streamed record
+    uint32_t            mStreamedLength;
+  };
+
+  /**
+   * Constructor
+   *
+   * @param aCapacity Maximum number of records per batch.
+   */
+  RecordBatch(size_t aCapacity = kDefaultCapacity);
+  ~RecordBatch();
+
+  size_t GetCapacity() const;
+  size_t GetSize() const;
+
+  /**
+   * Returns a record of the batch.
+   *
+   * @param aIndex Position in the batch, must be less than GetSize().
+   *
+   * @return Record&
+   */
+  Record& GetRecord(size_t aIndex);
+
+  /**
+   * Serializes a record; the parsed and raw members in payload order.
+   *
+   * @param aIndex Position in the batch, must be less than GetSize().
+   * @param aWriter SplicingWriter receiving the JSON.
+   */
+  template<typename Writer>
+  void Accept(size_t aIndex, Writer& aWriter) const;
+
+  /**
+   * Destroys the records and rewinds the arena.
+   */
+  void Clear();
+
+private:
+  friend class TelemetryRecord;
+
+  static const size_t kDefaultCapacity = 64;
+
+  size_t                  mCapacity;
+  ArenaAllocator          mAllocator;
+  std::vector<Record>     mRecords;
+  std::vector<RawMember>  mRawMembers;
+};
+
+inline size_t RecordBatch::GetCapacity() const
+{
+  return mCapacity;
+}
+
+inline size_t RecordBatch::GetSize() const
+{
+  return mRecords.size();
+}
+
+inline RecordBatch::Record& RecordBatch::GetRecord(size_t aIndex)
+{
+  return mRecords[aIndex];
+}
+
+template<typename Writer>
+void RecordBatch::Accept(size_t aIndex, Writer& aWriter) const
+{
+  const Record& r = mRecords[aIndex];
+  if (r.mStreamed) {
+    WriteStreamed(aWriter, *r.mDocument, r.mStreamed, r.mStreamedLength);
+    return;
+  }
+  const RawMember* raw = mRawMembers.data();
+  WriteSpliced(aWriter, *r.mDocument, raw + r.mRawBegin, raw + r.mRawEnd);
+}
+
+}
+}
+
+#endif // mozilla_telemetry_Record_Batch_h
@@ -0,0 +1,186 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/// @brief RecordIndex implementation @file
+
+#include "RecordIndex.h"
+#include "BinaryFile.h"
+#include "Crc32c.h"
+#include "TelemetryRecord.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+namespace mozilla {
+namespace telemetry {
+
+static const char kIndexMagic[4] = { 'T', 'I', 'D', 'X' };
+static const uint32_t kIndexVersion = 2;
+/// BinaryHeader, log size, entry count
+static const size_t kIndexHeaderSize = sizeof(BinaryHeader)
+  + 2 * sizeof(uint64_t);
+/// Entries are packed on disk: offset, timestamp, data length, path length
+static const size_t kEntrySize = 2 * sizeof(uint64_t) + sizeof(uint32_t)
+  + sizeof(uint16_t);
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename T>
+static void ReadField(const char*& aPos, T& aValue)
+{
+  memcpy(&aValue, aPos, sizeof(aValue));
+  aPos += sizeof(aValue);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template<typename T>
+static void WriteField(char*& aPos, const T& aValue)
+{
+  memcpy(aPos, &aValue, sizeof(aValue));
+  aPos += sizeof(aValue);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+RecordIndex::RecordIndex() : mLogSize(0) { }
+
+////////////////////////////////////////////////////////////////////////////////
+void RecordIndex::Build(const char* aBegin, const char* aEnd)
+{
+  mEntries.clear();
+  mLogSize = aEnd - aBegin;
+
+  TelemetryRecord record;
+  const char* pos = aBegin;
+  const char* sep;
+  while ((sep = record.SkipRecord(pos, aEnd)) != nullptr) {
+    Entry e;
+    e.mOffset = sep - aBegin;
+    e.mTimestamp = record.GetTimestamp();
+    e.mDataLength = record.GetDataLength();
+    e.mPathLength = record.GetPathLength();
+    mEntries.push_back(e);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void RecordIndex::Load(const boost::filesystem::path& aName)
+{
+  ifstream ifs(aName.c_str(), ios_base::binary);
+  if (!ifs) {
+    stringstream ss;
+    ss << "file open failed: " << aName.string();
+    throw runtime_error(ss.str());
+  }
+
+  char header[kIndexHeaderSize];
+  if (!ifs.read(header, sizeof(header))) {
+    stringstream ss;
+    ss << "invalid record index: " << aName.string();
+    throw runtime_error(ss.str());
+  }
+  BinaryHeader bh;
+  uint64_t logSize, count;
+  const char* pos = header;
+  ReadField(pos, bh);
+  ReadField(pos, logSize);
+  ReadField(pos, count);
+  CheckBinaryHeader(bh, kIndexMagic, kIndexVersion,
+                    "record index: " + aName.string());
+
+  // the count is only trusted once it matches the file size
+  uint64_t size = boost::filesystem::file_size(aName) - kIndexHeaderSize;
+  if (size % kEntrySize != 0 || size / kEntrySize != count) {
+    stringstream ss;
+    ss << "truncated record index: " << aName.string();
+    throw runtime_error(ss.str());
+  }
+  vector<char> buf(size);
+  if (!ifs.read(buf.data(), buf.size())
+      || Crc32c(0, buf.data(), buf.size()) != bh.mChecksum) {
+    stringstream ss;
+    ss << "corrupt record index: " << aName.string();
+    throw runtime_error(ss.str());
+  }
+
+  vector<Entry> entries(count);
+  pos = buf.data();
+  for (auto it = entries.begin(); it != entries.end(); ++it) {
+    ReadField(pos, it->mOffset);
+    ReadField(pos, it->mTimestamp);
+    ReadField(pos, it->mDataLength);
+    ReadField(pos, it->mPathLength);
+    // the offsets are used as pointers into the log
+    if (it->mOffset >= logSize
+        || (it != entries.begin() && it->mOffset <= (it - 1)->mOffset)) {
+      stringstream ss;
+      ss << "invalid record index offset: " << aName.string();
+      throw runtime_error(ss.str());
+    }
+  }
+  mLogSize = logSize;
+  mEntries.swap(entries);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void RecordIndex::Save(const boost::filesystem::path& aName) const
+{
+  vector<char> buf(kIndexHeaderSize + mEntries.size() * kEntrySize);
+  char* pos = buf.data() + kIndexHeaderSize;
+  for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
+    WriteField(pos, it->mOffset);
+    WriteField(pos, it->mTimestamp);
+    WriteField(pos, it->mDataLength);
+    WriteField(pos, it->mPathLength);
+  }
+  uint32_t checksum = Crc32c(0, buf.data() + kIndexHeaderSize,
+                             buf.size() - kIndexHeaderSize);
+  uint64_t count = mEntries.size();
+  pos = buf.data();
+  WriteField(pos, MakeBinaryHeader(kIndexMagic, kIndexVersion, checksum));
+  WriteField(pos, mLogSize);
+  WriteField(pos, count);
+  WriteBinaryFile(aName, [&](ostream& aOutput) {
+    aOutput.write(buf.data(), buf.size());
+  });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const std::vector<RecordIndex::Entry>& RecordIndex::GetEntries() const
+{
+  return mEntries;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t RecordIndex::GetLogSize() const
+{
+  return mLogSize;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const RecordIndex::Entry* RecordIndex::LowerBound(uint64_t aOffset) const
+{
+  auto it = lower_bound(mEntries.begin(), mEntries.end(), aOffset,
+                        [](const Entry& e, uint64_t aOff) {
+                          return e.mOffset < aOff;
+                        });
+  return it == mEntries.end() ? nullptr : &*it;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+boost::filesystem::path
+RecordIndex::GetIndexPath(const boost::filesystem::path& aLog)
+{
+  boost::filesystem::path p(aLog);
+  p += ".idx";
+  return p;
+}
+
+}
+}
@@ -0,0 +1,103 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Sidecar index of the record offsets in a telemetry log, used for random
+access (TelemetryRecord::ReadAt) and to split a file on record boundaries.
+ */
+
+#ifndef mozilla_telemetry_Record_Index_h
+#define mozilla_telemetry_Record_Index_h
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <vector>
+
+namespace mozilla {
+namespace telemetry {
+
+class RecordIndex
+{
+public:
+  struct Entry
+  {
+    uint64_t  mOffset;    ///< position of the record separator in the log
+    uint64_t  mTimestamp;
+    uint32_t  mDataLength;
+    uint16_t  mPathLength;
+  };
+
+  RecordIndex();
+
+  /**
+   * Indexes every record in the buffer (header scan only, the payloads are
+   * not inflated or parsed).
+   *
+   * @param aBegin First byte of the log (i.e. MemoryMappedFile::GetData).
+   * @param aEnd One past the last byte of the log.
+   */
+  void Build(const char* aBegin, const char* aEnd);
+
+  /**
+   * Loads a sidecar index written by Save. The entry count must match the
+   * file size and the offsets must increase and lie within the log; any
+   * other index is rejected and the current entries are kept.
+   *
+   * @param aName Index file name.
+   */
+  void Load(const boost::filesystem::path& aName);
+
+  /**
+   * Writes the index to a sidecar file (through a temporary file renamed
+   * over it).
+   *
+   * @param aName Index file name.
+   */
+  void Save(const boost::filesystem::path& aName) const;
+
+  /**
+   * Returns the index entries in file order.
+   *
+   * @return const std::vector<Entry>&
+   */
+  const std::vector<Entry>& GetEntries() const;
+
+  /**
+   * Returns the size of the log the index was built from; used to detect a
+   * stale index.
+   *
+   * @return uint64_t Size in bytes.
+   */
+  uint64_t GetLogSize() const;
+
+  /**
+   * Returns the first entry at or after the specified offset.
+   *
+   * @param aOffset Byte offset into the log.
+   *
+   * @return const Entry* nullptr if there is no record past aOffset.
+   */
+  const Entry* LowerBound(uint64_t aOffset) const;
+
+  /**
+   * Returns the conventional sidecar name for a log file.
+   *
+   * @param aLog Log file name.
+   *
+   * @return boost::filesystem::path aLog with ".idx" appended.
+   */
+  static boost::filesystem::path GetIndexPath(
+    const boost::filesystem::path& aLog);
+
+private:
+  uint64_t            mLogSize;
+  std::vector<Entry>  mEntries;
+};
+
+}
+}
+
+#endif // mozilla_telemetry_Record_Index_h
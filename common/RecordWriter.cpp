@@ -11,7 +11,13 @@
 using namespace std;
 namespace fs = boost::filesystem;
 
+#include <ctime>
+#include <exception>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <sstream>
+#include <unistd.h>
 
 namespace mozilla {
 namespace telemetry {
@@ -27,7 +33,8 @@ RecordWriter::RecordWriter(boost::filesystem::path aWorkFolder,
   mUploadFolder(aUploadFolder),
   mMaxUncompressedSize(aMaxUncompressedSize),
   mMemoryConstraint(aMemoryConstraint),
-  mCompressionPreset(aCompressionPreset)
+  mCompressionPreset(aCompressionPreset),
+  mSequence(0)
 {
 
 }
@@ -46,12 +53,110 @@ void RecordWriter::Write(const boost::filesystem::path&, const char*, size_t)
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-void RecordWriter::Finalize()
+size_t RecordWriter::Write(const boost::filesystem::path& aFilterPath,
+                           const char* aUuid, size_t aUuidLength,
+                           uint64_t aTimestamp,
+                           const RapidjsonValue& aDocument,
+                           const HistogramSpecification& aSpec)
+{
+  auto it = mBlocks.find(aFilterPath);
+  if (it == mBlocks.end()) {
+    if (mMemoryConstraint > 0 && mBlocks.size() >= mMemoryConstraint) {
+      // make room by writing out the largest block
+      auto largest = mBlocks.begin();
+      for (auto bit = mBlocks.begin(); bit != mBlocks.end(); ++bit) {
+        if (bit->second->GetSize() > largest->second->GetSize()) largest = bit;
+      }
+      Flush(largest);
+    }
+    it = mBlocks.insert(make_pair(aFilterPath, unique_ptr<ColumnarBlock>(
+      new ColumnarBlock))).first;
+  }
+  size_t size = it->second->Append(aUuid, aUuidLength, aTimestamp, aDocument,
+                                   aSpec);
+  if (it->second->GetSize() >= mMaxUncompressedSize) {
+    Flush(it);
+  }
+  return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void RecordWriter::Aggregate(const boost::filesystem::path& aFilterPath,
+                             const RapidjsonValue& aDocument,
+                             const HistogramSpecification& aSpec)
 {
+  if (mMemoryConstraint > 0 && !mAggregator.HasPartition(aFilterPath)
+      && mAggregator.GetPartitionCount() >= mMemoryConstraint) {
+    FlushAggregates();
+  }
+  mAggregator.Add(aFilterPath, aDocument, aSpec);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+void RecordWriter::Finalize()
+{
+  while (!mBlocks.empty()) {
+    Flush(mBlocks.begin());
+  }
+  if (mAggregator.GetPartitionCount() > 0) {
+    FlushAggregates();
+  }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+/// Private Member Functions
+////////////////////////////////////////////////////////////////////////////////
+void RecordWriter::Flush(BlockMap::iterator aBlock)
+{
+  ColumnarBlock& block = *aBlock->second;
+  Publish(aBlock->first, "tcol", [&](ostream& aOutput) {
+    block.Write(aOutput);
+  });
+  mBlocks.erase(aBlock);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+void RecordWriter::FlushAggregates()
+{
+  Publish(fs::path(), "agg", [this](ostream& aOutput) {
+    mAggregator.Write(aOutput);
+  });
+  mAggregator.Clear();
 }
+
+////////////////////////////////////////////////////////////////////////////////
+void RecordWriter::Publish(const boost::filesystem::path& aFilterPath,
+                           const char* aExtension,
+                           const function<void (ostream&)>& aWrite)
+{
+  stringstream ss;
+  ss << time(nullptr) << "." << getpid() << "." << mSequence++ << "."
+    << aExtension;
+  fs::path work = mWorkFolder / aFilterPath;
+  fs::path upload = mUploadFolder / aFilterPath;
+  create_directories(work);
+  create_directories(upload);
+  work /= ss.str();
+  upload /= ss.str();
+
+  ofstream ofs(work.c_str(), ios_base::binary);
+  aWrite(ofs);
+  ofs.close();
+  if (!ofs) {
+    stringstream es;
+    es << "output write failed: " << work.string();
+    throw runtime_error(es.str());
+  }
+
+  try {
+    rename(work, upload);
+  }
+  catch (const fs::filesystem_error&) {
+    // the upload folder is on another device
+    copy_file(work, upload);
+    remove(work);
+  }
 }
 
+}
+}
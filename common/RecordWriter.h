@@ -12,8 +12,16 @@ the data warehouse.
 #ifndef mozilla_telemetry_Record_Writer_h
 #define mozilla_telemetry_Record_Writer_h
 
+#include "ColumnarBlock.h"
+#include "HistogramAggregator.h"
+#include "HistogramSpecification.h"
+
 #include <boost/filesystem.hpp>
 #include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <rapidjson/document.h>
 
 namespace mozilla {
 namespace telemetry {
@@ -55,17 +63,81 @@ public:
   void Write(const boost::filesystem::path& aFilterPath, 
              const char* aRecord, size_t aLength);
 
+  /**
+   * Appends a converted record to the columnar block of aFilterPath; the
+   * block is written out once it reaches aMaxUncompressedSize or when more
+   * than aMemoryConstraint blocks are open.
+   *
+   * @param aFilterPath Path computed from the telemetry schema and histogram
+   *                    data.
+   * @param aUuid Record uuid.
+   * @param aUuidLength Length of the uuid.
+   * @param aTimestamp Record timestamp.
+   * @param aDocument Converted payload.
+   * @param aSpec Specification the histograms were converted with.
+   *
+   * @return size_t Number of bytes the record added to the block.
+   */
+  size_t Write(const boost::filesystem::path& aFilterPath,
+               const char* aUuid, size_t aUuidLength, uint64_t aTimestamp,
+               const RapidjsonValue& aDocument,
+               const HistogramSpecification& aSpec);
+
+  /**
+   * Adds the histograms of a converted record to the aggregate of
+   * aFilterPath; the aggregates are written out as a single file when more
+   * than aMemoryConstraint paths are open and on Finalize.
+   *
+   * @param aFilterPath Path computed from the telemetry schema and histogram
+   *                    data.
+   * @param aDocument Converted payload.
+   * @param aSpec Specification the histograms were converted with.
+   */
+  void Aggregate(const boost::filesystem::path& aFilterPath,
+                 const RapidjsonValue& aDocument,
+                 const HistogramSpecification& aSpec);
+
   /**
    * Compress all files and move them to aUploadFolder
    */
   void Finalize();
 
 private:
+  typedef std::map<boost::filesystem::path, std::unique_ptr<ColumnarBlock>>
+    BlockMap;
+
+  /**
+   * Writes a columnar block to aWorkFolder, moves it to aUploadFolder and
+   * removes it.
+   */
+  void Flush(BlockMap::iterator aBlock);
+
+  /**
+   * Writes the aggregates to aWorkFolder, moves them to aUploadFolder and
+   * clears them.
+   */
+  void FlushAggregates();
+
+  /**
+   * Writes a new file in aFilterPath under aWorkFolder and moves it to the
+   * same path under aUploadFolder.
+   *
+   * @param aFilterPath Subfolder of the file.
+   * @param aExtension File name extension.
+   * @param aWrite Writes the file content.
+   */
+  void Publish(const boost::filesystem::path& aFilterPath,
+               const char* aExtension,
+               const std::function<void (std::ostream&)>& aWrite);
+
   boost::filesystem::path mWorkFolder;
   boost::filesystem::path mUploadFolder;
   uint64_t mMaxUncompressedSize;
   size_t mMemoryConstraint;
   int mCompressionPreset;
+  BlockMap mBlocks;
+  HistogramAggregator mAggregator;
+  uint64_t mSequence;
 };
 
 }
@@ -0,0 +1,243 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+rapidjson Writer that can splice already serialized JSON into its output.
+ */
+
+#ifndef mozilla_telemetry_Splicing_Writer_h
+#define mozilla_telemetry_Splicing_Writer_h
+
+#include "Common.h"
+#include "PayloadCodec.h"
+#include "TelemetryConstants.h"
+
+#include <boost/utility.hpp>
+#include <cstring>
+#include <rapidjson/reader.h>
+#include <rapidjson/writer.h>
+
+namespace mozilla {
+namespace telemetry {
+
+/// Top level member left unparsed by a selective parse
+struct RawMember
+{
+  const char*     mName; ///< quoted name as it appears in the payload
+  size_t          mNameLength;
+  const char*     mValue;
+  size_t          mValueLength;
+  rapidjson::Type mType;
+  size_t          mPosition; ///< number of parsed members preceding it
+};
+
+/// Copies serialized JSON through the public stream interface
+template<typename Stream>
+inline void PutRaw(Stream& aStream, const char* aJson, size_t aLength)
+{
+  for (size_t i = 0; i < aLength; ++i) {
+    aStream.Put(aJson[i]);
+  }
+}
+
+template<typename Stream>
+class SplicingWriter : public rapidjson::Writer<Stream>
+{
+public:
+  typedef rapidjson::Writer<Stream> Base;
+
+  SplicingWriter(Stream& aStream) : Base(aStream) { }
+
+  /**
+   * Copies serialized JSON to the output verbatim.
+   *
+   * @param aJson Serialized JSON value (or quoted member name).
+   * @param aLength Number of bytes in aJson.
+   * @param aType Type of the value; member names must be kStringType.
+   *
+   * @return SplicingWriter&
+   */
+  SplicingWriter& Raw(const char* aJson, size_t aLength, rapidjson::Type aType)
+  {
+    Base::Prefix(aType);
+    PutRaw(Base::stream_, aJson, aLength);
+    return *this;
+  }
+};
+
+/**
+ * Serializes an object, the raw members are written back between the parsed
+ * members at their original position; raw members positioned past the last
+ * parsed member (i.e. after one was removed) are written last.
+ *
+ * @param aWriter SplicingWriter receiving the JSON.
+ * @param aObject Parsed members.
+ * @param aRawBegin First raw member.
+ * @param aRawEnd One past the last raw member.
+ */
+template<typename Writer>
+void WriteSpliced(Writer& aWriter, const RapidjsonValue& aObject,
+                  const RawMember* aRawBegin, const RawMember* aRawEnd)
+{
+  if (aRawBegin == aRawEnd) {
+    aObject.Accept(aWriter);
+    return;
+  }
+  aWriter.StartObject();
+  const RawMember* raw = aRawBegin;
+  size_t position = 0;
+  for (RapidjsonValue::ConstMemberIterator it = aObject.MemberBegin();
+       it != aObject.MemberEnd(); ++it, ++position) {
+    for (; raw != aRawEnd && raw->mPosition <= position; ++raw) {
+      aWriter.Raw(raw->mName, raw->mNameLength, rapidjson::kStringType);
+      aWriter.Raw(raw->mValue, raw->mValueLength, raw->mType);
+    }
+    aWriter.String(it->name.GetString(), it->name.GetStringLength());
+    it->value.Accept(aWriter);
+  }
+  for (; raw != aRawEnd; ++raw) {
+    aWriter.Raw(raw->mName, raw->mNameLength, rapidjson::kStringType);
+    aWriter.Raw(raw->mValue, raw->mValueLength, raw->mType);
+  }
+  aWriter.EndObject();
+}
+
+/**
+ * SAX handler writing a streamed payload back in member order. A top level
+ * member matching the next member of the DOM built by the first pass is
+ * written from the DOM (which may have been converted since), every other
+ * member is forwarded to the writer as it is parsed.
+ */
+template<typename Writer>
+class StreamedSplicer : boost::noncopyable
+{
+public:
+  typedef char Ch;
+
+  StreamedSplicer(Writer& aWriter, const RapidjsonValue& aObject) :
+    mWriter(aWriter),
+    mParsed(aObject.MemberBegin()),
+    mParsedEnd(aObject.MemberEnd()),
+    mDepth(0),
+    mExpectName(false),
+    mSkip(false) { }
+
+  void Null() { if (!mSkip) mWriter.Null(); EndValue(); }
+  void Bool(bool aValue) { if (!mSkip) mWriter.Bool(aValue); EndValue(); }
+  void Int(int aValue) { if (!mSkip) mWriter.Int(aValue); EndValue(); }
+  void Uint(unsigned aValue) { if (!mSkip) mWriter.Uint(aValue); EndValue(); }
+  void Int64(int64_t aValue) { if (!mSkip) mWriter.Int64(aValue); EndValue(); }
+  void Uint64(uint64_t aValue)
+  {
+    if (!mSkip) mWriter.Uint64(aValue);
+    EndValue();
+  }
+  void Double(double aValue) { if (!mSkip) mWriter.Double(aValue); EndValue(); }
+
+  void String(const Ch* aValue, rapidjson::SizeType aLength, bool)
+  {
+    if (mDepth == 1 && mExpectName) {
+      mExpectName = false;
+      if (mParsed != mParsedEnd && mParsed->name.GetStringLength() == aLength
+          && memcmp(mParsed->name.GetString(), aValue, aLength) == 0) {
+        mWriter.String(aValue, aLength);
+        mParsed->value.Accept(mWriter);
+        ++mParsed;
+        mSkip = true;
+        return;
+      }
+      mWriter.String(aValue, aLength);
+      return;
+    }
+    if (!mSkip) mWriter.String(aValue, aLength);
+    EndValue();
+  }
+
+  void StartObject()
+  {
+    if (mDepth++ == 0) {
+      mWriter.StartObject();
+      mExpectName = true;
+      return;
+    }
+    if (!mSkip) mWriter.StartObject();
+  }
+
+  void EndObject(rapidjson::SizeType)
+  {
+    if (--mDepth == 0) {
+      // members the conversion added to the DOM
+      for (; mParsed != mParsedEnd; ++mParsed) {
+        mWriter.String(mParsed->name.GetString(),
+                       mParsed->name.GetStringLength());
+        mParsed->value.Accept(mWriter);
+      }
+      mWriter.EndObject();
+      return;
+    }
+    if (!mSkip) mWriter.EndObject();
+    EndValue();
+  }
+
+  void StartArray()
+  {
+    ++mDepth;
+    if (!mSkip) mWriter.StartArray();
+  }
+
+  void EndArray(rapidjson::SizeType)
+  {
+    --mDepth;
+    if (!mSkip) mWriter.EndArray();
+    EndValue();
+  }
+
+private:
+  /// Called after each value, a top level member ends at depth 1
+  void EndValue()
+  {
+    if (mDepth == 1) {
+      mSkip = false;
+      mExpectName = true;
+    }
+  }
+
+  Writer&                               mWriter;
+  RapidjsonValue::ConstMemberIterator   mParsed;
+  RapidjsonValue::ConstMemberIterator   mParsedEnd;
+  int                                   mDepth;
+  bool                                  mExpectName;
+  bool                                  mSkip; ///< the member is in the DOM
+};
+
+/**
+ * Serializes a streamed record by decoding its payload a second time through
+ * a window; only the members built into the DOM are held in memory. The
+ * payload must still be readable (and unchanged) since it was parsed.
+ *
+ * @param aWriter SplicingWriter receiving the JSON.
+ * @param aObject Members built into the DOM by the first pass.
+ * @param aPayload Encoded payload.
+ * @param aLength Number of bytes in aPayload.
+ *
+ * @return bool False if the payload no longer decodes or parses.
+ */
+template<typename Writer>
+bool WriteStreamed(Writer& aWriter, const RapidjsonValue& aObject,
+                   const char* aPayload, size_t aLength)
+{
+  // the codecs keep their decoding state, the reader's decoder is not shared
+  PayloadDecoder decoder(kMaxTelemetryData);
+  PayloadDecoder::Stream stream(decoder, aPayload, aLength);
+  StreamedSplicer<Writer> splicer(aWriter, aObject);
+  rapidjson::Reader reader;
+  return reader.Parse<0>(stream, splicer) && !stream.HasError();
+}
+
+}
+}
+
+#endif // mozilla_telemetry_Splicing_Writer_h
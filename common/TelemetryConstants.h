@@ -22,6 +22,7 @@ extern const std::string kProgramDescription;
 
 extern const size_t kMaxTelemetryPath;
 extern const size_t kMaxTelemetryData;
+extern const size_t kMaxTelemetryDecoded;
 
 extern const char kRecordSeparator;
 extern const char kUnitSeparator;
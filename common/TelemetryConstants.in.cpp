@@ -20,6 +20,7 @@ const std::string kProgramDescription("@CPACK_PACKAGE_DESCRIPTION_SUMMARY@");
 
 const size_t kMaxTelemetryPath = 10 * 1024;
 const size_t kMaxTelemetryData = 200 * 1024;
+const size_t kMaxTelemetryDecoded = 10 * 1024 * 1024;
 
 const char kRecordSeparator = 0x1e;
 const char kUnitSeparator = 0x1f;
@@ -6,23 +6,258 @@
 
 /// @brief Telemetry record implementation @file
 
+#include "Crc32c.h"
 #include "HistogramSpecification.h"
+#include "JsonScanner.h"
 #include "TelemetryConstants.h"
 #include "TelemetryRecord.h"
 
 #include <boost/lexical_cast.hpp>
 #include <cstring>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <new>
+#include <ostream>
+#include <sstream>
 #include <string>
-#include <zlib.h>
 
 using namespace std;
 
 namespace mozilla {
 namespace telemetry {
 
+static const size_t kHeaderSize = sizeof(uint16_t) + sizeof(uint32_t)
+  + sizeof(uint64_t);
+/// v2 appends the path/payload checksum and the header checksum
+static const size_t kHeaderSizeV2 = kHeaderSize + 2 * sizeof(uint32_t);
+/// Set in the path length to mark the v2 framing (paths are <= 10KiB)
+static const uint16_t kFramingV2 = 0x8000;
+static const size_t kReadBufferSize = 256 * 1024;
+static const size_t kArenaChunkSize = 256 * 1024;
+static const size_t kArenaMaxRetained = 8 * 1024 * 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+/// Tests whether a payload starts like JSON or in a format aDecoder decodes
+static bool IsPayloadStart(const PayloadDecoder& aDecoder, const char* aData,
+                           size_t aLength)
+{
+  for (size_t i = 0; i < aLength; ++i) {
+    switch (aData[i]) {
+    case ' ': case '\t': case '\n': case '\r':
+      continue;
+    case '{':
+      return true;
+    default:
+      return i == 0 && aDecoder.Matches(aData, aLength);
+    }
+  }
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Length of the submission id, the path up to the first '/'
+static size_t GetSubmissionIdLength(const char* aPath, size_t aPathLength)
+{
+  const char* slash = static_cast<const char*>(memchr(aPath, '/',
+                                                      aPathLength));
+  return slash ? slash - aPath : aPathLength;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static bool IsListed(const vector<string>& aNames, const char* aName,
+                     size_t aNameLength)
+{
+  for (auto it = aNames.begin(); it != aNames.end(); ++it) {
+    if (it->size() == aNameLength
+        && memcmp(it->data(), aName, aNameLength) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * SAX handler for streamed payloads. The listed top level members are built
+ * into the DOM, the others are skipped as they are parsed and never held
+ * (WriteStreamed re-reads them from the payload).
+ */
+class StreamingHandler : boost::noncopyable
+{
+public:
+  typedef char Ch;
+
+  StreamingHandler(const vector<string>& aMembers, RapidjsonDocument& aDoc) :
+    mMembers(aMembers),
+    mDoc(aDoc),
+    mSkipDepth(-1),
+    mInvalid(false) { }
+
+  void Null()
+  {
+    if (Skip()) { EndSkippedValue(); return; }
+    RapidjsonValue v;
+    Add(v);
+  }
+
+  void Bool(bool aValue)
+  {
+    if (Skip()) { EndSkippedValue(); return; }
+    RapidjsonValue v(aValue);
+    Add(v);
+  }
+
+  void Int(int aValue)
+  {
+    if (Skip()) { EndSkippedValue(); return; }
+    RapidjsonValue v(aValue);
+    Add(v);
+  }
+
+  void Uint(unsigned aValue)
+  {
+    if (Skip()) { EndSkippedValue(); return; }
+    RapidjsonValue v(aValue);
+    Add(v);
+  }
+
+  void Int64(int64_t aValue)
+  {
+    if (Skip()) { EndSkippedValue(); return; }
+    RapidjsonValue v(aValue);
+    Add(v);
+  }
+
+  void Uint64(uint64_t aValue)
+  {
+    if (Skip()) { EndSkippedValue(); return; }
+    RapidjsonValue v(aValue);
+    Add(v);
+  }
+
+  void Double(double aValue)
+  {
+    if (Skip()) { EndSkippedValue(); return; }
+    RapidjsonValue v(aValue);
+    Add(v);
+  }
+
+  void String(const Ch* aValue, rapidjson::SizeType aLength, bool)
+  {
+    if (Skip()) { EndSkippedValue(); return; }
+    if (mStack.empty()) { mInvalid = true; return; }
+    if (mExpectName.back()) {
+      if (mStack.size() == 1 && !IsListed(mMembers, aValue, aLength)) {
+        mSkipDepth = 0;
+        return;
+      }
+      mName.SetString(aValue, aLength, mDoc.GetAllocator());
+      mExpectName.back() = false;
+      return;
+    }
+    RapidjsonValue v(aValue, aLength, mDoc.GetAllocator());
+    Add(v);
+  }
+
+  void StartObject()
+  {
+    if (Skip()) { ++mSkipDepth; return; }
+    if (mStack.empty()) { // root
+      mDoc.SetObject();
+      mStack.push_back(&mDoc);
+      mExpectName.push_back(true);
+      return;
+    }
+    RapidjsonValue v(rapidjson::kObjectType);
+    mStack.push_back(Add(v));
+    mExpectName.push_back(true);
+  }
+
+  void EndObject(rapidjson::SizeType)
+  {
+    if (Skip()) { --mSkipDepth; EndSkippedValue(); return; }
+    mStack.pop_back();
+    mExpectName.pop_back();
+  }
+
+  void StartArray()
+  {
+    if (Skip()) { ++mSkipDepth; return; }
+    if (mStack.empty()) { mInvalid = true; return; } // the root is an object
+    RapidjsonValue v(rapidjson::kArrayType);
+    mStack.push_back(Add(v));
+    mExpectName.push_back(false);
+  }
+
+  void EndArray(rapidjson::SizeType)
+  {
+    if (Skip()) { --mSkipDepth; EndSkippedValue(); return; }
+    if (mStack.empty()) return;
+    mStack.pop_back();
+    mExpectName.pop_back();
+  }
+
+  /**
+   * Tests whether the payload root was an object.
+   *
+   * @return bool False if the payload root is not an object.
+   */
+  bool IsValid() const
+  {
+    return !mInvalid;
+  }
+
+private:
+  bool Skip() const
+  {
+    return mSkipDepth >= 0 && !mInvalid;
+  }
+
+  RapidjsonValue* Add(RapidjsonValue& aValue)
+  {
+    if (mStack.empty()) {
+      mInvalid = true;
+      return &mDoc;
+    }
+    RapidjsonValue* top = mStack.back();
+    if (top->IsObject()) {
+      top->AddMember(mName, aValue, mDoc.GetAllocator());
+      mExpectName.back() = true;
+      return &(top->MemberEnd() - 1)->value;
+    }
+    top->PushBack(aValue, mDoc.GetAllocator());
+    return &(*top)[top->Size() - 1];
+  }
+
+  void EndSkippedValue()
+  {
+    if (mSkipDepth == 0) mSkipDepth = -1;
+  }
+
+  const vector<string>&             mMembers;
+  RapidjsonDocument&                mDoc;
+  vector<RapidjsonValue*>           mStack;
+  vector<bool>                      mExpectName;
+  RapidjsonValue                    mName;
+  int                               mSkipDepth; ///< -1 outside a member
+  bool                              mInvalid;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// Verifies the checksum of the v2 header starting at the separator
+static bool IsValidHeaderV2(const char* aSep)
+{
+  uint32_t crc;
+  memcpy(&crc, aSep + 1 + kHeaderSizeV2 - sizeof(crc), sizeof(crc));
+  return crc == Crc32c(0, aSep, 1 + kHeaderSizeV2 - sizeof(crc));
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 TelemetryRecord::TelemetryRecord() :
+  mAllocator(kArenaChunkSize, kArenaMaxRetained),
+  mDocument(new RapidjsonDocument(&mAllocator)),
+  mStreamed(nullptr),
+
   mPathLength(0),
   mPathSize(kMaxTelemetryPath),
   mPath(nullptr),
@@ -30,16 +265,29 @@ TelemetryRecord::TelemetryRecord() :
   mDataLength(0),
   mDataSize(kMaxTelemetryData),
   mData(nullptr),
+  mMaxDataLength(kMaxTelemetryData),
+  mStreamingThreshold(0),
 
   mTimestamp(0),
+  mHasChecksum(false),
+  mChecksum(0),
+  mFiltered(false),
+  mMinTimestamp(0),
+  mMaxTimestamp(numeric_limits<uint64_t>::max()),
+  mDuplicateFilter(nullptr),
+
+  mDecoder(kMaxTelemetryData),
 
-  mInflateLength(0),
-  mInflateSize(kMaxTelemetryData),
-  mInflate(nullptr)
+  mStream(nullptr),
+  mBuffer(nullptr),
+  mBufferPos(nullptr),
+  mBufferEnd(nullptr)
 {
   mPath = new char[mPathSize + 1];
   mData = new char[mDataSize + 1];
-  mInflate = new char[mInflateSize];
+  mBuffer = new char[kReadBufferSize];
+  mBufferPos = mBufferEnd = mBuffer;
+  mDecoder.SetMaxLength(kMaxTelemetryDecoded);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -47,35 +295,243 @@ TelemetryRecord::~TelemetryRecord()
 {
   delete[] mPath;
   delete[] mData;
-  delete[] mInflate;
+  delete[] mBuffer;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 bool TelemetryRecord::Read(std::istream& aInput)
 {
-  while (aInput) {
-    if (FindRecord(aInput)) {
-      if (!aInput.read(mPath, mPathLength).good()) {
-        return false;
-      }
-      mPath[mPathLength] = 0;
+  if (&aInput != mStream) { // discard any read ahead from a previous stream
+    mStream = &aInput;
+    mBufferPos = mBufferEnd = mBuffer;
+  }
+  while (FindRecord(aInput)) {
+    if (mFiltered && !IsInWindow()) {
+      if (!SkipBuffered(aInput, mPathLength + mDataLength)) break;
+      continue;
+    }
+    if (!ReadBuffered(aInput, mPath, mPathLength)) break;
+    mPath[mPathLength] = 0;
+    if (mFiltered && !HasPathPrefix(mPath)) {
+      if (!SkipBuffered(aInput, mDataLength)) break;
+      continue;
+    }
 
-      if (!aInput.read(mData, mDataLength).good()) {
-        return false;
-      }
-      mData[mDataLength] = 0;
-      if (ProcessRecord()) return true;
+    if (mDataLength > mDataSize) { // only after raising the limit
+      delete[] mData;
+      mData = nullptr;
+      mData = new char[mDataLength + 1];
+      mDataSize = mDataLength;
     }
+    if (!ReadBuffered(aInput, mData, mDataLength)) break;
+    mData[mDataLength] = 0;
+    if (!VerifyChecksum(mPath, mData)) continue;
+    if (IsDuplicate(mPath)) continue;
+    if (ProcessRecord(mData)) return true;
   }
+  // the stream is exhausted; never carry its read ahead over to a new stream
+  // that happens to be constructed at the same address
+  mStream = nullptr;
   return false;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::Read(const char*& aInput, const char* aEnd)
+{
+  return Read(aInput, aEnd, aEnd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::Read(const char*& aInput, const char* aLimit,
+                           const char* aEnd)
+{
+  const char* data;
+  while (NextRecord(aInput, aLimit, aEnd, data)) {
+    memcpy(mPath, data - mPathLength, mPathLength);
+    mPath[mPathLength] = 0;
+    if (ProcessRecord(data)) return true;
+  }
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+size_t TelemetryRecord::ReadBatch(const char*& aInput, const char* aLimit,
+                                  const char* aEnd, RecordBatch& aBatch)
+{
+  aBatch.Clear();
+  ArenaAllocator& arena = aBatch.mAllocator;
+  const char* data;
+  while (aBatch.mRecords.size() < aBatch.mCapacity
+         && NextRecord(aInput, aLimit, aEnd, data)) {
+    if (IsStreamed()) {
+      ReadStreamed(data, aBatch);
+      continue;
+    }
+    size_t length;
+    const char* payload = Decode(data, length);
+    if (!payload) continue;
+
+    // everything is copied into the batch arena so it outlives the next read
+    char* path = static_cast<char*>(arena.Malloc(mPathLength + 1));
+    memcpy(path, data - mPathLength, mPathLength);
+    path[mPathLength] = 0;
+    char* json = static_cast<char*>(arena.Malloc(length + 1));
+    memcpy(json, payload, length);
+    json[length] = 0;
+
+    RecordBatch::Record r;
+    r.mPath = path;
+    r.mPathLength = mPathLength;
+    r.mTimestamp = mTimestamp;
+    r.mPayloadLength = length;
+    r.mStreamed = nullptr;
+    r.mStreamedLength = 0;
+    r.mDocument = new(arena.Malloc(sizeof(RapidjsonDocument)))
+      RapidjsonDocument(&arena);
+    r.mRawBegin = aBatch.mRawMembers.size();
+    if (!Parse(json, *r.mDocument, aBatch.mRawMembers)) {
+      r.mDocument->~RapidjsonDocument();
+      aBatch.mRawMembers.resize(r.mRawBegin);
+      continue;
+    }
+    r.mRawEnd = aBatch.mRawMembers.size();
+    aBatch.mRecords.push_back(r);
+  }
+  return aBatch.mRecords.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::ReadPayload(const char*& aInput, const char* aLimit,
+                                  const char* aEnd)
+{
+  const char* data;
+  while (NextRecord(aInput, aLimit, aEnd, data)) {
+    memcpy(mPath, data - mPathLength, mPathLength);
+    mPath[mPathLength] = 0;
+    size_t length;
+    const char* payload = Decode(data, length);
+    if (!payload) continue;
+    if (payload != mDecoder.GetData()) {
+      // the payload is modified by the conversion
+      mDecoder.Copy(payload, length);
+    }
+    return true;
+  }
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::ReadAt(const char* aBegin, const char* aEnd,
+                             uint64_t aOffset)
+{
+  if (aOffset >= static_cast<uint64_t>(aEnd - aBegin)) return false;
+  const char* pos = aBegin + aOffset;
+  return Read(pos, pos + 1, aEnd); // only accept a record starting at pos
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const char* TelemetryRecord::SkipRecord(const char*& aInput, const char* aEnd)
+{
+  if (FindRecord(aInput, aEnd, aEnd)) {
+    const char* sep = aInput - 1
+      - (mHasChecksum ? kHeaderSizeV2 : kHeaderSize);
+    if (static_cast<size_t>(aEnd - aInput) >= mPathLength + mDataLength) {
+      aInput += mPathLength + mDataLength;
+      return sep;
+    }
+  }
+  aInput = aEnd;
+  return nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const char* TelemetryRecord::FindRecordStart(const char* aInput,
+                                             const char* aEnd) const
+{
+  while (aInput < aEnd) {
+    const char* sep = static_cast<const char*>(memchr(aInput, kRecordSeparator,
+                                                      aEnd - aInput));
+    if (!sep || static_cast<size_t>(aEnd - sep - 1) < kHeaderSize) break;
+
+    uint16_t pathLength;
+    uint32_t dataLength;
+    memcpy(&pathLength, sep + 1, sizeof(pathLength));
+    memcpy(&dataLength, sep + 1 + sizeof(pathLength), sizeof(dataLength));
+    if (pathLength & kFramingV2) {
+      if (static_cast<size_t>(aEnd - sep - 1) >= kHeaderSizeV2
+          && IsValidHeaderV2(sep)) {
+        return sep;
+      }
+      aInput = sep + 1;
+      continue;
+    }
+    size_t remaining = aEnd - sep - 1 - kHeaderSize;
+    size_t length = static_cast<size_t>(pathLength) + dataLength;
+    if (pathLength <= kMaxTelemetryPath && dataLength <= mMaxDataLength
+        && remaining >= length) {
+      // a stray separator inside a payload rarely chains to the next record
+      // or describes a payload the reader can decode
+      const char* data = sep + 1 + kHeaderSize + pathLength;
+      if (remaining == length || data[dataLength] == kRecordSeparator
+          || IsPayloadStart(mDecoder, data, dataLength)) {
+        return sep;
+      }
+    }
+    aInput = sep + 1;
+  }
+  return aEnd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void TelemetryRecord::WriteRecord(std::ostream& aOutput, const char* aPath,
+                                  uint16_t aPathLength, const char* aData,
+                                  uint32_t aDataLength, uint64_t aTimestamp)
+{
+  if (aPathLength > kMaxTelemetryPath || aDataLength > kMaxTelemetryData) {
+    stringstream ss;
+    ss << "record too large, path: " << aPathLength << " data: "
+      << aDataLength;
+    throw runtime_error(ss.str());
+  }
+  char header[1 + kHeaderSizeV2];
+  char* pos = header;
+  *pos++ = kRecordSeparator;
+  uint16_t pathLength = aPathLength | kFramingV2;
+  memcpy(pos, &pathLength, sizeof(pathLength));
+  pos += sizeof(pathLength);
+  memcpy(pos, &aDataLength, sizeof(aDataLength));
+  pos += sizeof(aDataLength);
+  memcpy(pos, &aTimestamp, sizeof(aTimestamp));
+  pos += sizeof(aTimestamp);
+  uint32_t crc = Crc32c(Crc32c(0, aPath, aPathLength), aData, aDataLength);
+  memcpy(pos, &crc, sizeof(crc));
+  pos += sizeof(crc);
+  crc = Crc32c(0, header, pos - header);
+  memcpy(pos, &crc, sizeof(crc));
+
+  aOutput.write(header, sizeof(header));
+  aOutput.write(aPath, aPathLength);
+  aOutput.write(aData, aDataLength);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 const char* TelemetryRecord::GetPath()
 {
   return mPath;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+uint16_t TelemetryRecord::GetPathLength()
+{
+  return mPathLength;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t TelemetryRecord::GetDataLength()
+{
+  return mDataLength;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 uint64_t TelemetryRecord::GetTimestamp()
 {
@@ -85,7 +541,70 @@ uint64_t TelemetryRecord::GetTimestamp()
 ////////////////////////////////////////////////////////////////////////////////
 RapidjsonDocument& TelemetryRecord::GetDocument()
 {
-  return mDocument;
+  return *mDocument;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+char* TelemetryRecord::GetPayload()
+{
+  return mDecoder.GetData();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+size_t TelemetryRecord::GetPayloadLength()
+{
+  return mDecoder.GetLength();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void TelemetryRecord::SetFilter(uint64_t aMinTimestamp, uint64_t aMaxTimestamp,
+                                const std::string& aPathPrefix)
+{
+  mMinTimestamp = aMinTimestamp;
+  mMaxTimestamp = aMaxTimestamp;
+  mPathPrefix = aPathPrefix;
+  mFiltered = aMinTimestamp != 0
+    || aMaxTimestamp != numeric_limits<uint64_t>::max()
+    || !aPathPrefix.empty();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void TelemetryRecord::SetDuplicateFilter(DuplicateFilter* aFilter)
+{
+  mDuplicateFilter = aFilter;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::CommitRecord(const char* aPath, uint64_t aTimestamp)
+{
+  if (!mDuplicateFilter) return true;
+
+  size_t length = GetSubmissionIdLength(aPath, strlen(aPath));
+  if (length == 0
+      || !mDuplicateFilter->IsDuplicate(aPath, length, aTimestamp)) {
+    return true;
+  }
+  ++mMetrics.mDuplicateRecords.mValue;
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void TelemetryRecord::SetLimits(size_t aMaxDataLength, size_t aMaxDecodedLength,
+                                size_t aStreamingThreshold)
+{
+  if (aMaxDataLength > numeric_limits<uint32_t>::max()) {
+    aMaxDataLength = numeric_limits<uint32_t>::max();
+  }
+  mMaxDataLength = aMaxDataLength;
+  mDecoder.SetMaxLength(aMaxDecodedLength);
+  mStreamingThreshold = aStreamingThreshold;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+TelemetryRecord::SetParsedMembers(const std::vector<std::string>& aMembers)
+{
+  mParsedMembers = aMembers;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -98,12 +617,51 @@ TelemetryRecord::GetMetrics(message::Message& aMsg)
   ConstructField(aMsg, mMetrics.mInflateFailures);
   ConstructField(aMsg, mMetrics.mParseFailures);
   ConstructField(aMsg, mMetrics.mCorruptData);
+  ConstructField(aMsg, mMetrics.mHeaderChecksumFailures);
+  ConstructField(aMsg, mMetrics.mDataChecksumFailures);
+  ConstructField(aMsg, mMetrics.mFilteredRecords);
+  ConstructField(aMsg, mMetrics.mStreamedRecords);
+  ConstructField(aMsg, mMetrics.mDuplicateRecords);
+  mDecoder.GetMetrics(aMsg);
 
   mMetrics.mInvalidPathLength.mValue = 0;
   mMetrics.mInvalidDataLength.mValue = 0;
   mMetrics.mInflateFailures.mValue = 0;
   mMetrics.mParseFailures.mValue = 0;
   mMetrics.mCorruptData.mValue = 0;
+  mMetrics.mHeaderChecksumFailures.mValue = 0;
+  mMetrics.mDataChecksumFailures.mValue = 0;
+  mMetrics.mFilteredRecords.mValue = 0;
+  mMetrics.mStreamedRecords.mValue = 0;
+  mMetrics.mDuplicateRecords.mValue = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void TelemetryRecord::MergeMetrics(TelemetryRecord& aRecord)
+{
+  Metrics& m = aRecord.mMetrics;
+  mMetrics.mInvalidPathLength.mValue += m.mInvalidPathLength.mValue;
+  mMetrics.mInvalidDataLength.mValue += m.mInvalidDataLength.mValue;
+  mMetrics.mInflateFailures.mValue += m.mInflateFailures.mValue;
+  mMetrics.mParseFailures.mValue += m.mParseFailures.mValue;
+  mMetrics.mCorruptData.mValue += m.mCorruptData.mValue;
+  mMetrics.mHeaderChecksumFailures.mValue += m.mHeaderChecksumFailures.mValue;
+  mMetrics.mDataChecksumFailures.mValue += m.mDataChecksumFailures.mValue;
+  mMetrics.mFilteredRecords.mValue += m.mFilteredRecords.mValue;
+  mMetrics.mStreamedRecords.mValue += m.mStreamedRecords.mValue;
+  mMetrics.mDuplicateRecords.mValue += m.mDuplicateRecords.mValue;
+  mDecoder.MergeMetrics(aRecord.mDecoder);
+
+  m.mInvalidPathLength.mValue = 0;
+  m.mInvalidDataLength.mValue = 0;
+  m.mInflateFailures.mValue = 0;
+  m.mParseFailures.mValue = 0;
+  m.mCorruptData.mValue = 0;
+  m.mHeaderChecksumFailures.mValue = 0;
+  m.mDataChecksumFailures.mValue = 0;
+  m.mFilteredRecords.mValue = 0;
+  m.mStreamedRecords.mValue = 0;
+  m.mDuplicateRecords.mValue = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -111,74 +669,254 @@ TelemetryRecord::GetMetrics(message::Message& aMsg)
 ////////////////////////////////////////////////////////////////////////////////
 bool TelemetryRecord::FindRecord(std::istream& aInput)
 {
-  while (aInput.good()) {
-    char ch;
-    aInput.get(ch);
-    if (ch == kRecordSeparator) {
-      streampos pos = aInput.tellg();
-      if (ReadHeader(aInput)) {
-        return true;
-      }
-      if (!aInput) {
-        return false;
-      }
-      aInput.seekg(pos); // reset back to where the bad header starts
-    } else {
-      ++mMetrics.mCorruptData.mValue;
+  do {
+    const char* pos = mBufferPos;
+    bool found = FindRecord(pos, mBufferEnd, mBufferEnd);
+    mBufferPos = pos;
+    if (found) return true;
+  } while (FillBuffer(aInput));
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::FillBuffer(std::istream& aInput)
+{
+  size_t remaining = mBufferEnd - mBufferPos;
+  if (remaining && mBufferPos != mBuffer) {
+    memmove(mBuffer, mBufferPos, remaining);
+  }
+  mBufferPos = mBuffer;
+  mBufferEnd = mBuffer + remaining;
+  if (!aInput) return false;
+
+  aInput.read(mBuffer + remaining, kReadBufferSize - remaining);
+  mBufferEnd += aInput.gcount();
+  return aInput.gcount() > 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::ReadBuffered(std::istream& aInput, char* aDest,
+                                   size_t aLength)
+{
+  size_t available = mBufferEnd - mBufferPos;
+  if (available >= aLength) {
+    memcpy(aDest, mBufferPos, aLength);
+    mBufferPos += aLength;
+    return true;
+  }
+  memcpy(aDest, mBufferPos, available);
+  mBufferPos = mBufferEnd = mBuffer;
+  return aInput.read(aDest + available, aLength - available).good();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::FindRecord(const char*& aInput, const char* aLimit,
+                                 const char* aEnd)
+{
+  while (aInput < aLimit) {
+    const char* sep = static_cast<const char*>(memchr(aInput, kRecordSeparator,
+                                                      aLimit - aInput));
+    if (!sep) {
+      mMetrics.mCorruptData.mValue += aLimit - aInput;
+      aInput = aLimit;
+      return false;
     }
+    mMetrics.mCorruptData.mValue += sep - aInput;
+    aInput = sep;
+    size_t available = aEnd - sep - 1;
+    if (available < kHeaderSize) {
+      return false; // incomplete header, leave the input on the separator
+    }
+    uint16_t pathLength;
+    memcpy(&pathLength, sep + 1, sizeof(pathLength));
+    if ((pathLength & kFramingV2) && available < kHeaderSizeV2) {
+      return false;
+    }
+    const char* pos = sep + 1;
+    if (ReadHeader(pos)) {
+      aInput = pos;
+      return true;
+    }
+    aInput = sep + 1; // resume the scan after the bad separator
   }
   return false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-bool TelemetryRecord::ReadHeader(std::istream& aInput)
+bool TelemetryRecord::ReadHeader(const char*& aInput)
 {
   // todo support conversion to big endian if necessary
-  if (!read_value(aInput, mPathLength).good()) return false;
+  memcpy(&mPathLength, aInput, sizeof(mPathLength));
+  mHasChecksum = (mPathLength & kFramingV2) != 0;
+  if (mHasChecksum) {
+    // reject a false sync before trusting any of the lengths
+    if (!IsValidHeaderV2(aInput - 1)) {
+      ++mMetrics.mHeaderChecksumFailures.mValue;
+      return false;
+    }
+    mPathLength &= ~kFramingV2;
+  }
+  aInput += sizeof(mPathLength);
   if (mPathLength > kMaxTelemetryPath) {
     ++mMetrics.mInvalidPathLength.mValue;
     return false;
   }
 
-  if (!read_value(aInput, mDataLength).good()) return false;
-  if (mDataLength > kMaxTelemetryData) {
+  memcpy(&mDataLength, aInput, sizeof(mDataLength));
+  aInput += sizeof(mDataLength);
+  if (mDataLength > mMaxDataLength) {
     ++mMetrics.mInvalidDataLength.mValue;
     return false;
   }
 
-  if (!read_value(aInput, mTimestamp).good()) return false;
+  memcpy(&mTimestamp, aInput, sizeof(mTimestamp));
+  aInput += sizeof(mTimestamp);
+
+  if (mHasChecksum) {
+    memcpy(&mChecksum, aInput, sizeof(mChecksum));
+    aInput += kHeaderSizeV2 - kHeaderSize;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::SkipBuffered(std::istream& aInput, size_t aLength)
+{
+  size_t available = mBufferEnd - mBufferPos;
+  if (available >= aLength) {
+    mBufferPos += aLength;
+    return true;
+  }
+  mBufferPos = mBufferEnd = mBuffer;
+  aLength -= available;
+  if (aInput.seekg(aLength, ios_base::cur)) return true;
+  aInput.clear(); // not seekable (i.e. a pipe), read past the payload instead
+  return static_cast<size_t>(aInput.ignore(aLength).gcount()) == aLength;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::IsInWindow()
+{
+  if (mTimestamp >= mMinTimestamp && mTimestamp < mMaxTimestamp) return true;
+  ++mMetrics.mFilteredRecords.mValue;
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::HasPathPrefix(const char* aPath)
+{
+  if (mPathPrefix.size() <= mPathLength
+      && memcmp(aPath, mPathPrefix.data(), mPathPrefix.size()) == 0) {
+    return true;
+  }
+  ++mMetrics.mFilteredRecords.mValue;
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::IsDuplicate(const char* aPath)
+{
+  if (!mDuplicateFilter) return false;
+
+  size_t length = GetSubmissionIdLength(aPath, mPathLength);
+  if (length == 0 || !mDuplicateFilter->WasSeen(aPath, length)) return false;
+  ++mMetrics.mDuplicateRecords.mValue;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::VerifyChecksum(const char* aPath, const char* aData)
+{
+  if (!mHasChecksum) return true;
+
+  uint32_t crc = Crc32c(Crc32c(0, aPath, mPathLength), aData, mDataLength);
+  if (crc != mChecksum) {
+    ++mMetrics.mDataChecksumFailures.mValue;
+    return false;
+  }
   return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-bool TelemetryRecord::ProcessRecord()
+bool TelemetryRecord::NextRecord(const char*& aInput, const char* aLimit,
+                                 const char* aEnd, const char*& aData)
 {
-  if (mDataLength > 2 && mData[0] == 0x1f
-      && static_cast<unsigned char>(mData[1]) == 0x8b) {
-    int ret = Inflate();
-    if (ret != Z_OK) {
-      ++mMetrics.mInflateFailures.mValue;
+  while (FindRecord(aInput, aLimit, aEnd)) {
+    if (static_cast<size_t>(aEnd - aInput) < mPathLength + mDataLength) {
+      aInput = aEnd;
       return false;
-    } else {
-      if (mInflateLength < mInflateSize) {
-        mInflate[mInflateLength] = 0;
-      } else {
-        size_t required = mInflateLength + 1; // make room for the null
-        char* tmp = new char[required];
-        if (tmp) {
-          memcpy(tmp, mInflate, mInflateLength);
-          delete[] mInflate;
-          mInflate = tmp;
-          mInflateSize = required;
-          mInflate[mInflateLength] = 0;
-        }
-      }
-      mDocument.ParseInsitu<0>(mInflate); // destructively parse
     }
+    const char* path = aInput;
+    aData = aInput + mPathLength;
+    aInput = aData + mDataLength;
+    if (mFiltered && (!IsInWindow() || !HasPathPrefix(path))) continue;
+    if (!VerifyChecksum(path, aData)) continue;
+    if (IsDuplicate(path)) continue;
+    return true;
+  }
+  if (aInput < aLimit) aInput = aLimit;
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::ProcessRecord(const char* aData)
+{
+  if (IsStreamed()) {
+    mDocument.reset();
+    mAllocator.Reset();
+    mDocument.reset(new RapidjsonDocument(&mAllocator));
+    mRawMembers.clear();
+    mStreamed = mParsedMembers.empty() ? nullptr : aData;
+    return ParseStreamed(aData, *mDocument);
+  }
+  mStreamed = nullptr;
+
+  size_t length;
+  const char* payload = Decode(aData, length);
+  if (!payload) return false;
+
+  char* json = mData;
+  if (payload == mDecoder.GetData()) {
+    json = mDecoder.GetData();
+  } else if (payload != mData) {
+    // the parse is destructive so a payload in a read only buffer is copied
+    // into the scratch buffer
+    mDecoder.Copy(payload, length);
+    json = mDecoder.GetData();
+  }
+  // The document's parse stack lives in the arena too so it is rebuilt after
+  // the rewind rather than reused.
+  mDocument.reset();
+  mAllocator.Reset();
+  mDocument.reset(new RapidjsonDocument(&mAllocator));
+  mRawMembers.clear();
+  return Parse(json, *mDocument, mRawMembers);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::IsStreamed() const
+{
+  return mStreamingThreshold > 0 && mDataLength > mStreamingThreshold;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::ParseStreamed(const char* aData, RapidjsonDocument& aDoc)
+{
+  ++mMetrics.mStreamedRecords.mValue;
+  PayloadDecoder::Stream stream(mDecoder, aData, mDataLength);
+  bool parsed;
+  if (mParsedMembers.empty()) {
+    parsed = !aDoc.ParseStream<0>(stream).HasParseError();
   } else {
-    mDocument.ParseInsitu<0>(mData); // destructively parse
+    StreamingHandler handler(mParsedMembers, aDoc);
+    rapidjson::Reader reader;
+    parsed = reader.Parse<0>(stream, handler) && handler.IsValid();
   }
-  if (mDocument.HasParseError()) {
+  if (stream.HasError()) {
+    ++mMetrics.mInflateFailures.mValue;
+    return false;
+  }
+  if (!parsed) {
     ++mMetrics.mParseFailures.mValue;
     return false;
   }
@@ -186,45 +924,145 @@ bool TelemetryRecord::ProcessRecord()
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-int TelemetryRecord::Inflate()
+void TelemetryRecord::ReadStreamed(const char* aData, RecordBatch& aBatch)
+{
+  ArenaAllocator& arena = aBatch.mAllocator;
+  RecordBatch::Record r;
+  r.mDocument = new(arena.Malloc(sizeof(RapidjsonDocument)))
+    RapidjsonDocument(&arena);
+  if (!ParseStreamed(aData, *r.mDocument)) {
+    r.mDocument->~RapidjsonDocument();
+    return;
+  }
+  // the unselected members are re-read from the input by Accept
+  r.mRawBegin = r.mRawEnd = aBatch.mRawMembers.size();
+  r.mStreamed = mParsedMembers.empty() ? nullptr : aData;
+  r.mStreamedLength = mDataLength;
+  char* path = static_cast<char*>(arena.Malloc(mPathLength + 1));
+  memcpy(path, aData - mPathLength, mPathLength);
+  path[mPathLength] = 0;
+
+  r.mPath = path;
+  r.mPathLength = mPathLength;
+  r.mTimestamp = mTimestamp;
+  r.mPayloadLength = mDataLength;
+  aBatch.mRecords.push_back(r);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const char* TelemetryRecord::Decode(const char* aData, size_t& aLength)
 {
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = mDataLength;
-  strm.next_in = reinterpret_cast<unsigned char*>(mData);
-  strm.avail_out = mInflateSize;
-  strm.next_out = reinterpret_cast<unsigned char*>(mInflate);
+  switch (mDecoder.Decode(aData, mDataLength)) {
+  case PayloadDecoder::kDecoded:
+    aLength = mDecoder.GetLength();
+    return mDecoder.GetData();
+  case PayloadDecoder::kFailed:
+    ++mMetrics.mInflateFailures.mValue;
+    return nullptr;
+  default:
+    aLength = mDataLength;
+    return aData;
+  }
+}
 
-  int ret = inflateInit2(&strm, 16 + MAX_WBITS);
-  if (ret != Z_OK) {
-    return ret;
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::Parse(char* aJson, RapidjsonDocument& aDoc,
+                            std::vector<RawMember>& aRawMembers)
+{
+  if (!mParsedMembers.empty()) {
+    if (!ParseSelective(aJson, aDoc, aRawMembers)) {
+      ++mMetrics.mParseFailures.mValue;
+      return false;
+    }
+    return true;
   }
+  aDoc.ParseInsitu<0>(aJson); // destructively parse
+  if (aDoc.HasParseError()) {
+    ++mMetrics.mParseFailures.mValue;
+    return false;
+  }
+  return true;
+}
 
-  do {
-    if (ret == Z_BUF_ERROR) {
-      size_t required = mInflateSize * 2;
-      char* tmp = new char[required];
-      if (tmp) {
-        memcpy(tmp, mInflate, mInflateLength);
-        delete[] mInflate;
-        mInflate = tmp;
-        mInflateSize = required;
-        strm.avail_out = mInflateSize - mInflateLength;
-        strm.next_out = reinterpret_cast<unsigned char*>(mInflate +
-                                                         mInflateLength);
-      } else {
-        break;
-      }
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::ParseSelective(char* aJson, RapidjsonDocument& aDoc,
+                                     std::vector<RawMember>& aRawMembers)
+{
+  aDoc.SetObject();
+  char* p = SkipWhitespace(aJson);
+  if (*p != '{') return false;
+
+  p = SkipWhitespace(p + 1);
+  while (*p != '}') {
+    if (*p != '"') return false;
+    char* name = p;
+    p = SkipString(p);
+    if (!p) return false;
+    size_t nameLength = p - name;
+
+    p = SkipWhitespace(p);
+    if (*p != ':') return false;
+    char* value = SkipWhitespace(p + 1);
+    p = SkipValue(value);
+    if (!p || p == value) return false;
+
+    if (IsParsedMember(name + 1, nameLength - 2)) {
+      if (!ParseMember(name + 1, nameLength - 2, value, p, aDoc)) return false;
+    } else {
+      // copied to the output verbatim so it is validated, not parsed
+      if (!IsValidValue(value, p)) return false;
+      RawMember rm = { name, nameLength, value, static_cast<size_t>(p - value),
+        GetJsonType(*value),
+        static_cast<size_t>(aDoc.MemberEnd() - aDoc.MemberBegin()) };
+      aRawMembers.push_back(rm);
     }
-    ret = inflate(&strm, Z_FINISH);
-    mInflateLength = mInflateSize - strm.avail_out;
+
+    p = SkipWhitespace(p);
+    if (*p == ',') {
+      p = SkipWhitespace(p + 1);
+      if (*p == '}') return false;
+    } else if (*p != '}') {
+      return false;
+    }
+  }
+  return *SkipWhitespace(p + 1) == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::ParseMember(const char* aName, size_t aNameLength,
+                                  char* aValue, char* aEnd,
+                                  RapidjsonDocument& aDoc)
+{
+  RapidjsonDocument::AllocatorType& allocator = aDoc.GetAllocator();
+  RapidjsonDocument doc(&allocator);
+  RapidjsonValue name(aName, aNameLength, allocator);
+  if (*aValue == '{' || *aValue == '[') {
+    char ch = *aEnd;
+    *aEnd = 0;
+    doc.ParseInsitu<0>(aValue); // destructively parse
+    *aEnd = ch;
+    if (doc.HasParseError()) return false;
+    aDoc.AddMember(name, doc, allocator);
+  } else {
+    // a scalar is not a valid root, parse it wrapped in an array
+    size_t length = aEnd - aValue;
+    char* tmp = static_cast<char*>(allocator.Malloc(length + 3));
+    tmp[0] = '[';
+    memcpy(tmp + 1, aValue, length);
+    tmp[length + 1] = ']';
+    tmp[length + 2] = 0;
+    doc.ParseInsitu<0>(tmp);
+    if (doc.HasParseError() || doc.Size() != 1) return false;
+    aDoc.AddMember(name, doc[0u], allocator);
   }
-  while (ret == Z_BUF_ERROR);
+  return true;
+}
 
-  inflateEnd(&strm);
-  return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
+////////////////////////////////////////////////////////////////////////////////
+bool TelemetryRecord::IsParsedMember(const char* aName,
+                                     size_t aNameLength) const
+{
+  return IsListed(mParsedMembers, aName, aNameLength);
 }
 
 }
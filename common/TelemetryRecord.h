@@ -10,23 +10,25 @@
 #define mozilla_telemetry_Telemetry_Record_h
 
 #include "Common.h"
+#include "DuplicateFilter.h"
 #include "Metric.h"
+#include "PayloadCodec.h"
+#include "RecordBatch.h"
+#include "SplicingWriter.h"
 #include "TelemetryConstants.h"
 
 #include <boost/utility.hpp>
 #include <cstdint>
+#include <istream>
+#include <ostream>
+#include <memory>
 #include <rapidjson/document.h>
+#include <string>
+#include <vector>
 
 namespace mozilla {
 namespace telemetry {
 
-template<class T>
-std::istream& read_value(std::istream& aInput, T& val)
-{
-  aInput.read((char*)&val, sizeof(val));
-  return aInput;
-}
-
 class TelemetryRecord : boost::noncopyable
 {
 public:
@@ -35,9 +37,209 @@ public:
 
   bool Read(std::istream& aInput);
 
+  /**
+   * Reads the next record directly from a memory buffer (i.e. a
+   * MemoryMappedFile). Only the path is copied; compressed payloads are
+   * inflated straight out of the buffer.
+   *
+   * @param aInput Current position in the buffer, it is advanced past the
+   *               record (or to aEnd when no more records are available).
+   * @param aEnd One past the last byte of the buffer.
+   *
+   * @return bool True if a record was read.
+   */
+  bool Read(const char*& aInput, const char* aEnd);
+
+  /**
+   * Reads the next record that starts before aLimit. Used to process one byte
+   * range of a buffer; a record starting inside the range is read in full
+   * even when it extends past aLimit, so consecutive ranges cover each record
+   * exactly once.
+   *
+   * @param aInput Current position in the buffer, it is advanced past the
+   *               record (or to at least aLimit when no more records start
+   *               inside the range).
+   * @param aLimit One past the last byte of the range.
+   * @param aEnd One past the last byte of the buffer.
+   *
+   * @return bool True if a record was read.
+   */
+  bool Read(const char*& aInput, const char* aLimit, const char* aEnd);
+
+  /**
+   * Reads up to aBatch.GetCapacity() records that start before aLimit. All
+   * records of the batch stay valid until the next call; the batch storage
+   * is reused. Streamed records are re-read from the buffer when written so
+   * it must outlive the batch.
+   *
+   * @param aInput Current position in the buffer, it is advanced past the
+   *               last record read.
+   * @param aLimit One past the last byte of the range.
+   * @param aEnd One past the last byte of the buffer.
+   * @param aBatch Batch receiving the records (cleared first).
+   *
+   * @return size_t Number of records read, 0 when no more are available.
+   */
+  size_t ReadBatch(const char*& aInput, const char* aLimit, const char* aEnd,
+                   RecordBatch& aBatch);
+
+  /**
+   * Reads the next record that starts before aLimit without parsing it, for
+   * a single pass conversion of the payload (see ConvertHistogramData). The
+   * decoded payload is left null terminated in a scratch buffer that is
+   * reused by the next read; the streaming threshold does not apply.
+   *
+   * @param aInput Current position in the buffer, it is advanced past the
+   *               record (or to at least aLimit when no more records start
+   *               inside the range).
+   * @param aLimit One past the last byte of the range.
+   * @param aEnd One past the last byte of the buffer.
+   *
+   * @return bool True if a record was read (see GetPayload).
+   */
+  bool ReadPayload(const char*& aInput, const char* aLimit, const char* aEnd);
+
+  /**
+   * Reads the record at a known offset (i.e. from a RecordIndex entry).
+   *
+   * @param aBegin First byte of the buffer.
+   * @param aEnd One past the last byte of the buffer.
+   * @param aOffset Position of the record separator relative to aBegin.
+   *
+   * @return bool True if a valid record was found at aOffset.
+   */
+  bool ReadAt(const char* aBegin, const char* aEnd, uint64_t aOffset);
+
+  /**
+   * Advances past the next record decoding only its header; the path and
+   * payload are not read (GetPath and GetDocument are not updated).
+   *
+   * @param aInput Current position in the buffer, it is advanced past the
+   *               record (or to aEnd when no more records are available).
+   * @param aEnd One past the last byte of the buffer.
+   *
+   * @return const char* Position of the record separator, nullptr if there
+   *         are no more records.
+   */
+  const char* SkipRecord(const char*& aInput, const char* aEnd);
+
+  /**
+   * Locates the first record at or after aInput. A separator only qualifies
+   * when its header passes the checks of Read and the record it describes
+   * either ends at aEnd/another separator or has a payload Read can decode
+   * (JSON after optional whitespace, or a codec's magic number). Reading the
+   * previous range up to the returned position (as its aLimit) leaves no
+   * record between the ranges.
+   *
+   * @param aInput Position to start the search (i.e. a range boundary).
+   * @param aEnd One past the last byte of the buffer.
+   *
+   * @return const char* Position of the record separator, aEnd if not found.
+   */
+  const char* FindRecordStart(const char* aInput, const char* aEnd) const;
+
+  /**
+   * Writes a record using the v2 framing. The header carries a CRC32C of
+   * itself and one of the path and payload, so readers can reject false
+   * syncs before touching the payload. Readers accept v1 and v2 records.
+   *
+   * @param aOutput Stream receiving the record.
+   * @param aPath Record path.
+   * @param aPathLength Number of bytes in aPath.
+   * @param aData Record payload (JSON or gzipped JSON).
+   * @param aDataLength Number of bytes in aData.
+   * @param aTimestamp Record timestamp.
+   */
+  static void WriteRecord(std::ostream& aOutput, const char* aPath,
+                          uint16_t aPathLength, const char* aData,
+                          uint32_t aDataLength, uint64_t aTimestamp);
+
   const char* GetPath();
+  uint16_t GetPathLength();
+  uint32_t GetDataLength();
   uint64_t GetTimestamp();
   RapidjsonDocument& GetDocument();
+  char* GetPayload();
+  size_t GetPayloadLength();
+
+  /**
+   * Restricts Read to records with a header timestamp in
+   * [aMinTimestamp, aMaxTimestamp) and a path starting with aPathPrefix. The
+   * filter is applied to the header (and path) only; the payload of a
+   * skipped record is never read or inflated.
+   *
+   * @param aMinTimestamp Inclusive lower bound.
+   * @param aMaxTimestamp Exclusive upper bound.
+   * @param aPathPrefix Required path prefix, empty matches every path.
+   */
+  void SetFilter(uint64_t aMinTimestamp, uint64_t aMaxTimestamp,
+                 const std::string& aPathPrefix = std::string());
+
+  /**
+   * Drops records whose submission id (the path up to the first '/') was
+   * already seen. The check runs on the header and path only, before the
+   * payload is inflated; duplicates are counted as Duplicate Records. Reading
+   * does not record the id, see CommitRecord.
+   *
+   * @param aFilter Filter shared by the records of all the workers (not
+   *                owned), nullptr disables the check.
+   */
+  void SetDuplicateFilter(DuplicateFilter* aFilter);
+
+  /**
+   * Records the submission id of a successfully converted record in the
+   * duplicate filter, so a record that fails to decode, parse or convert
+   * does not block a later copy. The id may have been committed since the
+   * record was read (a copy in the same batch or converted by another
+   * worker); the record is then a duplicate and must not be written.
+   *
+   * @param aPath Null terminated record path.
+   * @param aTimestamp Header timestamp of the record.
+   *
+   * @return bool False if the record is a duplicate (counted as Duplicate
+   *         Records).
+   */
+  bool CommitRecord(const char* aPath, uint64_t aTimestamp);
+
+  /**
+   * Overrides the record size limits. Payloads above the streaming threshold
+   * are decoded through a fixed window and parsed incrementally; only the
+   * members selected by SetParsedMembers are built into the DOM, the others
+   * are skipped and Accept decodes the payload a second time to write them.
+   * A streamed record holds the window and the selected members, a string
+   * value is still read in full; without selected members the whole payload
+   * is built into the DOM.
+   *
+   * @param aMaxDataLength Largest framed payload accepted, larger records are
+   *                       counted as Invalid Data Length (default
+   *                       kMaxTelemetryData).
+   * @param aMaxDecodedLength Largest decompressed payload, larger ones fail
+   *                          to decode (default kMaxTelemetryDecoded).
+   * @param aStreamingThreshold Framed payload size above which records are
+   *                            streamed, 0 disables streaming (default).
+   */
+  void SetLimits(size_t aMaxDataLength, size_t aMaxDecodedLength,
+                 size_t aStreamingThreshold);
+
+  /**
+   * Limits the DOM to the named top level members. All other members are
+   * kept as raw spans of the payload and spliced back into the output by
+   * Accept, streamed records re-read them (see SetLimits). An empty list
+   * restores full parsing.
+   *
+   * @param aMembers Names of the top level members to parse.
+   */
+  void SetParsedMembers(const std::vector<std::string>& aMembers);
+
+  /**
+   * Serializes the record; the parsed and raw members in payload order. A
+   * streamed record is re-read from the input of the last Read, which must
+   * still be readable.
+   *
+   * @param aWriter SplicingWriter receiving the JSON.
+   */
+  template<typename Writer>
+  void Accept(Writer& aWriter) const;
 
   /**
    * Rolls up the internal metric data into the fields element of the provided 
@@ -48,6 +250,14 @@ public:
    */
   void GetMetrics(message::Message& aMsg);
 
+  /**
+   * Adds the metrics of another record (i.e. one used by a worker thread) to
+   * this record's metrics; the metrics of aRecord are reset.
+   *
+   * @param aRecord Record to collect the metrics from.
+   */
+  void MergeMetrics(TelemetryRecord& aRecord);
+
 private:
   struct Metrics {
     Metrics() :
@@ -55,21 +265,57 @@ private:
       mInvalidDataLength("Invalid Data Length"),
       mInflateFailures("Inflate Failures"),
       mParseFailures("Parse Failures"),
-      mCorruptData("Corrupt Data", "B")  { }
+      mCorruptData("Corrupt Data", "B"),
+      mHeaderChecksumFailures("Header Checksum Failures"),
+      mDataChecksumFailures("Data Checksum Failures"),
+      mFilteredRecords("Filtered Records"),
+      mStreamedRecords("Streamed Records"),
+      mDuplicateRecords("Duplicate Records") { }
 
     Metric mInvalidPathLength;
     Metric mInvalidDataLength;
     Metric mInflateFailures;
     Metric mParseFailures;
     Metric mCorruptData;
+    Metric mHeaderChecksumFailures;
+    Metric mDataChecksumFailures;
+    Metric mFilteredRecords;
+    Metric mStreamedRecords;
+    Metric mDuplicateRecords;
   };
 
   bool FindRecord(std::istream& aInput);
-  bool ReadHeader(std::istream& aInput);
-  bool ProcessRecord();
-  int Inflate();
+  bool FillBuffer(std::istream& aInput);
+  bool ReadBuffered(std::istream& aInput, char* aDest, size_t aLength);
+  bool SkipBuffered(std::istream& aInput, size_t aLength);
+  bool FindRecord(const char*& aInput, const char* aLimit, const char* aEnd);
+  bool ReadHeader(const char*& aInput);
+  bool VerifyChecksum(const char* aPath, const char* aData);
+  bool IsInWindow();
+  bool HasPathPrefix(const char* aPath);
+  bool IsDuplicate(const char* aPath);
 
-  RapidjsonDocument mDocument;
+  bool NextRecord(const char*& aInput, const char* aLimit, const char* aEnd,
+                  const char*& aData);
+  bool ProcessRecord(const char* aData);
+  bool IsStreamed() const;
+  bool ParseStreamed(const char* aData, RapidjsonDocument& aDoc);
+  void ReadStreamed(const char* aData, RecordBatch& aBatch);
+  const char* Decode(const char* aData, size_t& aLength);
+  bool Parse(char* aJson, RapidjsonDocument& aDoc,
+             std::vector<RawMember>& aRawMembers);
+  bool ParseSelective(char* aJson, RapidjsonDocument& aDoc,
+                      std::vector<RawMember>& aRawMembers);
+  bool ParseMember(const char* aName, size_t aNameLength, char* aValue,
+                   char* aEnd, RapidjsonDocument& aDoc);
+  bool IsParsedMember(const char* aName, size_t aNameLength) const;
+
+  /// Backs every DOM node of the current record, rewound per record
+  ArenaAllocator mAllocator;
+  std::unique_ptr<RapidjsonDocument> mDocument;
+  std::vector<std::string> mParsedMembers;
+  std::vector<RawMember> mRawMembers;
+  const char* mStreamed; ///< payload of a streamed record, nullptr otherwise
 
   uint16_t  mPathLength;
   size_t    mPathSize;
@@ -78,17 +324,43 @@ private:
   uint32_t  mDataLength;
   size_t    mDataSize;
   char*     mData;
+  size_t    mMaxDataLength;
+  size_t    mStreamingThreshold;
 
   uint64_t  mTimestamp;
+  bool      mHasChecksum; ///< v2 framing
+  uint32_t  mChecksum;
+
+  bool        mFiltered;
+  uint64_t    mMinTimestamp;
+  uint64_t    mMaxTimestamp;
+  std::string mPathPrefix;
+  DuplicateFilter* mDuplicateFilter;
+
+  /// Decodes compressed payloads into a reusable scratch buffer
+  PayloadDecoder mDecoder;
 
-  uint32_t  mInflateLength;
-  size_t    mInflateSize;
-  char*     mInflate;
+  /// Block read ahead of the istream input, scanned in place for records
+  std::istream* mStream;
+  char*         mBuffer;
+  const char*   mBufferPos;
+  const char*   mBufferEnd;
 
   Metrics   mMetrics;
 
 };
 
+template<typename Writer>
+void TelemetryRecord::Accept(Writer& aWriter) const
+{
+  if (mStreamed) {
+    WriteStreamed(aWriter, *mDocument, mStreamed, mDataLength);
+    return;
+  }
+  const RawMember* raw = mRawMembers.data();
+  WriteSpliced(aWriter, *mDocument, raw, raw + mRawMembers.size());
+}
+
 }
 }
 
@@ -95,15 +95,21 @@ TelemetrySchema::TelemetrySchema(const boost::filesystem::path& fileName)
 boost::filesystem::path
 TelemetrySchema::GetDimensionPath(const RapidjsonDocument& aDoc)
 {
-  const RapidjsonValue& info = aDoc["info"];
-  if (!info.IsObject()) {
+  return GetInfoDimensionPath(aDoc["info"]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+boost::filesystem::path
+TelemetrySchema::GetInfoDimensionPath(const RapidjsonValue& aInfo)
+{
+  if (!aInfo.IsObject()) {
     throw runtime_error("info element must be an object");
   }
   static const string kOther("other");
   boost::filesystem::path p;
   auto end = mDimensions.end();
   for (auto it = mDimensions.begin(); it != end; ++it){
-    const RapidjsonValue& v = info[(*it)->mName.c_str()];
+    const RapidjsonValue& v = aInfo[(*it)->mName.c_str()];
     if (v.IsString()) {
       string dim = v.GetString();
       switch ((*it)->mType) {
@@ -47,6 +47,16 @@ public:
    */
   boost::filesystem::path GetDimensionPath(const RapidjsonDocument& aDoc);
 
+  /**
+   * Constructs the storage layout path from the info object alone (i.e. the
+   * one extracted by the single pass ConvertHistogramData).
+   *
+   * @param aInfo Histogram info object.
+   *
+   * @return boost::filesystem::path
+   */
+  boost::filesystem::path GetInfoDimensionPath(const RapidjsonValue& aInfo);
+
   /**
    * Rolls up the internal metric data into the fields element of the provided 
    * message. The metrics are reset after each call. 
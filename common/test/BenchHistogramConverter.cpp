@@ -0,0 +1,229 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Microbenchmarks of the histogram conversion inner loops; run by hand, not part
+of the test suite. Usage: BenchHistogramConverter [iterations]
+ */
+
+#include "TestConfig.h"
+#include "../HistogramConverter.h"
+#include "../HistogramKernels.h"
+#include "../JsonScanner.h"
+#include "../TelemetryRecord.h"
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace mozilla::telemetry;
+
+typedef chrono::steady_clock Clock;
+
+////////////////////////////////////////////////////////////////////////////////
+static double Elapsed(Clock::time_point aStart)
+{
+  return chrono::duration<double>(Clock::now() - aStart).count();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void Report(const char* aName, double aSeconds, double aOps,
+                   const char* aUnit, long aChecksum)
+{
+  cout << aName << ": " << aSeconds * 1e9 / aOps << " ns/" << aUnit
+    << " (checksum " << aChecksum << ")" << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Every bucket lower bound of a specification, as member names
+static vector<string> LoadKeys()
+{
+  ifstream ifs((kDataPath + "cache/ad0ae007aa9e.json").c_str());
+  string json((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+  RapidjsonDocument doc;
+  doc.Parse<0>(json.c_str());
+  vector<string> keys;
+  const RapidjsonValue& h = doc["histograms"];
+  for (RapidjsonValue::ConstMemberIterator it = h.MemberBegin();
+       it != h.MemberEnd(); ++it) {
+    const RapidjsonValue& b = it->value["buckets"];
+    for (rapidjson::SizeType i = 0; i < b.Size(); ++i) {
+      keys.push_back(to_string(b[i].GetInt()));
+    }
+  }
+  return keys;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void BenchKeys(int aIterations)
+{
+  vector<string> keys = LoadKeys();
+  double ops = static_cast<double>(keys.size()) * aIterations;
+
+  long sum = 0;
+  Clock::time_point start = Clock::now();
+  for (int n = 0; n < aIterations; ++n) {
+    for (auto& k : keys) sum += strtol(k.c_str(), nullptr, 10);
+  }
+  Report("key strtol", Elapsed(start), ops, "key", sum);
+
+  sum = 0;
+  start = Clock::now();
+  for (int n = 0; n < aIterations; ++n) {
+    for (auto& k : keys) sum += ParseLong(k.c_str(), k.size());
+  }
+  Report("key ParseLong", Elapsed(start), ops, "key", sum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void BenchCounters(int aIterations)
+{
+  // bucket counts of the histograms in a typical payload
+  const int counts[] = { 3, 3, 20, 50, 100, 21, 10, 70, 3, 30 };
+  const int kCounts = sizeof(counts) / sizeof(counts[0]);
+  double ops = static_cast<double>(kCounts) * aIterations * 100;
+
+  long sum = 0;
+  Clock::time_point start = Clock::now();
+  for (int n = 0; n < aIterations * 100; ++n) {
+    for (int i = 0; i < kCounts; ++i) {
+      vector<int> rewrite(counts[i]);
+      rewrite[n % counts[i]] = n;
+      sum += rewrite[i % counts[i]];
+    }
+  }
+  Report("counters vector", Elapsed(start), ops, "histogram", sum);
+
+  sum = 0;
+  vector<int> scratch(*max_element(counts, counts + kCounts));
+  start = Clock::now();
+  for (int n = 0; n < aIterations * 100; ++n) {
+    for (int i = 0; i < kCounts; ++i) {
+      int* rewrite = scratch.data();
+      fill_n(rewrite, counts[i], 0);
+      rewrite[n % counts[i]] = n;
+      sum += rewrite[i % counts[i]];
+    }
+  }
+  Report("counters scratch", Elapsed(start), ops, "histogram", sum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void BenchKernels(int aIterations)
+{
+  // as many counts as the specification has buckets, mostly zeros like real
+  // payloads
+  vector<int> counts(LoadKeys().size());
+  for (size_t i = 0; i < counts.size(); ++i) {
+    counts[i] = i % 5 ? 0 : static_cast<int>(i);
+  }
+  vector<int> other(counts);
+  vector<int64_t> sum(counts.size());
+  const int kLength = 50; // a typical exponential histogram
+  double ops = static_cast<double>(counts.size() / kLength) * aIterations * 10;
+
+  vector<const HistogramKernels*> kernels = GetSupportedHistogramKernels();
+  for (auto kit = kernels.begin(); kit != kernels.end(); ++kit) {
+    const HistogramKernels& k = **kit;
+    string prefix = string(k.mName) + " ";
+    fill(sum.begin(), sum.end(), 0);
+    long checksum = 0;
+    Clock::time_point start = Clock::now();
+    for (int n = 0; n < aIterations * 10; ++n) {
+      for (size_t i = 0; i + kLength <= counts.size(); i += kLength) {
+        k.mAddCounts(sum.data() + i, counts.data() + i, kLength);
+      }
+    }
+    checksum = static_cast<long>(sum[kLength]);
+    Report((prefix + "add").c_str(), Elapsed(start), ops, "histogram",
+           checksum);
+
+    checksum = 0;
+    start = Clock::now();
+    for (int n = 0; n < aIterations * 10; ++n) {
+      for (size_t i = 0; i + kLength <= counts.size(); i += kLength) {
+        checksum += k.mCountsEqual(counts.data() + i, other.data() + i,
+                                   kLength);
+      }
+    }
+    Report((prefix + "equal").c_str(), Elapsed(start), ops, "histogram",
+           checksum);
+
+    checksum = 0;
+    start = Clock::now();
+    for (int n = 0; n < aIterations * 10; ++n) {
+      for (size_t i = 0; i + kLength <= counts.size(); i += kLength) {
+        checksum += k.mCountNonZero(counts.data() + i, kLength);
+      }
+    }
+    Report((prefix + "non zero").c_str(), Elapsed(start), ops, "histogram",
+           checksum);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void BenchConvert(int aIterations)
+{
+  ifstream file((kDataPath + "telemetry1.log").c_str(), ios_base::binary);
+  string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  if (!tr.ReadPayload(pos, end, end)) {
+    cerr << "failed to read the benchmark record" << endl;
+    return;
+  }
+  string payload(tr.GetPayload(), tr.GetPayloadLength());
+  HistogramCache cache("localhost:9898");
+  vector<char> buf(payload.size() + 1);
+  rapidjson::StringBuffer sb;
+  RapidjsonDocument info;
+
+  long sum = 0;
+  Clock::time_point start = Clock::now();
+  for (int n = 0; n < aIterations; ++n) {
+    copy(payload.begin(), payload.end(), buf.begin());
+    buf[payload.size()] = 0;
+    sb.Clear();
+    if (ConvertHistogramData(cache, buf.data(), sb, info)) sum += sb.Size();
+  }
+  Report("convert single pass", Elapsed(start), aIterations, "record", sum);
+
+  sum = 0;
+  start = Clock::now();
+  for (int n = 0; n < aIterations; ++n) {
+    RapidjsonDocument doc;
+    doc.Parse<0>(payload.c_str());
+    if (ConvertHistogramData(cache, doc)) {
+      sb.Clear();
+      rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+      doc.Accept(writer);
+      sum += sb.Size();
+    }
+  }
+  Report("convert DOM", Elapsed(start), aIterations, "record", sum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : 200;
+  BenchKeys(iterations);
+  BenchCounters(iterations);
+  BenchKernels(iterations);
+  BenchConvert(iterations);
+  return 0;
+}
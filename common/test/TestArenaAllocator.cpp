@@ -0,0 +1,67 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestArenaAllocator
+#include <boost/test/unit_test.hpp>
+#include "TestConfig.h"
+#include "../ArenaAllocator.h"
+#include "../Common.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace mozilla::telemetry;
+
+BOOST_AUTO_TEST_CASE(test_malloc)
+{
+  ArenaAllocator a(1024, 4096);
+  char* p = static_cast<char*>(a.Malloc(10));
+  char* q = static_cast<char*>(a.Malloc(10));
+  BOOST_REQUIRE_EQUAL(16, q - p);
+  BOOST_REQUIRE_EQUAL(32, a.Size());
+  BOOST_REQUIRE_EQUAL(1024, a.Capacity());
+}
+
+BOOST_AUTO_TEST_CASE(test_realloc_in_place)
+{
+  ArenaAllocator a(1024, 4096);
+  char* p = static_cast<char*>(a.Malloc(16));
+  memcpy(p, "0123456789abcdef", 16);
+  BOOST_REQUIRE(p == a.Realloc(p, 16, 64));
+  BOOST_REQUIRE_EQUAL(64, a.Size());
+  a.Malloc(8);
+  char* q = static_cast<char*>(a.Realloc(p, 64, 128)); // no longer the top
+  BOOST_REQUIRE(p != q);
+  BOOST_REQUIRE_EQUAL(0, memcmp(q, "0123456789abcdef", 16));
+}
+
+BOOST_AUTO_TEST_CASE(test_reset)
+{
+  ArenaAllocator a(1024, 4096);
+  void* p = a.Malloc(100);
+  for (int i = 0; i < 100; ++i) {
+    a.Malloc(1000);
+  }
+  BOOST_REQUIRE(a.Capacity() > 4096);
+  a.Reset();
+  BOOST_REQUIRE(a.Capacity() <= 4096);
+  BOOST_REQUIRE_EQUAL(0, a.Size());
+  BOOST_REQUIRE(p == a.Malloc(100)); // memory is reused
+}
+
+BOOST_AUTO_TEST_CASE(test_document)
+{
+  ArenaAllocator a(1024, 4096);
+  for (int i = 0; i < 3; ++i) {
+    RapidjsonDocument d(&a);
+    d.Parse<0>("{\"a\":[1,2,3],\"b\":\"str\"}");
+    BOOST_REQUIRE(!d.HasParseError());
+    d["a"].PushBack(4, d.GetAllocator());
+    BOOST_REQUIRE_EQUAL(4, d["a"].Size());
+    BOOST_REQUIRE_EQUAL(string("str"), d["b"].GetString());
+    a.Reset();
+  }
+}
@@ -0,0 +1,69 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestAsyncReadBuffer
+#include <boost/test/unit_test.hpp>
+#include "TestConfig.h"
+#include "../AsyncReadBuffer.h"
+#include "../TelemetryRecord.h"
+
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+using namespace std;
+using namespace mozilla::telemetry;
+namespace fs = boost::filesystem;
+
+BOOST_AUTO_TEST_CASE(test_read)
+{
+  string fn(kDataPath + "telemetry1.log");
+  ifstream ifs(fn.c_str(), ios_base::binary);
+  string expected((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+
+  // chunk sizes smaller than, dividing and larger than the file
+  size_t sizes[] = { 1000, expected.size() / 4, expected.size() * 2 };
+  for (int i = 0; i < 3; ++i) {
+    AsyncReadBuffer buf(fn, sizes[i]);
+    istream input(&buf);
+    string actual((istreambuf_iterator<char>(input)),
+                  istreambuf_iterator<char>());
+    BOOST_REQUIRE(expected == actual);
+    BOOST_REQUIRE(buf.GetError().empty());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_record)
+{
+  AsyncReadBuffer buf(kDataPath + "telemetry1.log", 4096);
+  istream input(&buf);
+  TelemetryRecord tr;
+  BOOST_REQUIRE_EQUAL(true, tr.Read(input));
+  BOOST_REQUIRE(tr.GetDocument()["histograms"].IsObject());
+  BOOST_REQUIRE_EQUAL(false, tr.Read(input));
+}
+
+BOOST_AUTO_TEST_CASE(test_empty)
+{
+  fs::path fn = fs::temp_directory_path() / "TestAsyncReadBuffer.empty";
+  ofstream(fn.c_str()).close();
+  {
+    AsyncReadBuffer buf(fn);
+    istream input(&buf);
+    BOOST_REQUIRE_EQUAL(istream::traits_type::eof(), input.get());
+  }
+  fs::remove(fn);
+  BOOST_REQUIRE_THROW(AsyncReadBuffer buf(fn), runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_early_destruction)
+{
+  // the I/O thread must stop while blocked on a full buffer
+  AsyncReadBuffer buf(kDataPath + "telemetry1.log", 16);
+  istream input(&buf);
+  BOOST_REQUIRE_EQUAL('\x1e', input.get());
+}
@@ -0,0 +1,82 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestBinaryFile
+#include <boost/test/unit_test.hpp>
+#include "../BinaryFile.h"
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+using namespace mozilla::telemetry;
+namespace fs = boost::filesystem;
+
+static const char kMagic[4] = { 'T', 'E', 'S', 'T' };
+
+static string ReadFile(const fs::path& aName)
+{
+  ifstream ifs(aName.c_str(), ios_base::binary);
+  return string((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+}
+
+static size_t CountTemporaries(const fs::path& aName)
+{
+  size_t count = 0;
+  string prefix = aName.filename().string() + ".";
+  for (fs::directory_iterator it(aName.parent_path()), end; it != end; ++it) {
+    if (it->path().filename().string().find(prefix) == 0) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+BOOST_AUTO_TEST_CASE(test_header)
+{
+  BinaryHeader h = MakeBinaryHeader(kMagic, 3, 0xdeadbeef);
+  BOOST_REQUIRE_EQUAL(0xdeadbeefu, h.mChecksum);
+  CheckBinaryHeader(h, kMagic, 3, "test file");
+
+  BOOST_REQUIRE_THROW(CheckBinaryHeader(h, "TIDX", 3, "test file"),
+                      runtime_error);
+  BOOST_REQUIRE_THROW(CheckBinaryHeader(h, kMagic, 2, "test file"),
+                      runtime_error);
+  h.mMagic[0] = 'X';
+  BOOST_REQUIRE_THROW(CheckBinaryHeader(h, kMagic, 3, "test file"),
+                      runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_foreign_byte_order)
+{
+  BinaryHeader h = MakeBinaryHeader(kMagic, 1, 0);
+  h.mByteOrder = __builtin_bswap32(h.mByteOrder);
+  BOOST_REQUIRE_THROW(CheckBinaryHeader(h, kMagic, 1, "test file"),
+                      runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_write)
+{
+  fs::path fn = fs::temp_directory_path() / "TestBinaryFile.bin";
+  WriteBinaryFile(fn, [](ostream& aOutput) { aOutput << "first"; });
+  BOOST_REQUIRE_EQUAL("first", ReadFile(fn));
+  BOOST_REQUIRE_EQUAL(0u, CountTemporaries(fn));
+
+  // a failed write keeps the previous file and cleans up after itself
+  BOOST_REQUIRE_THROW(WriteBinaryFile(fn, [](ostream& aOutput) {
+    aOutput << "partial";
+    throw runtime_error("write failed");
+  }), runtime_error);
+  BOOST_REQUIRE_EQUAL("first", ReadFile(fn));
+  BOOST_REQUIRE_EQUAL(0u, CountTemporaries(fn));
+
+  WriteBinaryFile(fn, [](ostream& aOutput) { aOutput << "second"; });
+  BOOST_REQUIRE_EQUAL("second", ReadFile(fn));
+  remove(fn);
+}
@@ -0,0 +1,178 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestColumnarBlock
+#include <boost/test/unit_test.hpp>
+#include "TestConfig.h"
+#include "../ColumnarBlock.h"
+#include "../HistogramConverter.h"
+#include "../TelemetryRecord.h"
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace mozilla::telemetry;
+
+static const char* kRevision = "http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302";
+
+static string Serialize(const RapidjsonValue& aValue)
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  writer.StartArray();
+  aValue.Accept(writer);
+  writer.EndArray();
+  return string(sb.GetString() + 1, sb.Size() - 2);
+}
+
+static vector<ColumnarBlock::Row> RoundTrip(const ColumnarBlock& aBlock)
+{
+  ostringstream oss;
+  aBlock.Write(oss);
+  string data = oss.str();
+  BOOST_REQUIRE_EQUAL(aBlock.GetSize(), data.size());
+  vector<ColumnarBlock::Row> rows;
+  ColumnarBlock::Read(data.data(), data.size(), rows);
+  BOOST_REQUIRE_EQUAL(aBlock.GetRowCount(), rows.size());
+  return rows;
+}
+
+BOOST_AUTO_TEST_CASE(test_round_trip)
+{
+  ifstream file((kDataPath + "telemetry1.log").c_str(), ios_base::binary);
+  string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  HistogramCache cache("localhost:9898");
+  TelemetryRecord tr;
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  BOOST_REQUIRE(tr.Read(pos, end));
+  RapidjsonDocument& doc = tr.GetDocument();
+  BOOST_REQUIRE(ConvertHistogramData(cache, doc));
+  shared_ptr<HistogramSpecification> spec =
+    cache.FindHistogram(doc["info"]["revision"].GetString());
+  BOOST_REQUIRE(spec);
+
+  ColumnarBlock block;
+  size_t size = block.GetSize();
+  size_t added = block.Append("uuid1", 5, tr.GetTimestamp(), doc, *spec);
+  BOOST_REQUIRE_EQUAL(size + added, block.GetSize());
+  block.Append("uuid2", 5, tr.GetTimestamp() - 7, doc, *spec);
+  vector<ColumnarBlock::Row> rows = RoundTrip(block);
+
+  BOOST_REQUIRE_EQUAL("uuid1", rows[0].mUuid);
+  BOOST_REQUIRE_EQUAL("uuid2", rows[1].mUuid);
+  BOOST_REQUIRE_EQUAL(tr.GetTimestamp(), rows[0].mTimestamp);
+  BOOST_REQUIRE_EQUAL(tr.GetTimestamp() - 7, rows[1].mTimestamp);
+  BOOST_REQUIRE_EQUAL(spec->GetHash(), rows[1].mSpecHash);
+
+  const RapidjsonValue& info = doc["info"];
+  BOOST_REQUIRE_EQUAL(info.MemberEnd() - info.MemberBegin(),
+                      rows[1].mInfo.size());
+  for (auto it = rows[1].mInfo.begin(); it != rows[1].mInfo.end(); ++it) {
+    BOOST_REQUIRE_EQUAL(Serialize(info[it->first.c_str()]), it->second);
+  }
+
+  const RapidjsonValue& h = doc["histograms"];
+  BOOST_REQUIRE(!rows[1].mHistograms.empty());
+  BOOST_REQUIRE_EQUAL(rows[0].mHistograms.size(), rows[1].mHistograms.size());
+  for (auto it = rows[1].mHistograms.begin(); it != rows[1].mHistograms.end();
+       ++it) {
+    const RapidjsonValue& v = h[it->mName.c_str()];
+    BOOST_REQUIRE_MESSAGE(v.IsArray(), it->mName);
+    uint32_t id;
+    BOOST_REQUIRE(spec->GetDefinition(it->mName.c_str(), id));
+    BOOST_REQUIRE_EQUAL(id, it->mDefinition);
+    BOOST_REQUIRE_EQUAL(v.Size(), it->mCounts.size() + it->mSummary.size());
+    rapidjson::SizeType i = 0;
+    for (auto cit = it->mCounts.begin(); cit != it->mCounts.end(); ++cit) {
+      BOOST_REQUIRE_EQUAL(v[i++].GetInt(), *cit);
+    }
+    for (auto sit = it->mSummary.begin(); sit != it->mSummary.end(); ++sit) {
+      BOOST_REQUIRE_EQUAL(v[i++].GetDouble(), *sit);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_sparse_and_missing)
+{
+  HistogramCache cache("localhost:9898");
+  shared_ptr<HistogramSpecification> spec = cache.FindHistogram(kRevision);
+  BOOST_REQUIRE(spec);
+  const char* docs[] = {
+    "{\"ver\":3,\"info\":{\"revision\":\"r\",\"OS\":\"Linux\"},\"histograms\":{\"CYCLE_COLLECTOR\":[[0,2,12,5],85,-1,-1,1.5,-1],\"UNKNOWN\":[1,2]}}",
+    "{\"ver\":3,\"info\":{\"revision\":\"r\",\"appName\":\"Firefox\"},\"histograms\":{\"A11Y_IATABLE_USAGE_FLAG\":[1,0,0,0,-1,-1,-1,-1]}}",
+    "{\"ver\":3,\"info\":{\"OS\":\"Linux\"},\"histograms\":{\"CYCLE_COLLECTOR\":[[],0,-1,-1,-1,-1],\"A11Y_IATABLE_USAGE_FLAG\":{\"values\":{}}}}",
+    nullptr
+  };
+  ColumnarBlock block;
+  for (int i = 0; docs[i] != nullptr; ++i) {
+    RapidjsonDocument d;
+    d.Parse<0>(docs[i]);
+    BOOST_REQUIRE(!d.HasParseError());
+    block.Append("u", 1, 100 + i, d, *spec);
+  }
+  vector<ColumnarBlock::Row> rows = RoundTrip(block);
+
+  BOOST_REQUIRE_EQUAL(2u, rows[0].mInfo.size());
+  BOOST_REQUIRE_EQUAL("OS", rows[0].mInfo[1].first);
+  BOOST_REQUIRE_EQUAL("\"Linux\"", rows[0].mInfo[1].second);
+  BOOST_REQUIRE_EQUAL(2u, rows[1].mInfo.size());
+  BOOST_REQUIRE_EQUAL("\"Firefox\"", rows[1].mInfo[1].second);
+  BOOST_REQUIRE_EQUAL(1u, rows[2].mInfo.size());
+  BOOST_REQUIRE_EQUAL("\"Linux\"", rows[2].mInfo[0].second);
+  BOOST_REQUIRE_EQUAL(102u, rows[2].mTimestamp);
+
+  // unknown and unconverted histograms are dropped
+  BOOST_REQUIRE_EQUAL(1u, rows[0].mHistograms.size());
+  const ColumnarBlock::Histogram& cc = rows[0].mHistograms[0];
+  BOOST_REQUIRE_EQUAL("CYCLE_COLLECTOR", cc.mName);
+  BOOST_REQUIRE_EQUAL(50u, cc.mCounts.size());
+  BOOST_REQUIRE_EQUAL(2, cc.mCounts[0]);
+  BOOST_REQUIRE_EQUAL(5, cc.mCounts[12]);
+  BOOST_REQUIRE_EQUAL(0, cc.mCounts[1]);
+  BOOST_REQUIRE_EQUAL(85, cc.mSummary[0]);
+  BOOST_REQUIRE_EQUAL(1.5, cc.mSummary[3]);
+  BOOST_REQUIRE_EQUAL(1u, rows[1].mHistograms.size());
+  BOOST_REQUIRE_EQUAL(1, rows[1].mHistograms[0].mCounts[0]);
+  BOOST_REQUIRE_EQUAL(1u, rows[2].mHistograms.size());
+  BOOST_REQUIRE_EQUAL(0, rows[2].mHistograms[0].mCounts[0]);
+
+  block.Clear();
+  BOOST_REQUIRE(RoundTrip(block).empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_invalid)
+{
+  HistogramCache cache("localhost:9898");
+  shared_ptr<HistogramSpecification> spec = cache.FindHistogram(kRevision);
+  BOOST_REQUIRE(spec);
+  RapidjsonDocument d;
+  d.Parse<0>("{\"info\":{\"OS\":\"Linux\"},\"histograms\":{\"CYCLE_COLLECTOR\":[[0,2],1,2,3,4,5]}}");
+  ColumnarBlock block;
+  block.Append("uuid", 4, 1, d, *spec);
+  ostringstream oss;
+  block.Write(oss);
+  string data = oss.str();
+
+  vector<ColumnarBlock::Row> rows;
+  for (size_t i = 0; i < data.size(); ++i) {
+    BOOST_CHECK_THROW(ColumnarBlock::Read(data.data(), i, rows),
+                      runtime_error);
+  }
+  data += "x";
+  BOOST_CHECK_THROW(ColumnarBlock::Read(data.data(), data.size(), rows),
+                    runtime_error);
+  data[0] = 'X';
+  BOOST_CHECK_THROW(ColumnarBlock::Read(data.data(), data.size(), rows),
+                    runtime_error);
+}
@@ -0,0 +1,37 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestCrc32c
+#include <boost/test/unit_test.hpp>
+#include "../Crc32c.h"
+
+#include <string>
+
+using namespace std;
+using namespace mozilla::telemetry;
+
+BOOST_AUTO_TEST_CASE(test_check_value)
+{
+  BOOST_REQUIRE_EQUAL(0u, Crc32c(0, "", 0));
+  BOOST_REQUIRE_EQUAL(0xe3069283u, Crc32c(0, "123456789", 9));
+  string zeros(32, 0);
+  BOOST_REQUIRE_EQUAL(0x8a9136aau, Crc32c(0, zeros.data(), zeros.size()));
+}
+
+BOOST_AUTO_TEST_CASE(test_incremental)
+{
+  string data;
+  for (int i = 0; i < 1000; ++i) {
+    data.push_back(static_cast<char>(i * 31));
+  }
+  uint32_t expected = Crc32c(0, data.data(), data.size());
+  // every split point and alignment must give the same result
+  for (size_t i = 0; i < 24; ++i) {
+    uint32_t crc = Crc32c(0, data.data(), i);
+    BOOST_REQUIRE_EQUAL(expected, Crc32c(crc, data.data() + i,
+                                         data.size() - i));
+  }
+}
@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestDuplicateFilter
+#include <boost/test/unit_test.hpp>
+#include "TestConfig.h"
+#include "../DuplicateFilter.h"
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <string>
+
+using namespace std;
+using namespace mozilla::telemetry;
+namespace fs = boost::filesystem;
+
+static bool IsDuplicate(DuplicateFilter& aFilter, const string& aKey,
+                        uint64_t aTimestamp = 0)
+{
+  return aFilter.IsDuplicate(aKey.data(), aKey.size(), aTimestamp);
+}
+
+static string Key(int aIndex)
+{
+  return "4a1c9b6e-0f3d-4e52-9a7b-" + to_string(100000000000LL + aIndex);
+}
+
+BOOST_AUTO_TEST_CASE(test_duplicates)
+{
+  DuplicateFilter df(1024 * 1024, 0);
+  BOOST_REQUIRE_EQUAL(262144, df.GetCapacity());
+  for (int i = 0; i < 10000; ++i) {
+    BOOST_REQUIRE_EQUAL(false, IsDuplicate(df, Key(i)));
+  }
+  for (int i = 0; i < 10000; ++i) {
+    BOOST_REQUIRE_EQUAL(true, IsDuplicate(df, Key(i)));
+  }
+  // the check alone does not record the key
+  string key = Key(10000);
+  BOOST_REQUIRE_EQUAL(false, df.WasSeen(key.data(), key.size()));
+  BOOST_REQUIRE_EQUAL(false, df.WasSeen(key.data(), key.size()));
+  key = Key(0);
+  BOOST_REQUIRE_EQUAL(true, df.WasSeen(key.data(), key.size()));
+}
+
+BOOST_AUTO_TEST_CASE(test_false_positives)
+{
+  DuplicateFilter df(64 * 1024, 0);
+  size_t capacity = df.GetCapacity();
+  for (size_t i = 0; i < capacity; ++i) {
+    IsDuplicate(df, Key(i));
+  }
+  // the generation is full, the next key rotates it so both generations are
+  // queried
+  int fp = 0;
+  for (size_t i = capacity; i < capacity * 2; ++i) {
+    if (IsDuplicate(df, Key(i))) ++fp;
+  }
+  BOOST_REQUIRE_LT(fp, static_cast<int>(capacity / 100));
+}
+
+BOOST_AUTO_TEST_CASE(test_rotation_window)
+{
+  DuplicateFilter df(4096, 100);
+  BOOST_REQUIRE_EQUAL(false, IsDuplicate(df, "a", 1000));
+  BOOST_REQUIRE_EQUAL(true, IsDuplicate(df, "a", 1099));
+  // rotates, "a" is still known from the previous generation and carried
+  // over
+  BOOST_REQUIRE_EQUAL(false, IsDuplicate(df, "b", 1100));
+  BOOST_REQUIRE_EQUAL(true, IsDuplicate(df, "a", 1150));
+  // rotates twice, "b" is forgotten but "a" was refreshed in between
+  BOOST_REQUIRE_EQUAL(false, IsDuplicate(df, "c", 1200));
+  BOOST_REQUIRE_EQUAL(true, IsDuplicate(df, "a", 1250));
+  BOOST_REQUIRE_EQUAL(false, IsDuplicate(df, "d", 1300));
+  BOOST_REQUIRE_EQUAL(false, IsDuplicate(df, "b", 1310));
+  // an older timestamp never rotates
+  BOOST_REQUIRE_EQUAL(true, IsDuplicate(df, "d", 5));
+}
+
+BOOST_AUTO_TEST_CASE(test_save_load)
+{
+  fs::path fn = fs::temp_directory_path() / "TestDuplicateFilter.state";
+  DuplicateFilter df(4096, 100);
+  IsDuplicate(df, "a", 1000);
+  IsDuplicate(df, "b", 1100);
+  df.Save(fn);
+  for (fs::directory_iterator it(fn.parent_path()), end; it != end; ++it) {
+    string name = it->path().filename().string();
+    BOOST_REQUIRE_MESSAGE(name.find("TestDuplicateFilter.state.") != 0,
+                          "temporary file left behind: " << name);
+  }
+
+  DuplicateFilter restored(4096, 100);
+  restored.Load(fn);
+  BOOST_REQUIRE_EQUAL(true, IsDuplicate(restored, "a", 1150));
+  BOOST_REQUIRE_EQUAL(true, IsDuplicate(restored, "b", 1150));
+  BOOST_REQUIRE_EQUAL(false, IsDuplicate(restored, "c", 1150));
+  // the generation started at 1100 rotates at 1200
+  BOOST_REQUIRE_EQUAL(true, IsDuplicate(restored, "b", 1200));
+
+  DuplicateFilter other(8192, 100);
+  BOOST_REQUIRE_THROW(other.Load(fn), exception);
+
+  {
+    ofstream ofs(fn.c_str(), ios_base::binary | ios_base::trunc);
+    ofs << "TDUP";
+  }
+  BOOST_REQUIRE_THROW(restored.Load(fn), exception);
+
+  // a state written with the other byte order
+  df.Save(fn);
+  {
+    fstream f(fn.c_str(), ios_base::binary | ios_base::in | ios_base::out);
+    f.seekp(4);
+    f.write("\x01\x02\x03\x04", 4);
+  }
+  BOOST_REQUIRE_THROW(restored.Load(fn), exception);
+  remove(fn);
+}
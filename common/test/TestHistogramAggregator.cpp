@@ -0,0 +1,61 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestHistogramAggregator
+#include <boost/test/unit_test.hpp>
+#include "TestConfig.h"
+#include "../HistogramAggregator.h"
+#include "../HistogramCache.h"
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+using namespace std;
+using namespace mozilla::telemetry;
+
+static void Add(HistogramAggregator& aAgg, const char* aPath,
+                const char* aJson, const HistogramSpecification& aSpec)
+{
+  RapidjsonDocument d;
+  d.Parse<0>(aJson);
+  BOOST_REQUIRE(!d.HasParseError());
+  aAgg.Add(aPath, d, aSpec);
+}
+
+BOOST_AUTO_TEST_CASE(test_aggregate)
+{
+  HistogramCache cache("localhost:9898");
+  shared_ptr<HistogramSpecification> spec =
+    cache.FindHistogram("http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302");
+  BOOST_REQUIRE(spec);
+
+  HistogramAggregator agg;
+  Add(agg, "b", "{\"histograms\":{\"A11Y_IATABLE_USAGE_FLAG\":[1,0,0,0,-1,-1,-1,-1]}}", *spec);
+  Add(agg, "a", "{\"histograms\":{\"A11Y_IATABLE_USAGE_FLAG\":[1,0,0,2,-1,-1,0.25,-1]}}", *spec);
+  Add(agg, "a", "{\"histograms\":{\"A11Y_IATABLE_USAGE_FLAG\":[[1,3],5,-1,-1,0.5,-1],\"UNKNOWN\":[1,2]}}", *spec);
+  Add(agg, "a", "{\"histograms\":{\"A11Y_IATABLE_USAGE_FLAG\":{\"values\":{}}}}", *spec);
+  BOOST_REQUIRE_EQUAL(2u, agg.GetPartitionCount());
+  BOOST_REQUIRE(agg.HasPartition("a"));
+  BOOST_REQUIRE(!agg.HasPartition("c"));
+
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx",
+           static_cast<unsigned long long>(spec->GetHash()));
+  string prefix = string("\t{\"spec\":\"") + hash + "\",\"records\":";
+  stringstream expected;
+  expected << "a" << prefix << "3,\"histograms\":{\"A11Y_IATABLE_USAGE_FLAG\":[1,3,0,7,-1,-1,0.75,-1]}}\n"
+    << "b" << prefix << "1,\"histograms\":{\"A11Y_IATABLE_USAGE_FLAG\":[1,0,0,0,-1,-1,-1,-1]}}\n";
+  stringstream ss;
+  agg.Write(ss);
+  BOOST_REQUIRE_EQUAL(expected.str(), ss.str());
+
+  agg.Clear();
+  BOOST_REQUIRE_EQUAL(0u, agg.GetPartitionCount());
+  ss.str("");
+  agg.Write(ss);
+  BOOST_REQUIRE_EQUAL("", ss.str());
+}
@@ -9,6 +9,10 @@
 #include "TestConfig.h"
 #include "../HistogramCache.h"
 
+#include <fstream>
+#include <thread>
+#include <vector>
+
 using namespace std;
 using namespace mozilla::telemetry;
 
@@ -26,9 +30,88 @@ BOOST_AUTO_TEST_CASE(test_unknown_revision)
   BOOST_REQUIRE(!h);
 }
 
+BOOST_AUTO_TEST_CASE(test_concurrent)
+{
+  const char* revision =
+    "http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302";
+  HistogramCache cache("localhost:9898");
+  vector<shared_ptr<HistogramSpecification> > found(8);
+  vector<thread> threads;
+  for (size_t i = 0; i < found.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      found[i] = cache.FindHistogram(revision);
+    });
+  }
+  for (auto it = threads.begin(); it != threads.end(); ++it) {
+    it->join();
+  }
+  for (size_t i = 0; i < found.size(); ++i) {
+    BOOST_REQUIRE(found[i]);
+    BOOST_REQUIRE(found[i].get() == found[0].get());
+  }
+  // the revision is loaded once, the other threads wait for it
+  message::Message msg;
+  cache.GetMetrics(msg);
+  for (int i = 0; i < msg.fields_size(); ++i) {
+    if (msg.fields(i).name() == "Cache Misses") {
+      BOOST_REQUIRE_EQUAL(1, msg.fields(i).value_double(0));
+    } else if (msg.fields(i).name() == "Cache Hits") {
+      BOOST_REQUIRE_EQUAL(7, msg.fields(i).value_double(0));
+    }
+  }
+}
+
 BOOST_AUTO_TEST_CASE(test_invalid_revision)
 {
   HistogramCache cache("localhost:9898");
   auto h = cache.FindHistogram("missing");
   BOOST_REQUIRE(!h);
 }
+
+BOOST_AUTO_TEST_CASE(test_snapshot)
+{
+  namespace fs = boost::filesystem;
+  const char* revision =
+    "http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302";
+  fs::path snapshot = fs::temp_directory_path()
+    / "http:--hg.mozilla.org-releases-mozilla-release-rev-a55c55edf302.spec";
+  fs::remove(snapshot);
+
+  uint64_t hash;
+  {
+    HistogramCache cache("localhost:9898");
+    auto h = cache.FindHistogram(revision);
+    BOOST_REQUIRE(h);
+    hash = h->GetHash();
+    BOOST_REQUIRE(fs::exists(snapshot));
+  }
+  {
+    HistogramCache cache("localhost:9898");
+    auto h = cache.FindHistogram(revision);
+    BOOST_REQUIRE(h);
+    BOOST_REQUIRE_EQUAL(hash, h->GetHash());
+    BOOST_REQUIRE(h->GetDefinition("CYCLE_COLLECTOR"));
+
+    // another revision with the same content maps to the cached specification
+    fs::path copy = fs::temp_directory_path()
+      / "http:--hg.mozilla.org-releases-mozilla-release-rev-0000000000000.spec";
+    fs::copy_file(snapshot, copy, fs::copy_option::overwrite_if_exists);
+    auto c = cache.FindHistogram(
+      "http://hg.mozilla.org/releases/mozilla-release/rev/0000000000000");
+    fs::remove(copy);
+    BOOST_REQUIRE(c.get() == h.get());
+  }
+
+  // a damaged snapshot falls back to the JSON and is rewritten
+  {
+    ofstream ofs(snapshot.c_str(), ios_base::binary | ios_base::trunc);
+    ofs << "THSS garbage";
+  }
+  {
+    HistogramCache cache("localhost:9898");
+    auto h = cache.FindHistogram(revision);
+    BOOST_REQUIRE(h);
+    BOOST_REQUIRE_EQUAL(hash, h->GetHash());
+    BOOST_REQUIRE(fs::file_size(snapshot) > 100);
+  }
+}
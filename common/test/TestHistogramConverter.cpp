@@ -8,11 +8,21 @@
 #include <boost/test/unit_test.hpp>
 #include "TestConfig.h"
 #include "../HistogramConverter.h"
+#include "../JsonScanner.h"
+#include "../TelemetryRecord.h"
 
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
 using namespace std;
 using namespace mozilla::telemetry;
 
@@ -33,3 +43,198 @@ BOOST_AUTO_TEST_CASE(test_converter)
   d.Accept(writer);
   BOOST_REQUIRE_EQUAL(conv, sb.GetString());
 }
+
+static string Convert(HistogramCache& aCache, string aJson,
+                      HistogramEncoding aEncoding = kDenseHistograms)
+{
+  rapidjson::StringBuffer sb;
+  RapidjsonDocument info;
+  if (!ConvertHistogramData(aCache, &aJson[0], sb, info, aEncoding)) {
+    return ""; // the partial output is discarded
+  }
+  BOOST_REQUIRE(info.IsObject());
+  return sb.GetString();
+}
+
+BOOST_AUTO_TEST_CASE(test_single_pass)
+{
+  HistogramCache cache("localhost:9898");
+  // the histograms preceding info keep their position
+  string hist = "{\"ver\":1,\"histograms\":{\"A11Y_IATABLE_USAGE_FLAG\":{\"range\":[1,2],\"bucket_count\":3,\"histogram_type\":3,\"values\":{\"0\":1,\"1\":0},\"sum\":0,\"sum_squares_lo\":1.23415,\"sum_squares_hi\":1.01}},\"info\":{\"revision\":\"http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302\"}}";
+  string conv = "{\"ver\":2,\"histograms\":{\"A11Y_IATABLE_USAGE_FLAG\":[1,0,0,0,-1,-1,1.23415,1.01]},\"info\":{\"revision\":\"http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302\"}}";
+  BOOST_REQUIRE_EQUAL(conv, Convert(cache, hist));
+
+  // other members and unknown histograms are copied verbatim
+  hist = "{ \"info\" : {\"revision\":\"http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302\", \"x\" : 1.50}, \"simpleMeasurements\":{\"a\":[1.10, \"}\"]},\"ver\":1,\"histograms\":{\"UNKNOWN\":{\"values\":{\"7\":1}},\"A11Y_IATABLE_USAGE_FLAG\":{\"values\":{\"1\":3}}} }";
+  conv = "{\"info\":{\"revision\":\"http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302\", \"x\" : 1.50},\"simpleMeasurements\":{\"a\":[1.10, \"}\"]},\"ver\":2,\"histograms\":{\"UNKNOWN\":{\"values\":{\"7\":1}},\"A11Y_IATABLE_USAGE_FLAG\":[0,3,0,-1,-1,-1,-1,-1]}}";
+  BOOST_REQUIRE_EQUAL(conv, Convert(cache, hist));
+}
+
+BOOST_AUTO_TEST_CASE(test_single_pass_invalid)
+{
+  HistogramCache cache("localhost:9898");
+  string info = "\"info\":{\"revision\":\"http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302\"}";
+  string valid = "{\"A11Y_IATABLE_USAGE_FLAG\":{\"values\":{\"0\":1}}}";
+  BOOST_REQUIRE_NE("", Convert(cache, "{\"ver\":1,\"histograms\":" + valid
+                               + "," + info + "}"));
+  BOOST_REQUIRE_EQUAL("", Convert(cache, "{\"ver\":2,\"histograms\":" + valid
+                                  + "," + info + "}"));
+  BOOST_REQUIRE_EQUAL("", Convert(cache, "{\"ver\":1," + info + "}"));
+  BOOST_REQUIRE_EQUAL("", Convert(cache, "{\"ver\":1,\"histograms\":" + valid
+                                  + "}"));
+  BOOST_REQUIRE_EQUAL("", Convert(cache, "{\"ver\":1,\"histograms\":" + valid
+                                  + "," + info + "} x"));
+  BOOST_REQUIRE_EQUAL("", Convert(cache, "{\"ver\":1,\"histograms\":" + valid
+                                  + ",\"info\":{\"revision\":\"unknown\"}}"));
+
+  const char* histograms[] = {
+    "{\"A11Y_IATABLE_USAGE_FLAG\":{\"values\":{\"5\":1}}}",   // bad bound
+    "{\"A11Y_IATABLE_USAGE_FLAG\":{\"values\":{\"0\":1.5}}}", // not an int
+    "{\"A11Y_IATABLE_USAGE_FLAG\":{\"values\":[1]}}",
+    "{\"A11Y_IATABLE_USAGE_FLAG\":{\"sum\":1}}",
+    "{\"A11Y_IATABLE_USAGE_FLAG\":{\"values\":{\"0\":1}}",
+    "{\"A11Y_IATABLE_USAGE_FLAG\":{\"values\":{\"0\":}}}",
+    // unknown histograms are copied, but only once validated
+    "{\"UNKNOWN\":{\"values\":tru}}",
+    "{\"UNKNOWN\":{\"values\":1x}}",
+    "{\"UNKNOWN\":[1 2]}",
+    nullptr
+  };
+  for (int i = 0; histograms[i] != nullptr; ++i) {
+    BOOST_REQUIRE_EQUAL("", Convert(cache, "{\"ver\":1," + info
+                                    + ",\"histograms\":" + histograms[i]
+                                    + "}"));
+  }
+
+  // the other members are copied verbatim, invalid scalars are rejected
+  const char* members[] = { "tru", "1x", "[1 2]", "{\"b\" 1}", nullptr };
+  for (int i = 0; members[i] != nullptr; ++i) {
+    BOOST_REQUIRE_EQUAL("", Convert(cache, "{\"ver\":1," + info
+                                    + ",\"histograms\":" + valid
+                                    + ",\"a\":" + members[i] + "}"));
+  }
+  BOOST_REQUIRE_NE("", Convert(cache, "{\"ver\":1," + info
+                               + ",\"histograms\":" + valid
+                               + ",\"a\":[1,true,-2.5e3,\"x\"]}"));
+}
+
+static string Serialize(const RapidjsonValue& aValue)
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  aValue.Accept(writer);
+  return sb.GetString();
+}
+
+BOOST_AUTO_TEST_CASE(test_single_pass_matches_dom)
+{
+  ifstream file((kDataPath + "telemetry1.log").c_str(), ios_base::binary);
+  string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  HistogramCache cache("localhost:9898");
+
+  TelemetryRecord tr;
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  BOOST_REQUIRE(tr.Read(pos, end));
+  RapidjsonDocument& dom = tr.GetDocument();
+  BOOST_REQUIRE(ConvertHistogramData(cache, dom));
+  // the DOM lives in the scratch buffer reused by the next read
+  string expectedInfo = Serialize(dom["info"]);
+  vector<pair<string, string>> expected;
+  const RapidjsonValue& h = dom["histograms"];
+  for (RapidjsonValue::ConstMemberIterator it = h.MemberBegin();
+       it != h.MemberEnd(); ++it) {
+    expected.push_back(make_pair(it->name.GetString(), Serialize(it->value)));
+  }
+  BOOST_REQUIRE(!expected.empty());
+
+  pos = data.data();
+  BOOST_REQUIRE(tr.ReadPayload(pos, end, end));
+  rapidjson::StringBuffer sb;
+  RapidjsonDocument info;
+  BOOST_REQUIRE(ConvertHistogramData(cache, tr.GetPayload(), sb, info));
+  RapidjsonDocument converted;
+  converted.Parse<0>(sb.GetString());
+  BOOST_REQUIRE(!converted.HasParseError());
+
+  BOOST_REQUIRE_EQUAL(2, converted["ver"].GetInt());
+  BOOST_REQUIRE_EQUAL(expectedInfo, Serialize(info));
+  BOOST_REQUIRE_EQUAL(expectedInfo, Serialize(converted["info"]));
+  for (auto it = expected.begin(); it != expected.end(); ++it) {
+    const RapidjsonValue& v = converted["histograms"][it->first.c_str()];
+    BOOST_REQUIRE_MESSAGE(!v.IsNull(), it->first);
+    BOOST_REQUIRE_EQUAL(it->second, Serialize(v));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_sparse)
+{
+  HistogramCache cache("localhost:9898");
+  // CYCLE_COLLECTOR has 50 buckets, two are set; the flag histogram is
+  // shorter dense ("1,0,0," vs "[0,1],")
+  string hist = "{\"info\":{\"revision\":\"http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302\"},\"ver\":1,\"histograms\":{\"CYCLE_COLLECTOR\":{\"values\":{\"0\":2,\"17\":5},\"sum\":85},\"A11Y_IATABLE_USAGE_FLAG\":{\"values\":{\"0\":1},\"sum\":0}}}";
+  string conv = "{\"info\":{\"revision\":\"http://hg.mozilla.org/releases/mozilla-release/rev/a55c55edf302\"},\"ver\":3,\"histograms\":{\"CYCLE_COLLECTOR\":[[0,2,12,5],85,-1,-1,-1,-1],\"A11Y_IATABLE_USAGE_FLAG\":[1,0,0,0,-1,-1,-1,-1]}}";
+
+  RapidjsonDocument d;
+  d.Parse<0>(hist.c_str());
+  BOOST_REQUIRE(!d.HasParseError());
+  BOOST_REQUIRE(ConvertHistogramData(cache, d, kSparseHistograms));
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  d.Accept(writer);
+  BOOST_REQUIRE_EQUAL(conv, sb.GetString());
+
+  BOOST_REQUIRE_EQUAL(conv, Convert(cache, hist, kSparseHistograms));
+
+  // the dense encoding is unchanged
+  string dense = Convert(cache, hist);
+  BOOST_REQUIRE(dense.find(",\"ver\":2,") != string::npos);
+  BOOST_REQUIRE(dense.find("[2,0,0,0,0,0,0,0,0,0,0,0,5,0,") != string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(test_read_histogram_array)
+{
+  const char* arrays[] = {
+    "[1,0,3,0,-1,-1,1.5,-1]",
+    "[[0,1,2,3],0,-1,-1,1.5,-1]",
+    "[1,0,3,0,-1,-1,1.5]",          // short summary
+    "[[0,1,3,3],0,-1,-1,1.5,-1]",   // index past the buckets
+    "[[0,1,2],0,-1,-1,1.5,-1]",     // odd pairs
+    "[1,0.5,3,0,-1,-1,1.5,-1]",     // not an int
+    "{}",
+    nullptr
+  };
+  for (int i = 0; arrays[i] != nullptr; ++i) {
+    RapidjsonDocument d;
+    d.Parse<0>(arrays[i]);
+    BOOST_REQUIRE(!d.HasParseError());
+    int counts[3] = { 9, 9, 9 };
+    double summary[5];
+    bool valid = ReadHistogramArray(d, 3, counts, summary);
+    BOOST_REQUIRE_MESSAGE(valid == (i < 2), arrays[i]);
+    if (!valid) continue;
+    BOOST_REQUIRE_EQUAL(1, counts[0]);
+    BOOST_REQUIRE_EQUAL(0, counts[1]);
+    BOOST_REQUIRE_EQUAL(3, counts[2]);
+    BOOST_REQUIRE_EQUAL(0, summary[0]);
+    BOOST_REQUIRE_EQUAL(1.5, summary[3]);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_long)
+{
+  const char* keys[] = { "0", "1", "7", "12", "123", "99999999", "100000000",
+    "2147483647", "2147483648", "1234567890123456", "12345678901234567",
+    "-1", "-42", "-", "", "+5", " 5", "5 ", "12a", "a12", "0x10", "007",
+    "9/", ":9", "-12345678901", nullptr };
+  for (int i = 0; keys[i]; ++i) {
+    BOOST_REQUIRE_MESSAGE(strtol(keys[i], nullptr, 10)
+                          == ParseLong(keys[i], strlen(keys[i])),
+                          "key: '" << keys[i] << "'");
+  }
+  char buf[32];
+  for (long v = -100000; v < 3000000; v += 7) {
+    int n = snprintf(buf, sizeof(buf), "%ld", v);
+    BOOST_REQUIRE_EQUAL(v, ParseLong(buf, n));
+  }
+}
@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestHistogramKernels
+#include <boost/test/unit_test.hpp>
+#include "../HistogramKernels.h"
+
+#include <climits>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace mozilla::telemetry;
+
+static const size_t kMaxLength = 70;
+
+/// Counts with runs of zeros and the extreme values, one spare element so
+/// every variant also runs unaligned
+static vector<int> RandomCounts(mt19937& aRng, size_t aLength)
+{
+  uniform_int_distribution<int> kind(0, 5);
+  uniform_int_distribution<int> value(-1000, 1000000);
+  vector<int> counts(aLength + 1);
+  for (auto it = counts.begin(); it != counts.end(); ++it) {
+    switch (kind(aRng)) {
+    case 0: *it = INT_MAX; break;
+    case 1: *it = INT_MIN; break;
+    case 2: *it = value(aRng); break;
+    default: *it = 0; break;
+    }
+  }
+  return counts;
+}
+
+BOOST_AUTO_TEST_CASE(test_variants)
+{
+  vector<const HistogramKernels*> kernels = GetSupportedHistogramKernels();
+  BOOST_REQUIRE(!kernels.empty());
+  const HistogramKernels& scalar = *kernels[0];
+  BOOST_REQUIRE_EQUAL("scalar", scalar.mName);
+  BOOST_REQUIRE_EQUAL(kernels.back(), &GetHistogramKernels());
+
+  mt19937 rng(42);
+  for (auto kit = kernels.begin(); kit != kernels.end(); ++kit) {
+    const HistogramKernels& k = **kit;
+    BOOST_TEST_MESSAGE("kernels: " << k.mName);
+    for (size_t length = 0; length <= kMaxLength; ++length) {
+      for (size_t offset = 0; offset < 2; ++offset) {
+        vector<int> a = RandomCounts(rng, length);
+        vector<int> b = RandomCounts(rng, length);
+        const int* pa = a.data() + offset;
+
+        vector<int64_t> expected(length + 1, INT64_C(1) << 40);
+        vector<int64_t> actual(expected);
+        scalar.mAddCounts(expected.data() + offset, pa, length);
+        k.mAddCounts(actual.data() + offset, pa, length);
+        BOOST_REQUIRE(expected == actual);
+        scalar.mSubtractCounts(expected.data() + offset, b.data(), length);
+        k.mSubtractCounts(actual.data() + offset, b.data(), length);
+        BOOST_REQUIRE(expected == actual);
+
+        BOOST_REQUIRE_EQUAL(scalar.mCountNonZero(pa, length),
+                            k.mCountNonZero(pa, length));
+
+        vector<int> c(pa, pa + length);
+        BOOST_REQUIRE(k.mCountsEqual(pa, c.data(), length));
+        for (size_t i = 0; i < length; ++i) {
+          c[i] ^= 1 << (i % 32);
+          BOOST_REQUIRE_MESSAGE(!k.mCountsEqual(pa, c.data(), length),
+                                k.mName << " length " << length << " at "
+                                << i);
+          c[i] = pa[i];
+        }
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_scatter)
+{
+  vector<const HistogramKernels*> kernels = GetSupportedHistogramKernels();
+  for (auto kit = kernels.begin(); kit != kernels.end(); ++kit) {
+    const HistogramKernels& k = **kit;
+    vector<int> counts(10, 7);
+    const int pairs[] = { 0, 3, 9, -2, 4, 5 };
+    BOOST_REQUIRE(k.mScatterCounts(counts.data(), counts.size(), pairs, 3));
+    const int expected[] = { 3, 0, 0, 0, 5, 0, 0, 0, 0, -2 };
+    BOOST_REQUIRE(vector<int>(expected, expected + 10) == counts);
+
+    BOOST_REQUIRE(k.mScatterCounts(counts.data(), counts.size(), pairs, 0));
+    BOOST_REQUIRE_EQUAL(0u, k.mCountNonZero(counts.data(), counts.size()));
+
+    const int invalid[] = { 1, 1, 10, 1 };
+    BOOST_REQUIRE(!k.mScatterCounts(counts.data(), counts.size(), invalid, 2));
+    const int negative[] = { -1, 1 };
+    BOOST_REQUIRE(!k.mScatterCounts(counts.data(), counts.size(), negative,
+                                    1));
+  }
+}
@@ -7,9 +7,15 @@
 #define BOOST_TEST_MODULE TestHistogramSpecification
 #include <boost/test/unit_test.hpp>
 #include "TestConfig.h"
+#include "../Crc32c.h"
 #include "../HistogramSpecification.h"
 
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <map>
+#include <set>
+#include <sstream>
 
 using namespace std;
 using namespace mozilla::telemetry;
@@ -37,6 +43,308 @@ BOOST_AUTO_TEST_CASE(test_load)
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_bucket_index)
+{
+  string fn(kDataPath + "cache/ad0ae007aa9e.json");
+  ifstream ifs(fn.c_str());
+  string json((istream_iterator<char>(ifs)), istream_iterator<char>());
+  HistogramSpecification h(json);
+  BOOST_REQUIRE_EQUAL(HistogramDefinition::kExponential,
+                      h.GetDefinition("CYCLE_COLLECTOR")->GetKind());
+  BOOST_REQUIRE_EQUAL(HistogramDefinition::kLinear,
+                      h.GetDefinition("A11Y_CONSUMERS")->GetKind());
+  BOOST_REQUIRE_EQUAL(HistogramDefinition::kBoolean,
+                      h.GetDefinition("CYCLE_COLLECTOR_FINISH_IGC")->GetKind());
+  BOOST_REQUIRE_EQUAL(HistogramDefinition::kFlag,
+                      h.GetDefinition("A11Y_INSTANTIATED_FLAG")->GetKind());
+
+  // every index function must agree with a plain lookup of the bucket array
+  RapidjsonDocument doc;
+  BOOST_REQUIRE(!doc.Parse<0>(json.c_str()).HasParseError());
+  const RapidjsonValue& histograms = doc["histograms"];
+  for (RapidjsonValue::ConstMemberIterator it = histograms.MemberBegin();
+       it != histograms.MemberEnd(); ++it) {
+    const HistogramDefinition* hd = h.GetDefinition(it->name.GetString());
+    BOOST_REQUIRE(hd);
+    const RapidjsonValue& buckets = it->value["buckets"];
+    map<long, int> expected;
+    for (rapidjson::SizeType i = 0; i < buckets.Size(); ++i) {
+      expected.insert(make_pair(buckets[i].GetInt(), static_cast<int>(i)));
+    }
+    vector<long> probes = { -1, numeric_limits<long>::min(),
+      numeric_limits<long>::max() };
+    for (auto& b : expected) {
+      probes.push_back(b.first - 1);
+      probes.push_back(b.first);
+      probes.push_back(b.first + 1);
+    }
+    for (long lb : probes) {
+      auto e = expected.find(lb);
+      int index = e == expected.end() ? -1 : e->second;
+      BOOST_REQUIRE_MESSAGE(index == hd->GetBucketIndex(lb),
+                            it->name.GetString() << " lower bound " << lb);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_bucket_index_fallback)
+{
+  // a strided linear histogram, a flag histogram with unexpected bounds and an
+  // unsorted bucket array
+  string json = "{\"histograms\":{"
+    "\"L\":{\"kind\":\"1\",\"min\":5,\"max\":25,\"bucket_count\":6,"
+    "\"buckets\":[0,5,10,15,20,25]},"
+    "\"F\":{\"kind\":\"3\",\"min\":1,\"max\":2,\"bucket_count\":3,"
+    "\"buckets\":[0,2,4]},"
+    "\"U\":{\"kind\":\"0\",\"min\":1,\"max\":2,\"bucket_count\":4,"
+    "\"buckets\":[0,9,4,9]}}}";
+  HistogramSpecification h(json);
+  const HistogramDefinition* hd = h.GetDefinition("L");
+  BOOST_REQUIRE_EQUAL(0, hd->GetBucketIndex(0));
+  BOOST_REQUIRE_EQUAL(1, hd->GetBucketIndex(5));
+  BOOST_REQUIRE_EQUAL(5, hd->GetBucketIndex(25));
+  BOOST_REQUIRE_EQUAL(-1, hd->GetBucketIndex(30));
+  BOOST_REQUIRE_EQUAL(-1, hd->GetBucketIndex(12));
+  BOOST_REQUIRE_EQUAL(-1, hd->GetBucketIndex(-5));
+
+  hd = h.GetDefinition("F");
+  BOOST_REQUIRE_EQUAL(1, hd->GetBucketIndex(2));
+  BOOST_REQUIRE_EQUAL(-1, hd->GetBucketIndex(1));
+
+  hd = h.GetDefinition("U");
+  BOOST_REQUIRE_EQUAL(1, hd->GetBucketIndex(9));
+  BOOST_REQUIRE_EQUAL(2, hd->GetBucketIndex(4));
+  BOOST_REQUIRE_EQUAL(-1, hd->GetBucketIndex(5));
+}
+
+BOOST_AUTO_TEST_CASE(test_name_index)
+{
+  string fn(kDataPath + "cache/ad0ae007aa9e.json");
+  ifstream ifs(fn.c_str());
+  string json((istream_iterator<char>(ifs)), istream_iterator<char>());
+  HistogramSpecification h(json);
+  RapidjsonDocument doc;
+  BOOST_REQUIRE(!doc.Parse<0>(json.c_str()).HasParseError());
+  const RapidjsonValue& histograms = doc["histograms"];
+  set<uint32_t> seen;
+  for (RapidjsonValue::ConstMemberIterator it = histograms.MemberBegin();
+       it != histograms.MemberEnd(); ++it) {
+    uint32_t id;
+    const HistogramDefinition* hd = h.GetDefinition(it->name.GetString(), id);
+    BOOST_REQUIRE(hd);
+    BOOST_REQUIRE(hd == h.GetDefinition(it->name.GetString()));
+    BOOST_REQUIRE(seen.insert(id).second);
+    BOOST_REQUIRE_EQUAL(static_cast<int>(it->value["buckets"].Size()),
+                        hd->GetBucketCount());
+  }
+  BOOST_REQUIRE(!h.GetDefinition(""));
+  BOOST_REQUIRE(!h.GetDefinition("CYCLE_COLLECTO"));
+  BOOST_REQUIRE(!h.GetDefinition("CYCLE_COLLECTOR_"));
+
+  // the first of two definitions sharing a name wins
+  HistogramSpecification dup("{\"histograms\":{"
+    "\"D\":{\"kind\":\"2\",\"min\":1,\"max\":2,\"bucket_count\":3,"
+    "\"buckets\":[0,1,2]},"
+    "\"D\":{\"kind\":\"0\",\"min\":1,\"max\":2,\"bucket_count\":2,"
+    "\"buckets\":[0,1]}}}");
+  BOOST_REQUIRE_EQUAL(3, dup.GetDefinition("D")->GetBucketCount());
+  HistogramSpecification none("{\"histograms\":{}}");
+  BOOST_REQUIRE(!none.GetDefinition("D"));
+}
+
+BOOST_AUTO_TEST_CASE(test_startup_alias)
+{
+  string fn(kDataPath + "cache/ad0ae007aa9e.json");
+  ifstream ifs(fn.c_str());
+  string json((istream_iterator<char>(ifs)), istream_iterator<char>());
+  HistogramSpecification h(json);
+  const HistogramDefinition* cc = h.GetDefinition("CYCLE_COLLECTOR");
+  BOOST_REQUIRE(!h.GetDefinition("STARTUP_CYCLE_COLLECTOR"));
+
+  const char* name = "STARTUP_CYCLE_COLLECTOR";
+  BOOST_REQUIRE(cc == h.ResolveDefinition(name));
+  BOOST_REQUIRE_EQUAL(string("CYCLE_COLLECTOR"), name);
+
+  name = "CYCLE_COLLECTOR";
+  BOOST_REQUIRE(cc == h.ResolveDefinition(name));
+  BOOST_REQUIRE_EQUAL(string("CYCLE_COLLECTOR"), name);
+
+  // only the exact prefix is stripped
+  name = "XXXXXXXXCYCLE_COLLECTOR";
+  BOOST_REQUIRE(!h.ResolveDefinition(name));
+  name = "STARTUP_";
+  BOOST_REQUIRE(!h.ResolveDefinition(name));
+  name = "STARTUP_STARTUP_XUL_CACHE_DISABLED";
+  BOOST_REQUIRE(h.GetDefinition("STARTUP_XUL_CACHE_DISABLED")
+                == h.ResolveDefinition(name));
+  BOOST_REQUIRE_EQUAL(string("STARTUP_XUL_CACHE_DISABLED"), name);
+
+  // a defined prefixed name is not shadowed by the alias
+  name = "STARTUP_STARTUP_CACHE_AGE_HOURS";
+  BOOST_REQUIRE(h.GetDefinition(name) == h.ResolveDefinition(name));
+  BOOST_REQUIRE_EQUAL(string("STARTUP_STARTUP_CACHE_AGE_HOURS"), name);
+  HistogramSpecification defined("{\"histograms\":{"
+    "\"STARTUP_A\":{\"kind\":\"2\",\"min\":1,\"max\":2,"
+    "\"bucket_count\":3,\"buckets\":[0,1,2]},"
+    "\"A\":{\"kind\":\"0\",\"min\":1,\"max\":2,\"bucket_count\":2,"
+    "\"buckets\":[0,1]}}}");
+  name = "STARTUP_A";
+  BOOST_REQUIRE_EQUAL(3, defined.ResolveDefinition(name)->GetBucketCount());
+  BOOST_REQUIRE_EQUAL(string("STARTUP_A"), name);
+  name = "A";
+  BOOST_REQUIRE_EQUAL(2, defined.ResolveDefinition(name)->GetBucketCount());
+}
+
+BOOST_AUTO_TEST_CASE(test_interning)
+{
+  string fn(kDataPath + "cache/ad0ae007aa9e.json");
+  ifstream ifs(fn.c_str());
+  string json((istream_iterator<char>(ifs)), istream_iterator<char>());
+  // a revision with one definition changed
+  string changed(json);
+  size_t pos = changed.find("\"CYCLE_COLLECTOR\":{");
+  BOOST_REQUIRE(pos != string::npos);
+  pos = changed.find("\"max\":", pos);
+  changed.insert(pos + 6, "1");
+
+  HistogramDefinitionPool pool;
+  {
+    HistogramSpecification h(json, &pool);
+    size_t size = pool.GetSize();
+    HistogramSpecification r(changed, &pool);
+    BOOST_REQUIRE_EQUAL(size + 1, pool.GetSize());
+    BOOST_REQUIRE(h.GetDefinition("CYCLE_COLLECTOR")
+                  != r.GetDefinition("CYCLE_COLLECTOR"));
+    BOOST_REQUIRE(h.GetDefinition("A11Y_CONSUMERS")
+                  == r.GetDefinition("A11Y_CONSUMERS"));
+
+    // identical definitions share one object but keep their own ids
+    uint32_t first, second;
+    const HistogramDefinition* a = h.GetDefinition("A11Y_INSTANTIATED_FLAG",
+                                                   first);
+    const HistogramDefinition* b = h.GetDefinition("A11Y_ISIMPLEDOM_USAGE_FLAG",
+                                                   second);
+    BOOST_REQUIRE(a && a == b);
+    BOOST_REQUIRE(first != second);
+
+    stringstream ss;
+    r.WriteSnapshot(ss);
+    string snapshot = ss.str();
+    HistogramSpecification s(snapshot.data(), snapshot.size(), &pool);
+    BOOST_REQUIRE_EQUAL(size + 1, pool.GetSize());
+    BOOST_REQUIRE(s.GetDefinition("CYCLE_COLLECTOR")
+                  == r.GetDefinition("CYCLE_COLLECTOR"));
+  }
+  BOOST_REQUIRE_EQUAL(0u, pool.GetSize());
+}
+
+BOOST_AUTO_TEST_CASE(test_snapshot)
+{
+  string fn(kDataPath + "cache/ad0ae007aa9e.json");
+  ifstream ifs(fn.c_str());
+  string json((istream_iterator<char>(ifs)), istream_iterator<char>());
+  HistogramSpecification h(json);
+  stringstream ss;
+  h.WriteSnapshot(ss);
+  string snapshot = ss.str();
+  HistogramSpecification s(snapshot.data(), snapshot.size());
+  BOOST_REQUIRE_EQUAL(h.GetHash(), s.GetHash());
+  BOOST_REQUIRE_EQUAL(h.GetMaxBucketCount(), s.GetMaxBucketCount());
+
+  RapidjsonDocument doc;
+  BOOST_REQUIRE(!doc.Parse<0>(json.c_str()).HasParseError());
+  const RapidjsonValue& histograms = doc["histograms"];
+  for (RapidjsonValue::ConstMemberIterator it = histograms.MemberBegin();
+       it != histograms.MemberEnd(); ++it) {
+    uint32_t hid, sid;
+    const HistogramDefinition* hd = h.GetDefinition(it->name.GetString(), hid);
+    const HistogramDefinition* sd = s.GetDefinition(it->name.GetString(), sid);
+    BOOST_REQUIRE(sd);
+    BOOST_REQUIRE_EQUAL(hid, sid);
+    BOOST_REQUIRE_EQUAL(hd->GetKind(), sd->GetKind());
+    BOOST_REQUIRE_EQUAL(hd->GetBucketCount(), sd->GetBucketCount());
+    const RapidjsonValue& buckets = it->value["buckets"];
+    for (rapidjson::SizeType i = 0; i < buckets.Size(); ++i) {
+      long lb = buckets[i].GetInt();
+      BOOST_REQUIRE_EQUAL(hd->GetBucketIndex(lb), sd->GetBucketIndex(lb));
+      BOOST_REQUIRE_EQUAL(hd->GetBucketIndex(lb + 1),
+                          sd->GetBucketIndex(lb + 1));
+    }
+  }
+  BOOST_REQUIRE(!s.GetDefinition("CYCLE_COLLECTO"));
+  const char* name = "STARTUP_CYCLE_COLLECTOR";
+  BOOST_REQUIRE(s.GetDefinition("CYCLE_COLLECTOR") == s.ResolveDefinition(name));
+
+  // a loaded snapshot writes back identically
+  stringstream again;
+  s.WriteSnapshot(again);
+  BOOST_REQUIRE(snapshot == again.str());
+
+  // strided and permuted index functions survive the round trip
+  HistogramSpecification f("{\"histograms\":{"
+    "\"L\":{\"kind\":\"1\",\"min\":5,\"max\":25,\"bucket_count\":6,"
+    "\"buckets\":[0,5,10,15,20,25]},"
+    "\"U\":{\"kind\":\"0\",\"min\":1,\"max\":2,\"bucket_count\":4,"
+    "\"buckets\":[0,9,4,9]}}}");
+  ss.str("");
+  f.WriteSnapshot(ss);
+  snapshot = ss.str();
+  HistogramSpecification fs(snapshot.data(), snapshot.size());
+  BOOST_REQUIRE_EQUAL(5, fs.GetDefinition("L")->GetBucketIndex(25));
+  BOOST_REQUIRE_EQUAL(-1, fs.GetDefinition("L")->GetBucketIndex(12));
+  BOOST_REQUIRE_EQUAL(2, fs.GetDefinition("U")->GetBucketIndex(4));
+  BOOST_REQUIRE_EQUAL(-1, fs.GetDefinition("U")->GetBucketIndex(5));
+
+  HistogramSpecification none("{\"histograms\":{}}");
+  ss.str("");
+  none.WriteSnapshot(ss);
+  snapshot = ss.str();
+  HistogramSpecification ns(snapshot.data(), snapshot.size());
+  BOOST_REQUIRE(!ns.GetDefinition("L"));
+}
+
+BOOST_AUTO_TEST_CASE(test_invalid_snapshot)
+{
+  HistogramSpecification h("{\"histograms\":{"
+    "\"L\":{\"kind\":\"1\",\"min\":5,\"max\":25,\"bucket_count\":6,"
+    "\"buckets\":[0,5,10,15,20,25]}}}");
+  stringstream ss;
+  h.WriteSnapshot(ss);
+  const string snapshot = ss.str();
+
+  string s = snapshot.substr(0, 10);
+  BOOST_CHECK_THROW(HistogramSpecification(s.data(), s.size()), runtime_error);
+  s = snapshot.substr(0, snapshot.size() - 4);
+  BOOST_CHECK_THROW(HistogramSpecification(s.data(), s.size()), runtime_error);
+  s = snapshot;
+  s[0] = '{';
+  BOOST_CHECK_THROW(HistogramSpecification(s.data(), s.size()), runtime_error);
+  s = snapshot;
+  ++s[4]; // version
+  BOOST_CHECK_THROW(HistogramSpecification(s.data(), s.size()), runtime_error);
+  s = snapshot;
+  ++s[s.size() - 1]; // last bound
+  BOOST_CHECK_THROW(HistogramSpecification(s.data(), s.size()), runtime_error);
+
+  // the compiled fields are restored as is, a zero stride is rejected even
+  // with a valid checksum
+  const int fields[] = { 1, 5, 25, 6, 5, 6 }; // kind ... stride, search count
+  size_t pos = snapshot.find(string(reinterpret_cast<const char*>(fields),
+                                    sizeof(fields)));
+  BOOST_REQUIRE(pos != string::npos);
+  s = snapshot;
+  memset(&s[pos + 4 * sizeof(int)], 0, sizeof(int));
+  const size_t header = 56; // sizeof(SnapshotHeader)
+  uint32_t crc = Crc32c(0, s.data() + header, s.size() - header);
+  memcpy(&s[12], &crc, sizeof(crc)); // after the magic, version and marker
+  BOOST_CHECK_THROW(HistogramSpecification(s.data(), s.size()), runtime_error);
+  memcpy(&s[pos + 4 * sizeof(int)], &fields[4], sizeof(int));
+  crc = Crc32c(0, s.data() + header, s.size() - header);
+  memcpy(&s[12], &crc, sizeof(crc));
+  HistogramSpecification r(s.data(), s.size());
+  BOOST_REQUIRE_EQUAL(2, r.GetDefinition("L")->GetBucketIndex(10));
+}
+
 BOOST_AUTO_TEST_CASE(test_invalid_file)
 {
   string fn(kDataPath + "invalid.json");
@@ -0,0 +1,203 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestPayloadCodec
+#include <boost/test/unit_test.hpp>
+#include "TestConfig.h"
+#include "TestUtil.h"
+#include "../PayloadCodec.h"
+
+#include <string>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+using namespace std;
+using namespace mozilla::telemetry;
+
+static void TestRoundTrip(PayloadDecoder& aDecoder, const string& aName,
+                          const string& aEncoded, const string& aJson)
+{
+  BOOST_REQUIRE_EQUAL(PayloadDecoder::kDecoded,
+                      aDecoder.Decode(aEncoded.data(), aEncoded.size()));
+  BOOST_REQUIRE_EQUAL(aJson.size(), aDecoder.GetLength());
+  BOOST_REQUIRE_EQUAL(aJson, aDecoder.GetData());
+
+  // truncated
+  BOOST_REQUIRE_EQUAL(PayloadDecoder::kFailed,
+                      aDecoder.Decode(aEncoded.data(), aEncoded.size() - 4));
+
+  message::Message msg;
+  aDecoder.GetMetrics(msg);
+  BOOST_REQUIRE_EQUAL(1, FindField(msg, aName + " Decoded"));
+  BOOST_REQUIRE_EQUAL(1, FindField(msg, aName + " Decode Failures"));
+  BOOST_REQUIRE_CLOSE(static_cast<double>(aJson.size()) / aEncoded.size(),
+                      FindField(msg, aName + " Compression Ratio"), .01);
+}
+
+static string Json()
+{
+  string json("{\"log\":[");
+  for (int i = 0; i < 1000; ++i) {
+    json += "[\"entry\",1234],";
+  }
+  json += "[]]}";
+  return json;
+}
+
+BOOST_AUTO_TEST_CASE(test_not_encoded)
+{
+  PayloadDecoder pd(16);
+  string json("{\"a\":1}");
+  BOOST_REQUIRE_EQUAL(PayloadDecoder::kNotEncoded,
+                      pd.Decode(json.data(), json.size()));
+  pd.Copy(json.data(), json.size());
+  BOOST_REQUIRE_EQUAL(json, pd.GetData());
+}
+
+BOOST_AUTO_TEST_CASE(test_gzip)
+{
+  PayloadDecoder pd(16); // forces the buffer to grow
+  string json = Json();
+  TestRoundTrip(pd, "gzip", Gzip(json), json);
+}
+
+BOOST_AUTO_TEST_CASE(test_gzip_corrupt)
+{
+  PayloadDecoder pd(1024);
+  string gz = Gzip(Json());
+  gz[gz.size() / 2] ^= 0xff;
+  BOOST_REQUIRE_EQUAL(PayloadDecoder::kFailed,
+                      pd.Decode(gz.data(), gz.size()));
+}
+
+#ifdef HAVE_ZSTD
+BOOST_AUTO_TEST_CASE(test_zstd)
+{
+  PayloadDecoder pd(16);
+  string json = Json();
+  string zs(ZSTD_compressBound(json.size()), 0);
+  zs.resize(ZSTD_compress(&zs[0], zs.size(), json.data(), json.size(), 3));
+  TestRoundTrip(pd, "zstd", zs, json);
+}
+#endif
+
+#ifdef HAVE_LZ4
+BOOST_AUTO_TEST_CASE(test_lz4)
+{
+  PayloadDecoder pd(16);
+  string json = Json();
+  string lz(LZ4F_compressFrameBound(json.size(), nullptr), 0);
+  lz.resize(LZ4F_compressFrame(&lz[0], lz.size(), json.data(), json.size(),
+                               nullptr));
+  TestRoundTrip(pd, "lz4", lz, json);
+}
+#endif
+
+class ReverseCodec : public PayloadCodec
+{
+public:
+  const char* GetName() const
+  {
+    return "reverse";
+  }
+
+  bool Matches(const char* aData, size_t aLength) const
+  {
+    return aLength > 0 && aData[0] == '}';
+  }
+
+  uint64_t Begin(const char* aData, size_t aLength)
+  {
+    mPos = aData + aLength;
+    mBegin = aData;
+    return 0;
+  }
+
+  Status Next(char* aOut, size_t aSize, size_t& aLength)
+  {
+    for (aLength = 0; aLength < aSize && mPos != mBegin; ++aLength) {
+      aOut[aLength] = *--mPos;
+    }
+    return mPos == mBegin ? kEnd : kMore;
+  }
+
+private:
+  const char* mBegin;
+  const char* mPos;
+};
+
+BOOST_AUTO_TEST_CASE(test_register)
+{
+  PayloadDecoder pd(4);
+  pd.Register(std::unique_ptr<PayloadCodec>(new ReverseCodec));
+  string data("}1:\"a\"{");
+  BOOST_REQUIRE_EQUAL(PayloadDecoder::kDecoded,
+                      pd.Decode(data.data(), data.size()));
+  BOOST_REQUIRE_EQUAL("{\"a\":1}", pd.GetData());
+
+  message::Message msg;
+  pd.GetMetrics(msg);
+  BOOST_REQUIRE_EQUAL(1, FindField(msg, "reverse Decoded"));
+  BOOST_REQUIRE_EQUAL(1, FindField(msg, "Inflate Buffer Resizes"));
+}
+
+BOOST_AUTO_TEST_CASE(test_max_length)
+{
+  PayloadDecoder pd(16);
+  string json = Json();
+  string gz = Gzip(json);
+  pd.SetMaxLength(json.size() - 1);
+  BOOST_REQUIRE_EQUAL(PayloadDecoder::kFailed,
+                      pd.Decode(gz.data(), gz.size()));
+  pd.SetMaxLength(json.size());
+  BOOST_REQUIRE_EQUAL(PayloadDecoder::kDecoded,
+                      pd.Decode(gz.data(), gz.size()));
+  BOOST_REQUIRE_EQUAL(json, pd.GetData());
+}
+
+static string ReadStream(PayloadDecoder::Stream& aStream)
+{
+  string s;
+  while (aStream.Peek() != 0) {
+    s.push_back(aStream.Take());
+  }
+  return s;
+}
+
+BOOST_AUTO_TEST_CASE(test_stream)
+{
+  PayloadDecoder pd(64); // window
+  string json = Json();
+  string gz = Gzip(json);
+  PayloadDecoder::Stream s(pd, gz.data(), gz.size());
+  BOOST_REQUIRE_EQUAL(json, ReadStream(s));
+  BOOST_REQUIRE(!s.HasError());
+  BOOST_REQUIRE_EQUAL(json.size(), s.Tell());
+
+  PayloadDecoder::Stream raw(pd, json.data(), json.size());
+  BOOST_REQUIRE_EQUAL(json, ReadStream(raw));
+
+  PayloadDecoder::Stream truncated(pd, gz.data(), gz.size() - 4);
+  ReadStream(truncated);
+  BOOST_REQUIRE(truncated.HasError());
+
+  pd.SetMaxLength(json.size() - 1);
+  PayloadDecoder::Stream limited(pd, gz.data(), gz.size());
+  BOOST_REQUIRE(ReadStream(limited).size() < json.size());
+  BOOST_REQUIRE(limited.HasError());
+
+  message::Message msg;
+  pd.GetMetrics(msg);
+  BOOST_REQUIRE_EQUAL(1, FindField(msg, "gzip Decoded"));
+  BOOST_REQUIRE_EQUAL(2, FindField(msg, "gzip Decode Failures"));
+  BOOST_REQUIRE_EQUAL(0, FindField(msg, "Inflate Buffer Resizes"));
+}
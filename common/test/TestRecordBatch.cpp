@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestRecordBatch
+#include <boost/test/unit_test.hpp>
+#include "TestConfig.h"
+#include "TestUtil.h"
+#include "../RecordBatch.h"
+#include "../SplicingWriter.h"
+#include "../TelemetryRecord.h"
+
+#include <limits>
+#include <sstream>
+#include <string>
+
+#include <rapidjson/stringbuffer.h>
+
+using namespace std;
+using namespace mozilla::telemetry;
+
+static string Records()
+{
+  ostringstream oss;
+  TelemetryRecord::WriteRecord(oss, "a", 1, "{\"n\":1}", 7, 10);
+  string gz = Gzip("{\"n\":2,\"log\":[1,2]}");
+  TelemetryRecord::WriteRecord(oss, "bb", 2, gz.data(), gz.size(), 20);
+  TelemetryRecord::WriteRecord(oss, "bad", 3, "{\"n\":", 5, 30);
+  TelemetryRecord::WriteRecord(oss, "ccc", 3, "{\"n\":3}", 7, 40);
+  TelemetryRecord::WriteRecord(oss, "d", 1, "{\"n\":4}", 7, 50);
+  return oss.str();
+}
+
+static string Serialize(const RecordBatch& aBatch, size_t aIndex)
+{
+  rapidjson::StringBuffer sb;
+  SplicingWriter<rapidjson::StringBuffer> writer(sb);
+  aBatch.Accept(aIndex, writer);
+  return string(sb.GetString(), sb.Size());
+}
+
+BOOST_AUTO_TEST_CASE(test_read_batch)
+{
+  string data = Records();
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  RecordBatch batch(2);
+  BOOST_REQUIRE_EQUAL(2, batch.GetCapacity());
+
+  BOOST_REQUIRE_EQUAL(2, tr.ReadBatch(pos, end, end, batch));
+  BOOST_REQUIRE_EQUAL(string("a"), batch.GetRecord(0).mPath);
+  BOOST_REQUIRE_EQUAL(10, batch.GetRecord(0).mTimestamp);
+  BOOST_REQUIRE_EQUAL(string("bb"), batch.GetRecord(1).mPath);
+  BOOST_REQUIRE_EQUAL(20, batch.GetRecord(1).mTimestamp);
+  BOOST_REQUIRE_EQUAL(19, batch.GetRecord(1).mPayloadLength);
+  // every document of the batch is valid at the same time
+  BOOST_REQUIRE_EQUAL(1, (*batch.GetRecord(0).mDocument)["n"].GetInt());
+  BOOST_REQUIRE_EQUAL(2, (*batch.GetRecord(1).mDocument)["n"].GetInt());
+
+  // the invalid JSON record is dropped
+  BOOST_REQUIRE_EQUAL(2, tr.ReadBatch(pos, end, end, batch));
+  BOOST_REQUIRE_EQUAL(string("ccc"), batch.GetRecord(0).mPath);
+  BOOST_REQUIRE_EQUAL(3, (*batch.GetRecord(0).mDocument)["n"].GetInt());
+  BOOST_REQUIRE_EQUAL(string("d"), batch.GetRecord(1).mPath);
+  BOOST_REQUIRE_EQUAL(4, (*batch.GetRecord(1).mDocument)["n"].GetInt());
+
+  BOOST_REQUIRE_EQUAL(0, tr.ReadBatch(pos, end, end, batch));
+  BOOST_REQUIRE_EQUAL(0, batch.GetSize());
+  BOOST_REQUIRE(pos == end);
+}
+
+BOOST_AUTO_TEST_CASE(test_read_batch_limit)
+{
+  string data = Records();
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  RecordBatch batch;
+
+  // only the first record starts before the limit
+  BOOST_REQUIRE_EQUAL(1, tr.ReadBatch(pos, pos + 1, end, batch));
+  BOOST_REQUIRE_EQUAL(string("a"), batch.GetRecord(0).mPath);
+  BOOST_REQUIRE_EQUAL(3, tr.ReadBatch(pos, end, end, batch));
+  BOOST_REQUIRE_EQUAL(string("d"), batch.GetRecord(2).mPath);
+}
+
+BOOST_AUTO_TEST_CASE(test_read_batch_selective)
+{
+  string data = Records();
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  tr.SetParsedMembers(vector<string>(1, "n"));
+  RecordBatch batch;
+
+  BOOST_REQUIRE_EQUAL(4, tr.ReadBatch(pos, end, end, batch));
+  BOOST_REQUIRE_EQUAL(2, (*batch.GetRecord(1).mDocument)["n"].GetInt());
+  BOOST_REQUIRE((*batch.GetRecord(1).mDocument)["log"].IsNull());
+  BOOST_REQUIRE_EQUAL("{\"n\":1}", Serialize(batch, 0));
+  BOOST_REQUIRE_EQUAL("{\"n\":2,\"log\":[1,2]}", Serialize(batch, 1));
+}
+
+BOOST_AUTO_TEST_CASE(test_read_batch_streamed)
+{
+  string data = Records();
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  tr.SetParsedMembers(vector<string>(1, "n"));
+  tr.SetLimits(kMaxTelemetryData, numeric_limits<size_t>::max(), 1);
+  RecordBatch batch;
+
+  BOOST_REQUIRE_EQUAL(4, tr.ReadBatch(pos, end, end, batch));
+  BOOST_REQUIRE_EQUAL(string("bb"), batch.GetRecord(1).mPath);
+  BOOST_REQUIRE_EQUAL(2, (*batch.GetRecord(1).mDocument)["n"].GetInt());
+  BOOST_REQUIRE_EQUAL("{\"n\":1}", Serialize(batch, 0));
+  BOOST_REQUIRE_EQUAL("{\"n\":2,\"log\":[1,2]}", Serialize(batch, 1));
+  BOOST_REQUIRE_EQUAL("{\"n\":4}", Serialize(batch, 3));
+}
@@ -0,0 +1,165 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define BOOST_TEST_MODULE TestRecordIndex
+#include <boost/test/unit_test.hpp>
+#include "TestConfig.h"
+#include "../Crc32c.h"
+#include "../MemoryMappedFile.h"
+#include "../RecordIndex.h"
+#include "../TelemetryRecord.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+using namespace mozilla::telemetry;
+namespace fs = boost::filesystem;
+
+static const string rec("\x1e\x04\x00\x07\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00" "abcd{\"a\":8}", 26);
+
+static string Data()
+{
+  ostringstream oss;
+  oss << rec << "junk";
+  TelemetryRecord::WriteRecord(oss, "v2", 2, "{\"a\":9}", 7, 5);
+  oss << rec;
+  return oss.str();
+}
+
+BOOST_AUTO_TEST_CASE(test_build)
+{
+  string data(Data());
+  RecordIndex idx;
+  idx.Build(data.data(), data.data() + data.size());
+  BOOST_REQUIRE_EQUAL(data.size(), idx.GetLogSize());
+  const vector<RecordIndex::Entry>& entries = idx.GetEntries();
+  BOOST_REQUIRE_EQUAL(3u, entries.size());
+  uint64_t offsets[] = { 0, 30, 62 };
+  uint64_t timestamps[] = { 1, 5, 1 };
+  for (int i = 0; i < 3; ++i) {
+    BOOST_REQUIRE_EQUAL(offsets[i], entries[i].mOffset);
+    BOOST_REQUIRE_EQUAL(timestamps[i], entries[i].mTimestamp);
+    BOOST_REQUIRE_EQUAL(7u, entries[i].mDataLength);
+  }
+  BOOST_REQUIRE_EQUAL(2, entries[1].mPathLength);
+
+  BOOST_REQUIRE_EQUAL(30u, idx.LowerBound(1)->mOffset);
+  BOOST_REQUIRE_EQUAL(62u, idx.LowerBound(62)->mOffset);
+  BOOST_REQUIRE(nullptr == idx.LowerBound(63));
+}
+
+BOOST_AUTO_TEST_CASE(test_read_at)
+{
+  string data(Data());
+  const char* begin = data.data();
+  const char* end = begin + data.size();
+  RecordIndex idx;
+  idx.Build(begin, end);
+  TelemetryRecord tr;
+  BOOST_REQUIRE_EQUAL(true, tr.ReadAt(begin, end, idx.GetEntries()[1].mOffset));
+  BOOST_REQUIRE_EQUAL("v2", tr.GetPath());
+  BOOST_REQUIRE_EQUAL(9, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(true, tr.ReadAt(begin, end, 0));
+  BOOST_REQUIRE_EQUAL("abcd", tr.GetPath());
+  // an offset that is not a record start must not read ahead
+  BOOST_REQUIRE_EQUAL(false, tr.ReadAt(begin, end, 26));
+  BOOST_REQUIRE_EQUAL(false, tr.ReadAt(begin, end, data.size()));
+}
+
+BOOST_AUTO_TEST_CASE(test_save_load)
+{
+  MemoryMappedFile file(kDataPath + "telemetry1.log");
+  RecordIndex idx;
+  idx.Build(file.GetData(), file.GetData() + file.GetSize());
+  BOOST_REQUIRE_EQUAL(1u, idx.GetEntries().size());
+
+  fs::path fn = fs::temp_directory_path() / "TestRecordIndex.idx";
+  idx.Save(fn);
+  BOOST_REQUIRE_EQUAL(32u + 22, fs::file_size(fn));
+  RecordIndex loaded;
+  loaded.Load(fn);
+  BOOST_REQUIRE_EQUAL(file.GetSize(), loaded.GetLogSize());
+  BOOST_REQUIRE_EQUAL(1u, loaded.GetEntries().size());
+  const RecordIndex::Entry& e = loaded.GetEntries()[0];
+  const RecordIndex::Entry& o = idx.GetEntries()[0];
+  BOOST_REQUIRE_EQUAL(o.mOffset, e.mOffset);
+  BOOST_REQUIRE_EQUAL(o.mTimestamp, e.mTimestamp);
+  BOOST_REQUIRE_EQUAL(o.mDataLength, e.mDataLength);
+  BOOST_REQUIRE_EQUAL(o.mPathLength, e.mPathLength);
+
+  fs::resize_file(fn, fs::file_size(fn) - 1);
+  BOOST_REQUIRE_THROW(loaded.Load(fn), runtime_error);
+  BOOST_REQUIRE_EQUAL(1u, loaded.GetEntries().size()); // left unchanged
+  fs::remove(fn);
+  BOOST_REQUIRE_THROW(loaded.Load(fn), runtime_error);
+
+  BOOST_REQUIRE_EQUAL("a.log.idx",
+                      RecordIndex::GetIndexPath("a.log").string());
+}
+
+/// Writes an index file with a valid header and checksum
+static void WriteIndex(const fs::path& aName, uint64_t aLogSize,
+                       uint64_t aCount, const vector<uint64_t>& aOffsets)
+{
+  string entries;
+  for (auto it = aOffsets.begin(); it != aOffsets.end(); ++it) {
+    entries.append(reinterpret_cast<const char*>(&*it), sizeof(*it));
+    entries.append(14, '\0'); // timestamp, data length, path length
+  }
+  uint32_t byteOrder = 0x01020304, version = 2;
+  uint32_t checksum = Crc32c(0, entries.data(), entries.size());
+  ofstream ofs(aName.c_str(), ios_base::binary | ios_base::trunc);
+  ofs.write("TIDX", 4);
+  ofs.write(reinterpret_cast<const char*>(&byteOrder), sizeof(byteOrder));
+  ofs.write(reinterpret_cast<const char*>(&version), sizeof(version));
+  ofs.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+  ofs.write(reinterpret_cast<const char*>(&aLogSize), sizeof(aLogSize));
+  ofs.write(reinterpret_cast<const char*>(&aCount), sizeof(aCount));
+  ofs << entries;
+}
+
+BOOST_AUTO_TEST_CASE(test_load_invalid)
+{
+  fs::path fn = fs::temp_directory_path() / "TestRecordIndex.idx";
+  RecordIndex idx;
+  WriteIndex(fn, 100, 2, { 0, 50 });
+  idx.Load(fn);
+  BOOST_REQUIRE_EQUAL(2u, idx.GetEntries().size());
+
+  // a count that does not match the file size (or overflows the allocation)
+  WriteIndex(fn, 100, 3, { 0, 50 });
+  BOOST_REQUIRE_THROW(idx.Load(fn), runtime_error);
+  WriteIndex(fn, 100, UINT64_C(0x2000000000000000), { 0, 50 });
+  BOOST_REQUIRE_THROW(idx.Load(fn), runtime_error);
+  // offsets past the log or out of order
+  WriteIndex(fn, 100, 2, { 0, 100 });
+  BOOST_REQUIRE_THROW(idx.Load(fn), runtime_error);
+  WriteIndex(fn, 100, 2, { 50, 50 });
+  BOOST_REQUIRE_THROW(idx.Load(fn), runtime_error);
+  WriteIndex(fn, 100, 2, { 50, 0 });
+  BOOST_REQUIRE_THROW(idx.Load(fn), runtime_error);
+  BOOST_REQUIRE_EQUAL(2u, idx.GetEntries().size());
+  BOOST_REQUIRE_EQUAL(50u, idx.GetEntries()[1].mOffset);
+
+  // a damaged entry or a foreign byte order
+  WriteIndex(fn, 100, 2, { 0, 50 });
+  {
+    fstream f(fn.c_str(), ios_base::binary | ios_base::in | ios_base::out);
+    f.seekp(40);
+    f.put('x');
+  }
+  BOOST_REQUIRE_THROW(idx.Load(fn), runtime_error);
+  WriteIndex(fn, 100, 2, { 0, 50 });
+  {
+    fstream f(fn.c_str(), ios_base::binary | ios_base::in | ios_base::out);
+    f.seekp(4);
+    f.write("\x01\x02\x03\x04", 4);
+  }
+  BOOST_REQUIRE_THROW(idx.Load(fn), runtime_error);
+  fs::remove(fn);
+}
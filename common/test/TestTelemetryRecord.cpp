@@ -7,12 +7,17 @@
 #define BOOST_TEST_MODULE TestTelemetryRecord
 #include <boost/test/unit_test.hpp>
 #include "TestConfig.h"
+#include "TestUtil.h"
+#include "../MemoryMappedFile.h"
+#include "../SplicingWriter.h"
 #include "../TelemetryRecord.h"
 
+#include <limits>
 #include <string>
 #include <fstream>
 #include <sstream>
 
+#include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
 #include <iostream>
@@ -20,6 +25,18 @@
 using namespace std;
 using namespace mozilla::telemetry;
 
+static string Frame(const string& aPath, const string& aData)
+{
+  string r(1, '\x1e');
+  uint16_t pl = aPath.size();
+  uint32_t dl = aData.size();
+  uint64_t ts = 1;
+  r.append((const char*)&pl, sizeof(pl));
+  r.append((const char*)&dl, sizeof(dl));
+  r.append((const char*)&ts, sizeof(ts));
+  return r + aPath + aData;
+}
+
 static const string rec("\x1e\x04\x00\x07\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00" "abcd{\"a\":8}", 26);
 
 BOOST_AUTO_TEST_CASE(test_read)
@@ -63,6 +80,332 @@ BOOST_AUTO_TEST_CASE(test_short_pathlength)
   BOOST_REQUIRE_EQUAL(false, tr.Read(iss));
 }
 
+static double GetMetric(TelemetryRecord& aRecord, const string& aName)
+{
+  message::Message msg;
+  aRecord.GetMetrics(msg);
+  return FindField(msg, aName);
+}
+
+BOOST_AUTO_TEST_CASE(test_corrupt_data)
+{
+  string bad_header("\x1e\xff\xff\x07\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00", 15);
+  string data("junk" + rec + bad_header + rec + "\x1e\x1e");
+  istringstream iss(data);
+  TelemetryRecord tr;
+  for (int i = 0; i < 2; ++i) {
+    BOOST_REQUIRE_EQUAL(true, tr.Read(iss));
+    BOOST_REQUIRE_EQUAL("abcd", tr.GetPath());
+  }
+  BOOST_REQUIRE_EQUAL(false, tr.Read(iss));
+  BOOST_REQUIRE_EQUAL(18, GetMetric(tr, "Corrupt Data"));
+}
+
+BOOST_AUTO_TEST_CASE(test_buffer_boundaries)
+{
+  // separators, headers and payloads straddling the read ahead block
+  for (size_t junk = 256 * 1024 - 40; junk < 256 * 1024 + 2; ++junk) {
+    string data(string(junk, 'x') + rec + rec);
+    istringstream iss(data);
+    TelemetryRecord tr;
+    for (int i = 0; i < 2; ++i) {
+      BOOST_REQUIRE_EQUAL(true, tr.Read(iss));
+      BOOST_REQUIRE_EQUAL("abcd", tr.GetPath());
+      BOOST_REQUIRE_EQUAL(8, tr.GetDocument()["a"].GetInt());
+    }
+    BOOST_REQUIRE_EQUAL(false, tr.Read(iss));
+    BOOST_REQUIRE_EQUAL(junk, GetMetric(tr, "Corrupt Data"));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_inflate)
+{
+  string large("{\"a\":8,\"b\":\"" + string(500 * 1024, 'x') + "\"}");
+  string data(Frame("abcd", Gzip(large)) + Frame("abcd", Gzip("{\"a\":9}"))
+              + Frame("abcd", Gzip(large)));
+  istringstream iss(data);
+  TelemetryRecord tr;
+  BOOST_REQUIRE_EQUAL(true, tr.Read(iss));
+  BOOST_REQUIRE_EQUAL(8, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(500 * 1024, tr.GetDocument()["b"].GetStringLength());
+  BOOST_REQUIRE_EQUAL(true, tr.Read(iss));
+  BOOST_REQUIRE_EQUAL(9, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(true, tr.Read(iss));
+  BOOST_REQUIRE_EQUAL(8, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(false, tr.Read(iss));
+  message::Message msg;
+  tr.GetMetrics(msg);
+  // sized once from the trailer then reused
+  BOOST_REQUIRE_EQUAL(1, FindField(msg, "Inflate Buffer Resizes"));
+  BOOST_REQUIRE(FindField(msg, "Compression Ratio") > 100);
+}
+
+BOOST_AUTO_TEST_CASE(test_inflate_bad_trailer)
+{
+  string large("{\"a\":8,\"b\":\"" + string(500 * 1024, 'x') + "\"}");
+  string gz(Gzip(large));
+  gz[gz.size() - 2] = 0; // understate ISIZE
+  string data(Frame("abcd", gz) + rec);
+  istringstream iss(data);
+  TelemetryRecord tr;
+  BOOST_REQUIRE_EQUAL(true, tr.Read(iss));
+  BOOST_REQUIRE_EQUAL("abcd", tr.GetPath());
+  BOOST_REQUIRE_EQUAL(8, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(false, tr.Read(iss));
+  BOOST_REQUIRE_EQUAL(1, GetMetric(tr, "Inflate Failures"));
+}
+
+BOOST_AUTO_TEST_CASE(test_read_buffer)
+{
+  string data(rec + string("\x1e\xff\xff\x07\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00", 15) + "junk" + rec);
+  const char* pos = data.c_str();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  for (int i = 0; i < 2; ++i) {
+    BOOST_REQUIRE_EQUAL(true, tr.Read(pos, end));
+    BOOST_REQUIRE_EQUAL(1, tr.GetTimestamp());
+    BOOST_REQUIRE_EQUAL("abcd", tr.GetPath());
+    BOOST_REQUIRE_EQUAL(8, tr.GetDocument()["a"].GetInt());
+  }
+  BOOST_REQUIRE_EQUAL(false, tr.Read(pos, end));
+  BOOST_REQUIRE(pos == end);
+  BOOST_REQUIRE_EQUAL('\x1e', data[0]); // the input buffer is not modified
+}
+
+BOOST_AUTO_TEST_CASE(test_read_buffer_truncated)
+{
+  string data(rec + rec.substr(0, 20));
+  const char* pos = data.c_str();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  BOOST_REQUIRE_EQUAL(true, tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(false, tr.Read(pos, end));
+  BOOST_REQUIRE(pos == end);
+}
+
+BOOST_AUTO_TEST_CASE(test_read_mapped_file)
+{
+  MemoryMappedFile file(kDataPath + "telemetry1.log");
+  const char* pos = file.GetData();
+  const char* end = pos + file.GetSize();
+  TelemetryRecord tr;
+  BOOST_REQUIRE_EQUAL(true, tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(0, strncmp("17caa68c-25f5-450a-9cce-7d31318846d8/",
+                                 tr.GetPath(), 37));
+  BOOST_REQUIRE(tr.GetDocument()["histograms"].IsObject());
+  BOOST_REQUIRE_EQUAL(false, tr.Read(pos, end));
+}
+
+BOOST_AUTO_TEST_CASE(test_read_ranges)
+{
+  // the second path embeds a separator and a plausible header
+  string fake("\x1e\x00\x00\x02\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00xx",
+              17);
+  // the whitespace record is followed by junk, only its payload qualifies it
+  string data(rec + Frame("p" + fake, "{\"b\":1}") + "junk"
+              + Frame("gz", Gzip("{\"c\":[1,2,3]}"))
+              + Frame("ws", " \r\n{\"d\":1}") + "junk" + rec);
+  const char* begin = data.data();
+  const char* end = begin + data.size();
+  TelemetryRecord tr;
+  for (size_t split = 0; split <= data.size(); ++split) {
+    int cnt = 0;
+    const char* pos = begin;
+    const char* bound = tr.FindRecordStart(begin + split, end);
+    while (tr.Read(pos, bound, end)) ++cnt;
+    BOOST_REQUIRE(pos >= bound);
+    pos = bound;
+    while (tr.Read(pos, end)) ++cnt;
+    BOOST_REQUIRE_EQUAL(5, cnt);
+  }
+  BOOST_REQUIRE(end == tr.FindRecordStart(end - 3, end));
+
+  // a record the resync passes over is read by the previous range
+  string odd(rec + Frame("x", "[1]") + "junk" + rec);
+  begin = odd.data();
+  end = begin + odd.size();
+  const char* bound = tr.FindRecordStart(begin + 1, end);
+  BOOST_REQUIRE(end - rec.size() == bound);
+  const char* pos = begin;
+  BOOST_REQUIRE(tr.Read(pos, bound, end));
+  BOOST_REQUIRE(tr.Read(pos, bound, end));
+  BOOST_REQUIRE_EQUAL(string("x"), tr.GetPath());
+  BOOST_REQUIRE(!tr.Read(pos, bound, end));
+}
+
+static string FrameV2(const string& aPath, const string& aData)
+{
+  ostringstream oss;
+  TelemetryRecord::WriteRecord(oss, aPath.data(), aPath.size(), aData.data(),
+                               aData.size(), 2);
+  return oss.str();
+}
+
+BOOST_AUTO_TEST_CASE(test_framing_v2)
+{
+  string data(FrameV2("v2", "{\"a\":8}") + rec
+              + FrameV2("gz", Gzip("{\"a\":8}")));
+  BOOST_REQUIRE_EQUAL(23u + 2 + 7, data.find('\x1e', 1));
+  const char* paths[] = { "v2", "abcd", "gz" };
+  uint64_t timestamps[] = { 2, 1, 2 };
+
+  istringstream iss(data);
+  TelemetryRecord tr;
+  for (int i = 0; i < 3; ++i) {
+    BOOST_REQUIRE_EQUAL(true, tr.Read(iss));
+    BOOST_REQUIRE_EQUAL(paths[i], tr.GetPath());
+    BOOST_REQUIRE_EQUAL(timestamps[i], tr.GetTimestamp());
+    BOOST_REQUIRE_EQUAL(8, tr.GetDocument()["a"].GetInt());
+  }
+  BOOST_REQUIRE_EQUAL(false, tr.Read(iss));
+
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  for (int i = 0; i < 3; ++i) {
+    BOOST_REQUIRE_EQUAL(true, tr.Read(pos, end));
+    BOOST_REQUIRE_EQUAL(paths[i], tr.GetPath());
+  }
+  BOOST_REQUIRE_EQUAL(false, tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(0, GetMetric(tr, "Corrupt Data"));
+}
+
+BOOST_AUTO_TEST_CASE(test_framing_v2_corrupt)
+{
+  string badHeader(FrameV2("abcd", "{\"a\":1}"));
+  badHeader[9] ^= 1; // timestamp
+  string badData(FrameV2("abcd", "{\"a\":2}"));
+  badData[badData.size() - 2] ^= 1;
+  // a header inside a payload only syncs if its checksum matches
+  string falseSync(FrameV2("abcd", "{\"a\":\"" + badHeader + "\"}"));
+  string data(badHeader + badData + rec);
+
+  istringstream iss(data);
+  TelemetryRecord tr;
+  BOOST_REQUIRE_EQUAL(true, tr.Read(iss));
+  BOOST_REQUIRE_EQUAL(8, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(1, GetMetric(tr, "Header Checksum Failures"));
+  BOOST_REQUIRE_EQUAL(false, tr.Read(iss));
+
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  BOOST_REQUIRE_EQUAL(true, tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(8, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(1, GetMetric(tr, "Data Checksum Failures"));
+
+  BOOST_REQUIRE(falseSync.data() == tr.FindRecordStart(
+    falseSync.data(), falseSync.data() + falseSync.size()));
+  BOOST_REQUIRE(falseSync.data() + falseSync.size()
+                == tr.FindRecordStart(falseSync.data() + 1,
+                                      falseSync.data() + falseSync.size()));
+}
+
+BOOST_AUTO_TEST_CASE(test_write_record_limits)
+{
+  ostringstream oss;
+  string big(kMaxTelemetryData + 1, ' ');
+  BOOST_REQUIRE_THROW(TelemetryRecord::WriteRecord(oss, "p", 1, big.data(),
+                                                   big.size(), 0),
+                      runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_filter)
+{
+  string data;
+  for (uint64_t ts = 1; ts <= 5; ++ts) {
+    ostringstream oss;
+    string path(ts % 2 ? "odd/x" : "even/x");
+    TelemetryRecord::WriteRecord(oss, path.data(), path.size(), "{\"a\":8}", 7,
+                                 ts);
+    data += oss.str();
+  }
+  // the payload of a filtered record is never inflated
+  data += Frame("odd/y", string("\x1f\x8b\x08 garbage", 12));
+  data += Frame("odd/z", "{\"a\":9}");
+
+  TelemetryRecord tr;
+  tr.SetFilter(2, 5, "odd/");
+  istringstream iss(data);
+  BOOST_REQUIRE_EQUAL(true, tr.Read(iss));
+  BOOST_REQUIRE_EQUAL(3u, tr.GetTimestamp());
+  BOOST_REQUIRE_EQUAL(false, tr.Read(iss));
+  BOOST_REQUIRE_EQUAL(6, GetMetric(tr, "Filtered Records"));
+
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  tr.SetFilter(1, 2, "odd/x");
+  BOOST_REQUIRE_EQUAL(true, tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL("odd/x", tr.GetPath());
+  BOOST_REQUIRE_EQUAL(false, tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(0, GetMetric(tr, "Inflate Failures"));
+
+  pos = data.data();
+  tr.SetFilter(0, numeric_limits<uint64_t>::max());
+  int cnt = 0;
+  while (tr.Read(pos, end)) ++cnt;
+  BOOST_REQUIRE_EQUAL(6, cnt);
+  BOOST_REQUIRE_EQUAL(1, GetMetric(tr, "Inflate Failures"));
+}
+
+static string Serialize(const TelemetryRecord& aRecord)
+{
+  rapidjson::StringBuffer sb;
+  SplicingWriter<rapidjson::StringBuffer> writer(sb);
+  aRecord.Accept(writer);
+  return string(sb.GetString(), sb.Size());
+}
+
+BOOST_AUTO_TEST_CASE(test_selective_parse)
+{
+  string json("{\"simpleMeasurements\" : {\"a\":\"}\\\"]\",\"b\":[1,{}]},"
+              "\"ver\":1,\"info\":{\"revision\":\"r\"},\"log\":[],"
+              "\"histograms\":{\"H\":{\"values\":{\"0\":1}}},\"x\":null}");
+  string data(Frame("abcd", json));
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  tr.SetParsedMembers({"info", "ver", "histograms"});
+  BOOST_REQUIRE_EQUAL(true, tr.Read(pos, end));
+  RapidjsonDocument& doc = tr.GetDocument();
+  BOOST_REQUIRE_EQUAL(3, doc.MemberEnd() - doc.MemberBegin());
+  BOOST_REQUIRE_EQUAL(1, doc["ver"].GetInt());
+  BOOST_REQUIRE_EQUAL("r", doc["info"]["revision"].GetString());
+  BOOST_REQUIRE(doc["histograms"]["H"].IsObject());
+  BOOST_REQUIRE(doc["log"].IsNull());
+  // the raw members are spliced back at their original position
+  BOOST_REQUIRE_EQUAL("{\"simpleMeasurements\":{\"a\":\"}\\\"]\",\"b\":[1,{}]},"
+                      "\"ver\":1,\"info\":{\"revision\":\"r\"},\"log\":[],"
+                      "\"histograms\":{\"H\":{\"values\":{\"0\":1}}},"
+                      "\"x\":null}", Serialize(tr));
+
+  tr.SetParsedMembers(vector<string>());
+  data = Frame("abcd", "{\"a\":8}");
+  pos = data.data();
+  end = pos + data.size();
+  BOOST_REQUIRE_EQUAL(true, tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL("{\"a\":8}", Serialize(tr));
+}
+
+BOOST_AUTO_TEST_CASE(test_selective_parse_malformed)
+{
+  const char* bad[] = { "[1]", "{\"a\":{\"b\":1}", "{\"a\":\"x}", "{\"a\" 1}",
+    "{\"a\":1,}", "{\"ver\":1x}", "{\"info\":{\"b\"}}", "{\"a\":1} 2",
+    // unparsed members are validated before they are copied
+    "{\"ver\":1,\"a\":tru}", "{\"ver\":1,\"a\":[1 2]}", "{\"ver\":1,\"a\":1x}",
+    "{\"ver\":1,\"a\":{\"b\" 1}}", nullptr };
+  string data;
+  for (int i = 0; bad[i]; ++i) {
+    data += Frame("abcd", bad[i]);
+  }
+  data += rec;
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  tr.SetParsedMembers({"info", "ver"});
+  BOOST_REQUIRE_EQUAL(true, tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL("{\"a\":8}", Serialize(tr));
+  BOOST_REQUIRE_EQUAL(12, GetMetric(tr, "Parse Failures"));
+}
+
 //BOOST_AUTO_TEST_CASE(test_large_file)
 //{
 //  ifstream file(kDataPath + "../../../../telemetry.log", ios_base::binary);
@@ -73,3 +416,155 @@ BOOST_AUTO_TEST_CASE(test_short_pathlength)
 //  }
 //  BOOST_REQUIRE_EQUAL(7331, cnt);
 //}
+
+BOOST_AUTO_TEST_CASE(test_limits)
+{
+  string big("{\"a\":\"" + string(kMaxTelemetryData, 'x') + "\"}");
+  string data = Frame("abcd", big) + rec;
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  BOOST_REQUIRE(tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(8, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(1, GetMetric(tr, "Invalid Data Length"));
+
+  tr.SetLimits(big.size(), numeric_limits<size_t>::max(), 0);
+  pos = data.data();
+  BOOST_REQUIRE(tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(kMaxTelemetryData,
+                      tr.GetDocument()["a"].GetStringLength());
+  istringstream iss(data);
+  BOOST_REQUIRE(tr.Read(iss));
+  BOOST_REQUIRE_EQUAL(kMaxTelemetryData,
+                      tr.GetDocument()["a"].GetStringLength());
+
+  // a small payload inflating past the decoded limit is discarded
+  string gz = Gzip(big);
+  data = Frame("abcd", gz) + rec;
+  tr.SetLimits(kMaxTelemetryData, big.size() - 1, 0);
+  pos = data.data();
+  end = pos + data.size();
+  BOOST_REQUIRE(tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(8, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(1, GetMetric(tr, "Inflate Failures"));
+
+  // the decoded length is limited by default
+  string huge("{\"a\":\"" + string(kMaxTelemetryDecoded, 'x') + "\"}");
+  data = Frame("abcd", Gzip(huge)) + rec;
+  pos = data.data();
+  end = pos + data.size();
+  TelemetryRecord dr;
+  BOOST_REQUIRE(dr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(8, dr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(1, GetMetric(dr, "Inflate Failures"));
+}
+
+BOOST_AUTO_TEST_CASE(test_streamed)
+{
+  string json("{\"simpleMeasurements\":{\"a\":\"}\\\"]\",\"b\":[1,{},-2.5]},"
+              "\"ver\":1,\"info\":{\"revision\":\"r\",\"x\":[true,null]},"
+              "\"log\":[],\"histograms\":{\"H\":{\"values\":{\"0\":1}}},"
+              "\"x\":null}");
+  string data = Frame("abcd", Gzip(json)) + Frame("efgh", json);
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  TelemetryRecord tr;
+  tr.SetLimits(kMaxTelemetryData, numeric_limits<size_t>::max(), 1);
+  vector<string> members = { "ver", "info", "histograms" };
+  tr.SetParsedMembers(members);
+  for (int i = 0; i < 2; ++i) {
+    BOOST_REQUIRE(tr.Read(pos, end));
+    RapidjsonDocument& doc = tr.GetDocument();
+    BOOST_REQUIRE_EQUAL(1, doc["ver"].GetInt());
+    BOOST_REQUIRE_EQUAL("r", doc["info"]["revision"].GetString());
+    BOOST_REQUIRE(doc["info"]["x"][0u].IsTrue());
+    BOOST_REQUIRE_EQUAL(1, doc["histograms"]["H"]["values"]["0"].GetInt());
+    BOOST_REQUIRE(doc["log"].IsNull());
+    // the other members are re-read from the payload, the parsed ones are
+    // written from the (modified) DOM
+    doc["ver"].SetInt(2);
+    BOOST_REQUIRE_EQUAL("{\"simpleMeasurements\":{\"a\":\"}\\\"]\","
+                        "\"b\":[1,{},-2.5]},\"ver\":2,\"info\":{\"revision\":"
+                        "\"r\",\"x\":[true,null]},\"log\":[],\"histograms\":"
+                        "{\"H\":{\"values\":{\"0\":1}}},\"x\":null}",
+                        Serialize(tr));
+  }
+  BOOST_REQUIRE_EQUAL(2, GetMetric(tr, "Streamed Records"));
+
+  // the istream input is re-read from the record buffer
+  istringstream is(data);
+  BOOST_REQUIRE(tr.Read(is));
+  BOOST_REQUIRE_EQUAL(json, Serialize(tr));
+
+  // full parse
+  tr.SetParsedMembers(vector<string>());
+  pos = data.data();
+  BOOST_REQUIRE(tr.Read(pos, end));
+  RapidjsonValue& sm = tr.GetDocument()["simpleMeasurements"];
+  BOOST_REQUIRE_EQUAL(-2.5, sm["b"][2].GetDouble());
+
+  // truncated payload
+  string gz = Gzip(json);
+  data = Frame("abcd", gz.substr(0, gz.size() - 4));
+  pos = data.data();
+  end = pos + data.size();
+  BOOST_REQUIRE(!tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(1, GetMetric(tr, "Inflate Failures"));
+
+  // malformed JSON
+  tr.SetParsedMembers(members);
+  data = Frame("abcd", Gzip("{\"ver\":1,\"log\":[}"));
+  pos = data.data();
+  end = pos + data.size();
+  BOOST_REQUIRE(!tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(1, GetMetric(tr, "Parse Failures"));
+}
+
+BOOST_AUTO_TEST_CASE(test_duplicates)
+{
+  // the payload of a duplicate is never inflated
+  string data = Frame("abcd/saved-session/Firefox", "{\"a\":1}")
+    + Frame("efgh/saved-session/Firefox", "{\"a\":2}")
+    + Frame("abcd/idle-daily/Firefox", string("\x1f\x8b\x08 garbage", 12))
+    + Frame("efgh", "{\"a\":3}");
+  DuplicateFilter df(4096, 0);
+  TelemetryRecord tr;
+  tr.SetDuplicateFilter(&df);
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  BOOST_REQUIRE(tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(1, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE(tr.CommitRecord(tr.GetPath(), tr.GetTimestamp()));
+  BOOST_REQUIRE(tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(2, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE(tr.CommitRecord(tr.GetPath(), tr.GetTimestamp()));
+  BOOST_REQUIRE(!tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(2, GetMetric(tr, "Duplicate Records"));
+  BOOST_REQUIRE_EQUAL(0, GetMetric(tr, "Inflate Failures"));
+
+  // only committed ids are remembered, a copy of a record that failed to
+  // parse or convert is still read
+  string copies = Frame("ijkl/x", "{\"a\":") + Frame("ijkl/x", "{\"a\":4}")
+    + Frame("ijkl/x", "{\"a\":5}");
+  pos = copies.data();
+  end = pos + copies.size();
+  BOOST_REQUIRE(tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(4, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE(tr.Read(pos, end));
+  BOOST_REQUIRE_EQUAL(5, tr.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE(tr.CommitRecord(tr.GetPath(), tr.GetTimestamp()));
+  // a copy committed since the read is caught by the commit
+  BOOST_REQUIRE(!tr.CommitRecord("ijkl/y", 0));
+  message::Message msg;
+  tr.GetMetrics(msg);
+  BOOST_REQUIRE_EQUAL(1, FindField(msg, "Parse Failures"));
+  BOOST_REQUIRE_EQUAL(1, FindField(msg, "Duplicate Records"));
+
+  // the filter is shared with a stream reader
+  TelemetryRecord other;
+  other.SetDuplicateFilter(&df);
+  istringstream iss(data + Frame("mnop/x", "{\"a\":6}"));
+  BOOST_REQUIRE(other.Read(iss));
+  BOOST_REQUIRE_EQUAL(6, other.GetDocument()["a"].GetInt());
+  BOOST_REQUIRE_EQUAL(4, GetMetric(other, "Duplicate Records"));
+}
@@ -0,0 +1,63 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Helpers shared by the unit tests.
+ */
+
+#ifndef mozilla_telemetry_Test_Util_h
+#define mozilla_telemetry_Test_Util_h
+
+#include <cstring>
+#include <string>
+
+#include <zlib.h>
+
+#include "../message.pb.h"
+
+/**
+ * Compresses data into a single gzip member.
+ *
+ * @param aData Data to compress.
+ *
+ * @return std::string Gzip encoded data.
+ */
+inline std::string Gzip(const std::string& aData)
+{
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+               Z_DEFAULT_STRATEGY);
+  std::string out(deflateBound(&strm, aData.size()), 0);
+  strm.next_in = (Bytef*)aData.data();
+  strm.avail_in = aData.size();
+  strm.next_out = (Bytef*)&out[0];
+  strm.avail_out = out.size();
+  deflate(&strm, Z_FINISH);
+  out.resize(out.size() - strm.avail_out);
+  deflateEnd(&strm);
+  return out;
+}
+
+/**
+ * Looks up a numeric field of a metrics message.
+ *
+ * @param aMsg Message filled by a GetMetrics call.
+ * @param aName Field name.
+ *
+ * @return double First value of the field, -1 when it is missing.
+ */
+inline double FindField(const message::Message& aMsg, const std::string& aName)
+{
+  for (int i = 0; i < aMsg.fields_size(); ++i) {
+    if (aMsg.fields(i).name() == aName) {
+      return aMsg.fields(i).value_double(0);
+    }
+  }
+  return -1;
+}
+
+#endif // mozilla_telemetry_Test_Util_h
@@ -6,12 +6,18 @@
 
 /// @brief Telemetry data coverter implementation @file
 
+#include "AsyncReadBuffer.h"
+#include "DuplicateFilter.h"
 #include "HistogramCache.h"
 #include "HistogramConverter.h"
+#include "MemoryMappedFile.h"
+#include "RecordBatch.h"
+#include "RecordIndex.h"
 #include "TelemetryRecord.h"
 #include "TelemetrySchema.h"
 #include "RecordWriter.h"
 #include "Metric.h"
+#include "SplicingWriter.h"
 #include "message.pb.h"
 
 #include <boost/filesystem.hpp>
@@ -22,17 +28,33 @@
 #include <exception>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 #include <sstream>
 #include <sys/inotify.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 using namespace std;
 namespace fs = boost::filesystem;
 namespace mt = mozilla::telemetry;
 
+/// Layout of the converted records handed to the RecordWriter
+enum OutputFormat {
+  /// uuid, tab, converted JSON, newline per record
+  kJsonOutput,
+  /// ColumnarBlock per partition
+  kColumnarOutput,
+  /// histogram totals per partition (HistogramAggregator), no records
+  kAggregateOutput
+};
+
 struct ConvertConfig
 {
   fs::path    mInputDirectory;
@@ -44,8 +66,25 @@ struct ConvertConfig
   uint64_t    mMaxUncompressed;
   size_t      mMemoryConstraint;
   int         mCompressionPreset;
+  unsigned    mWorkerThreads;
+  bool        mReadAhead;
+  uint64_t    mMinTimestamp;
+  uint64_t    mMaxTimestamp;
+  std::string mPathPrefix;
+  size_t      mMaxDataLength;
+  size_t      mMaxDecodedLength;
+  size_t      mStreamingThreshold;
+  size_t      mDedupMemory;
+  uint64_t    mDedupWindow;
+  fs::path    mDedupState;
+  bool        mSinglePass;
+  mt::HistogramEncoding mHistogramEncoding;
+  OutputFormat mOutputFormat;
 };
 
+/// Smallest byte range worth handing to a separate worker thread
+static const size_t kMinRangeSize = 4 * 1024 * 1024;
+
 struct Metrics
 {
   Metrics() :
@@ -165,45 +204,489 @@ void ReadConfig(const char* aFile, ConvertConfig& aConfig)
     throw runtime_error("compression_preset not specified");
   }
   aConfig.mCompressionPreset = cpr.GetInt();
+
+  RapidjsonValue& wt = doc["worker_threads"];
+  if (wt.IsNull()) {
+    aConfig.mWorkerThreads = 1;
+  } else if (wt.IsUint() && wt.GetUint() > 0) {
+    aConfig.mWorkerThreads = wt.GetUint();
+  } else {
+    throw runtime_error("worker_threads must be a positive integer");
+  }
+
+  RapidjsonValue& ra = doc["read_ahead"];
+  if (ra.IsNull()) {
+    aConfig.mReadAhead = false;
+  } else if (ra.IsBool()) {
+    aConfig.mReadAhead = ra.GetBool();
+  } else {
+    throw runtime_error("read_ahead must be a boolean");
+  }
+
+  RapidjsonValue& mints = doc["min_timestamp"];
+  if (mints.IsNull()) {
+    aConfig.mMinTimestamp = 0;
+  } else if (mints.IsUint64()) {
+    aConfig.mMinTimestamp = mints.GetUint64();
+  } else {
+    throw runtime_error("min_timestamp must be an unsigned integer");
+  }
+
+  RapidjsonValue& maxts = doc["max_timestamp"];
+  if (maxts.IsNull()) {
+    aConfig.mMaxTimestamp = numeric_limits<uint64_t>::max();
+  } else if (maxts.IsUint64()) {
+    aConfig.mMaxTimestamp = maxts.GetUint64();
+  } else {
+    throw runtime_error("max_timestamp must be an unsigned integer");
+  }
+
+  RapidjsonValue& pp = doc["path_prefix"];
+  if (pp.IsNull()) {
+    aConfig.mPathPrefix.clear();
+  } else if (pp.IsString()) {
+    aConfig.mPathPrefix = pp.GetString();
+  } else {
+    throw runtime_error("path_prefix must be a string");
+  }
+
+  RapidjsonValue& mdl = doc["max_data_length"];
+  if (mdl.IsNull()) {
+    aConfig.mMaxDataLength = mt::kMaxTelemetryData;
+  } else if (mdl.IsUint64()) {
+    aConfig.mMaxDataLength = mdl.GetUint64();
+  } else {
+    throw runtime_error("max_data_length must be an unsigned integer");
+  }
+
+  RapidjsonValue& mdec = doc["max_decoded_length"];
+  if (mdec.IsNull()) {
+    aConfig.mMaxDecodedLength = mt::kMaxTelemetryDecoded;
+  } else if (mdec.IsUint64()) {
+    aConfig.mMaxDecodedLength = mdec.GetUint64();
+  } else {
+    throw runtime_error("max_decoded_length must be an unsigned integer");
+  }
+
+  RapidjsonValue& st = doc["streaming_threshold"];
+  if (st.IsNull()) {
+    aConfig.mStreamingThreshold = 0;
+  } else if (st.IsUint64()) {
+    aConfig.mStreamingThreshold = st.GetUint64();
+  } else {
+    throw runtime_error("streaming_threshold must be an unsigned integer");
+  }
+
+  RapidjsonValue& dm = doc["dedup_memory"];
+  if (dm.IsNull()) {
+    aConfig.mDedupMemory = 0;
+  } else if (dm.IsUint64()) {
+    aConfig.mDedupMemory = dm.GetUint64();
+  } else {
+    throw runtime_error("dedup_memory must be an unsigned integer");
+  }
+
+  RapidjsonValue& dw = doc["dedup_window"];
+  if (dw.IsNull()) {
+    aConfig.mDedupWindow = 0;
+  } else if (dw.IsUint64()) {
+    aConfig.mDedupWindow = dw.GetUint64();
+  } else {
+    throw runtime_error("dedup_window must be an unsigned integer");
+  }
+
+  RapidjsonValue& spc = doc["single_pass"];
+  if (spc.IsNull()) {
+    aConfig.mSinglePass = false;
+  } else if (spc.IsBool()) {
+    aConfig.mSinglePass = spc.GetBool();
+  } else {
+    throw runtime_error("single_pass must be a boolean");
+  }
+
+  RapidjsonValue& sh = doc["sparse_histograms"];
+  if (sh.IsNull()) {
+    aConfig.mHistogramEncoding = mt::kDenseHistograms;
+  } else if (sh.IsBool()) {
+    aConfig.mHistogramEncoding = sh.GetBool() ? mt::kSparseHistograms
+      : mt::kDenseHistograms;
+  } else {
+    throw runtime_error("sparse_histograms must be a boolean");
+  }
+
+  RapidjsonValue& of = doc["output_format"];
+  if (of.IsNull() || (of.IsString() && string("json") == of.GetString())) {
+    aConfig.mOutputFormat = kJsonOutput;
+  } else if (of.IsString() && string("columnar") == of.GetString()) {
+    aConfig.mOutputFormat = kColumnarOutput;
+  } else if (of.IsString() && string("aggregate") == of.GetString()) {
+    aConfig.mOutputFormat = kAggregateOutput;
+  } else {
+    throw runtime_error("output_format must be \"json\", \"columnar\" or "
+                        "\"aggregate\"");
+  }
+  if (aConfig.mOutputFormat != kJsonOutput && aConfig.mSinglePass) {
+    throw runtime_error("output_format columnar and aggregate require the DOM "
+                        "conversion (single_pass false)");
+  }
+
+  RapidjsonValue& ds = doc["dedup_state"];
+  if (ds.IsNull()) {
+    aConfig.mDedupState.clear();
+  } else if (ds.IsString()) {
+    aConfig.mDedupState = ds.GetString();
+  } else {
+    throw runtime_error("dedup_state must be a string");
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SaveDedupState(mt::DuplicateFilter* aFilter, const ConvertConfig& aConfig)
+{
+  if (!aFilter || aConfig.mDedupState.empty()) return;
+  try {
+    aFilter->Save(aConfig.mDedupState);
+  }
+  catch (const exception& e) {
+    cerr << "saving the dedup state failed: " << e.what() << endl;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Appends a converted record to the columnar block or the aggregate of its
+/// partition, returns the number of bytes added to the output
+size_t WriteDocument(OutputFormat aFormat, const char* aPath,
+                     uint64_t aTimestamp, const RapidjsonDocument& aDoc,
+                     mt::TelemetrySchema& aSchema,
+                     mt::HistogramCache& aCache,
+                     mt::RecordWriter& aWriter)
+{
+  size_t uuidLength = 0;
+  while (aPath[uuidLength] != 0 && aPath[uuidLength] != '/') ++uuidLength;
+  // the conversion succeeded so the revision resolves to a cached spec
+  shared_ptr<mt::HistogramSpecification> spec =
+    aCache.FindHistogram(aDoc["info"]["revision"].GetString());
+  fs::path p = aSchema.GetDimensionPath(aDoc);
+  if (aFormat == kAggregateOutput) {
+    aWriter.Aggregate(p, aDoc, *spec);
+    return 0;
+  }
+  return aWriter.Write(p, aPath, uuidLength, aTimestamp, aDoc, *spec);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename Read>
+void ProcessRecords(Read aRead,
+                    mt::TelemetrySchema& aSchema,
+                    mt::TelemetryRecord& aRecord,
+                    mt::HistogramCache& aCache,
+                    mt::HistogramEncoding aEncoding,
+                    OutputFormat aFormat,
+                    mt::RecordWriter& aWriter,
+                    mutex& aMutex)
+{
+  double processed = 0, failed = 0, dataOut = 0;
+  rapidjson::StringBuffer sb;
+  mt::SplicingWriter<rapidjson::StringBuffer> writer(sb);
+  while (aRead()) {
+    if (!ConvertHistogramData(aCache, aRecord.GetDocument(), aEncoding)) {
+      // cerr << "Conversion failed: " << aRecord.GetPath() << endl;
+      ++failed;
+    } else if (!aRecord.CommitRecord(aRecord.GetPath(),
+                                     aRecord.GetTimestamp())) {
+      continue; // a copy was converted since the record was read
+    } else if (aFormat != kJsonOutput) {
+      lock_guard<mutex> lock(aMutex);
+      dataOut += WriteDocument(aFormat, aRecord.GetPath(),
+                               aRecord.GetTimestamp(), aRecord.GetDocument(),
+                               aSchema, aCache, aWriter);
+    } else {
+      sb.Clear();
+      const char* s = aRecord.GetPath();
+      for (int x = 0; s[x] != 0 && s[x] != '/'; ++x) { // extract uuid
+        sb.Put(s[x]);
+      }
+      sb.Put('\t');
+      aRecord.Accept(writer);
+      sb.Put('\n');
+      lock_guard<mutex> lock(aMutex);
+      fs::path p = aSchema.GetDimensionPath(aRecord.GetDocument());
+      aWriter.Write(p, sb.GetString(), sb.Size());
+      dataOut += sb.Size();
+    }
+    ++processed;
+  }
+  lock_guard<mutex> lock(aMutex);
+  gMetrics.mRecordsProcessed.mValue += processed;
+  gMetrics.mRecordsFailed.mValue += failed;
+  gMetrics.mDataOut.mValue += dataOut;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ProcessRange(const char* aBegin, const char* aLimit, const char* aEnd,
+                  mt::TelemetrySchema& aSchema,
+                  mt::TelemetryRecord& aRecord,
+                  mt::HistogramCache& aCache,
+                  mt::HistogramEncoding aEncoding,
+                  OutputFormat aFormat,
+                  mt::RecordWriter& aWriter,
+                  mutex& aMutex)
+{
+  double processed = 0, failed = 0, dataOut = 0;
+  rapidjson::StringBuffer sb;
+  mt::SplicingWriter<rapidjson::StringBuffer> writer(sb);
+  mt::RecordBatch batch;
+  vector<size_t> converted;
+  vector<size_t> offsets;
+  const char* pos = aBegin;
+  while (size_t n = aRecord.ReadBatch(pos, aLimit, aEnd, batch)) {
+    // convert and serialize the whole batch before taking the lock once
+    sb.Clear();
+    converted.clear();
+    offsets.clear();
+    for (size_t i = 0; i < n; ++i) {
+      mt::RecordBatch::Record& r = batch.GetRecord(i);
+      if (!ConvertHistogramData(aCache, *r.mDocument, aEncoding)) {
+        ++failed;
+        continue;
+      }
+      if (!aRecord.CommitRecord(r.mPath, r.mTimestamp)) {
+        --processed; // dropped like the duplicates skipped by the read
+        continue;
+      }
+      converted.push_back(i);
+      if (aFormat != kJsonOutput) continue; // written under the lock
+      offsets.push_back(sb.Size());
+      for (int x = 0; r.mPath[x] != 0 && r.mPath[x] != '/'; ++x) { // uuid
+        sb.Put(r.mPath[x]);
+      }
+      sb.Put('\t');
+      batch.Accept(i, writer);
+      sb.Put('\n');
+    }
+    processed += n;
+    offsets.push_back(sb.Size());
+    dataOut += sb.Size();
+
+    const char* out = sb.GetString();
+    lock_guard<mutex> lock(aMutex);
+    for (size_t i = 0; i < converted.size(); ++i) {
+      mt::RecordBatch::Record& r = batch.GetRecord(converted[i]);
+      if (aFormat != kJsonOutput) {
+        dataOut += WriteDocument(aFormat, r.mPath, r.mTimestamp, *r.mDocument,
+                                 aSchema, aCache, aWriter);
+        continue;
+      }
+      fs::path p = aSchema.GetDimensionPath(*r.mDocument);
+      aWriter.Write(p, out + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+  }
+  lock_guard<mutex> lock(aMutex);
+  gMetrics.mRecordsProcessed.mValue += processed;
+  gMetrics.mRecordsFailed.mValue += failed;
+  gMetrics.mDataOut.mValue += dataOut;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ConvertRange(const char* aBegin, const char* aLimit, const char* aEnd,
+                  mt::TelemetrySchema& aSchema,
+                  mt::TelemetryRecord& aRecord,
+                  mt::HistogramCache& aCache,
+                  mt::HistogramEncoding aEncoding,
+                  OutputFormat, // always JSON, see ReadConfig
+                  mt::RecordWriter& aWriter,
+                  mutex& aMutex)
+{
+  static const size_t kBatchSize = 64;
+  double processed = 0, failed = 0, dataOut = 0;
+  // each record is serialized on its own so a failed conversion is simply
+  // not appended to the batch output
+  rapidjson::StringBuffer sb;
+  string out;
+  // only the info object of each record is parsed, it is kept for the
+  // dimension path until the batch is written
+  mt::ArenaAllocator arena;
+  vector<RapidjsonDocument*> infos;
+  vector<size_t> offsets;
+  const char* pos = aBegin;
+  bool more = true;
+  while (more) {
+    out.clear();
+    offsets.clear();
+    for (auto it = infos.begin(); it != infos.end(); ++it) {
+      (*it)->~RapidjsonDocument();
+    }
+    infos.clear();
+    arena.Reset();
+    while (infos.size() < kBatchSize
+           && (more = aRecord.ReadPayload(pos, aLimit, aEnd))) {
+      ++processed;
+      sb.Clear();
+      const char* s = aRecord.GetPath();
+      for (int x = 0; s[x] != 0 && s[x] != '/'; ++x) { // extract uuid
+        sb.Put(s[x]);
+      }
+      sb.Put('\t');
+      RapidjsonDocument* info = new(arena.Malloc(sizeof(RapidjsonDocument)))
+        RapidjsonDocument(&arena);
+      if (!mt::ConvertHistogramData(aCache, aRecord.GetPayload(), sb, *info,
+                                    aEncoding)) {
+        info->~RapidjsonDocument();
+        ++failed;
+        continue;
+      }
+      if (!aRecord.CommitRecord(aRecord.GetPath(), aRecord.GetTimestamp())) {
+        info->~RapidjsonDocument();
+        --processed; // dropped like the duplicates skipped by the read
+        continue;
+      }
+      sb.Put('\n');
+      offsets.push_back(out.size());
+      out.append(sb.GetString(), sb.Size());
+      infos.push_back(info);
+    }
+    if (infos.empty()) continue;
+    offsets.push_back(out.size());
+    dataOut += out.size();
+
+    lock_guard<mutex> lock(aMutex);
+    for (size_t i = 0; i < infos.size(); ++i) {
+      fs::path p = aSchema.GetInfoDimensionPath(*infos[i]);
+      aWriter.Write(p, out.data() + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+  }
+  for (auto it = infos.begin(); it != infos.end(); ++it) {
+    (*it)->~RapidjsonDocument();
+  }
+  lock_guard<mutex> lock(aMutex);
+  gMetrics.mRecordsProcessed.mValue += processed;
+  gMetrics.mRecordsFailed.mValue += failed;
+  gMetrics.mDataOut.mValue += dataOut;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ProcessStream(const boost::filesystem::path& aName,
+                   mt::TelemetrySchema& aSchema,
+                   mt::TelemetryRecord& aRecord,
+                   mt::HistogramCache& aCache,
+                   mt::HistogramEncoding aEncoding,
+                   OutputFormat aFormat,
+                   mt::RecordWriter& aWriter,
+                   mutex& aMutex)
+{
+  mt::AsyncReadBuffer buf(aName);
+  istream input(&buf);
+  ProcessRecords([&]() { return aRecord.Read(input); },
+                 aSchema, aRecord, aCache, aEncoding, aFormat, aWriter,
+                 aMutex);
+  if (!buf.GetError().empty()) {
+    stringstream ss;
+    ss << "file read failed: " << aName.string() << " " << buf.GetError();
+    throw runtime_error(ss.str());
+  }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 bool ProcessFile(const boost::filesystem::path& aName,
                  mt::TelemetrySchema& aSchema,
-                 mt::TelemetryRecord& aRecord,
+                 vector<unique_ptr<mt::TelemetryRecord>>& aRecords,
                  mt::HistogramCache& aCache,
-                 mt::RecordWriter& aWriter)
+                 mt::RecordWriter& aWriter,
+                 const ConvertConfig& aConfig)
 {
   try {
     cout << "processing file:" << aName.filename() << endl;
     chrono::time_point<chrono::system_clock> start, end;
     start = chrono::system_clock::now();
-    ifstream file(aName.c_str());
-    rapidjson::StringBuffer sb;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
-    while (aRecord.Read(file)) {
-      if (ConvertHistogramData(aCache, aRecord.GetDocument())) {
-        sb.Clear();
-        const char* s = aRecord.GetPath();
-        for (int x = 0; s[x] != 0 && s[x] != '/'; ++x) { // extract uuid
-          sb.Put(s[x]);
+    size_t size = fs::file_size(aName);
+    mutex m;
+    // the single pass conversion never builds a DOM of the payload
+    auto process = aConfig.mSinglePass ? ConvertRange : ProcessRange;
+    mt::HistogramEncoding encoding = aConfig.mHistogramEncoding;
+    OutputFormat format = aConfig.mOutputFormat;
+
+    // split the file into byte ranges starting on the first record found past
+    // each split point, each worker reads the records starting in its range
+    size_t ranges = size / kMinRangeSize;
+    if (ranges > aRecords.size()) ranges = aRecords.size();
+    bool stream = ranges < 2 && aConfig.mReadAhead && !aConfig.mSinglePass;
+    // the read ahead reads the file itself, the other paths scan a mapping
+    unique_ptr<mt::MemoryMappedFile> file;
+    const char* data = nullptr;
+    const char* limit = nullptr;
+    if (!stream) {
+      file.reset(new mt::MemoryMappedFile(aName));
+      data = file->GetData();
+      size = file->GetSize();
+      limit = data + size;
+    }
+    if (stream) {
+      ProcessStream(aName, aSchema, *aRecords[0], aCache, encoding, format,
+                    aWriter, m);
+    } else if (ranges < 2) {
+      process(data, limit, limit, aSchema, *aRecords[0], aCache, encoding,
+              format, aWriter, m);
+    } else {
+      // a sidecar index lets the ranges start exactly on record boundaries
+      mt::RecordIndex idx;
+      bool indexed = false;
+      fs::path fn = mt::RecordIndex::GetIndexPath(aName);
+      if (exists(fn)) {
+        try {
+          idx.Load(fn);
+          indexed = idx.GetLogSize() == size;
+        }
+        catch (const exception& e) {
+          cerr << "ignoring record index: " << e.what() << endl;
         }
-        sb.Put('\t');
-        aRecord.GetDocument().Accept(writer);
-        sb.Put('\n');
-        fs::path p = aSchema.GetDimensionPath(aRecord.GetDocument());
-        aWriter.Write(p, sb.GetString(), sb.Size());
-        gMetrics.mDataOut.mValue += sb.Size();
-      } else {
-        // cerr << "Conversion failed: " << aRecord.GetPath() << endl;
-        ++gMetrics.mRecordsFailed.mValue;
       }
-      ++gMetrics.mRecordsProcessed.mValue;
+      size_t rangeSize = size / ranges;
+      vector<const char*> bounds(ranges + 1, limit);
+      bounds[0] = data;
+      for (size_t i = 1; i < ranges; ++i) {
+        if (indexed) {
+          const mt::RecordIndex::Entry* e = idx.LowerBound(i * rangeSize);
+          bounds[i] = e ? data + e->mOffset : limit;
+        } else {
+          // the previous range ends where this one resyncs so a record the
+          // resync passes over is still read by the previous worker
+          const char* split = max(data + i * rangeSize, bounds[i - 1]);
+          bounds[i] = aRecords[0]->FindRecordStart(split, limit);
+        }
+      }
+
+      vector<thread> workers;
+      vector<exception_ptr> errors(ranges);
+      for (size_t i = 0; i < ranges; ++i) {
+        const char* begin = bounds[i];
+        const char* rangeLimit = bounds[i + 1];
+        mt::TelemetryRecord& record = *aRecords[i];
+        exception_ptr& error = errors[i];
+        workers.emplace_back([=, &aSchema, &aCache, &aWriter, &m, &record,
+                              &error]() {
+          try {
+            process(begin, rangeLimit, limit, aSchema, record, aCache, encoding,
+                    format, aWriter, m);
+          }
+          catch (...) {
+            error = current_exception();
+          }
+        });
+      }
+      for (auto it = workers.begin(); it != workers.end(); ++it) {
+        it->join();
+      }
+      for (size_t i = 1; i < aRecords.size(); ++i) {
+        aRecords[0]->MergeMetrics(*aRecords[i]);
+      }
+      for (auto it = errors.begin(); it != errors.end(); ++it) {
+        if (*it) rethrow_exception(*it);
+      }
     }
     end = chrono::system_clock::now();
     chrono::duration<double> elapsed = end - start;
     gMetrics.mProcessingTime.mValue = elapsed.count();
-    gMetrics.mDataIn.mValue = file_size(aName);
+    gMetrics.mDataIn.mValue = size;
 
     if (gMetrics.mProcessingTime.mValue > 0) {
       gMetrics.mThroughput.mValue = gMetrics.mDataIn.mValue / 1024 / 1024
@@ -272,16 +755,47 @@ int main(int argc, char** argv)
   try {
     ConvertConfig config;
     ReadConfig(argv[1], config);
-    mt::TelemetryRecord record;
+    // resubmitted records are dropped across files and restarts
+    unique_ptr<mt::DuplicateFilter> dedup;
+    if (config.mDedupMemory) {
+      dedup.reset(new mt::DuplicateFilter(config.mDedupMemory,
+                                          config.mDedupWindow));
+      if (!config.mDedupState.empty() && exists(config.mDedupState)) {
+        try {
+          dedup->Load(config.mDedupState);
+        }
+        catch (const exception& e) {
+          cerr << "ignoring dedup state: " << e.what() << endl;
+        }
+      }
+    }
+    // one record per worker thread, the first one also collects the metrics
+    vector<unique_ptr<mt::TelemetryRecord>> records;
+    for (unsigned i = 0; i < config.mWorkerThreads; ++i) {
+      records.emplace_back(new mt::TelemetryRecord);
+      // only the members used by the conversion are materialized in the DOM
+      records.back()->SetParsedMembers({"info", "ver", "histograms"});
+      records.back()->SetFilter(config.mMinTimestamp, config.mMaxTimestamp,
+                                config.mPathPrefix);
+      records.back()->SetLimits(config.mMaxDataLength,
+                                config.mMaxDecodedLength,
+                                config.mStreamingThreshold);
+      records.back()->SetDuplicateFilter(dedup.get());
+    }
     mt::HistogramCache cache(config.mHistogramServer);
     mt::TelemetrySchema schema(config.mTelemetrySchema);
     mt::RecordWriter writer(config.mStoragePath, config.mUploadPath,
                             config.mMaxUncompressed, config.mMemoryConstraint,
                             config.mCompressionPreset);
 
+    bool processed = true;
     for (int i = 2; i < argc; i++) {
-      ProcessFile(argv[i], schema, record, cache, writer);
+      processed &= ProcessFile(argv[i], schema, records, cache, writer,
+                               config);
     }
+    writer.Finalize();
+    // the state is only saved when every file was processed
+    if (processed) SaveDedupState(dedup.get(), config);
     // do not move on to inotify mode in batch mode
     if (argc > 2) return EXIT_SUCCESS;
 
@@ -323,9 +837,11 @@ int main(int argc, char** argv)
         try {
           fs::path tfn = fs::temp_directory_path() / fn.filename();
           rename(fn, tfn);
-          if (ProcessFile(tfn, schema, record, cache, writer)) {
-            remove(tfn);
-          }
+          bool processed = ProcessFile(tfn, schema, records, cache, writer,
+                                       config);
+          if (processed) remove(tfn);
+          writer.Finalize();
+          if (processed) SaveDedupState(dedup.get(), config);
           RollLog(ofs, config);
           boost::uuids::uuid u = boost::uuids::random_generator()();
           msg.set_uuid(&u, u.size());
@@ -339,7 +855,7 @@ int main(int argc, char** argv)
           mt::WriteMessage(ofs, msg);
 
           msg.set_logger("record");
-          record.GetMetrics(msg);
+          records[0]->GetMetrics(msg);
           mt::WriteMessage(ofs, msg);
 
           msg.set_logger("schema");
@@ -0,0 +1,49 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @file
+Writes a sidecar record offset index (<log>.idx) for each telemetry log.
+ */
+
+#include "MemoryMappedFile.h"
+#include "RecordIndex.h"
+
+#include <boost/filesystem.hpp>
+#include <exception>
+#include <iostream>
+
+using namespace std;
+namespace fs = boost::filesystem;
+namespace mt = mozilla::telemetry;
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    cerr << "usage: " << argv[0] << " <space-separated log file list>\n";
+    return EXIT_FAILURE;
+  }
+
+  int result = EXIT_SUCCESS;
+  for (int i = 1; i < argc; ++i) {
+    try {
+      fs::path log(argv[i]);
+      mt::MemoryMappedFile file(log);
+      mt::RecordIndex idx;
+      idx.Build(file.GetData(), file.GetData() + file.GetSize());
+      fs::path fn = mt::RecordIndex::GetIndexPath(log);
+      idx.Save(fn);
+      cout << "indexed file:" << log.filename()
+        << " records:" << idx.GetEntries().size()
+        << " index:" << fn.filename() << endl;
+    }
+    catch (const exception& e) {
+      cerr << "std exception: " << e.what() << endl;
+      result = EXIT_FAILURE;
+    }
+  }
+  return result;
+}